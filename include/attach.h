@@ -0,0 +1,34 @@
+#ifndef ATTACH_H
+#define ATTACH_H
+
+#include <sqlite3.h>
+
+#define ATTACH_CHUNK 65536   // bytes moved per sqlite3_blob_read/write call
+#define ATTACH_MAX_LIST 32   // attachments shown per book
+
+typedef struct {
+  sqlite3_int64 id;
+  int book_id;
+  char name[128];
+  char mime[64];
+  sqlite3_int64 size;
+} Attachment;
+
+// Stores the file at path as an attachment of book_id. The row is created
+// with a zeroblob of the file's size and filled in ATTACH_CHUNK pieces, so
+// neither side ever holds the whole file in memory. name defaults to the
+// file's base name. The new row id is stored in id.
+int import_attachment(sqlite3 *db, int book_id, const char *path,
+                      const char *name, sqlite3_int64 *id);
+
+// Streams attachment id into the file at path, ATTACH_CHUNK bytes at a time.
+int export_attachment(sqlite3 *db, sqlite3_int64 id, const char *path);
+
+// Lists the metadata of a book's attachments from ATTACHMENTS_BY_BOOK; the
+// DATA column is never read. Returns the number stored in out (at most max),
+// or -1 on error.
+int list_attachments(sqlite3 *db, int book_id, Attachment *out, int max);
+
+int delete_attachment(sqlite3 *db, sqlite3_int64 id);
+
+#endif // ATTACH_H
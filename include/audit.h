@@ -0,0 +1,61 @@
+#ifndef AUDIT_H
+#define AUDIT_H
+
+#include "db.h"
+#include <sqlite3.h>
+
+#define AUDIT_FORMAT 1          // first byte of every diff blob
+#define AUDIT_MAX_DIFF 1024     // fits every field of a Book twice
+#define AUDIT_HISTORY_ROWS 50   // edits printed by the history command
+
+// Bits of BookEdit.fields, also the field tags inside a diff blob
+typedef enum {
+  AUDIT_TITLE = 1 << 0,
+  AUDIT_AUTHOR = 1 << 1,
+  AUDIT_PUBLISHER = 1 << 2,
+  AUDIT_YEAR = 1 << 3,
+  AUDIT_ISBN = 1 << 4,
+} AuditField;
+
+// One row of BOOK_EDITS, decoded. Only the fields set in fields are filled
+// in before and after.
+typedef struct {
+  sqlite3_int64 id;
+  int book_id;
+  long long edited_at; // unix seconds
+  char editor[100];
+  sqlite3_int64 undone_by; // 0 unless a later edit reverted this one
+  unsigned fields;
+  Book before;
+  Book after;
+} BookEdit;
+
+// Packs the fields that differ between before and after into out as
+// <format><tag><old><new>..., where text is a varint length plus bytes and
+// the year a zigzag varint. Returns the blob length, 0 when nothing changed.
+int audit_encode(const Book *before, const Book *after, unsigned char *out,
+                 int size);
+int audit_decode(const unsigned char *blob, int length, BookEdit *edit);
+
+// Stores the diff between before and after in BOOK_EDITS. Callers run it in
+// the transaction that made the change. Nothing is written if the rows are
+// equal; edit_id is 0 then.
+int record_book_edit(sqlite3 *db, const Book *before, const Book *after,
+                     const char *editor, sqlite3_int64 *edit_id);
+
+// Registers book_diff(old title, new title, old author, new author, old
+// publisher, new publisher, old year, new year, old isbn, new isbn) on db,
+// returning the audit_encode blob of the whole values or NULL, so set-based
+// writes can audit every row inside the same statement.
+int audit_register_functions(sqlite3 *db);
+
+// Puts back the old values of an edit in one transaction, itself recorded as
+// an edit. Only the columns in the diff are written, with the whole stored
+// values. Refuses with SQLITE_CONSTRAINT when the edit was already undone or
+// a field has changed again since.
+int undo_book_edit(sqlite3 *db, sqlite3_int64 edit_id, const char *editor);
+
+// Newest first. Returns the number stored in out, or -1 on error.
+int list_book_edits(sqlite3 *db, int book_id, BookEdit *out, int max);
+
+#endif // AUDIT_H
@@ -1,19 +1,67 @@
 #ifndef AUTH_H
 #define AUTH_H
 
+#include <sqlite3.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// PBKDF2 iterations are 1 << cost. Raising the cost only affects new
+// passwords; existing rows are re-hashed on their next successful login.
+#ifndef AUTH_HASH_COST
+#define AUTH_HASH_COST 14
+#endif
+
+#define AUTH_SALT_SIZE 16
+#define AUTH_SESSION_SLOTS 8
+#define AUTH_SESSION_TTL 900 // seconds
+
 typedef enum {
     ROLE_ADMIN,
     ROLE_LIBRARIAN,
     ROLE_USER
 } UserRole;
 
+typedef enum {
+    ACTION_VIEW_BOOKS = 1u << 0,
+    ACTION_ADD_BOOK = 1u << 1,
+    ACTION_UPDATE_BOOK = 1u << 2,
+    ACTION_BORROW_BOOK = 1u << 3,
+    ACTION_RETURN_BOOK = 1u << 4,
+    ACTION_MANAGE_USERS = 1u << 5,
+    ACTION_CHECKOUT_DESK = 1u << 6 // borrow and return on behalf of others
+} Action;
+
+// Role masks are resolved at compile time so a permission check is one AND.
+#define PERMISSIONS_USER                                                       \
+    (ACTION_VIEW_BOOKS | ACTION_BORROW_BOOK | ACTION_RETURN_BOOK)
+#define PERMISSIONS_LIBRARIAN                                                  \
+    (PERMISSIONS_USER | ACTION_ADD_BOOK | ACTION_UPDATE_BOOK |               \
+     ACTION_CHECKOUT_DESK)
+#define PERMISSIONS_ADMIN (PERMISSIONS_LIBRARIAN | ACTION_MANAGE_USERS)
+
 typedef struct {
     char username[100];
     UserRole role;
+    unsigned permissions;
     // Diğer kullanıcı bilgileri...
 } User;
 
-User* authenticate_user(const char* username, const char* password);
-bool has_permission(const User* user, const char* action);
+int create_users_table(sqlite3 *db);
+int create_user(sqlite3 *db, const char *username, const char *password,
+                UserRole role);
+
+// Returns a user owned by the session cache, or NULL if the credentials are
+// wrong. A repeated login inside the session TTL skips the password hash.
+// The screens call it from a database job, while they wait for it.
+User *authenticate_user(sqlite3 *db, const char *username,
+                        const char *password);
+bool has_permission(const User* user, Action action);
+
+const User *current_user(void);
+// Copies the signed-in user's name into out for a database job, which must
+// not call current_user from the worker thread. Returns 1 once the session
+// has expired, leaving out empty.
+int current_username(char *out, size_t size);
+void logout_user(void);
 
-#endif // AUTH_H 
\ No newline at end of file
+#endif // AUTH_H
@@ -0,0 +1,36 @@
+#ifndef BACKUP_H
+#define BACKUP_H
+
+#define BACKUP_PAGES_PER_STEP 64
+#define BACKUP_STEP_SLEEP_MS 10
+#define BACKUP_MAX_RESTARTS 20 // copies restarted by other writers
+
+typedef struct {
+  int pages_total;
+  int pages_done;
+  double seconds;
+  double pages_per_second;
+  int verified;    // 1 if the copy passed integrity_check
+  int rc;          // SQLite result of the backup, SQLITE_OK on success
+  char error[160]; // why it failed, empty on success
+} BackupStatus;
+
+typedef void (*BackupProgress)(const BackupStatus *status, void *arg);
+
+// Copies src into dest while other connections keep working. Pages are copied
+// in small batches with a sleep between them so writers are never held up.
+// Each commit by another connection restarts the copy; after
+// BACKUP_MAX_RESTARTS of them it fails with SQLITE_BUSY. Nothing is printed, since the scheduler runs it under the screens; a
+// failure is described in status->error.
+int backup_database(const char *src, const char *dest, int pages_per_step,
+                    int sleep_ms, BackupProgress progress, void *arg,
+                    BackupStatus *status);
+
+// Runs backup_database every interval seconds on a background thread,
+// writing timestamped copies into dir.
+int backup_scheduler_start(const char *src, const char *dir,
+                           unsigned interval);
+void backup_scheduler_stop(void);
+int backup_scheduler_status(BackupStatus *status);
+
+#endif // BACKUP_H
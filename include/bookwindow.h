@@ -4,9 +4,16 @@
 
 void book_menu();
 void search_book();
+void list_borrowed_books();
+void fuzzy_search_book();
+void search_all_branches();
 void update_book();
+void bulk_update();
+void find_book();
 void book_details(int *id);
 void list_books();
+void browse_by_author();
+void browse_by_publisher();
 void add_book();
 
 #endif // BOOKWINDOW_H
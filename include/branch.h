@@ -0,0 +1,43 @@
+#ifndef BRANCH_H
+#define BRANCH_H
+
+#include "db.h"
+#include <sqlite3.h>
+
+#define BRANCH_SEARCH_LIMIT 200 // rows taken from each branch
+
+// Migrates and ATTACHes every configured branch to db as branch_<id>, and
+// opens one read-only search connection per branch. With no branches
+// configured it does nothing and every screen keeps using main alone.
+int attach_branches(sqlite3 *db);
+void detach_branches(void);
+int branch_count(void);
+// Returns the branch name, "main" for 0, or NULL for an unknown id.
+const char *branch_name(int branch_id);
+
+// Writes routed by branch. Branch 0 goes through the regular db.c
+// functions; any other branch is written in its own attached file, so
+// desks at different branches do not contend for one lock.
+int branch_insert_book(sqlite3 *db, int branch_id, const Book *book);
+int branch_book_exists(sqlite3 *db, int branch_id, int book_id, int *found);
+int branch_borrow_book(sqlite3 *db, int branch_id, int book_id,
+                       const char *borrower_name);
+int branch_return_book(sqlite3 *db, int branch_id, int book_id,
+                       const char *borrower_name);
+
+typedef struct {
+  int branch_id;
+  Book book;
+} BranchBook;
+
+typedef struct {
+  BranchBook *items;
+  int count;
+} BranchResults;
+
+// Searches titles in main and every branch at once, one thread and one
+// connection per database, and merges the results by title.
+int federated_search(const char *title, BranchResults *results);
+void free_branch_results(BranchResults *results);
+
+#endif // BRANCH_H
@@ -0,0 +1,36 @@
+#ifndef BROWSE_H
+#define BROWSE_H
+
+#include "db.h"
+#include <sqlite3.h>
+
+typedef enum {
+  BROWSE_AUTHOR,
+  BROWSE_PUBLISHER,
+  BROWSE_GROUP_COUNT
+} BrowseGroup;
+
+typedef struct {
+  char *name; // the whole name, however long; see free_group_page
+  int books;
+} GroupCount;
+
+const char *browse_group_name(BrowseGroup group); // "Author" or "Publisher"
+
+// One alphabetical page of authors or publishers with their book counts,
+// read from AUTHOR_COUNTS or PUBLISHER_COUNTS, which triggers keep up to
+// date. The page holds the names after from, or from and after when
+// inclusive is set (an empty from starts at the top). Returns the number
+// stored in out (at most max), or -1 on error. The names are allocated and
+// released with free_group_page.
+int list_group_page(sqlite3 *db, BrowseGroup group, const char *from,
+                    int inclusive, GroupCount *out, int max);
+void free_group_page(GroupCount *rows, int count);
+
+// One page of the books of a single author or publisher in ID order,
+// continuing after the book with ID after_id (0 for the first page). Served
+// by BOOKS_BY_AUTHOR or BOOKS_BY_PUBLISHER.
+int list_group_books(sqlite3 *db, BrowseGroup group, const char *name,
+                     int after_id, int page_size, BookList *page);
+
+#endif // BROWSE_H
@@ -0,0 +1,51 @@
+#ifndef BULK_H
+#define BULK_H
+
+#include "db.h"
+#include <sqlite3.h>
+
+// Which books a bulk edit touches. Unset parts match everything, but at
+// least one has to be set so a typo cannot rewrite the whole catalog.
+typedef struct {
+  char author[100];     // exact match
+  char publisher[100];  // exact match
+  char title_like[100]; // LIKE pattern on the folded title, e.g. "%atlas%"
+  int year_from;        // 0 means no lower bound
+  int year_to;          // 0 means no upper bound
+} BookFilter;
+
+typedef enum {
+  BULK_TITLE,
+  BULK_AUTHOR,
+  BULK_PUBLISHER,
+  BULK_YEAR,
+  BULK_FIELD_COUNT
+} BulkField;
+
+int book_filter_empty(const BookFilter *filter);
+// Parses "title", "author", "publisher" or "year"; returns -1 otherwise.
+int bulk_field_from_name(const char *name);
+
+// Parses "1990-2000", "1990-" (and later), "-2000" (and earlier) or
+// "1990" (that year only) into a filter range. Returns 1 on bad syntax.
+int parse_year_range(const char *text, int *from, int *to);
+
+// Returns why the request cannot run, or NULL when it can: no filter, a
+// reversed year range, an empty value or a year that is not a number.
+// count_bulk_update and bulk_update_books refuse such requests with
+// SQLITE_MISUSE.
+const char *bulk_request_error(const BookFilter *filter, BulkField field,
+                               const char *value);
+
+// Counts the books the edit would change; rows that already hold value are
+// not counted.
+int count_bulk_update(sqlite3 *db, const BookFilter *filter, BulkField field,
+                      const char *value, int *count);
+
+// Sets field to value on every matching book in one IMMEDIATE transaction:
+// one INSERT ... SELECT writes the audit diffs and one UPDATE changes the
+// rows. changed receives the number of updated books.
+int bulk_update_books(sqlite3 *db, const BookFilter *filter, BulkField field,
+                      const char *value, const char *editor, int *changed);
+
+#endif // BULK_H
@@ -0,0 +1,41 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "db.h"
+#include <sqlite3.h>
+
+#define RESULT_CACHE_MAX_KEY 320    // bytes of a key, with the NUL
+#define RESULT_CACHE_MAX_BOOKS 2000 // larger results are not kept
+#define RESULT_CACHE_MAX_AGE 30     // seconds an entry is kept at most
+
+typedef struct {
+  unsigned long long hits;
+  unsigned long long misses;
+  unsigned long long version; // bumped by every write to BOOKS or LOANS
+  int entries;
+  int capacity;
+} ResultCacheStats;
+
+// Keeps up to capacity search and list results in memory on the UI thread,
+// evicting the least recently used. An update hook on db bumps the version
+// on any change to BOOKS or LOANS, which drops every entry at once. A
+// capacity of 0 disables the cache.
+int result_cache_init(sqlite3 *db, int capacity);
+void result_cache_close(void);
+
+// Run by jobs on the worker before they query: bumps the version when
+// another connection has committed since the last check, then returns the
+// version the results will belong to.
+unsigned long long result_cache_begin(sqlite3 *db);
+
+// Copies a cached result into out and returns 1, or returns 0 on a miss.
+// Callers run result_cache_begin on the worker first, so a commit from
+// another connection invalidates the entry before it is served.
+int result_cache_get(const char *key, BookList *out);
+// Stores a copy of list, unless the data changed after version was taken.
+void result_cache_put(const char *key, const BookList *list,
+                      unsigned long long version);
+
+void result_cache_stats(ResultCacheStats *stats);
+
+#endif // CACHE_H
@@ -0,0 +1,75 @@
+#ifndef CHANGELOG_H
+#define CHANGELOG_H
+
+#include "db.h"
+#include <sqlite3.h>
+
+#define CHANGELOG_MAGIC "LIBLOG1\n" // first 8 bytes of every log file
+#define CHANGELOG_MAGIC_SIZE 8
+#define CHANGELOG_SYNC_MS 50        // longest a record waits for fsync
+#define CHANGELOG_GROUP_RECORDS 64  // sync early once this many are pending
+#define CHANGELOG_MAX_RECORD 1024   // payload limit, fits every event
+#define CHANGELOG_REPLAY_BATCH 1000 // events per transaction when replaying
+#define CHANGELOG_VERIFY_PRINT 20   // differences listed by changelog_verify
+
+typedef enum {
+  CHANGE_ADD_BOOK = 1,
+  CHANGE_UPDATE_BOOK,
+  CHANGE_BORROW,
+  CHANGE_RETURN,
+  CHANGE_DELETE_BOOK,
+} ChangeType;
+
+// One logged change. Catalog events carry the whole row as it was after the
+// change, so replaying never depends on the previous state; loan events use
+// book.id and, for a borrow, book.borrower; a delete uses only book.id.
+typedef struct {
+  ChangeType type;
+  unsigned long long seq;
+  long long time; // unix seconds
+  Book book;
+} ChangeEvent;
+
+// Records are <u32 length><u32 crc32 of payload><payload>, little endian.
+// changelog_open appends to path, repairing a torn last record. A new log
+// starts with a snapshot of db so it can rebuild the database on its own.
+// Records are written immediately (readers can tail them) and a background
+// thread fsyncs them in groups.
+int changelog_open(sqlite3 *db, const char *path);
+void changelog_close(void);
+
+// No-ops while no log is open.
+void changelog_book(ChangeType type, const Book *book);
+void changelog_loan(ChangeType type, int book_id, const char *borrower);
+
+// Sequential reader with a fixed buffer. changelog_read returns 1 for an
+// event, 0 at the end of the file (possibly in the middle of a record that
+// is still being written) and -1 for a record that fails its checksum.
+typedef struct {
+  int fd;
+  long long offset; // start of the next record
+  unsigned char buf[CHANGELOG_MAX_RECORD];
+} ChangeReader;
+
+int changelog_reader_open(ChangeReader *reader, const char *path);
+int changelog_read(ChangeReader *reader, ChangeEvent *event);
+void changelog_reader_close(ChangeReader *reader);
+
+typedef struct {
+  long long events;
+  long long bad_records; // checksum failures; replay stops at the first one
+  double seconds;
+} ReplayReport;
+
+// Applies every event in the log to db in batched transactions.
+int changelog_replay(sqlite3 *db, const char *path, ReplayReport *report);
+
+// Rebuilds the log into a scratch in-memory database and compares books and
+// active loans with the database at db_path. differences receives the
+// number of rows that do not match; the first few are printed to stdout.
+int changelog_verify(const char *db_path, const char *path,
+                     ReplayReport *report, int *differences);
+
+const char *change_type_name(ChangeType type);
+
+#endif // CHANGELOG_H
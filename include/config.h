@@ -0,0 +1,40 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#define CONFIG_FILE "library.conf"
+#define CONFIG_MAX_BRANCHES 8 // SQLite attaches at most 10 databases
+
+// Another branch's database, attached to the main connection. The main
+// database is always branch 0.
+typedef struct {
+  int id;
+  char name[32];
+  char path[256];
+} BranchConfig;
+
+// Runtime settings read from CONFIG_FILE (or $LIBRARY_CONFIG) at startup.
+// Anything missing from the file keeps the default from config.c.
+typedef struct {
+  char db_path[256];
+  long long mmap_size;   // bytes, 0 disables memory-mapped I/O
+  int cache_size;        // pages if positive, KiB if negative
+  int page_size;         // only applies to newly created databases
+  char temp_store[16];   // default, file or memory
+  char journal_mode[16]; // delete, truncate, persist, memory, wal or off
+  char synchronous[16];  // off, normal, full or extra
+  int busy_timeout;      // milliseconds
+  char backup_dir[256];
+  unsigned backup_interval; // seconds, 0 disables scheduled backups
+  char changelog_path[256]; // empty disables the change log
+  unsigned recs_interval;   // seconds between recommendation refreshes, 0 off
+  int result_cache_entries; // cached search/list pages, 0 disables the cache
+  int loan_days;            // loan period; later returns are overdue
+  BranchConfig branches[CONFIG_MAX_BRANCHES]; // "branch = <id> <name> <path>"
+  int branch_count;
+} Config;
+
+extern Config config;
+
+int load_config(const char *path, Config *config);
+
+#endif // CONFIG_H
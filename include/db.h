@@ -3,13 +3,56 @@
 #ifndef DB_H
 #define DB_H
 
+// Default path, overridden by db_path in the configuration file
 #define DB_FILE "library.db"
 
 int connect_to_database(const char *db_name);
+int open_connection(const char *db_name, sqlite3 **db);
+sqlite3 *get_database(void);
+void close_database(void);
 int create_book_table(sqlite3 *db);
 int create_loans_table(sqlite3 *db);
 int borrow_book(sqlite3 *db, int book_id, const char *borrower_name);
-int return_book(sqlite3 *db, int book_id);
+// borrower_name NULL returns the book whoever holds it; otherwise only that
+// borrower's loan is returned.
+int return_book(sqlite3 *db, int book_id, const char *borrower_name);
+
+typedef enum {
+  LOAN_OK,
+  LOAN_NOT_FOUND,
+  LOAN_ALREADY_BORROWED,
+  LOAN_NOT_BORROWED,
+  LOAN_BORROWED_BY_OTHER, // returning someone else's loan
+} LoanStatus;
+
+// Basket checkout and return: every book is checked and written inside one
+// IMMEDIATE transaction and statuses gets one entry per id. If any item is
+// not LOAN_OK the whole basket is rolled back and SQLITE_CONSTRAINT is
+// returned, so either all loans change or none do. A return basket with a
+// borrower_name only takes back that borrower's loans.
+int borrow_books(sqlite3 *db, const int *book_ids, int count,
+                 const char *borrower_name, LoanStatus *statuses);
+int return_books(sqlite3 *db, const int *book_ids, int count,
+                 const char *borrower_name, LoanStatus *statuses);
+
+// An outstanding loan. Loan dates are Unix epochs; returned loans are
+// deleted, so LOANS only holds books that are out.
+typedef struct {
+  int book_id;
+  char title[100];
+  char borrower[100];
+  long long borrowed_at;
+} LoanRow;
+
+// Counts loans borrowed in [from, to) that are still out. Both loan reports
+// are range scans of LOANS_BY_BORROW_DATE.
+int count_loans_between(sqlite3 *db, long long from, long long to,
+                        int *count);
+// Loans borrowed before borrowed_before, oldest first. total receives the
+// number of such loans even when more than max exist. Returns the number
+// stored in out, or -1 on error.
+int list_overdue_loans(sqlite3 *db, long long borrowed_before, LoanRow *out,
+                       int max, int *total);
 
 typedef struct {
   int id;
@@ -17,7 +60,51 @@ typedef struct {
   char author[100];
   char publisher[100];
   int year;
-  char borrower[100];
+  char borrower[100]; // empty when the book is not borrowed
+  char isbn[32];      // normalized ISBN-13 or barcode, empty if unknown
 } Book;
 
+typedef struct {
+  Book *items;
+  int count;
+  int capacity;
+} BookList;
+
+typedef enum {
+  SORT_BY_ID,
+  SORT_BY_TITLE,
+  SORT_BY_AUTHOR,
+  SORT_BY_YEAR,
+  SORT_BY_AVAILABILITY, // available first, then by title
+  SORT_KEY_COUNT
+} SortKey;
+
+typedef struct {
+  SortKey sort;
+  int descending;
+  int available_only;
+  int year_from; // 0 means no lower bound
+  int year_to;   // 0 means no upper bound
+  int page_size;
+} ListQuery;
+
+// Fetches one page of the book list. When after is not NULL the page starts
+// right after that row in the requested order (keyset paging). Every sort
+// and filter combination is served by one of the covering BOOKS indexes.
+int list_books_page(sqlite3 *db, const ListQuery *query, const Book *after,
+                    BookList *page);
+const char *sort_key_name(SortKey key);
+
+// Catalog writes. update_book_fields keeps the current value of any field
+// that is empty (or a year of 0) in book, matching the update screen, and
+// records the changed fields for editor in BOOK_EDITS.
+int insert_book(sqlite3 *db, const Book *book);
+int update_book_fields(sqlite3 *db, const Book *book, const char *editor);
+int book_exists(sqlite3 *db, int book_id, int *found);
+
+// Steps stmt and appends every row. Columns must be ID, TITLE, AUTHOR,
+// PUBLISHER, YEAR, BORROWER_NAME and optionally ISBN.
+int collect_books(sqlite3_stmt *stmt, BookList *list);
+void free_book_list(BookList *list);
+
 #endif // DB_H
@@ -0,0 +1,61 @@
+#ifndef DEDUPE_H
+#define DEDUPE_H
+
+#include <sqlite3.h>
+
+#define DEDUPE_BANDS 20          // LSH bands, one comparison task each
+#define DEDUPE_BAND_ROWS 3       // MinHash values per band
+#define DEDUPE_SHINGLE 3         // bytes per title shingle
+#define DEDUPE_FIELD_MAX 128     // bytes of a normalized field that count
+#define DEDUPE_MAX_BUCKET 1000   // larger buckets are skipped, not compared
+#define DEDUPE_MAX_THREADS 16    // capped by the core count
+#define DEDUPE_CHUNK 4096        // records a thread signs at a time
+#define DEDUPE_DEFAULT_THRESHOLD 85 // percent similarity of title and author
+#define DEDUPE_REPORT_ROWS 100   // suggestions printed by the CLI
+
+typedef struct {
+  int books;
+  long long pairs;   // candidate pairs compared
+  int suggestions;   // pairs written to BOOK_DUPLICATES
+  int skipped;       // buckets over DEDUPE_MAX_BUCKET
+  int threads;
+  double load_seconds;
+  double block_seconds;   // normalizing and MinHash signatures
+  double compare_seconds; // bucketing and pair comparison
+  double write_seconds;
+} DedupeReport;
+
+typedef struct {
+  int keep_id; // the older record, which a merge keeps
+  int duplicate_id;
+  int similarity; // percent
+  char keep_title[100];
+  char keep_author[100];
+  char duplicate_title[100];
+  char duplicate_author[100];
+} DuplicateRow;
+
+// Rebuilds BOOK_DUPLICATES. Titles, authors and publishers are Turkish
+// case-folded with punctuation dropped, and author words are sorted so
+// "Pamuk, Orhan" matches "Orhan Pamuk". Candidates are books that share a
+// MinHash LSH bucket of their title shingles; each band is bucketed and
+// compared on its own thread. A pair is suggested when both title and author
+// are at least threshold percent alike by edit distance, the years agree
+// (or one is unknown) and the ISBNs do not contradict each other.
+int find_duplicates(sqlite3 *db, int threshold, DedupeReport *report);
+
+// Suggestions, most similar first. total receives the number of
+// suggestions. Returns the number stored in out (at most max), or -1 on
+// error.
+int list_duplicates(sqlite3 *db, DuplicateRow *out, int max, int *total);
+
+// Folds duplicate_id into keep_id in one transaction: loans, loan counts,
+// borrowing history, attachments, fees and edit history move to keep_id,
+// which also takes the duplicate's ISBN if it has none, and the duplicate is
+// deleted. After the commit the change log gets the moved loan, the delete
+// and keep_id's new row. Fails with SQLITE_NOTFOUND when either book is
+// missing and with SQLITE_CONSTRAINT when both are on loan. moved receives
+// the number of loans moved.
+int merge_books(sqlite3 *db, int keep_id, int duplicate_id, int *moved);
+
+#endif // DEDUPE_H
@@ -0,0 +1,37 @@
+#ifndef FEES_H
+#define FEES_H
+
+#include <sqlite3.h>
+
+#define FEE_MAX_TYPES 16 // item types a FEE_SCHEDULE may define, 0..15
+
+// Fee rule for one item type, read from FEE_SCHEDULE. Amounts are in the
+// smallest currency unit (kuruş).
+typedef struct {
+  int grace_days; // free days after the due date
+  int daily_fee;
+  int max_fee;
+} FeeRule;
+
+typedef struct {
+  int loans;            // active loans looked at
+  int late;             // loans that owe a fee
+  long long total_fee;
+  double load_seconds;
+  double compute_seconds;
+  double write_seconds;
+} FeeReport;
+
+// Computes the late fee of every active loan in schema ("main" or an
+// attached "branch_<id>") as of as_of, using that schema's FEE_SCHEDULE and
+// config.loan_days, and replaces its LOAN_FEES with the loans that owe
+// something, in one transaction. Loan ages are loaded into columnar arrays
+// grouped by item type, so each type is one branch-free loop.
+int compute_late_fees(sqlite3 *db, const char *schema, long long as_of,
+                      FeeReport *report);
+
+// Sets the item type of the given books; the type must be in FEE_SCHEDULE.
+int set_item_type(sqlite3 *db, int item_type, const int *book_ids,
+                  int count);
+
+#endif // FEES_H
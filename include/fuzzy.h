@@ -0,0 +1,27 @@
+#ifndef FUZZY_H
+#define FUZZY_H
+
+#include <sqlite3.h>
+
+#define FUZZY_MAX_PATTERN 64 // one machine word per pattern
+#define FUZZY_MAX_RESULTS 50
+#define FUZZY_MAX_THREADS 8
+
+typedef struct {
+  int id;
+  int distance; // edit distance of the best matching title or author
+} FuzzyMatch;
+
+// Normalizes text for matching: ASCII letters are lower-cased, punctuation
+// becomes a space and runs of spaces collapse. Returns the output length.
+int fuzzy_normalize(const char *text, char *out, int size);
+
+// Ranks BOOKS by the edit distance between query and the best matching
+// substring of each title or author, compared on the Turkish case-folded
+// TITLE_KEY and AUTHOR_KEY. The normalized columns are loaded once
+// and reloaded only after the database changes. Returns the number of
+// matches written to results (at most max_results), or -1 on error.
+int fuzzy_search(sqlite3 *db, const char *query, FuzzyMatch *results,
+                 int max_results);
+
+#endif // FUZZY_H
@@ -0,0 +1,33 @@
+#ifndef MARC_H
+#define MARC_H
+
+#include <sqlite3.h>
+
+#define MARC_RECORD_MAX 99999 // ISO 2709 record length has five digits
+#define MARC_BUFFER (1 << 20) // read buffer; always holds a whole record
+#define MARC_BATCH 1000       // records per transaction
+#define MARC_ERROR_PRINT 20   // rejected records described on stderr
+
+typedef struct {
+  long long records;    // records read, good or bad
+  long long imported;   // rows added to BOOKS
+  long long duplicates; // ISBN already in BOOKS
+  long long rejected;   // no title, or MARC-8 text that is not plain ASCII
+  long long malformed;  // bad leader, directory or terminator
+  long long bytes;      // bytes of the file consumed
+  double seconds;
+} MarcReport;
+
+// Streams a MARC 21 file in ISO 2709 format into BOOKS through one fixed
+// buffer, so the memory used does not depend on the file's size. Title is
+// 245 $a and $b, author 100 $a, publisher and year 264 (second indicator
+// 1) or 260 $b and $c, falling back to the year in 008, and ISBN the first
+// 020 $a, normalized like a scanned code. A damaged record is skipped up to
+// the next record terminator and counted; the import goes on. Rows are
+// inserted batch records to a transaction and reach the change log once
+// their batch has committed. Fails only on a database or file error,
+// keeping the batches committed before it.
+int import_marc(sqlite3 *db, const char *path, int batch,
+                MarcReport *report);
+
+#endif // MARC_H
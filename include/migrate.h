@@ -0,0 +1,18 @@
+#ifndef MIGRATE_H
+#define MIGRATE_H
+
+#include <sqlite3.h>
+
+// A schema step. Either sql or apply is set; apply is for steps that need C
+// code (backfills). Versions are stored in PRAGMA user_version.
+typedef struct {
+  int version;
+  const char *description;
+  const char *sql;
+  int (*apply)(sqlite3 *db);
+} Migration;
+
+int schema_version(sqlite3 *db);
+int migrate_database(sqlite3 *db);
+
+#endif // MIGRATE_H
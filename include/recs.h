@@ -0,0 +1,45 @@
+#ifndef RECS_H
+#define RECS_H
+
+#include <sqlite3.h>
+
+#define RECS_TOP_K 5          // neighbours kept per book
+#define RECS_MAX_BASKET 500   // larger baskets (bulk accounts) are skipped
+#define RECS_MAX_THREADS 16   // counting threads, capped by the core count
+#define RECS_CHUNK 64         // target books a thread claims at a time
+
+typedef struct {
+  int id;
+  char title[100];
+  char author[100];
+  int shared; // borrowers who took both books
+} Recommendation;
+
+typedef struct {
+  int targets;    // books whose neighbour lists were rebuilt
+  int baskets;    // borrower baskets that were counted
+  long long rows; // neighbour rows written
+  int threads;
+  double load_seconds;
+  double count_seconds;
+  double write_seconds;
+} RecsReport;
+
+// Rebuilds BOOK_NEIGHBOURS, the top RECS_TOP_K books borrowed by the same
+// borrowers, from BORROWER_BOOKS. With full set every book is rebuilt;
+// otherwise only the books the loan triggers marked in RECS_DIRTY. Counting
+// runs on several threads outside any write transaction; only the final
+// write takes the lock.
+int refresh_recommendations(sqlite3 *db, int full, RecsReport *report);
+
+// Reads the neighbour list of one book (a single BOOK_NEIGHBOURS range seek).
+// Returns the number of recommendations stored in out, or -1 on error.
+int book_recommendations(sqlite3 *db, int book_id,
+                         Recommendation out[RECS_TOP_K]);
+
+// Runs the incremental refresh every interval seconds on a background thread
+// with its own connection to db_path.
+int recs_refresher_start(const char *db_path, unsigned interval);
+void recs_refresher_stop(void);
+
+#endif // RECS_H
@@ -0,0 +1,39 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include "db.h"
+#include <sqlite3.h>
+#include <stddef.h>
+
+typedef enum { SCAN_BORROW, SCAN_RETURN } ScanMode;
+
+typedef enum {
+  SCAN_DONE,
+  SCAN_UNKNOWN_CODE,
+  SCAN_ALREADY_BORROWED,
+  SCAN_NOT_BORROWED,
+} ScanOutcome;
+
+// Statements for the checkout desk, prepared once and reused for every item
+// so a scan costs one index seek and one small write.
+typedef struct {
+  sqlite3_stmt *lookup;
+  sqlite3_stmt *borrow;
+  sqlite3_stmt *give_back;
+} Scanner;
+
+// Normalizes an ISBN or barcode: hyphens and spaces are dropped, letters are
+// upper-cased and a valid ISBN-10 becomes the equivalent ISBN-13, so every
+// printed form of the same book finds the same row. Returns 1 if nothing
+// usable is left.
+int normalize_code(const char *code, char *out, size_t size);
+
+int scanner_open(sqlite3 *db, Scanner *scanner);
+void scanner_close(Scanner *scanner);
+
+// Resolves code through BOOKS_BY_ISBN and borrows or returns the book. book
+// receives the matched row (borrower is the holder before a return).
+int scan_item(Scanner *scanner, ScanMode mode, const char *code,
+              const char *borrower, ScanOutcome *outcome, Book *book);
+
+#endif // SCAN_H
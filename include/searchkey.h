@@ -0,0 +1,29 @@
+#ifndef SEARCHKEY_H
+#define SEARCHKEY_H
+
+#include <sqlite3.h>
+
+#define SEARCH_KEY_MAX 256 // bytes of a folded title or author, with the NUL
+
+// Case-folds UTF-8 text for searching: I, İ (or I followed by a combining
+// dot), ı and i all become i, so Turkish and English spellings meet; other
+// Latin-1 and Latin Extended-A capitals lose their case as usual. Bytes that
+// are not valid UTF-8 are copied as they are. The output is never longer
+// than the input. Returns the output length.
+int fold_search_key(const char *text, char *out, int size);
+
+// Binds the folded form of text to param. Every statement that writes
+// TITLE or AUTHOR also writes TITLE_KEY or AUTHOR_KEY this way.
+int bind_search_key(sqlite3_stmt *stmt, int param, const char *text);
+
+// Registers search_key(text) on db, for SQL that refolds stored rows:
+// migrate_database and rebuild_search_keys.
+int register_search_key_function(sqlite3 *db);
+
+// Recomputes TITLE_KEY and AUTHOR_KEY wherever they differ from the current
+// folding, for rows written before the keys existed, under older rules or
+// by tools outside this program. Covers main and every attached branch.
+// rows receives the number of books rewritten.
+int rebuild_search_keys(sqlite3 *db, int *rows);
+
+#endif // SEARCHKEY_H
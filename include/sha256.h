@@ -0,0 +1,26 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+
+typedef struct {
+  uint32_t state[8];
+  uint64_t length;
+  uint8_t buffer[64];
+  size_t used;
+} Sha256;
+
+void sha256_init(Sha256 *ctx);
+void sha256_update(Sha256 *ctx, const void *data, size_t len);
+void sha256_final(Sha256 *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+void hmac_sha256(const uint8_t *key, size_t key_len, const uint8_t *msg,
+                 size_t msg_len, uint8_t digest[SHA256_DIGEST_SIZE]);
+void pbkdf2_sha256(const uint8_t *password, size_t password_len,
+                   const uint8_t *salt, size_t salt_len, uint32_t iterations,
+                   uint8_t out[SHA256_DIGEST_SIZE]);
+
+#endif // SHA256_H
@@ -0,0 +1,9 @@
+#ifndef STATSWINDOW_H
+#define STATSWINDOW_H
+
+#define STATS_TOP_ROWS 10
+#define STATS_DAYS 14
+
+void stats_menu();
+
+#endif // STATSWINDOW_H
@@ -1,8 +1,14 @@
 #ifndef USERWINDOW_H
 #define USERWINDOW_H
 
+#include "auth.h"
+
+const User *login_menu();
 void user_menu();
 void borrow_book_menu();
 void return_book_menu();
+void scan_desk();
+void borrow_basket_menu();
+void return_basket_menu();
 
 #endif // USERWINDOW_H
@@ -2,8 +2,48 @@
 #ifndef WINDOW_H
 #define WINDOW_H
 
+#include "worker.h"
+
+#define SPINNER_DELAY_MS 150
+#define SPINNER_INTERVAL_MS 80
+
 void start_window();
 void call_menu(void *menu);
 void clear_screen();
 
+// Runs job on the database worker and keeps the screen alive while it waits:
+// a spinner appears for slow jobs and q interrupts the running query, in
+// which case SQLITE_INTERRUPT is returned.
+int run_db_job(DbJob job, void *arg);
+
+// Formats row index of rows into line; a ListView calls it only for rows
+// that are on screen.
+typedef void (*ListRowFormat)(const void *rows, int index, char *line,
+                              int size);
+
+// A scrolling window over count rows, from screen line top down to the line
+// above the footer (LINES - 1). Redraws cost the visible rows only, however
+// long the list, and the view follows the terminal size after KEY_RESIZE.
+typedef struct {
+  int top;
+  int count;
+  int cursor; // selected row
+  int first;  // row shown on line top
+} ListView;
+
+// Rows that fit on screen at the current terminal size
+int list_view_rows(const ListView *view);
+// Scrolls so the cursor is visible, then draws the visible rows with the
+// cursor highlighted and clears the lines below them.
+void list_view_draw(ListView *view, ListRowFormat format, const void *rows);
+// Moves the cursor for UP/DOWN, PgUp/PgDn and Home/End and takes
+// KEY_RESIZE. Returns 0 for keys it does not handle.
+int list_view_key(ListView *view, int ch);
+
+// Startup is timed from start_startup_timer (top of main) to the first
+// painted menu. stop_startup_timer returns 1 only on the first call.
+void start_startup_timer();
+int stop_startup_timer();
+double startup_time_ms();
+
 #endif // WINDOW_H
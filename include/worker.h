@@ -0,0 +1,26 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <sqlite3.h>
+
+#define WORKER_QUEUE_SIZE 16 // must be a power of two
+
+// A unit of database work. It runs on the worker thread and must not touch
+// ncurses; results go back through arg.
+typedef int (*DbJob)(sqlite3 *db, void *arg);
+
+int start_db_worker(sqlite3 *db);
+void stop_db_worker(void);
+
+// Queues a job and returns a ticket, or 0 if the queue is full. A job that
+// got a ticket always runs.
+unsigned submit_db_job(DbJob job, void *arg);
+// Returns 1 and stores the job's result once the ticket has completed.
+int poll_db_job(unsigned ticket, int *rc);
+// Blocks until the ticket has completed and returns its result. Unlike
+// run_db_job it leaves pending keyboard input alone.
+int wait_db_job(unsigned ticket);
+// Interrupts whatever statement the worker is running.
+void cancel_db_jobs(void);
+
+#endif // WORKER_H
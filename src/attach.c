@@ -0,0 +1,216 @@
+#include "../include/attach.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+static const char *guess_mime(const char *name) {
+  static const struct {
+    const char *extension;
+    const char *mime;
+  } types[] = {{".jpg", "image/jpeg"},  {".jpeg", "image/jpeg"},
+               {".png", "image/png"},   {".gif", "image/gif"},
+               {".webp", "image/webp"}, {".pdf", "application/pdf"},
+               {".txt", "text/plain"}};
+
+  const char *dot = strrchr(name, '.');
+  for (size_t i = 0; dot != NULL && i < sizeof(types) / sizeof(types[0]); i++) {
+    if (strcasecmp(dot, types[i].extension) == 0)
+      return types[i].mime;
+  }
+  return "application/octet-stream";
+}
+
+static int exec_sql(sqlite3 *db, const char *sql) {
+  char *zErrMsg = 0;
+  int rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "SQL error: %s\n", zErrMsg);
+    sqlite3_free(zErrMsg);
+  }
+  return rc;
+}
+
+// Inserts the metadata row with a zero-filled DATA of the right size.
+static int insert_placeholder(sqlite3 *db, int book_id, const char *name,
+                              sqlite3_int64 size, sqlite3_int64 *id) {
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(
+      db,
+      "INSERT INTO ATTACHMENTS (BOOK_ID, NAME, MIME, SIZE, DATA) "
+      "SELECT ?1, ?2, ?3, ?4, ?5 WHERE EXISTS (SELECT 1 FROM BOOKS "
+      "WHERE ID = ?1);",
+      -1, &stmt, 0);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  sqlite3_bind_int(stmt, 1, book_id);
+  sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 3, guess_mime(name), -1, SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 4, size);
+  sqlite3_bind_zeroblob64(stmt, 5, (sqlite3_uint64)size);
+  rc = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE)
+    return rc;
+  if (sqlite3_changes(db) == 0) {
+    fprintf(stderr, "Book %d not found\n", book_id);
+    return SQLITE_NOTFOUND;
+  }
+  *id = sqlite3_last_insert_rowid(db);
+  return SQLITE_OK;
+}
+
+static int copy_into_blob(sqlite3 *db, sqlite3_int64 id, FILE *in,
+                          sqlite3_int64 size) {
+  sqlite3_blob *blob;
+  int rc = sqlite3_blob_open(db, "main", "ATTACHMENTS", "DATA", id, 1, &blob);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  char *chunk = malloc(ATTACH_CHUNK);
+  if (chunk == NULL) {
+    sqlite3_blob_close(blob);
+    return SQLITE_NOMEM;
+  }
+  sqlite3_int64 offset = 0;
+  size_t n;
+  while (rc == SQLITE_OK && (n = fread(chunk, 1, ATTACH_CHUNK, in)) > 0) {
+    // A file that grew since it was measured would not fit the blob
+    if (offset + (sqlite3_int64)n > size) {
+      rc = SQLITE_IOERR;
+      break;
+    }
+    rc = sqlite3_blob_write(blob, chunk, (int)n, (int)offset);
+    offset += n;
+  }
+  if (rc == SQLITE_OK && (ferror(in) || offset != size))
+    rc = SQLITE_IOERR;
+  free(chunk);
+
+  int close_rc = sqlite3_blob_close(blob);
+  return rc != SQLITE_OK ? rc : close_rc;
+}
+
+int import_attachment(sqlite3 *db, int book_id, const char *path,
+                      const char *name, sqlite3_int64 *id) {
+  FILE *in = fopen(path, "rb");
+  if (in == NULL) {
+    perror(path);
+    return SQLITE_CANTOPEN;
+  }
+  sqlite3_int64 size = -1;
+  if (fseeko(in, 0, SEEK_END) == 0)
+    size = ftello(in);
+  rewind(in);
+  // Blob offsets are ints, and the row has to fit SQLite's length limit
+  if (size < 0 || size > 0x7fffffff ||
+      size > sqlite3_limit(db, SQLITE_LIMIT_LENGTH, -1)) {
+    fprintf(stderr, "%s: too large for an attachment\n", path);
+    fclose(in);
+    return SQLITE_TOOBIG;
+  }
+
+  if (name == NULL) {
+    const char *slash = strrchr(path, '/');
+    name = slash != NULL ? slash + 1 : path;
+  }
+
+  // The placeholder and its contents commit together
+  int rc = exec_sql(db, "BEGIN IMMEDIATE;");
+  if (rc == SQLITE_OK)
+    rc = insert_placeholder(db, book_id, name, size, id);
+  if (rc == SQLITE_OK)
+    rc = copy_into_blob(db, *id, in, size);
+  if (rc == SQLITE_OK)
+    rc = exec_sql(db, "COMMIT;");
+  if (rc != SQLITE_OK) {
+    if (rc != SQLITE_NOTFOUND)
+      fprintf(stderr, "Attachment error: %s\n", sqlite3_errstr(rc));
+    sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+  }
+  fclose(in);
+  return rc;
+}
+
+int export_attachment(sqlite3 *db, sqlite3_int64 id, const char *path) {
+  sqlite3_blob *blob;
+  int rc = sqlite3_blob_open(db, "main", "ATTACHMENTS", "DATA", id, 0, &blob);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Attachment %lld: %s\n", (long long)id,
+            sqlite3_errmsg(db));
+    return rc;
+  }
+
+  FILE *out = fopen(path, "wb");
+  char *chunk = malloc(ATTACH_CHUNK);
+  if (out == NULL || chunk == NULL) {
+    if (out == NULL)
+      perror(path);
+    else
+      fclose(out);
+    free(chunk);
+    sqlite3_blob_close(blob);
+    return out == NULL ? SQLITE_CANTOPEN : SQLITE_NOMEM;
+  }
+
+  int size = sqlite3_blob_bytes(blob);
+  for (int offset = 0; rc == SQLITE_OK && offset < size;) {
+    int n = size - offset < ATTACH_CHUNK ? size - offset : ATTACH_CHUNK;
+    rc = sqlite3_blob_read(blob, chunk, n, offset);
+    if (rc == SQLITE_OK && fwrite(chunk, 1, n, out) != (size_t)n)
+      rc = SQLITE_IOERR;
+    offset += n;
+  }
+  free(chunk);
+  sqlite3_blob_close(blob);
+  if (fclose(out) != 0 && rc == SQLITE_OK)
+    rc = SQLITE_IOERR;
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Attachment error: %s\n", sqlite3_errstr(rc));
+    remove(path);
+  }
+  return rc;
+}
+
+int list_attachments(sqlite3 *db, int book_id, Attachment *out, int max) {
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(db,
+                              "SELECT ID, NAME, MIME, SIZE FROM ATTACHMENTS "
+                              "WHERE BOOK_ID = ? ORDER BY NAME;",
+                              -1, &stmt, 0);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+
+  sqlite3_bind_int(stmt, 1, book_id);
+  int count = 0;
+  while (count < max && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    Attachment *item = &out[count++];
+    item->id = sqlite3_column_int64(stmt, 0);
+    item->book_id = book_id;
+    snprintf(item->name, sizeof(item->name), "%s",
+             (const char *)sqlite3_column_text(stmt, 1));
+    snprintf(item->mime, sizeof(item->mime), "%s",
+             (const char *)sqlite3_column_text(stmt, 2));
+    item->size = sqlite3_column_int64(stmt, 3);
+  }
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_ROW || rc == SQLITE_DONE ? count : -1;
+}
+
+int delete_attachment(sqlite3 *db, sqlite3_int64 id) {
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(db, "DELETE FROM ATTACHMENTS WHERE ID = ?;", -1,
+                              &stmt, 0);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  sqlite3_bind_int64(stmt, 1, id);
+  rc = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE)
+    return rc;
+  return sqlite3_changes(db) > 0 ? SQLITE_OK : SQLITE_NOTFOUND;
+}
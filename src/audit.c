@@ -0,0 +1,555 @@
+#include "../include/audit.h"
+#include "../include/changelog.h"
+#include "../include/searchkey.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+static int put_varint(unsigned char *out, int pos, int size,
+                      unsigned long long value) {
+  do {
+    if (pos >= size)
+      return -1;
+    unsigned char byte = value & 0x7f;
+    value >>= 7;
+    out[pos++] = byte | (value ? 0x80 : 0);
+  } while (value);
+  return pos;
+}
+
+static int get_varint(const unsigned char *in, int pos, int length,
+                      unsigned long long *value) {
+  *value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (pos >= length)
+      return -1;
+    unsigned char byte = in[pos++];
+    *value |= (unsigned long long)(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return pos;
+  }
+  return -1;
+}
+
+static int put_text(unsigned char *out, int pos, int size, const char *text,
+                    int length) {
+  pos = put_varint(out, pos, size, length);
+  if (pos < 0 || pos + length > size)
+    return -1;
+  memcpy(out + pos, text, length);
+  return pos + length;
+}
+
+static unsigned long long zigzag(long long value) {
+  return ((unsigned long long)value << 1) ^ (unsigned long long)(value >> 63);
+}
+
+static long long unzigzag(unsigned long long value) {
+  return (long long)(value >> 1) ^ -(long long)(value & 1);
+}
+
+// The text fields of a Book and their columns; the year is encoded on its
+// own
+typedef struct {
+  AuditField tag;
+  size_t offset;
+  size_t size;
+  const char *column;
+  const char *key_column; // folded copy kept next to it, or NULL
+} TextField;
+
+static const TextField text_fields[] = {
+    {AUDIT_TITLE, offsetof(Book, title), sizeof(((Book *)0)->title), "TITLE",
+     "TITLE_KEY"},
+    {AUDIT_AUTHOR, offsetof(Book, author), sizeof(((Book *)0)->author),
+     "AUTHOR", "AUTHOR_KEY"},
+    {AUDIT_PUBLISHER, offsetof(Book, publisher),
+     sizeof(((Book *)0)->publisher), "PUBLISHER", NULL},
+    {AUDIT_ISBN, offsetof(Book, isbn), sizeof(((Book *)0)->isbn), "ISBN",
+     NULL},
+};
+
+#define TEXT_FIELD_COUNT (int)(sizeof(text_fields) / sizeof(text_fields[0]))
+#define FIELD(book, field) ((char *)(book) + (field)->offset)
+
+// A text value of any length, pointing into a Book, a blob or an SQL value
+typedef struct {
+  const char *text;
+  int length;
+} DiffText;
+
+// The changed fields of one edit, text fields indexed like text_fields.
+// Unlike a Book it holds whole values, however long the columns are.
+typedef struct {
+  unsigned fields;
+  DiffText before[TEXT_FIELD_COUNT];
+  DiffText after[TEXT_FIELD_COUNT];
+  int year_before;
+  int year_after;
+} Diff;
+
+// An upper bound of what encode_diff writes; a varint takes at most 10 bytes
+static int diff_size(const Diff *diff) {
+  int size = 1 + 30;
+  for (int i = 0; i < TEXT_FIELD_COUNT; i++) {
+    if (diff->fields & text_fields[i].tag)
+      size += 30 + diff->before[i].length + diff->after[i].length;
+  }
+  return size;
+}
+
+// Returns the blob length, 1 when no field is set, or -1 if out is too small
+static int encode_diff(const Diff *diff, unsigned char *out, int size) {
+  if (size < 1)
+    return -1;
+  int pos = 0;
+  out[pos++] = AUDIT_FORMAT;
+
+  for (int i = 0; i < TEXT_FIELD_COUNT && pos > 0; i++) {
+    if (!(diff->fields & text_fields[i].tag))
+      continue;
+    pos = put_varint(out, pos, size, text_fields[i].tag);
+    if (pos > 0)
+      pos = put_text(out, pos, size, diff->before[i].text,
+                     diff->before[i].length);
+    if (pos > 0)
+      pos = put_text(out, pos, size, diff->after[i].text,
+                     diff->after[i].length);
+  }
+  if (pos > 0 && (diff->fields & AUDIT_YEAR)) {
+    pos = put_varint(out, pos, size, AUDIT_YEAR);
+    if (pos > 0)
+      pos = put_varint(out, pos, size, zigzag(diff->year_before));
+    if (pos > 0)
+      pos = put_varint(out, pos, size, zigzag(diff->year_after));
+  }
+  return pos;
+}
+
+// Points the text of diff into blob, which has to outlive it
+static int parse_diff(const unsigned char *blob, int length, Diff *diff) {
+  memset(diff, 0, sizeof(*diff));
+  if (blob == NULL || length < 1 || blob[0] != AUDIT_FORMAT)
+    return -1;
+
+  int pos = 1;
+  while (pos < length) {
+    unsigned long long tag;
+    pos = get_varint(blob, pos, length, &tag);
+    if (pos < 0)
+      return -1;
+    if (tag == AUDIT_YEAR) {
+      unsigned long long old_year, new_year;
+      pos = get_varint(blob, pos, length, &old_year);
+      if (pos > 0)
+        pos = get_varint(blob, pos, length, &new_year);
+      if (pos < 0)
+        return -1;
+      diff->year_before = (int)unzigzag(old_year);
+      diff->year_after = (int)unzigzag(new_year);
+      diff->fields |= AUDIT_YEAR;
+      continue;
+    }
+
+    int field = -1;
+    for (int i = 0; i < TEXT_FIELD_COUNT; i++) {
+      if (text_fields[i].tag == tag)
+        field = i;
+    }
+    if (field < 0)
+      return -1;
+    DiffText *values[] = {&diff->before[field], &diff->after[field]};
+    for (int i = 0; i < 2; i++) {
+      unsigned long long n;
+      pos = get_varint(blob, pos, length, &n);
+      if (pos < 0 || n > (unsigned long long)(length - pos))
+        return -1;
+      values[i]->text = (const char *)blob + pos;
+      values[i]->length = (int)n;
+      pos += (int)n;
+    }
+    diff->fields |= text_fields[field].tag;
+  }
+  return 0;
+}
+
+int audit_encode(const Book *before, const Book *after, unsigned char *out,
+                 int size) {
+  Diff diff = {0};
+  for (int i = 0; i < TEXT_FIELD_COUNT; i++) {
+    const TextField *field = &text_fields[i];
+    const char *old_text = FIELD(before, field);
+    const char *new_text = FIELD(after, field);
+    if (strcmp(old_text, new_text) == 0)
+      continue;
+    diff.fields |= field->tag;
+    diff.before[i] = (DiffText){old_text, (int)strlen(old_text)};
+    diff.after[i] = (DiffText){new_text, (int)strlen(new_text)};
+  }
+  if (before->year != after->year) {
+    diff.fields |= AUDIT_YEAR;
+    diff.year_before = before->year;
+    diff.year_after = after->year;
+  }
+  int pos = encode_diff(&diff, out, size);
+  if (pos < 0)
+    return -1;
+  return pos > 1 ? pos : 0;
+}
+
+// Copies as much of text as fits, without splitting a UTF-8 sequence
+static void copy_text(char *dest, size_t size, const DiffText *text) {
+  int length = text->length;
+  if (length >= (int)size) {
+    length = (int)size - 1;
+    while (length > 0 && ((unsigned char)text->text[length] & 0xC0) == 0x80)
+      length--;
+  }
+  memcpy(dest, text->text, length);
+  dest[length] = '\0';
+}
+
+int audit_decode(const unsigned char *blob, int length, BookEdit *edit) {
+  Diff diff;
+  edit->fields = 0;
+  if (parse_diff(blob, length, &diff) != 0)
+    return -1;
+
+  for (int i = 0; i < TEXT_FIELD_COUNT; i++) {
+    const TextField *field = &text_fields[i];
+    if (!(diff.fields & field->tag))
+      continue;
+    copy_text(FIELD(&edit->before, field), field->size, &diff.before[i]);
+    copy_text(FIELD(&edit->after, field), field->size, &diff.after[i]);
+  }
+  edit->before.year = diff.year_before;
+  edit->after.year = diff.year_after;
+  edit->fields = diff.fields;
+  return 0;
+}
+
+static int insert_edit(sqlite3 *db, int book_id, const char *editor,
+                       const unsigned char *diff, int length,
+                       sqlite3_int64 *edit_id) {
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(db,
+                              "INSERT INTO BOOK_EDITS (BOOK_ID, EDITED_AT, "
+                              "EDITOR, DIFF) VALUES (?, unixepoch(), ?, ?);",
+                              -1, &stmt, 0);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  sqlite3_bind_int(stmt, 1, book_id);
+  sqlite3_bind_text(stmt, 2, editor != NULL ? editor : "", -1, SQLITE_STATIC);
+  sqlite3_bind_blob(stmt, 3, diff, length, SQLITE_STATIC);
+  rc = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE)
+    return rc;
+  *edit_id = sqlite3_last_insert_rowid(db);
+  return SQLITE_OK;
+}
+
+int record_book_edit(sqlite3 *db, const Book *before, const Book *after,
+                     const char *editor, sqlite3_int64 *edit_id) {
+  *edit_id = 0;
+  unsigned char diff[AUDIT_MAX_DIFF];
+  int length = audit_encode(before, after, diff, sizeof(diff));
+  if (length <= 0)
+    return length == 0 ? SQLITE_OK : SQLITE_TOOBIG;
+  return insert_edit(db, after->id, editor, diff, length, edit_id);
+}
+
+// The whole text of an argument, NULL read as ''
+static DiffText value_text(sqlite3_value *value) {
+  const unsigned char *text = sqlite3_value_text(value);
+  if (text == NULL)
+    return (DiffText){"", 0};
+  return (DiffText){(const char *)text, sqlite3_value_bytes(value)};
+}
+
+static void book_diff_function(sqlite3_context *context, int argc,
+                               sqlite3_value **argv) {
+  (void)argc;
+  // Arguments come in old/new pairs, text fields in text_fields order
+  // with the year between publisher and isbn
+  static const int text_args[] = {0, 2, 4, 8};
+  Diff diff = {0};
+  for (int i = 0; i < TEXT_FIELD_COUNT; i++) {
+    DiffText old_text = value_text(argv[text_args[i]]);
+    DiffText new_text = value_text(argv[text_args[i] + 1]);
+    if (old_text.length == new_text.length &&
+        memcmp(old_text.text, new_text.text, old_text.length) == 0)
+      continue;
+    diff.fields |= text_fields[i].tag;
+    diff.before[i] = old_text;
+    diff.after[i] = new_text;
+  }
+  diff.year_before = sqlite3_value_int(argv[6]);
+  diff.year_after = sqlite3_value_int(argv[7]);
+  if (diff.year_before != diff.year_after)
+    diff.fields |= AUDIT_YEAR;
+  if (diff.fields == 0) {
+    sqlite3_result_null(context);
+    return;
+  }
+
+  int size = diff_size(&diff);
+  unsigned char *blob = sqlite3_malloc(size);
+  int length = blob != NULL ? encode_diff(&diff, blob, size) : -1;
+  if (length < 0) {
+    sqlite3_free(blob);
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  sqlite3_result_blob(context, blob, length, sqlite3_free);
+}
+
+int audit_register_functions(sqlite3 *db) {
+  return sqlite3_create_function_v2(
+      db, "book_diff", 10, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+      book_diff_function, NULL, NULL, NULL);
+}
+
+static int exec_sql(sqlite3 *db, const char *sql) {
+  char *zErrMsg = 0;
+  int rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "SQL error: %s\n", zErrMsg);
+    sqlite3_free(zErrMsg);
+  }
+  return rc;
+}
+
+// An edit row; diff points into blob, which is a copy of the column
+typedef struct {
+  int book_id;
+  sqlite3_int64 undone_by;
+  unsigned char *blob;
+  Diff diff;
+} StoredEdit;
+
+// Reads one edit row; SQLITE_NOTFOUND if there is none.
+static int load_edit(sqlite3 *db, sqlite3_int64 edit_id, StoredEdit *edit) {
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(db,
+                              "SELECT BOOK_ID, IFNULL(UNDONE_BY, 0), DIFF "
+                              "FROM BOOK_EDITS WHERE ID = ?;",
+                              -1, &stmt, 0);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  sqlite3_bind_int64(stmt, 1, edit_id);
+  rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    edit->book_id = sqlite3_column_int(stmt, 0);
+    edit->undone_by = sqlite3_column_int64(stmt, 1);
+    int length = sqlite3_column_bytes(stmt, 2);
+    edit->blob = sqlite3_malloc(length > 0 ? length : 1);
+    if (edit->blob == NULL) {
+      rc = SQLITE_NOMEM;
+    } else {
+      if (length > 0)
+        memcpy(edit->blob, sqlite3_column_blob(stmt, 2), length);
+      rc = parse_diff(edit->blob, length, &edit->diff) == 0 ? SQLITE_OK
+                                                            : SQLITE_CORRUPT;
+    }
+  } else if (rc == SQLITE_DONE) {
+    rc = SQLITE_NOTFOUND;
+  }
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+// bind_search_key for text that is not NUL-terminated
+static int bind_key(sqlite3_stmt *stmt, int param, const DiffText *text) {
+  char *copy = sqlite3_mprintf("%.*s", text->length, text->text);
+  if (copy == NULL)
+    return SQLITE_NOMEM;
+  int rc = bind_search_key(stmt, param, copy);
+  sqlite3_free(copy);
+  return rc;
+}
+
+// Writes the old values back into the columns the edit changed, and only
+// while each still holds the edit's new value. Text field i binds its old
+// value to ?(2 + 2i) and its new one to ?(3 + 2i), the year uses ?10 and ?11
+// and the folded keys ?(12 + i). reverted receives the stored row, or stays
+// empty when the book has changed since.
+static int revert_columns(sqlite3 *db, int book_id, const Diff *diff,
+                          BookList *reverted) {
+  if (diff->fields == 0)
+    return SQLITE_CORRUPT;
+  char sql[1024];
+  int len = snprintf(sql, sizeof(sql), "UPDATE BOOKS SET");
+  const char *sep = " ";
+  for (int i = 0; i < TEXT_FIELD_COUNT; i++) {
+    const TextField *field = &text_fields[i];
+    if (!(diff->fields & field->tag))
+      continue;
+    if (field->tag == AUDIT_ISBN)
+      len += snprintf(sql + len, sizeof(sql) - len, "%sISBN = NULLIF(?%d, '')",
+                      sep, 2 + 2 * i);
+    else
+      len += snprintf(sql + len, sizeof(sql) - len, "%s%s = ?%d", sep,
+                      field->column, 2 + 2 * i);
+    if (field->key_column != NULL)
+      len += snprintf(sql + len, sizeof(sql) - len, ", %s = ?%d",
+                      field->key_column, 12 + i);
+    sep = ", ";
+  }
+  if (diff->fields & AUDIT_YEAR)
+    len += snprintf(sql + len, sizeof(sql) - len, "%sYEAR = ?10", sep);
+  len += snprintf(sql + len, sizeof(sql) - len, " WHERE ID = ?1");
+  for (int i = 0; i < TEXT_FIELD_COUNT; i++) {
+    const TextField *field = &text_fields[i];
+    if (!(diff->fields & field->tag))
+      continue;
+    if (field->tag == AUDIT_ISBN)
+      len += snprintf(sql + len, sizeof(sql) - len,
+                      " AND IFNULL(ISBN, '') = ?%d", 3 + 2 * i);
+    else
+      len += snprintf(sql + len, sizeof(sql) - len, " AND %s = ?%d",
+                      field->column, 3 + 2 * i);
+  }
+  if (diff->fields & AUDIT_YEAR)
+    len += snprintf(sql + len, sizeof(sql) - len, " AND YEAR = ?11");
+  snprintf(sql + len, sizeof(sql) - len,
+           " RETURNING ID, TITLE, AUTHOR, PUBLISHER, YEAR, '', ISBN;");
+
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  sqlite3_bind_int(stmt, 1, book_id);
+  for (int i = 0; rc == SQLITE_OK && i < TEXT_FIELD_COUNT; i++) {
+    if (!(diff->fields & text_fields[i].tag))
+      continue;
+    sqlite3_bind_text(stmt, 2 + 2 * i, diff->before[i].text,
+                      diff->before[i].length, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3 + 2 * i, diff->after[i].text,
+                      diff->after[i].length, SQLITE_STATIC);
+    if (text_fields[i].key_column != NULL)
+      rc = bind_key(stmt, 12 + i, &diff->before[i]);
+  }
+  if (diff->fields & AUDIT_YEAR) {
+    sqlite3_bind_int(stmt, 10, diff->year_before);
+    sqlite3_bind_int(stmt, 11, diff->year_after);
+  }
+  if (rc == SQLITE_OK)
+    rc = collect_books(stmt, reverted);
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+// Stores the undo as the same fields with old and new swapped
+static int record_undo(sqlite3 *db, int book_id, const Diff *diff,
+                       const char *editor, sqlite3_int64 *undo_id) {
+  Diff undo = *diff;
+  for (int i = 0; i < TEXT_FIELD_COUNT; i++) {
+    undo.before[i] = diff->after[i];
+    undo.after[i] = diff->before[i];
+  }
+  undo.year_before = diff->year_after;
+  undo.year_after = diff->year_before;
+
+  int size = diff_size(&undo);
+  unsigned char *blob = sqlite3_malloc(size);
+  if (blob == NULL)
+    return SQLITE_NOMEM;
+  int length = encode_diff(&undo, blob, size);
+  int rc = length > 1 ? insert_edit(db, book_id, editor, blob, length, undo_id)
+                      : SQLITE_CORRUPT;
+  sqlite3_free(blob);
+  return rc;
+}
+
+int undo_book_edit(sqlite3 *db, sqlite3_int64 edit_id, const char *editor) {
+  int rc = exec_sql(db, "BEGIN IMMEDIATE;");
+  if (rc != SQLITE_OK)
+    return rc;
+
+  StoredEdit edit = {0};
+  BookList reverted = {0};
+  sqlite3_int64 undo_id = 0;
+  int found = 0;
+  rc = load_edit(db, edit_id, &edit);
+  if (rc == SQLITE_OK)
+    rc = book_exists(db, edit.book_id, &found);
+  if (rc == SQLITE_OK && !found)
+    rc = SQLITE_NOTFOUND;
+  if (rc == SQLITE_OK && edit.undone_by != 0) {
+    fprintf(stderr, "Edit %lld was already undone by edit %lld\n",
+            (long long)edit_id, (long long)edit.undone_by);
+    rc = SQLITE_CONSTRAINT;
+  }
+  if (rc == SQLITE_OK)
+    rc = revert_columns(db, edit.book_id, &edit.diff, &reverted);
+  if (rc == SQLITE_OK && reverted.count == 0) {
+    fprintf(stderr, "Book %d was changed again after edit %lld\n",
+            edit.book_id, (long long)edit_id);
+    rc = SQLITE_CONSTRAINT;
+  }
+  if (rc == SQLITE_OK)
+    rc = record_undo(db, edit.book_id, &edit.diff, editor, &undo_id);
+  if (rc == SQLITE_OK) {
+    sqlite3_stmt *stmt;
+    rc = sqlite3_prepare_v2(
+        db, "UPDATE BOOK_EDITS SET UNDONE_BY = ? WHERE ID = ?;", -1, &stmt, 0);
+    if (rc == SQLITE_OK) {
+      sqlite3_bind_int64(stmt, 1, undo_id);
+      sqlite3_bind_int64(stmt, 2, edit_id);
+      rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode(db);
+      sqlite3_finalize(stmt);
+    }
+  }
+  sqlite3_free(edit.blob);
+
+  if (rc == SQLITE_OK)
+    rc = exec_sql(db, "COMMIT;");
+  if (rc != SQLITE_OK) {
+    if (rc == SQLITE_NOTFOUND)
+      fprintf(stderr, "Edit %lld not found\n", (long long)edit_id);
+    else if (rc != SQLITE_CONSTRAINT)
+      fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+    sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+    free_book_list(&reverted);
+    return rc;
+  }
+  changelog_book(CHANGE_UPDATE_BOOK, &reverted.items[0]);
+  free_book_list(&reverted);
+  return SQLITE_OK;
+}
+
+int list_book_edits(sqlite3 *db, int book_id, BookEdit *out, int max) {
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(
+      db,
+      "SELECT ID, EDITED_AT, EDITOR, IFNULL(UNDONE_BY, 0), DIFF "
+      "FROM BOOK_EDITS WHERE BOOK_ID = ? ORDER BY ID DESC;",
+      -1, &stmt, 0);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+
+  sqlite3_bind_int(stmt, 1, book_id);
+  int count = 0;
+  while (count < max && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    BookEdit *edit = &out[count];
+    memset(edit, 0, sizeof(*edit));
+    edit->id = sqlite3_column_int64(stmt, 0);
+    edit->book_id = book_id;
+    edit->edited_at = sqlite3_column_int64(stmt, 1);
+    snprintf(edit->editor, sizeof(edit->editor), "%s",
+             (const char *)sqlite3_column_text(stmt, 2));
+    edit->undone_by = sqlite3_column_int64(stmt, 3);
+    // A blob that does not decode is skipped rather than shown wrong
+    if (audit_decode(sqlite3_column_blob(stmt, 4),
+                     sqlite3_column_bytes(stmt, 4), edit) == 0)
+      count++;
+  }
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_ROW || rc == SQLITE_DONE ? count : -1;
+}
@@ -0,0 +1,270 @@
+#include "../include/auth.h"
+#include "../include/db.h"
+#include "../include/sha256.h"
+#include <sqlite3.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static const unsigned role_permissions[] = {
+    [ROLE_ADMIN] = PERMISSIONS_ADMIN,
+    [ROLE_LIBRARIAN] = PERMISSIONS_LIBRARIAN,
+    [ROLE_USER] = PERMISSIONS_USER,
+};
+
+typedef struct {
+  int used;
+  User user;
+  uint8_t tag[SHA256_DIGEST_SIZE];
+  time_t expires;
+} Session;
+
+static Session sessions[AUTH_SESSION_SLOTS];
+static int active_session = -1;
+
+// Per-process key for session tags, so cached credentials are never kept in
+// memory in a form that is valid outside this process.
+static uint8_t session_key[SHA256_DIGEST_SIZE];
+static int session_key_ready = 0;
+
+static int random_bytes(uint8_t *buf, size_t len) {
+  FILE *f = fopen("/dev/urandom", "rb");
+  if (!f) {
+    fprintf(stderr, "Can't open /dev/urandom\n");
+    return 1;
+  }
+  size_t n = fread(buf, 1, len, f);
+  fclose(f);
+  return n == len ? 0 : 1;
+}
+
+static void to_hex(const uint8_t *data, size_t len, char *out) {
+  static const char digits[] = "0123456789abcdef";
+  for (size_t i = 0; i < len; i++) {
+    out[i * 2] = digits[data[i] >> 4];
+    out[i * 2 + 1] = digits[data[i] & 0x0f];
+  }
+  out[len * 2] = '\0';
+}
+
+static int from_hex(const char *hex, uint8_t *out, size_t len) {
+  if (hex == NULL || strlen(hex) != len * 2)
+    return 1;
+  for (size_t i = 0; i < len; i++) {
+    unsigned byte;
+    if (sscanf(hex + i * 2, "%2x", &byte) != 1)
+      return 1;
+    out[i] = (uint8_t)byte;
+  }
+  return 0;
+}
+
+// Compares without an early exit so timing does not leak the prefix length.
+static int digest_equal(const uint8_t *a, const uint8_t *b) {
+  uint8_t diff = 0;
+  for (int i = 0; i < SHA256_DIGEST_SIZE; i++)
+    diff |= a[i] ^ b[i];
+  return diff == 0;
+}
+
+static void hash_password(const char *password, const uint8_t *salt, int cost,
+                          uint8_t out[SHA256_DIGEST_SIZE]) {
+  pbkdf2_sha256((const uint8_t *)password, strlen(password), salt,
+                AUTH_SALT_SIZE, 1u << cost, out);
+}
+
+// The inputs are hashed incrementally, so names and passwords of any length
+// get a distinct tag; the HMAC then keys the digest to this process.
+static void session_tag(const char *username, const char *password,
+                        uint8_t out[SHA256_DIGEST_SIZE]) {
+  uint8_t digest[SHA256_DIGEST_SIZE];
+  Sha256 ctx;
+  sha256_init(&ctx);
+  sha256_update(&ctx, username, strlen(username) + 1);
+  sha256_update(&ctx, password, strlen(password));
+  sha256_final(&ctx, digest);
+  hmac_sha256(session_key, sizeof(session_key), digest, sizeof(digest), out);
+}
+
+int create_users_table(sqlite3 *db) {
+  char *sql = "CREATE TABLE IF NOT EXISTS USERS("
+              "ID INTEGER PRIMARY KEY     AUTOINCREMENT,"
+              "USERNAME        TEXT    NOT NULL UNIQUE,"
+              "SALT            TEXT    NOT NULL,"
+              "HASH            TEXT    NOT NULL,"
+              "COST            INT     NOT NULL,"
+              "ROLE            INT     NOT NULL);";
+  char *zErrMsg = 0;
+  int rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "SQL error: %s\n", zErrMsg);
+    sqlite3_free(zErrMsg);
+    return rc;
+  }
+  return 0;
+}
+
+// Inserts the user, or replaces the password and role if the name exists.
+int create_user(sqlite3 *db, const char *username, const char *password,
+                UserRole role) {
+  uint8_t salt[AUTH_SALT_SIZE];
+  uint8_t hash[SHA256_DIGEST_SIZE];
+  char salt_hex[AUTH_SALT_SIZE * 2 + 1];
+  char hash_hex[SHA256_DIGEST_SIZE * 2 + 1];
+
+  if (random_bytes(salt, sizeof(salt)))
+    return 1;
+  hash_password(password, salt, AUTH_HASH_COST, hash);
+  to_hex(salt, sizeof(salt), salt_hex);
+  to_hex(hash, sizeof(hash), hash_hex);
+
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(
+      db,
+      "INSERT INTO USERS (USERNAME, SALT, HASH, COST, ROLE) "
+      "VALUES (?, ?, ?, ?, ?) "
+      "ON CONFLICT(USERNAME) DO UPDATE SET SALT = excluded.SALT, "
+      "HASH = excluded.HASH, COST = excluded.COST, ROLE = excluded.ROLE;",
+      -1, &stmt, 0);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, salt_hex, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 3, hash_hex, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, 4, AUTH_HASH_COST);
+  sqlite3_bind_int(stmt, 5, role);
+
+  rc = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE) {
+    fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+  return 0;
+}
+
+// Checks the password against USERS. On success the role is stored in *role.
+// An empty USERS table lets nobody in; the first administrator is created
+// with the adduser command.
+static int verify_user(sqlite3 *db, const char *username,
+                       const char *password, UserRole *role) {
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(db,
+                              "SELECT SALT, HASH, COST, ROLE FROM USERS "
+                              "WHERE USERNAME = ?;",
+                              -1, &stmt, 0);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+  sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+
+  int ok = 0;
+  int cost = AUTH_HASH_COST;
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    uint8_t salt[AUTH_SALT_SIZE];
+    uint8_t stored[SHA256_DIGEST_SIZE];
+    uint8_t hash[SHA256_DIGEST_SIZE];
+    cost = sqlite3_column_int(stmt, 2);
+
+    if (cost > 0 && cost < 32 &&
+        from_hex((const char *)sqlite3_column_text(stmt, 0), salt,
+                 sizeof(salt)) == 0 &&
+        from_hex((const char *)sqlite3_column_text(stmt, 1), stored,
+                 sizeof(stored)) == 0) {
+      hash_password(password, salt, cost, hash);
+      ok = digest_equal(hash, stored);
+      *role = (UserRole)sqlite3_column_int(stmt, 3);
+    }
+  }
+  sqlite3_finalize(stmt);
+
+  // Upgrade hashes created with an older, cheaper cost.
+  if (ok && cost < AUTH_HASH_COST)
+    create_user(db, username, password, *role);
+
+  return ok ? 0 : 1;
+}
+
+User *authenticate_user(sqlite3 *db, const char *username,
+                        const char *password) {
+  if (username == NULL || password == NULL || username[0] == '\0')
+    return NULL;
+
+  if (!session_key_ready) {
+    if (random_bytes(session_key, sizeof(session_key)))
+      return NULL;
+    session_key_ready = 1;
+  }
+
+  uint8_t tag[SHA256_DIGEST_SIZE];
+  session_tag(username, password, tag);
+  time_t now = time(NULL);
+
+  // Pick the slot already holding this user, else a free or the oldest one.
+  int slot = 0;
+  for (int i = 0; i < AUTH_SESSION_SLOTS; i++) {
+    if (sessions[i].used &&
+        strcmp(sessions[i].user.username, username) == 0) {
+      slot = i;
+      break;
+    }
+    if (!sessions[i].used || sessions[i].expires < sessions[slot].expires)
+      slot = i;
+  }
+
+  Session *s = &sessions[slot];
+  if (s->used && s->expires > now &&
+      strcmp(s->user.username, username) == 0 && digest_equal(s->tag, tag)) {
+    s->expires = now + AUTH_SESSION_TTL;
+    active_session = slot;
+    return &s->user;
+  }
+
+  UserRole role;
+  if (verify_user(db, username, password, &role) != 0 ||
+      (unsigned)role >= sizeof(role_permissions) / sizeof(role_permissions[0]))
+    return NULL;
+
+  memset(s, 0, sizeof(*s));
+  s->used = 1;
+  snprintf(s->user.username, sizeof(s->user.username), "%s", username);
+  s->user.role = role;
+  s->user.permissions = role_permissions[role];
+  memcpy(s->tag, tag, sizeof(tag));
+  s->expires = now + AUTH_SESSION_TTL;
+  active_session = slot;
+  return &s->user;
+}
+
+bool has_permission(const User *user, Action action) {
+  return user != NULL && (user->permissions & action) != 0;
+}
+
+const User *current_user(void) {
+  if (active_session < 0)
+    return NULL;
+
+  Session *s = &sessions[active_session];
+  if (!s->used || s->expires <= time(NULL)) {
+    active_session = -1;
+    return NULL;
+  }
+  return &s->user;
+}
+
+int current_username(char *out, size_t size) {
+  const User *user = current_user();
+  snprintf(out, size, "%s", user != NULL ? user->username : "");
+  return user == NULL;
+}
+
+void logout_user(void) {
+  if (active_session >= 0)
+    memset(&sessions[active_session], 0, sizeof(Session));
+  active_session = -1;
+}
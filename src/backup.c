@@ -0,0 +1,198 @@
+#include "../include/backup.h"
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int verify_backup(sqlite3 *db) {
+  sqlite3_stmt *stmt;
+  int ok = 0;
+  if (sqlite3_prepare_v2(db, "PRAGMA integrity_check;", -1, &stmt, 0) ==
+      SQLITE_OK) {
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      const unsigned char *result = sqlite3_column_text(stmt, 0);
+      ok = result != NULL && strcmp((const char *)result, "ok") == 0;
+    }
+    sqlite3_finalize(stmt);
+  }
+  return ok;
+}
+
+int backup_database(const char *src, const char *dest, int pages_per_step,
+                    int sleep_ms, BackupProgress progress, void *arg,
+                    BackupStatus *status) {
+  BackupStatus local;
+  if (status == NULL)
+    status = &local;
+  memset(status, 0, sizeof(*status));
+
+  sqlite3 *src_db;
+  sqlite3 *dest_db;
+  int rc = sqlite3_open_v2(src, &src_db, SQLITE_OPEN_READONLY, NULL);
+  if (rc != SQLITE_OK) {
+    snprintf(status->error, sizeof(status->error), "Can't open database: %s",
+             sqlite3_errmsg(src_db));
+    sqlite3_close(src_db);
+    status->rc = rc;
+    return rc;
+  }
+  rc = sqlite3_open(dest, &dest_db);
+  if (rc != SQLITE_OK) {
+    snprintf(status->error, sizeof(status->error),
+             "Can't open backup file: %s", sqlite3_errmsg(dest_db));
+    sqlite3_close(dest_db);
+    sqlite3_close(src_db);
+    status->rc = rc;
+    return rc;
+  }
+
+  sqlite3_backup *backup = sqlite3_backup_init(dest_db, "main", src_db, "main");
+  if (backup == NULL) {
+    rc = sqlite3_errcode(dest_db);
+    snprintf(status->error, sizeof(status->error), "Backup error: %s",
+             sqlite3_errmsg(dest_db));
+    sqlite3_close(dest_db);
+    sqlite3_close(src_db);
+    status->rc = rc;
+    return rc;
+  }
+
+  // The copy reads through a connection of its own, so every commit by
+  // another connection starts it over. Under steady writes it would never
+  // end; past a few restarts it gives up and says so.
+  double start = now_seconds();
+  int restarts = 0;
+  do {
+    int done_before = status->pages_done;
+    rc = sqlite3_backup_step(backup, pages_per_step);
+
+    status->pages_total = sqlite3_backup_pagecount(backup);
+    status->pages_done = status->pages_total - sqlite3_backup_remaining(backup);
+    if (status->pages_done < done_before &&
+        ++restarts > BACKUP_MAX_RESTARTS) {
+      rc = SQLITE_BUSY;
+      break;
+    }
+    status->seconds = now_seconds() - start;
+    if (status->seconds > 0)
+      status->pages_per_second = status->pages_done / status->seconds;
+    if (progress != NULL)
+      progress(status, arg);
+
+    // Give other connections a window to take the lock between batches
+    if (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED)
+      sqlite3_sleep(sleep_ms);
+  } while (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED);
+
+  sqlite3_backup_finish(backup);
+  if (rc == SQLITE_DONE) {
+    rc = SQLITE_OK;
+    status->verified = verify_backup(dest_db);
+  } else if (restarts > BACKUP_MAX_RESTARTS) {
+    snprintf(status->error, sizeof(status->error),
+             "Backup error: restarted %d times by other writers, gave up at "
+             "%d/%d pages",
+             restarts, status->pages_done, status->pages_total);
+  } else {
+    snprintf(status->error, sizeof(status->error), "Backup error: %s",
+             sqlite3_errstr(rc));
+  }
+  status->rc = rc;
+
+  sqlite3_close(dest_db);
+  sqlite3_close(src_db);
+  return rc;
+}
+
+static pthread_t scheduler_thread;
+static pthread_mutex_t scheduler_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scheduler_wake = PTHREAD_COND_INITIALIZER;
+static int scheduler_running = 0;
+static char scheduler_src[256];
+static char scheduler_dir[256];
+static unsigned scheduler_interval;
+static BackupStatus scheduler_last;
+static int scheduler_has_status = 0;
+
+static void *scheduler_main(void *arg) {
+  (void)arg;
+
+  pthread_mutex_lock(&scheduler_lock);
+  while (scheduler_running) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += scheduler_interval;
+    while (scheduler_running &&
+           pthread_cond_timedwait(&scheduler_wake, &scheduler_lock,
+                                  &deadline) == 0) {
+    }
+    if (!scheduler_running)
+      break;
+    pthread_mutex_unlock(&scheduler_lock);
+
+    char dest[600];
+    char stamp[32];
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+    snprintf(dest, sizeof(dest), "%s/library-%s.db", scheduler_dir, stamp);
+
+    BackupStatus status;
+    backup_database(scheduler_src, dest, BACKUP_PAGES_PER_STEP,
+                    BACKUP_STEP_SLEEP_MS, NULL, NULL, &status);
+
+    pthread_mutex_lock(&scheduler_lock);
+    scheduler_last = status;
+    scheduler_has_status = 1;
+  }
+  pthread_mutex_unlock(&scheduler_lock);
+  return NULL;
+}
+
+int backup_scheduler_start(const char *src, const char *dir,
+                           unsigned interval) {
+  if (scheduler_running || interval == 0)
+    return 1;
+
+  snprintf(scheduler_src, sizeof(scheduler_src), "%s", src);
+  snprintf(scheduler_dir, sizeof(scheduler_dir), "%s", dir);
+  scheduler_interval = interval;
+  scheduler_running = 1;
+
+  if (pthread_create(&scheduler_thread, NULL, scheduler_main, NULL) != 0) {
+    scheduler_running = 0;
+    return 1;
+  }
+  return 0;
+}
+
+void backup_scheduler_stop(void) {
+  pthread_mutex_lock(&scheduler_lock);
+  if (!scheduler_running) {
+    pthread_mutex_unlock(&scheduler_lock);
+    return;
+  }
+  scheduler_running = 0;
+  pthread_cond_signal(&scheduler_wake);
+  pthread_mutex_unlock(&scheduler_lock);
+
+  pthread_join(scheduler_thread, NULL);
+}
+
+// Returns 0 and fills status once at least one scheduled backup has run.
+int backup_scheduler_status(BackupStatus *status) {
+  pthread_mutex_lock(&scheduler_lock);
+  int has_status = scheduler_has_status;
+  if (has_status)
+    *status = scheduler_last;
+  pthread_mutex_unlock(&scheduler_lock);
+  return has_status ? 0 : 1;
+}
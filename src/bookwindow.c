@@ -1,20 +1,263 @@
 #include "../include/bookwindow.h"
+#include "../include/attach.h"
+#include "../include/auth.h"
+#include "../include/branch.h"
+#include "../include/browse.h"
+#include "../include/bulk.h"
+#include "../include/cache.h"
+#include "../include/recs.h"
 #include "../include/db.h"
+#include "../include/fuzzy.h"
+#include "../include/scan.h"
+#include "../include/searchkey.h"
+#include "../include/userwindow.h"
 #include "../include/window.h"
 #include <ncurses.h>
+#include <stdlib.h>
 #include <string.h>
 
+#define BOOK_SELECT                                                            \
+  "SELECT BOOKS.ID, BOOKS.TITLE, BOOKS.AUTHOR, BOOKS.PUBLISHER, BOOKS.YEAR, "  \
+  "LOANS.BORROWER_NAME, BOOKS.ISBN "                                           \
+  "FROM BOOKS "                                                                \
+  "LEFT JOIN LOANS ON BOOKS.ID = LOANS.BOOK_ID AND LOANS.RETURN_DATE IS NULL "
+
+// Arguments and results of a query run on the database worker. text is bound
+// to the first parameter when set, otherwise number is.
+typedef struct {
+  const char *sql;
+  const char *text;
+  int number;
+  BookList result;
+  unsigned long long version; // set by cached_query_job
+} BookQuery;
+
+static int book_query_job(sqlite3 *db, void *arg) {
+  BookQuery *query = arg;
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(db, query->sql, -1, &stmt, 0);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  if (sqlite3_bind_parameter_count(stmt) > 0) {
+    if (query->text != NULL)
+      sqlite3_bind_text(stmt, 1, query->text, -1, SQLITE_STATIC);
+    else
+      sqlite3_bind_int(stmt, 1, query->number);
+  }
+
+  rc = collect_books(stmt, &query->result);
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+static int check_cache_job(sqlite3 *db, void *arg) {
+  (void)arg;
+  result_cache_begin(db);
+  return SQLITE_OK;
+}
+
+// A hit is only served after the worker has read data_version, so a commit
+// from another desk is seen on the next lookup, not RESULT_CACHE_MAX_AGE
+// later. The check is one pragma, so it is waited for without a spinner.
+static int cache_lookup(const char *key, BookList *out) {
+  unsigned ticket = submit_db_job(check_cache_job, NULL);
+  if (ticket == 0 || wait_db_job(ticket) != SQLITE_OK)
+    return 0;
+  return result_cache_get(key, out);
+}
+
+// The same query run for the result cache, which needs the data version the
+// rows were read at.
+static int cached_query_job(sqlite3 *db, void *arg) {
+  BookQuery *query = arg;
+  query->version = result_cache_begin(db);
+  return book_query_job(db, arg);
+}
+
+typedef struct {
+  const char *text;
+  FuzzyMatch matches[FUZZY_MAX_RESULTS];
+  int count;
+  BookList result;
+  int distances[FUZZY_MAX_RESULTS]; // of each row in result
+} FuzzyQuery;
+
+// Ranks titles and authors by edit distance, then loads the matching rows
+// in rank order. A book deleted since the index was built has no row, so
+// each distance is stored next to the row it was loaded with.
+static int fuzzy_query_job(sqlite3 *db, void *arg) {
+  FuzzyQuery *query = arg;
+  query->count =
+      fuzzy_search(db, query->text, query->matches, FUZZY_MAX_RESULTS);
+  if (query->count < 0)
+    return SQLITE_ERROR;
+
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(db, BOOK_SELECT "WHERE BOOKS.ID = ?;", -1,
+                              &stmt, 0);
+  for (int i = 0; rc == SQLITE_OK && i < query->count; i++) {
+    int loaded = query->result.count;
+    sqlite3_bind_int(stmt, 1, query->matches[i].id);
+    rc = collect_books(stmt, &query->result);
+    sqlite3_reset(stmt);
+    if (query->result.count > loaded)
+      query->distances[loaded] = query->matches[i].distance;
+  }
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+typedef struct {
+  Book book;
+  int found;
+  int branch_id;    // 0 is the main database
+  char editor[100]; // captured on the UI thread
+} BookWrite;
+
+static int insert_book_job(sqlite3 *db, void *arg) {
+  BookWrite *write = arg;
+  return branch_insert_book(db, write->branch_id, &write->book);
+}
+
+static int update_book_job(sqlite3 *db, void *arg) {
+  BookWrite *write = arg;
+  return update_book_fields(db, &write->book, write->editor);
+}
+
+typedef struct {
+  BookFilter filter;
+  BulkField field;
+  char value[100];
+  char editor[100]; // captured on the UI thread
+  int count;
+} BulkEdit;
+
+static int bulk_count_job(sqlite3 *db, void *arg) {
+  BulkEdit *edit = arg;
+  return count_bulk_update(db, &edit->filter, edit->field, edit->value,
+                           &edit->count);
+}
+
+static int bulk_update_job(sqlite3 *db, void *arg) {
+  BulkEdit *edit = arg;
+  return bulk_update_books(db, &edit->filter, edit->field, edit->value,
+                           edit->editor, &edit->count);
+}
+
+static int book_exists_job(sqlite3 *db, void *arg) {
+  BookWrite *write = arg;
+  return book_exists(db, write->book.id, &write->found);
+}
+
+static void print_book_info(const Book *book) {
+  // Display book details with a border and alignment
+  printw("\n");
+  printw("###############################################\n");
+  printw("#                 Book Info                  #\n");
+  printw("###############################################\n");
+  printw("%-20s : %-30s\n", "Title", book->title);
+  printw("%-20s : %-30s\n", "Author", book->author);
+  printw("%-20s : %-30s\n", "Publisher", book->publisher);
+  printw("%-20s : %-10d\n", "Year", book->year);
+  printw("%-20s : %-30s\n", "ISBN", book->isbn[0] ? book->isbn : "-");
+
+  if (book->borrower[0] != '\0') {
+    printw("%-20s : %-30s\n", "Borrowed By", book->borrower);
+  } else {
+    printw("%-20s : %-30s\n", "Borrowed By", "Not Borrowed");
+  }
+
+  printw("###############################################\n");
+}
+
+// Stores the normalized code, or leaves isbn empty if nothing was typed
+static void read_isbn(Book *book) {
+  char code[64];
+  getnstr(code, sizeof(code) - 1);
+  if (normalize_code(code, book->isbn, sizeof(book->isbn)) != 0)
+    book->isbn[0] = '\0';
+}
+
+static void print_sql_error(int rc) {
+  if (rc == SQLITE_INTERRUPT) {
+    printw("\nCancelled.\n");
+    return;
+  }
+  printw("\n###############################################\n");
+  printw("#               SQL Error                     #\n");
+  printw("###############################################\n");
+  printw("Error: %s\n", sqlite3_errstr(rc));
+}
+
+static void format_book_row(const void *rows, int index, char *line,
+                            int size) {
+  const Book *book = (const Book *)rows + index;
+  snprintf(line, size, "%-5d %-30.30s %-30.30s %-20.20s %-10d %-20.20s",
+           book->id, book->title, book->author, book->publisher, book->year,
+           book->borrower[0] != '\0' ? book->borrower : "Not Borrowed");
+}
+
+// Cut to the terminal width, so a narrow screen does not wrap them and push
+// the rows down
+static void print_book_columns() {
+  char line[160];
+  snprintf(line, sizeof(line), "%-5s %-30s %-30s %-20s %-10s %-20s", "ID",
+           "Title", "Author", "Publisher", "Year", "Borrower");
+  printw("%.*s\n", COLS - 1, line);
+  printw("%.*s\n", COLS - 1,
+         "------------------------------------------------------------------"
+         "------------------------------------------------------------------"
+         "------");
+}
+
+// Scrolls through a loaded result until q; Enter opens the selected book.
+static void browse_books(const char *heading, const BookList *list) {
+  ListView view = {0, list->count, 0, 0};
+  while (1) {
+    erase();
+    printw("###############################################\n");
+    printw("#%-45s#\n", heading);
+    printw("###############################################\n");
+    printw("%d book(s)\n", list->count);
+    print_book_columns();
+    view.top = getcury(stdscr);
+    list_view_draw(&view, format_book_row, list->items);
+    mvprintw(LINES - 1, 0,
+             "UP/DOWN move, PgUp/PgDn page, Enter details, Q quit.");
+    refresh();
+
+    int ch = getch();
+    if (ch == '\n') {
+      int id = list->items[view.cursor].id;
+      clear_screen();
+      book_details(&id);
+    } else if (ch == 'q' || ch == 'Q') {
+      break;
+    } else {
+      list_view_key(&view, ch);
+    }
+  }
+}
+
 void book_menu() {
   typedef struct {
     char *name;
     void (*func)();
+    Action action;
   } BookMenu;
 
-  BookMenu books[] = {{"Add Book", add_book},
-                      {"List Books", list_books},
-                      {"Find Book by ID", book_details},
-                      {"Update Book", update_book},
-                      {"Search Book by Title", search_book}};
+  BookMenu books[] = {
+      {"Add Book", add_book, ACTION_ADD_BOOK},
+      {"List Books", list_books, ACTION_VIEW_BOOKS},
+      {"Browse by Author", browse_by_author, ACTION_VIEW_BOOKS},
+      {"Browse by Publisher", browse_by_publisher, ACTION_VIEW_BOOKS},
+      {"Find Book by ID", find_book, ACTION_VIEW_BOOKS},
+      {"Update Book", update_book, ACTION_UPDATE_BOOK},
+      {"Bulk Update", bulk_update, ACTION_UPDATE_BOOK},
+      {"Search Book by Title", search_book, ACTION_VIEW_BOOKS},
+      {"Fuzzy Search", fuzzy_search_book, ACTION_VIEW_BOOKS},
+      {"Search All Branches", search_all_branches, ACTION_VIEW_BOOKS}};
 
   int size = sizeof(books) / sizeof(books[0]);
   int highlight = 0;
@@ -46,7 +289,23 @@ void book_menu() {
       highlight = (highlight == size - 1) ? 0 : highlight + 1;
       break;
     case '\n': // Enter key
+      // Catalog edits need a librarian session; browsing is open to everyone
+      if (books[highlight].action & (ACTION_ADD_BOOK | ACTION_UPDATE_BOOK)) {
+        clear_screen();
+        const User *user = login_menu();
+        if (user == NULL)
+          break;
+        if (!has_permission(user, books[highlight].action)) {
+          printw("You are not allowed to do that.\n");
+          refresh();
+          getch();
+          break;
+        }
+      }
       call_menu(books[highlight].func);
+      // Like the user menu, a catalog edit does not leave a session behind
+      if (books[highlight].action & (ACTION_ADD_BOOK | ACTION_UPDATE_BOOK))
+        logout_user();
       return;
     case 'q': // Quit key
       return;
@@ -56,6 +315,49 @@ void book_menu() {
   }
 }
 
+static void print_fuzzy_results(const char *text) {
+  FuzzyQuery query = {text, {{0, 0}}, 0, {0}, {0}};
+  int rc = run_db_job(fuzzy_query_job, &query);
+
+  if (rc != SQLITE_OK) {
+    print_sql_error(rc);
+  } else if (query.result.count == 0) {
+    printw("\nNo similar titles or authors found.\n");
+  } else {
+    printw("\n%-5s %-5s %-30s %-30s %-20s %-10s\n", "Typos", "ID", "Title",
+           "Author", "Publisher", "Year");
+    for (int i = 0; i < query.result.count; i++) {
+      Book *book = &query.result.items[i];
+      printw("%-5d %-5d %-30.30s %-30.30s %-20.20s %-10d\n",
+             query.distances[i], book->id, book->title, book->author,
+             book->publisher, book->year);
+    }
+  }
+  free_book_list(&query.result);
+}
+
+void fuzzy_search_book() {
+  // Header with a border
+  printw("###############################################\n");
+  printw("#                Fuzzy Search                 #\n");
+  printw("###############################################\n");
+
+  echo();
+
+  printw("Enter title or author (typos are fine): ");
+  refresh();
+  char text[100];
+  getnstr(text, sizeof(text) - 1);
+  noecho();
+
+  print_fuzzy_results(text);
+
+  // Prompt to continue
+  printw("\nPress any key to return to the menu...\n");
+  refresh();
+  getch();
+}
+
 void search_book() {
   // Header with a border
   printw("###############################################\n");
@@ -68,55 +370,161 @@ void search_book() {
   printw("Enter book title to search: ");
   refresh();
   char title[100];
-  getstr(title);
+  getnstr(title, sizeof(title) - 1);
+  noecho();
 
-  // Open the database
-  sqlite3 *db;
-  sqlite3_open(DB_FILE, &db);
+  // The key index is much narrower than BOOKS, so the substring test scans
+  // it instead of the table; matches are folded the Turkish way
+  char key[SEARCH_KEY_MAX];
+  fold_search_key(title, key, sizeof(key));
+  BookQuery query = {BOOK_SELECT "WHERE BOOKS.ID IN (SELECT ID FROM BOOKS "
+                                 "WHERE instr(TITLE_KEY, ?) > 0);",
+                     key, 0, {0}, 0};
+  // Folded, so "IŞIK" and "ışık" share an entry
+  char cache_key[RESULT_CACHE_MAX_KEY];
+  snprintf(cache_key, sizeof(cache_key), "search:%s", key);
+  int rc = SQLITE_OK;
+  if (!cache_lookup(cache_key, &query.result)) {
+    rc = run_db_job(cached_query_job, &query);
+    if (rc == SQLITE_OK)
+      result_cache_put(cache_key, &query.result, query.version);
+  }
 
-  // Check if the book exists
-  sqlite3_stmt *stmt;
-  char check_sql[300];
-  snprintf(check_sql, sizeof(check_sql),
-           "SELECT BOOKS.TITLE, BOOKS.AUTHOR, BOOKS.PUBLISHER, BOOKS.YEAR, "
-           "LOANS.BORROWER_NAME "
-           "FROM BOOKS "
-           "LEFT JOIN LOANS ON BOOKS.ID = LOANS.BOOK_ID AND LOANS.RETURN_DATE "
-           "IS NULL "
-           "WHERE BOOKS.TITLE LIKE '%%%s%%';",
-           title);
-  sqlite3_prepare_v2(db, check_sql, -1, &stmt, 0);
+  if (rc == SQLITE_OK && query.result.count > 0) {
+    browse_books("             Search Results", &query.result);
+    free_book_list(&query.result);
+    return;
+  }
 
-  // Book details output
-  while (sqlite3_step(stmt) == SQLITE_ROW) {
-    const unsigned char *title = sqlite3_column_text(stmt, 0);
-    const unsigned char *author = sqlite3_column_text(stmt, 1);
-    const unsigned char *publisher = sqlite3_column_text(stmt, 2);
-    int year = sqlite3_column_int(stmt, 3);
-    const unsigned char *borrower = sqlite3_column_text(stmt, 4);
-
-    // Display book details with a border and alignment
-    printw("\n");
-    printw("###############################################\n");
-    printw("#                 Book Info                  #\n");
-    printw("###############################################\n");
-    printw("%-20s : %-30s\n", "Title", title);
-    printw("%-20s : %-30s\n", "Author", author);
-    printw("%-20s : %-30s\n", "Publisher", publisher);
-    printw("%-20s : %-10d\n", "Year", year);
+  if (rc != SQLITE_OK)
+    print_sql_error(rc);
 
-    if (borrower != NULL) {
-      printw("%-20s : %-30s\n", "Borrowed By", borrower);
-    } else {
-      printw("%-20s : %-30s\n", "Borrowed By", "Not Borrowed");
-    }
+  // Nothing matched exactly; the title may be misspelled
+  if (rc == SQLITE_OK && title[0] != '\0') {
+    printw("\nNo exact matches. Did you mean:\n");
+    print_fuzzy_results(title);
+  }
+  free_book_list(&query.result);
 
-    printw("###############################################\n");
+  // Prompt to continue
+  printw("\nPress any key to return to the menu...\n");
+  refresh();
+  getch();
+}
+
+void list_borrowed_books() {
+  // Oldest loan first; the join keeps only books that are out. Only staff
+  // who lend on behalf of others see every borrower.
+  char username[100];
+  int expired = current_username(username, sizeof(username));
+  BookQuery query = {BOOK_SELECT "WHERE LOANS.ID IS NOT NULL "
+                                 "ORDER BY LOANS.BORROW_DATE, LOANS.ID;",
+                     NULL, 0, {0}, 0};
+  if (!has_permission(current_user(), ACTION_CHECKOUT_DESK)) {
+    query.sql = BOOK_SELECT "WHERE LOANS.BORROWER_NAME = ? "
+                            "ORDER BY LOANS.BORROW_DATE, LOANS.ID;";
+    query.text = username;
   }
+  int rc = expired ? SQLITE_AUTH : run_db_job(book_query_job, &query);
 
-  // Close the database connection
-  sqlite3_finalize(stmt);
-  sqlite3_close(db);
+  if (rc == SQLITE_OK && query.result.count > 0) {
+    browse_books("             Borrowed Books", &query.result);
+    free_book_list(&query.result);
+    return;
+  }
+
+  printw("###############################################\n");
+  printw("#             Borrowed Books                 #\n");
+  printw("###############################################\n");
+  if (rc == SQLITE_AUTH)
+    printw("\nSession expired; log in again.\n");
+  else if (rc != SQLITE_OK)
+    print_sql_error(rc);
+  else
+    printw("\nNo books are borrowed.\n");
+  free_book_list(&query.result);
+
+  // Prompt to continue
+  printw("\nPress any key to return to the menu...\n");
+  refresh();
+  getch();
+}
+
+typedef struct {
+  const char *text;
+  BranchResults result;
+} BranchQuery;
+
+static int branch_query_job(sqlite3 *db, void *arg) {
+  (void)db;
+  BranchQuery *query = arg;
+  return federated_search(query->text, &query->result);
+}
+
+static void format_branch_row(const void *rows, int index, char *line,
+                              int size) {
+  const BranchBook *item = (const BranchBook *)rows + index;
+  snprintf(line, size, "%-12.12s %-5d %-30.30s %-25.25s %-6d %-20.20s",
+           branch_name(item->branch_id), item->book.id, item->book.title,
+           item->book.author, item->book.year,
+           item->book.borrower[0] != '\0' ? item->book.borrower
+                                          : "Not Borrowed");
+}
+
+void search_all_branches() {
+  // Header with a border
+  printw("###############################################\n");
+  printw("#           Search All Branches               #\n");
+  printw("###############################################\n");
+
+  if (branch_count() == 0) {
+    printw("\nNo other branches are configured.\n");
+    printw("\nPress any key to return to the menu...\n");
+    refresh();
+    getch();
+    return;
+  }
+
+  echo();
+  printw("Enter book title to search: ");
+  refresh();
+  char title[100];
+  getnstr(title, sizeof(title) - 1);
+  noecho();
+
+  BranchQuery query = {title, {0}};
+  int rc = run_db_job(branch_query_job, &query);
+
+  if (rc == SQLITE_OK && query.result.count > 0) {
+    // Book IDs are per branch, so there are no details to open here
+    ListView view = {0, query.result.count, 0, 0};
+    int ch = 0;
+    while (ch != 'q' && ch != 'Q') {
+      erase();
+      printw("###############################################\n");
+      printw("#           Search All Branches               #\n");
+      printw("###############################################\n");
+      printw("%d book(s)\n", query.result.count);
+      char columns[160];
+      snprintf(columns, sizeof(columns), "%-12s %-5s %-30s %-25s %-6s %-20s",
+               "Branch", "ID", "Title", "Author", "Year", "Borrower");
+      printw("%.*s\n", COLS - 1, columns);
+      view.top = getcury(stdscr);
+      list_view_draw(&view, format_branch_row, query.result.items);
+      mvprintw(LINES - 1, 0, "UP/DOWN move, PgUp/PgDn page, Q quit.");
+      refresh();
+      ch = getch();
+      list_view_key(&view, ch);
+    }
+    free_branch_results(&query.result);
+    return;
+  }
+
+  if (rc != SQLITE_OK)
+    print_sql_error(rc);
+  else
+    printw("\nNo books found.\n");
+  free_branch_results(&query.result);
 
   // Prompt to continue
   printw("\nPress any key to return to the menu...\n");
@@ -135,76 +543,56 @@ void update_book() {
   // Prompt for book ID to update
   printw("Enter book ID to update: ");
   refresh();
-  int id;
-  scanw("%d", &id);
-
-  // Open the database
-  sqlite3 *db;
-  sqlite3_open(DB_FILE, &db);
+  BookWrite write = {0};
+  scanw("%d", &write.book.id);
 
   // Check if the book exists
-  sqlite3_stmt *stmt;
-  char check_sql[200];
-  sprintf(check_sql, "SELECT * FROM BOOKS WHERE ID = %d", id);
-  sqlite3_prepare_v2(db, check_sql, -1, &stmt, 0);
-
-  if (sqlite3_step(stmt) != SQLITE_ROW) {
+  int rc = run_db_job(book_exists_job, &write);
+  if (rc != SQLITE_OK || !write.found) {
     // If book is not found
-    printw("\nBook not found!\n");
-    sqlite3_finalize(stmt);
-    sqlite3_close(db);
+    if (rc != SQLITE_OK)
+      print_sql_error(rc);
+    else
+      printw("\nBook not found!\n");
+    noecho();
     refresh();
     getch();
     return;
   }
 
-  // Close the statement for reuse
-  sqlite3_finalize(stmt);
-
   // Prompt for new details
   printw("Enter new book title (leave empty to keep current): ");
   refresh();
-  char title[100];
-  getstr(title);
+  getnstr(write.book.title, sizeof(write.book.title) - 1);
 
   printw("Enter new book author (leave empty to keep current): ");
   refresh();
-  char author[100];
-  getstr(author);
+  getnstr(write.book.author, sizeof(write.book.author) - 1);
 
   printw("Enter new book publisher (leave empty to keep current): ");
   refresh();
-  char publisher[100];
-  getstr(publisher);
+  getnstr(write.book.publisher, sizeof(write.book.publisher) - 1);
 
   printw("Enter new book year (leave empty to keep current): ");
   refresh();
-  int year;
-  scanw("%d", &year);
+  scanw("%d", &write.book.year);
+
+  printw("Enter new ISBN or barcode (leave empty to keep current): ");
+  refresh();
+  read_isbn(&write.book);
 
   noecho();
 
   // Update the book in the database
-  char sql[300];
-  sprintf(sql,
-          "UPDATE BOOKS SET "
-          "TITLE = COALESCE(NULLIF('%s', ''), TITLE), "
-          "AUTHOR = COALESCE(NULLIF('%s', ''), AUTHOR), "
-          "PUBLISHER = COALESCE(NULLIF('%s', ''), PUBLISHER), "
-          "YEAR = CASE WHEN %d = 0 THEN YEAR ELSE %d END "
-          "WHERE ID = %d;",
-          title, author, publisher, year, year, id);
-
-  char *zErrMsg = 0;
-  int rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
+  rc = current_username(write.editor, sizeof(write.editor))
+           ? SQLITE_AUTH
+           : run_db_job(update_book_job, &write);
 
-  if (rc != SQLITE_OK) {
+  if (rc == SQLITE_AUTH) {
+    printw("\nSession expired; log in again.\n");
+  } else if (rc != SQLITE_OK) {
     // Display SQL error message
-    printw("\n###############################################\n");
-    printw("#               SQL Error                     #\n");
-    printw("###############################################\n");
-    printw("Error: %s\n", zErrMsg);
-    sqlite3_free(zErrMsg);
+    print_sql_error(rc);
   } else {
     // Confirmation message
     printw("\n###############################################\n");
@@ -212,235 +600,551 @@ void update_book() {
     printw("###############################################\n");
   }
 
-  // Close the database
-  sqlite3_close(db);
-
   // Prompt to continue
   printw("\nPress any key to return to the menu...\n");
   refresh();
   getch();
 }
 
-void book_details(int *id) {
+void bulk_update() {
+  printw("###############################################\n");
+  printw("#             Bulk Update Books              #\n");
+  printw("###############################################\n");
+  printw("Leave a filter empty to ignore it.\n\n");
 
-  if (id == NULL) {
-    // Header with a border
-    printw("###############################################\n");
-    printw("#            Book Details                    #\n");
-    printw("###############################################\n");
+  echo();
+  BulkEdit edit = {0};
+  printw("Author is: ");
+  refresh();
+  getnstr(edit.filter.author, sizeof(edit.filter.author) - 1);
+  printw("Publisher is: ");
+  refresh();
+  getnstr(edit.filter.publisher, sizeof(edit.filter.publisher) - 1);
+  printw("Title matches (%% for any text): ");
+  refresh();
+  getnstr(edit.filter.title_like, sizeof(edit.filter.title_like) - 1);
+  printw("Year from: ");
+  refresh();
+  scanw("%d", &edit.filter.year_from);
+  printw("Year to: ");
+  refresh();
+  scanw("%d", &edit.filter.year_to);
 
-    echo();
+  char field[16];
+  printw("Field to set (title, author, publisher, year): ");
+  refresh();
+  getnstr(field, sizeof(field) - 1);
+  int parsed = bulk_field_from_name(field);
+  printw("New value: ");
+  refresh();
+  getnstr(edit.value, sizeof(edit.value) - 1);
+  noecho();
 
-    // Prompt for book ID
-    printw("Enter book ID: ");
+  const char *error = bulk_request_error(&edit.filter, parsed, edit.value);
+  if (error == NULL && current_username(edit.editor, sizeof(edit.editor)))
+    error = "Session expired; log in again";
+  if (error != NULL) {
+    printw("\n%s.\n", error);
+    printw("\nPress any key to return to the menu...\n");
     refresh();
-    scanw("%d", id);
-
-    noecho();
+    getch();
+    return;
   }
+  edit.field = parsed;
+
+  // Preview first; nothing is written until the count is confirmed
+  int rc = run_db_job(bulk_count_job, &edit);
+  if (rc == SQLITE_OK && edit.count == 0) {
+    printw("\nNo books would change.\n");
+  } else if (rc == SQLITE_OK) {
+    printw("\n%d book(s) will be changed. Continue? (y/n) ", edit.count);
+    refresh();
+    if (getch() == 'y') {
+      rc = run_db_job(bulk_update_job, &edit);
+      if (rc == SQLITE_OK)
+        printw("\n%d book(s) updated.\n", edit.count);
+    } else {
+      printw("\nNothing changed.\n");
+    }
+  }
+  if (rc != SQLITE_OK)
+    print_sql_error(rc);
 
-  sqlite3 *db;
-  sqlite3_open(DB_FILE, &db);
+  printw("\nPress any key to return to the menu...\n");
+  refresh();
+  getch();
+}
 
-  sqlite3_stmt *stmt;
-  char sql[300];
-  snprintf(sql, sizeof(sql),
-           "SELECT BOOKS.TITLE, BOOKS.AUTHOR, BOOKS.PUBLISHER, BOOKS.YEAR, "
-           "LOANS.BORROWER_NAME "
-           "FROM BOOKS "
-           "LEFT JOIN LOANS ON BOOKS.ID = LOANS.BOOK_ID AND LOANS.RETURN_DATE "
-           "IS NULL "
-           "WHERE BOOKS.ID = %d;",
-           *id);
-  sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+void find_book() {
+  // Header with a border
+  printw("###############################################\n");
+  printw("#            Book Details                    #\n");
+  printw("###############################################\n");
 
-  // Book details output
-  if (sqlite3_step(stmt) == SQLITE_ROW) {
-    const unsigned char *title = sqlite3_column_text(stmt, 0);
-    const unsigned char *author = sqlite3_column_text(stmt, 1);
-    const unsigned char *publisher = sqlite3_column_text(stmt, 2);
-    int year = sqlite3_column_int(stmt, 3);
-    const unsigned char *borrower = sqlite3_column_text(stmt, 4);
-
-    // Display book details with a border and alignment
-    printw("\n");
-    printw("###############################################\n");
-    printw("#                 Book Info                  #\n");
-    printw("###############################################\n");
-    printw("%-20s : %-30s\n", "Title", title);
-    printw("%-20s : %-30s\n", "Author", author);
-    printw("%-20s : %-30s\n", "Publisher", publisher);
-    printw("%-20s : %-10d\n", "Year", year);
+  echo();
 
-    if (borrower != NULL) {
-      printw("%-20s : %-30s\n", "Borrowed By", borrower);
-    } else {
-      printw("%-20s : %-30s\n", "Borrowed By", "Not Borrowed");
-    }
+  // Prompt for book ID
+  printw("Enter book ID: ");
+  refresh();
+  int id = 0;
+  scanw("%d", &id);
 
-    printw("###############################################\n");
+  noecho();
+
+  book_details(&id);
+}
+
+typedef struct {
+  BookQuery query;
+  Recommendation recs[RECS_TOP_K];
+  int rec_count;
+  Attachment files[ATTACH_MAX_LIST];
+  int file_count;
+} BookDetails;
+
+static int book_details_job(sqlite3 *db, void *arg) {
+  BookDetails *details = arg;
+  int rc = book_query_job(db, &details->query);
+  if (rc == SQLITE_OK && details->query.result.count > 0) {
+    details->rec_count =
+        book_recommendations(db, details->query.number, details->recs);
+    details->file_count = list_attachments(db, details->query.number,
+                                           details->files, ATTACH_MAX_LIST);
+  }
+  return rc;
+}
+
+void book_details(int *id) {
+  BookDetails details = {
+      {BOOK_SELECT "WHERE BOOKS.ID = ?;", NULL, *id, {0}, 0},
+      {{0}},
+      0,
+      {{0}},
+      0};
+  int rc = run_db_job(book_details_job, &details);
+  BookQuery query = details.query;
+
+  // Book details output
+  if (rc != SQLITE_OK) {
+    print_sql_error(rc);
+  } else if (query.result.count > 0) {
+    print_book_info(&query.result.items[0]);
+    if (details.rec_count > 0) {
+      printw("Patrons who borrowed this also borrowed:\n");
+      for (int i = 0; i < details.rec_count; i++)
+        printw("  %-5d %-30.30s %-25.25s (%d)\n", details.recs[i].id,
+               details.recs[i].title, details.recs[i].author,
+               details.recs[i].shared);
+    }
+    if (details.file_count > 0) {
+      printw("Attachments (export with: export <id> <file>):\n");
+      for (int i = 0; i < details.file_count; i++)
+        printw("  %-5lld %-30.30s %-20.20s %lld bytes\n",
+               (long long)details.files[i].id, details.files[i].name,
+               details.files[i].mime, (long long)details.files[i].size);
+    }
   } else {
     // If no book is found
     printw("\nBook not found\n");
   }
+  free_book_list(&query.result);
 
   printw("\nPress any key to continue...\n");
 
-  // Close the database connection
-  sqlite3_finalize(stmt);
-  sqlite3_close(db);
-
   refresh();
   getch();
 }
 
-void list_books() {
-  sqlite3 *db;
-  sqlite3_open(DB_FILE, &db);
+typedef struct {
+  ListQuery query;
+  const Book *after;
+  BookList result;
+  unsigned long long version;
+} BookPage;
+
+static int book_page_job(sqlite3 *db, void *arg) {
+  BookPage *page = arg;
+  page->version = result_cache_begin(db);
+  return list_books_page(db, &page->query, page->after, &page->result);
+}
 
-  sqlite3_stmt *stmt;
-  // sqlite3_prepare_v2(db, "SELECT * FROM BOOKS", -1, &stmt, 0);
-  sqlite3_prepare_v2(
-      db,
-      "SELECT BOOKS.ID, BOOKS.TITLE, BOOKS.AUTHOR, BOOKS.PUBLISHER, "
-      "BOOKS.YEAR, "
-      "LOANS.BORROWER_NAME "
-      "FROM BOOKS "
-      "LEFT JOIN LOANS ON BOOKS.ID = LOANS.BOOK_ID AND LOANS.RETURN_DATE IS "
-      "NULL;",
-      -1, &stmt, 0);
-
-  Book books[100]; // Adjust size based on expected rows
-  int num_books = 0;
-
-  while (sqlite3_step(stmt) == SQLITE_ROW) {
-    books[num_books].id = sqlite3_column_int(stmt, 0);
-    snprintf(books[num_books].title, sizeof(books[num_books].title), "%s",
-             sqlite3_column_text(stmt, 1));
-    snprintf(books[num_books].author, sizeof(books[num_books].author), "%s",
-             sqlite3_column_text(stmt, 2));
-    snprintf(books[num_books].publisher, sizeof(books[num_books].publisher),
-             "%s", sqlite3_column_text(stmt, 3));
-    books[num_books].year = sqlite3_column_int(stmt, 4);
-    snprintf(books[num_books].borrower, sizeof(books[num_books].borrower), "%s",
-             sqlite3_column_text(stmt, 5));
-    num_books++;
-  }
+// Within one data version the row a page starts after fixes its contents,
+// so the query plus that row's ID names the page.
+static int load_book_page(BookPage *page) {
+  char key[RESULT_CACHE_MAX_KEY];
+  const ListQuery *query = &page->query;
+  snprintf(key, sizeof(key), "list:%d:%d:%d:%d:%d:%d:%d", query->sort,
+           query->descending, query->available_only, query->year_from,
+           query->year_to, query->page_size,
+           page->after != NULL ? page->after->id : 0);
+  if (cache_lookup(key, &page->result))
+    return SQLITE_OK;
+
+  int rc = run_db_job(book_page_job, page);
+  if (rc == SQLITE_OK)
+    result_cache_put(key, &page->result, page->version);
+  return rc;
+}
 
-  sqlite3_finalize(stmt);
-  sqlite3_close(db);
+#define LIST_MAX_PAGES 1024 // how far back 'p' can go
 
-  // Cursor tracking
-  int current_row = 0;
+void list_books() {
+  ListQuery query = {SORT_BY_ID, 0, 0, 0, 0, 0};
+  // starts[n] is the last row of page n-1; page 0 starts at the top
+  static Book starts[LIST_MAX_PAGES];
+  int page_no = 0;
+  int reload = 1;
+  // Rows start below the six header lines; a page is one screenful
+  ListView view = {6, 0, 0, 0};
+  BookPage page = {{0}, NULL, {0}, 0};
+  int rc = SQLITE_OK;
 
   while (1) {
-    clear();
+    if (reload) {
+      query.page_size = list_view_rows(&view);
+      free_book_list(&page.result);
+      page.query = query;
+      page.after = page_no > 0 ? &starts[page_no] : NULL;
+      rc = load_book_page(&page);
+      view.count = page.result.count;
+      view.first = 0;
+      // Coming back from the details screen keeps the cursor in place
+      if (reload == 1)
+        view.cursor = 0;
+      reload = 0;
+    }
+
+    Book *books = page.result.items;
+    int num_books = page.result.count;
+
+    erase();
 
     // Header with a border
     printw("###############################################\n");
     printw("#               Book List                    #\n");
     printw("###############################################\n");
+    printw("Page %d | sort: %s %s | %s", page_no + 1,
+           sort_key_name(query.sort), query.descending ? "desc" : "asc",
+           query.available_only ? "available only" : "all books");
+    if (query.year_from || query.year_to)
+      printw(" | years %d-%d", query.year_from, query.year_to);
+    printw("\n");
 
-    // Column headers with better alignment
-    printw("%-5s %-30s %-30s %-20s %-10s %-20s\n", "ID", "Title", "Author",
-           "Publisher", "Year", "Borrower");
-    printw(
-        "---------------------------------------------------------------------"
-        "---------------------------------------------------------------------"
-        "\n");
-
-    // Display books with highlighting for the current row
-    for (int i = 0; i < num_books; i++) {
-      if (i == current_row) {
-        attron(A_REVERSE); // Highlight the selected row
-      }
+    print_book_columns();
 
-      mvprintw(5 + i, 0, "%-5d %-30s %-30s %-20s %-10d %-20s", books[i].id,
-               books[i].title, books[i].author, books[i].publisher,
-               books[i].year,
-               strcmp(books[i].borrower, "(null)") != 0 ? books[i].borrower
-                                                        : "Not "
-                                                          "Borrowed");
-
-      if (i == current_row) {
-        attroff(A_REVERSE); // Remove highlighting
-      }
-    }
+    if (rc != SQLITE_OK)
+      print_sql_error(rc);
+    else
+      list_view_draw(&view, format_book_row, books);
 
     // Footer with instructions
-    mvprintw(6 + num_books, 0, "Use UP/DOWN arrows to navigate, Q to quit.");
+    mvprintw(LINES - 1, 0,
+             "UP/DOWN move, N/P page, S sort, D direction, A available, "
+             "Y years, Q quit.");
 
     // Refresh the screen
     refresh();
 
     // Handle user input
     int ch = getch();
-    if (ch == KEY_DOWN) {
-      if (current_row < num_books - 1) {
-        current_row++;
+    if (ch == KEY_RESIZE) {
+      // Same first row, but as many rows as now fit
+      if (list_view_rows(&view) != query.page_size)
+        reload = 2;
+    } else if (ch == KEY_DOWN || ch == KEY_UP) {
+      list_view_key(&view, ch);
+    } else if (ch == 'n' || ch == KEY_NPAGE) {
+      // A short page is the last one
+      if (num_books == query.page_size && page_no + 1 < LIST_MAX_PAGES) {
+        starts[++page_no] = books[num_books - 1];
+        reload = 1;
+      }
+    } else if (ch == 'p' || ch == KEY_PPAGE) {
+      if (page_no > 0) {
+        page_no--;
+        reload = 1;
       }
-    } else if (ch == KEY_UP) {
-      if (current_row > 0) {
-        current_row--;
+    } else if (ch == 's' || ch == 'd' || ch == 'a' || ch == 'y') {
+      if (ch == 's')
+        query.sort = (query.sort + 1) % SORT_KEY_COUNT;
+      else if (ch == 'd')
+        query.descending = !query.descending;
+      else if (ch == 'a')
+        query.available_only = !query.available_only;
+      else {
+        mvprintw(LINES - 1, 0,
+                 "Year range as FROM TO, 0 for open ends: ");
+        clrtoeol();
+        echo();
+        refresh();
+        int from = 0, to = 0;
+        scanw("%d %d", &from, &to);
+        noecho();
+        query.year_from = from > 0 ? from : 0;
+        query.year_to = to > 0 ? to : 0;
       }
-    } else if (ch == '\n') {
-      int id = books[current_row].id;
+      // The keyset of the old order means nothing in the new one
+      page_no = 0;
+      reload = 1;
+    } else if (ch == '\n' && num_books > 0) {
+      int id = books[view.cursor].id;
       clear_screen();
       book_details(&id);
+      // The book may have been borrowed or returned meanwhile
+      reload = 2;
     } else if (ch == 'q' || ch == 'Q') {
       break;
     }
   }
+
+  free_book_list(&page.result);
+}
+
+typedef struct {
+  BrowseGroup group;
+  const char *from;
+  int inclusive;
+  GroupCount *rows;
+  int max;
+  int count;
+} GroupPage;
+
+static int group_page_job(sqlite3 *db, void *arg) {
+  GroupPage *page = arg;
+  page->count = list_group_page(db, page->group, page->from, page->inclusive,
+                                page->rows, page->max);
+  return page->count < 0 ? SQLITE_ERROR : SQLITE_OK;
+}
+
+typedef struct {
+  BrowseGroup group;
+  const char *name;
+  int after_id;
+  int page_size;
+  BookList result;
+} GroupBooks;
+
+static int group_books_job(sqlite3 *db, void *arg) {
+  GroupBooks *page = arg;
+  return list_group_books(db, page->group, page->name, page->after_id,
+                          page->page_size, &page->result);
+}
+
+static void format_group_row(const void *rows, int index, char *line,
+                             int size) {
+  const GroupCount *row = (const GroupCount *)rows + index;
+  snprintf(line, size, "%-60.60s %6d", row->name, row->books);
 }
 
+// The books of one author or publisher, a screenful per keyset page
+static void browse_group_books(BrowseGroup group, const char *name) {
+  // starts[n] is the ID page n starts after; page 0 starts at the top
+  static int starts[LIST_MAX_PAGES];
+  int page_no = 0;
+  int reload = 1;
+  ListView view = {6, 0, 0, 0};
+  GroupBooks page = {group, name, 0, 0, {0}};
+  int rc = SQLITE_OK;
+
+  while (1) {
+    if (reload) {
+      free_book_list(&page.result);
+      page.after_id = page_no > 0 ? starts[page_no] : 0;
+      page.page_size = list_view_rows(&view);
+      rc = run_db_job(group_books_job, &page);
+      view.count = page.result.count;
+      view.first = 0;
+      if (reload == 1)
+        view.cursor = 0;
+      reload = 0;
+    }
+
+    erase();
+    printw("###############################################\n");
+    printw("#             Books by %-23s#\n", browse_group_name(group));
+    printw("###############################################\n");
+    printw("%s: %s | page %d\n", browse_group_name(group), name,
+           page_no + 1);
+    print_book_columns();
+    if (rc != SQLITE_OK)
+      print_sql_error(rc);
+    else
+      list_view_draw(&view, format_book_row, page.result.items);
+    mvprintw(LINES - 1, 0,
+             "UP/DOWN move, N/P page, Enter details, Q back.");
+    refresh();
+
+    int ch = getch();
+    if (ch == KEY_RESIZE) {
+      if (list_view_rows(&view) != page.page_size)
+        reload = 2;
+    } else if (ch == KEY_DOWN || ch == KEY_UP) {
+      list_view_key(&view, ch);
+    } else if (ch == 'n' || ch == KEY_NPAGE) {
+      // A short page is the last one
+      if (page.result.count == page.page_size &&
+          page_no + 1 < LIST_MAX_PAGES) {
+        starts[++page_no] = page.result.items[page.result.count - 1].id;
+        reload = 1;
+      }
+    } else if (ch == 'p' || ch == KEY_PPAGE) {
+      if (page_no > 0) {
+        page_no--;
+        reload = 1;
+      }
+    } else if (ch == '\n' && page.result.count > 0) {
+      int id = page.result.items[view.cursor].id;
+      clear_screen();
+      book_details(&id);
+      reload = 2;
+    } else if (ch == 'q' || ch == 'Q') {
+      break;
+    }
+  }
+
+  free_book_list(&page.result);
+}
+
+#define GROUP_PAGE_MAX 256 // names on one page, however tall the screen
+
+// Authors or publishers in name order with their book counts. Pages come
+// from the maintained count tables, so BOOKS is never grouped here.
+static void browse_groups(BrowseGroup group) {
+  static GroupCount rows[GROUP_PAGE_MAX];
+  // starts[n] is the last name of page n-1, whole; page 0 starts at jump
+  static char *starts[LIST_MAX_PAGES];
+  char jump[100] = "";
+  int page_no = 0;
+  int reload = 1;
+  ListView view = {6, 0, 0, 0};
+  GroupPage page = {group, NULL, 0, rows, 0, 0};
+  int rc = SQLITE_OK;
+
+  while (1) {
+    if (reload) {
+      int fit = list_view_rows(&view);
+      page.max = fit < GROUP_PAGE_MAX ? fit : GROUP_PAGE_MAX;
+      page.from = page_no > 0 ? starts[page_no] : jump;
+      page.inclusive = page_no == 0;
+      free_group_page(rows, page.count);
+      rc = run_db_job(group_page_job, &page);
+      view.count = rc == SQLITE_OK ? page.count : 0;
+      view.first = 0;
+      if (reload == 1)
+        view.cursor = 0;
+      reload = 0;
+    }
+
+    erase();
+    printw("###############################################\n");
+    printw("#             Browse by %-22s#\n", browse_group_name(group));
+    printw("###############################################\n");
+    printw("Page %d", page_no + 1);
+    if (jump[0] != '\0')
+      printw(" | from \"%s\"", jump);
+    printw("\n");
+    printw("%-60s %6s\n", browse_group_name(group), "Books");
+    printw("%.*s\n", COLS - 1,
+           "-----------------------------------------------------------------"
+           "--");
+    if (rc != SQLITE_OK)
+      print_sql_error(rc);
+    else
+      list_view_draw(&view, format_group_row, rows);
+    mvprintw(LINES - 1, 0,
+             "UP/DOWN move, N/P page, J jump to name, Enter books, Q quit.");
+    refresh();
+
+    int ch = getch();
+    if (ch == KEY_RESIZE) {
+      if (list_view_rows(&view) != page.max)
+        reload = 2;
+    } else if (ch == KEY_DOWN || ch == KEY_UP) {
+      list_view_key(&view, ch);
+    } else if (ch == 'n' || ch == KEY_NPAGE) {
+      char *last = view.count == page.max && page_no + 1 < LIST_MAX_PAGES
+                       ? strdup(rows[view.count - 1].name)
+                       : NULL;
+      if (last != NULL) {
+        page_no++;
+        free(starts[page_no]);
+        starts[page_no] = last;
+        reload = 1;
+      }
+    } else if (ch == 'p' || ch == KEY_PPAGE) {
+      if (page_no > 0) {
+        page_no--;
+        reload = 1;
+      }
+    } else if (ch == 'j' || ch == 'J') {
+      mvprintw(LINES - 1, 0, "Jump to name (empty for the top): ");
+      clrtoeol();
+      echo();
+      refresh();
+      getnstr(jump, sizeof(jump) - 1);
+      noecho();
+      page_no = 0;
+      reload = 1;
+    } else if (ch == '\n' && view.count > 0) {
+      // The rows are not reloaded until the books are closed
+      browse_group_books(group, rows[view.cursor].name);
+      // Counts may have moved while the books were open
+      reload = 2;
+    } else if (ch == 'q' || ch == 'Q') {
+      break;
+    }
+  }
+  free_group_page(rows, page.count);
+}
+
+void browse_by_author() { browse_groups(BROWSE_AUTHOR); }
+
+void browse_by_publisher() { browse_groups(BROWSE_PUBLISHER); }
+
 void add_book() {
   // Header with a border
   printw("###############################################\n");
   printw("#                 Add Book                   #\n");
   printw("###############################################\n");
 
+  echo();
+
   // Prompt for book details with spacing for clarity
+  BookWrite write = {0};
   printw("Enter book title: ");
   refresh();
-  char title[100];
-  getstr(title);
+  getnstr(write.book.title, sizeof(write.book.title) - 1);
 
   printw("Enter book author: ");
   refresh();
-  char author[100];
-  getstr(author);
+  getnstr(write.book.author, sizeof(write.book.author) - 1);
 
   printw("Enter book publisher: ");
   refresh();
-  char publisher[100];
-  getstr(publisher);
+  getnstr(write.book.publisher, sizeof(write.book.publisher) - 1);
 
   printw("Enter book year: ");
   refresh();
-  int year;
-  scanw("%d", &year);
-
-  // Opening the database
-  sqlite3 *db;
-  sqlite3_open(DB_FILE, &db);
-
-  // SQL query for inserting the book
-  char sql[200];
-  sprintf(sql,
-          "INSERT INTO BOOKS (TITLE, AUTHOR, PUBLISHER, YEAR) VALUES ('%s', "
-          "'%s', '%s', %d);",
-          title, author, publisher, year);
-  char *zErrMsg = 0;
-
-  // Execute the SQL query
-  int rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
+  scanw("%d", &write.book.year);
+
+  printw("Enter ISBN or barcode (optional): ");
+  refresh();
+  read_isbn(&write.book);
+
+  // Only multi-branch setups are asked where the book belongs
+  if (branch_count() > 0) {
+    printw("Enter branch ID (0 for %s): ", branch_name(0));
+    refresh();
+    scanw("%d", &write.branch_id);
+  }
+
+  noecho();
+
+  // Insert the book on the database worker
+  int rc = run_db_job(insert_book_job, &write);
   if (rc != SQLITE_OK) {
     // Display error message
-    printw("\n###############################################\n");
-    printw("#               SQL Error                     #\n");
-    printw("###############################################\n");
-    printw("Error: %s\n", zErrMsg);
-    sqlite3_free(zErrMsg);
+    print_sql_error(rc);
   } else {
     // Confirmation message
     printw("\n###############################################\n");
@@ -448,9 +1152,6 @@ void add_book() {
     printw("###############################################\n");
   }
 
-  // Close the database
-  sqlite3_close(db);
-
   // Prompt to continue
   printw("\nPress any key to return to the menu...\n");
   refresh();
@@ -0,0 +1,302 @@
+#include "../include/branch.h"
+#include "../include/config.h"
+#include "../include/migrate.h"
+#include "../include/searchkey.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Search connections: slot 0 is main, slot i + 1 is config.branches[i]
+static sqlite3 *search_dbs[CONFIG_MAX_BRANCHES + 1];
+static int attached = 0;
+
+static const BranchConfig *find_branch(int branch_id) {
+  for (int i = 0; i < config.branch_count; i++) {
+    if (config.branches[i].id == branch_id)
+      return &config.branches[i];
+  }
+  return NULL;
+}
+
+// Brings a branch file to the current schema on a connection of its own,
+// since migrations always target main.
+static int migrate_branch(const BranchConfig *branch) {
+  sqlite3 *db;
+  int rc = sqlite3_open(branch->path, &db);
+  if (rc == SQLITE_OK) {
+    sqlite3_busy_timeout(db, config.busy_timeout);
+    rc = migrate_database(db);
+  }
+  if (rc != SQLITE_OK)
+    fprintf(stderr, "Branch %s (%s): %s\n", branch->name, branch->path,
+            sqlite3_errmsg(db));
+  sqlite3_close(db);
+  return rc;
+}
+
+static int open_search_db(const char *path, sqlite3 **db) {
+  int rc = sqlite3_open_v2(path, db,
+                           SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(*db));
+    sqlite3_close(*db);
+    *db = NULL;
+    return rc;
+  }
+  sqlite3_busy_timeout(*db, config.busy_timeout);
+  return SQLITE_OK;
+}
+
+int attach_branches(sqlite3 *db) {
+  if (attached || config.branch_count == 0)
+    return 0;
+
+  int rc = open_search_db(config.db_path, &search_dbs[0]);
+  for (int i = 0; rc == SQLITE_OK && i < config.branch_count; i++) {
+    const BranchConfig *branch = &config.branches[i];
+    rc = migrate_branch(branch);
+    if (rc == SQLITE_OK) {
+      char *sql = sqlite3_mprintf("ATTACH %Q AS branch_%d;", branch->path,
+                                  branch->id);
+      char *zErrMsg = 0;
+      rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
+      sqlite3_free(sql);
+      if (rc != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", zErrMsg);
+        sqlite3_free(zErrMsg);
+      }
+    }
+    if (rc == SQLITE_OK)
+      rc = open_search_db(branch->path, &search_dbs[i + 1]);
+  }
+
+  attached = 1;
+  if (rc != SQLITE_OK)
+    detach_branches();
+  return rc;
+}
+
+void detach_branches(void) {
+  for (int i = 0; i <= CONFIG_MAX_BRANCHES; i++) {
+    sqlite3_close(search_dbs[i]);
+    search_dbs[i] = NULL;
+  }
+  attached = 0;
+}
+
+int branch_count(void) { return attached ? config.branch_count : 0; }
+
+const char *branch_name(int branch_id) {
+  if (branch_id == 0)
+    return "main";
+  const BranchConfig *branch = attached ? find_branch(branch_id) : NULL;
+  return branch != NULL ? branch->name : NULL;
+}
+
+// Prepares sql with every %s replaced by the branch schema name.
+static int prepare_routed(sqlite3 *db, int branch_id, const char *sql,
+                          sqlite3_stmt **stmt) {
+  if (branch_name(branch_id) == NULL)
+    return SQLITE_NOTFOUND;
+  char schema[32];
+  snprintf(schema, sizeof(schema), "branch_%d", branch_id);
+  char *routed = sqlite3_mprintf(sql, schema, schema);
+  int rc = sqlite3_prepare_v2(db, routed, -1, stmt, 0);
+  sqlite3_free(routed);
+  return rc;
+}
+
+int branch_insert_book(sqlite3 *db, int branch_id, const Book *book) {
+  if (branch_id == 0)
+    return insert_book(db, book);
+
+  sqlite3_stmt *stmt;
+  int rc = prepare_routed(db, branch_id,
+                          "INSERT INTO %s.BOOKS (TITLE, AUTHOR, PUBLISHER, "
+                          "YEAR, ISBN, TITLE_KEY, AUTHOR_KEY) "
+                          "VALUES (?, ?, ?, ?, NULLIF(?, ''), ?, ?);",
+                          &stmt);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  sqlite3_bind_text(stmt, 1, book->title, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, book->author, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 3, book->publisher, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, 4, book->year);
+  sqlite3_bind_text(stmt, 5, book->isbn, -1, SQLITE_STATIC);
+  bind_search_key(stmt, 6, book->title);
+  bind_search_key(stmt, 7, book->author);
+
+  rc = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+int branch_book_exists(sqlite3 *db, int branch_id, int book_id, int *found) {
+  if (branch_id == 0)
+    return book_exists(db, book_id, found);
+  // A mistyped branch simply has no such book
+  *found = 0;
+  if (branch_name(branch_id) == NULL)
+    return SQLITE_OK;
+
+  sqlite3_stmt *stmt;
+  int rc = prepare_routed(db, branch_id, "SELECT 1 FROM %s.BOOKS WHERE ID = ?;",
+                          &stmt);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  sqlite3_bind_int(stmt, 1, book_id);
+  rc = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  *found = rc == SQLITE_ROW;
+  return rc == SQLITE_ROW || rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+// Returns 1 if the book is already borrowed, like borrow_book.
+int branch_borrow_book(sqlite3 *db, int branch_id, int book_id,
+                       const char *borrower_name) {
+  if (branch_id == 0)
+    return borrow_book(db, book_id, borrower_name);
+
+  // The guard makes the check and the insert a single statement
+  sqlite3_stmt *stmt;
+  int rc = prepare_routed(
+      db, branch_id,
+      "INSERT INTO %s.LOANS (BOOK_ID, BORROWER_NAME, BORROW_DATE) "
+      "SELECT ?1, ?2, unixepoch() WHERE NOT EXISTS ("
+      "  SELECT 1 FROM %s.LOANS WHERE BOOK_ID = ?1 AND RETURN_DATE IS NULL);",
+      &stmt);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  sqlite3_bind_int(stmt, 1, book_id);
+  sqlite3_bind_text(stmt, 2, borrower_name, -1, SQLITE_STATIC);
+  rc = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE)
+    return rc;
+  return sqlite3_changes(db) > 0 ? 0 : 1;
+}
+
+// Returns 1 if there was no loan to return, like return_book.
+int branch_return_book(sqlite3 *db, int branch_id, int book_id,
+                       const char *borrower_name) {
+  if (branch_id == 0)
+    return return_book(db, book_id, borrower_name);
+
+  sqlite3_stmt *stmt;
+  int rc = prepare_routed(db, branch_id,
+                          "DELETE FROM %s.LOANS WHERE BOOK_ID = ?1 "
+                          "AND RETURN_DATE IS NULL "
+                          "AND (?2 IS NULL OR BORROWER_NAME = ?2);",
+                          &stmt);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  sqlite3_bind_int(stmt, 1, book_id);
+  if (borrower_name != NULL)
+    sqlite3_bind_text(stmt, 2, borrower_name, -1, SQLITE_STATIC);
+  rc = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE)
+    return rc;
+  return sqlite3_changes(db) > 0 ? 0 : 1;
+}
+
+typedef struct {
+  sqlite3 *db;
+  const char *title;
+  BookList books;
+  int rc;
+} BranchSearch;
+
+static void *branch_search_main(void *arg) {
+  BranchSearch *search = arg;
+  sqlite3_stmt *stmt;
+  search->rc = sqlite3_prepare_v2(
+      search->db,
+      "SELECT BOOKS.ID, BOOKS.TITLE, BOOKS.AUTHOR, BOOKS.PUBLISHER, "
+      "BOOKS.YEAR, LOANS.BORROWER_NAME, BOOKS.ISBN "
+      "FROM BOOKS "
+      "LEFT JOIN LOANS ON BOOKS.ID = LOANS.BOOK_ID AND LOANS.RETURN_DATE IS "
+      "NULL WHERE instr(BOOKS.TITLE_KEY, ?) > 0 "
+      "ORDER BY BOOKS.TITLE, BOOKS.ID LIMIT ?;",
+      -1, &stmt, 0);
+  if (search->rc != SQLITE_OK)
+    return NULL;
+
+  sqlite3_bind_text(stmt, 1, search->title, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, 2, BRANCH_SEARCH_LIMIT);
+  search->rc = collect_books(stmt, &search->books);
+  sqlite3_finalize(stmt);
+  return NULL;
+}
+
+int federated_search(const char *title, BranchResults *results) {
+  memset(results, 0, sizeof(*results));
+  if (!attached)
+    return SQLITE_MISUSE;
+
+  // Every branch stores the same folded keys, so one folding serves all
+  char key[SEARCH_KEY_MAX];
+  fold_search_key(title, key, sizeof(key));
+
+  int count = config.branch_count + 1;
+  BranchSearch searches[CONFIG_MAX_BRANCHES + 1];
+  pthread_t threads[CONFIG_MAX_BRANCHES + 1];
+  int started[CONFIG_MAX_BRANCHES + 1];
+  memset(searches, 0, sizeof(searches));
+
+  for (int i = 0; i < count; i++) {
+    searches[i].db = search_dbs[i];
+    searches[i].title = key;
+    started[i] =
+        pthread_create(&threads[i], NULL, branch_search_main, &searches[i]) ==
+        0;
+    if (!started[i])
+      branch_search_main(&searches[i]);
+  }
+
+  int rc = SQLITE_OK;
+  int total = 0;
+  for (int i = 0; i < count; i++) {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+    if (searches[i].rc != SQLITE_OK)
+      rc = searches[i].rc;
+    total += searches[i].books.count;
+  }
+
+  // Each branch is already sorted by title, so a k-way merge keeps order
+  results->items = malloc((total > 0 ? total : 1) * sizeof(BranchBook));
+  if (results->items == NULL)
+    rc = SQLITE_NOMEM;
+  int next[CONFIG_MAX_BRANCHES + 1] = {0};
+  while (rc == SQLITE_OK && results->count < total) {
+    int best = -1;
+    for (int i = 0; i < count; i++) {
+      if (next[i] == searches[i].books.count)
+        continue;
+      if (best < 0 ||
+          strcmp(searches[i].books.items[next[i]].title,
+                 searches[best].books.items[next[best]].title) < 0)
+        best = i;
+    }
+    BranchBook *out = &results->items[results->count++];
+    out->branch_id = best == 0 ? 0 : config.branches[best - 1].id;
+    out->book = searches[best].books.items[next[best]++];
+  }
+
+  for (int i = 0; i < count; i++)
+    free_book_list(&searches[i].books);
+  if (rc != SQLITE_OK)
+    free_branch_results(results);
+  return rc;
+}
+
+void free_branch_results(BranchResults *results) {
+  free(results->items);
+  memset(results, 0, sizeof(*results));
+}
@@ -0,0 +1,93 @@
+#include "../include/browse.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  const char *name;
+  const char *page_sql;  // names after ?1, LIMIT ?2
+  const char *from_sql;  // names from ?1 on, LIMIT ?2
+  const char *books_sql; // books of ?1 with ID above ?2, LIMIT ?3
+} GroupSpec;
+
+#define GROUP_BOOKS(column)                                                    \
+  "SELECT BOOKS.ID, BOOKS.TITLE, BOOKS.AUTHOR, BOOKS.PUBLISHER, BOOKS.YEAR, "  \
+  "LOANS.BORROWER_NAME FROM BOOKS "                                            \
+  "LEFT JOIN LOANS ON BOOKS.ID = LOANS.BOOK_ID AND LOANS.RETURN_DATE IS NULL " \
+  "WHERE BOOKS." column " = ?1 AND BOOKS.ID > ?2 "                             \
+  "ORDER BY BOOKS.ID LIMIT ?3;"
+
+static const GroupSpec group_specs[BROWSE_GROUP_COUNT] = {
+    [BROWSE_AUTHOR] = {"Author",
+                       "SELECT AUTHOR, BOOKS FROM AUTHOR_COUNTS "
+                       "WHERE AUTHOR > ?1 ORDER BY AUTHOR LIMIT ?2;",
+                       "SELECT AUTHOR, BOOKS FROM AUTHOR_COUNTS "
+                       "WHERE AUTHOR >= ?1 ORDER BY AUTHOR LIMIT ?2;",
+                       GROUP_BOOKS("AUTHOR")},
+    [BROWSE_PUBLISHER] = {"Publisher",
+                          "SELECT PUBLISHER, BOOKS FROM PUBLISHER_COUNTS "
+                          "WHERE PUBLISHER > ?1 ORDER BY PUBLISHER LIMIT ?2;",
+                          "SELECT PUBLISHER, BOOKS FROM PUBLISHER_COUNTS "
+                          "WHERE PUBLISHER >= ?1 ORDER BY PUBLISHER "
+                          "LIMIT ?2;",
+                          GROUP_BOOKS("PUBLISHER")},
+};
+
+const char *browse_group_name(BrowseGroup group) {
+  return group_specs[group].name;
+}
+
+int list_group_page(sqlite3 *db, BrowseGroup group, const char *from,
+                    int inclusive, GroupCount *out, int max) {
+  const GroupSpec *spec = &group_specs[group];
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(db, inclusive ? spec->from_sql : spec->page_sql,
+                              -1, &stmt, 0);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+
+  sqlite3_bind_text(stmt, 1, from, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, 2, max);
+  int count = 0;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    // Cut short, a name would match no book and page from the wrong place
+    GroupCount *row = &out[count];
+    row->name = strdup((const char *)sqlite3_column_text(stmt, 0));
+    if (row->name == NULL) {
+      rc = SQLITE_NOMEM;
+      break;
+    }
+    row->books = sqlite3_column_int(stmt, 1);
+    count++;
+  }
+  sqlite3_finalize(stmt);
+  if (rc == SQLITE_DONE)
+    return count;
+  free_group_page(out, count);
+  return -1;
+}
+
+void free_group_page(GroupCount *rows, int count) {
+  for (int i = 0; i < count; i++) {
+    free(rows[i].name);
+    rows[i].name = NULL;
+  }
+}
+
+int list_group_books(sqlite3 *db, BrowseGroup group, const char *name,
+                     int after_id, int page_size, BookList *page) {
+  sqlite3_stmt *stmt;
+  int rc =
+      sqlite3_prepare_v2(db, group_specs[group].books_sql, -1, &stmt, 0);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, 2, after_id);
+  sqlite3_bind_int(stmt, 3, page_size);
+  rc = collect_books(stmt, page);
+  sqlite3_finalize(stmt);
+  return rc;
+}
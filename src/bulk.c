@@ -0,0 +1,269 @@
+#include "../include/bulk.h"
+#include "../include/audit.h"
+#include "../include/changelog.h"
+#include "../include/searchkey.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Parameters are numbered the same in every statement so that only the
+// conditions in use appear in the WHERE clause, where the planner can pick
+// BOOKS_BY_AUTHOR or BOOKS_BY_PUBLISHER for them.
+enum {
+  PARAM_AUTHOR = 1,
+  PARAM_PUBLISHER,
+  PARAM_TITLE,
+  PARAM_YEAR_FROM,
+  PARAM_YEAR_TO,
+  PARAM_VALUE,
+  PARAM_EDITOR,
+  PARAM_VALUE_KEY
+};
+
+static const char *column_names[BULK_FIELD_COUNT] = {"TITLE", "AUTHOR",
+                                                     "PUBLISHER", "YEAR"};
+// The folded copy kept beside a searched column, written with it
+static const char *key_columns[BULK_FIELD_COUNT] = {"TITLE_KEY", "AUTHOR_KEY",
+                                                    NULL, NULL};
+
+static int exec_sql(sqlite3 *db, const char *sql) {
+  char *zErrMsg = 0;
+  int rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "SQL error: %s\n", zErrMsg);
+    sqlite3_free(zErrMsg);
+  }
+  return rc;
+}
+
+int book_filter_empty(const BookFilter *filter) {
+  return filter->author[0] == '\0' && filter->publisher[0] == '\0' &&
+         filter->title_like[0] == '\0' && filter->year_from == 0 &&
+         filter->year_to == 0;
+}
+
+int bulk_field_from_name(const char *name) {
+  static const char *names[BULK_FIELD_COUNT] = {"title", "author",
+                                                "publisher", "year"};
+  for (int i = 0; i < BULK_FIELD_COUNT; i++) {
+    if (strcmp(name, names[i]) == 0)
+      return i;
+  }
+  return -1;
+}
+
+// Appends " WHERE ..." for the set parts of filter plus a guard that skips
+// rows already holding the new value, so they are neither counted, audited
+// nor rewritten.
+static void append_where(char *sql, size_t size, const BookFilter *filter,
+                         BulkField field) {
+  size_t len = strlen(sql);
+  len += snprintf(sql + len, size - len, " WHERE %s IS NOT ?%d",
+                  column_names[field], PARAM_VALUE);
+  if (filter->author[0] != '\0')
+    len += snprintf(sql + len, size - len, " AND AUTHOR = ?%d", PARAM_AUTHOR);
+  if (filter->publisher[0] != '\0')
+    len += snprintf(sql + len, size - len, " AND PUBLISHER = ?%d",
+                    PARAM_PUBLISHER);
+  if (filter->title_like[0] != '\0')
+    len += snprintf(sql + len, size - len, " AND TITLE_KEY LIKE ?%d",
+                    PARAM_TITLE);
+  if (filter->year_from != 0)
+    len += snprintf(sql + len, size - len, " AND YEAR >= ?%d",
+                    PARAM_YEAR_FROM);
+  if (filter->year_to != 0)
+    snprintf(sql + len, size - len, " AND YEAR <= ?%d", PARAM_YEAR_TO);
+}
+
+static void bind_filter(sqlite3_stmt *stmt, const BookFilter *filter,
+                        BulkField field, const char *value) {
+  // % and _ survive folding, so the pattern matches the stored keys
+  char title_key[SEARCH_KEY_MAX];
+  fold_search_key(filter->title_like, title_key, sizeof(title_key));
+  sqlite3_bind_text(stmt, PARAM_AUTHOR, filter->author, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, PARAM_PUBLISHER, filter->publisher, -1,
+                    SQLITE_STATIC);
+  sqlite3_bind_text(stmt, PARAM_TITLE, title_key, -1, SQLITE_TRANSIENT);
+  sqlite3_bind_int(stmt, PARAM_YEAR_FROM, filter->year_from);
+  sqlite3_bind_int(stmt, PARAM_YEAR_TO, filter->year_to);
+  // YEAR is an integer column; comparing it with text would never match.
+  // check_request has already made sure value is a whole number.
+  if (field == BULK_YEAR)
+    sqlite3_bind_int(stmt, PARAM_VALUE, (int)strtol(value, NULL, 10));
+  else
+    sqlite3_bind_text(stmt, PARAM_VALUE, value, -1, SQLITE_STATIC);
+  if (key_columns[field] != NULL)
+    bind_search_key(stmt, PARAM_VALUE_KEY, value);
+}
+
+// Prepares sql with the filter's WHERE appended; the statement may leave
+// some of the fixed parameters unused, which SQLite allows.
+static int prepare_filtered(sqlite3 *db, const char *head, const char *tail,
+                            const BookFilter *filter, BulkField field,
+                            const char *value, sqlite3_stmt **stmt) {
+  char sql[1024];
+  snprintf(sql, sizeof(sql), "%s", head);
+  append_where(sql, sizeof(sql), filter, field);
+  size_t len = strlen(sql);
+  snprintf(sql + len, sizeof(sql) - len, "%s;", tail);
+
+  int rc = sqlite3_prepare_v2(db, sql, -1, stmt, 0);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+  bind_filter(*stmt, filter, field, value);
+  return SQLITE_OK;
+}
+
+static int parse_year(const char *text, int *year) {
+  char *end;
+  long value = strtol(text, &end, 10);
+  if (end == text || *end != '\0' || value < 0 || value > 9999)
+    return 1;
+  *year = (int)value;
+  return 0;
+}
+
+int parse_year_range(const char *text, int *from, int *to) {
+  char first[16];
+  const char *dash = strchr(text, '-');
+  *from = *to = 0;
+  if (dash == NULL) {
+    if (parse_year(text, from))
+      return 1;
+    *to = *from;
+    return *from == 0;
+  }
+  if (dash - text >= (long)sizeof(first) || (dash == text && dash[1] == '\0'))
+    return 1;
+  snprintf(first, sizeof(first), "%.*s", (int)(dash - text), text);
+  return (first[0] != '\0' && (parse_year(first, from) || *from == 0)) ||
+         (dash[1] != '\0' && (parse_year(dash + 1, to) || *to == 0));
+}
+
+const char *bulk_request_error(const BookFilter *filter, BulkField field,
+                               const char *value) {
+  int year;
+  if (field < 0 || field >= BULK_FIELD_COUNT)
+    return "Unknown field";
+  if (book_filter_empty(filter))
+    return "A bulk update needs at least one filter";
+  if (filter->year_from < 0 || filter->year_to < 0 ||
+      (filter->year_to != 0 && filter->year_from > filter->year_to))
+    return "The year range is empty";
+  if (value == NULL || value[0] == '\0')
+    return "The new value is empty";
+  if (field == BULK_YEAR && parse_year(value, &year))
+    return "The new year is not a whole number between 0 and 9999";
+  return NULL;
+}
+
+static int check_request(const BookFilter *filter, BulkField field,
+                         const char *value) {
+  const char *error = bulk_request_error(filter, field, value);
+  if (error != NULL) {
+    fprintf(stderr, "%s\n", error);
+    return SQLITE_MISUSE;
+  }
+  return SQLITE_OK;
+}
+
+int count_bulk_update(sqlite3 *db, const BookFilter *filter, BulkField field,
+                      const char *value, int *count) {
+  int rc = check_request(filter, field, value);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  sqlite3_stmt *stmt;
+  rc = prepare_filtered(db, "SELECT COUNT(*) FROM BOOKS", "", filter, field,
+                        value, &stmt);
+  if (rc != SQLITE_OK)
+    return rc;
+  rc = sqlite3_step(stmt);
+  *count = rc == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : 0;
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_ROW ? SQLITE_OK : rc;
+}
+
+// One INSERT ... SELECT diffs every matching row against the new value
+// before the UPDATE touches it; book_diff() encodes the same blobs
+// record_book_edit() writes for single edits, so history and undo work on
+// them unchanged.
+static int audit_bulk_update(sqlite3 *db, const BookFilter *filter,
+                             BulkField field, const char *value,
+                             const char *editor) {
+  char head[512];
+  const char *after[BULK_FIELD_COUNT] = {"TITLE", "AUTHOR", "PUBLISHER",
+                                         "YEAR"};
+  char param[8];
+  snprintf(param, sizeof(param), "?%d", PARAM_VALUE);
+  after[field] = param;
+  snprintf(head, sizeof(head),
+           "INSERT INTO BOOK_EDITS (BOOK_ID, EDITED_AT, EDITOR, DIFF) "
+           "SELECT ID, unixepoch(), ?%d, book_diff(TITLE, %s, AUTHOR, %s, "
+           "PUBLISHER, %s, YEAR, %s, ISBN, ISBN) FROM BOOKS",
+           PARAM_EDITOR, after[BULK_TITLE], after[BULK_AUTHOR],
+           after[BULK_PUBLISHER], after[BULK_YEAR]);
+
+  sqlite3_stmt *stmt;
+  int rc = prepare_filtered(db, head, "", filter, field, value, &stmt);
+  if (rc != SQLITE_OK)
+    return rc;
+  sqlite3_bind_text(stmt, PARAM_EDITOR, editor, -1, SQLITE_STATIC);
+  rc = sqlite3_step(stmt);
+  if (rc != SQLITE_DONE)
+    fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+int bulk_update_books(sqlite3 *db, const BookFilter *filter, BulkField field,
+                      const char *value, const char *editor, int *changed) {
+  *changed = 0;
+  int rc = check_request(filter, field, value);
+  if (rc == SQLITE_OK)
+    rc = audit_register_functions(db);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  rc = exec_sql(db, "BEGIN IMMEDIATE;");
+  if (rc != SQLITE_OK)
+    return rc;
+  rc = audit_bulk_update(db, filter, field, value, editor);
+
+  // The rows come back as stored, for the change log
+  BookList updated = {0};
+  sqlite3_stmt *stmt;
+  if (rc == SQLITE_OK) {
+    char head[96];
+    int len = snprintf(head, sizeof(head), "UPDATE BOOKS SET %s = ?%d",
+                       column_names[field], PARAM_VALUE);
+    if (key_columns[field] != NULL)
+      snprintf(head + len, sizeof(head) - len, ", %s = ?%d",
+               key_columns[field], PARAM_VALUE_KEY);
+    rc = prepare_filtered(db, head,
+                          " RETURNING ID, TITLE, AUTHOR, PUBLISHER, YEAR, "
+                          "'', ISBN",
+                          filter, field, value, &stmt);
+  }
+  if (rc == SQLITE_OK) {
+    rc = collect_books(stmt, &updated);
+    if (rc != SQLITE_OK)
+      fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+  }
+  if (rc == SQLITE_OK)
+    rc = exec_sql(db, "COMMIT;");
+  if (rc != SQLITE_OK) {
+    sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+  } else {
+    // The fuzzy index notices the write and reloads once on its next
+    // search; only the log needs one record per row
+    for (int i = 0; i < updated.count; i++)
+      changelog_book(CHANGE_UPDATE_BOOK, &updated.items[i]);
+    *changed = updated.count;
+  }
+  free_book_list(&updated);
+  return rc;
+}
@@ -0,0 +1,170 @@
+#include "../include/cache.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+typedef struct {
+  char key[RESULT_CACHE_MAX_KEY];
+  unsigned hash;
+  BookList list;
+  unsigned long long version;
+  time_t stored_at;
+  unsigned long long used; // tick of the last hit, for LRU eviction
+  int in_use;
+} Entry;
+
+static Entry *entries = NULL;
+static int capacity = 0;
+static unsigned long long tick = 0;
+static unsigned long long hits = 0;
+static unsigned long long misses = 0;
+
+// Written by the update hook on whichever thread runs the statement
+static _Atomic unsigned long long version = 1;
+// Only touched by the worker, inside result_cache_begin
+static sqlite3_int64 last_data_version = -1;
+
+static unsigned hash_key(const char *key) {
+  unsigned hash = 2166136261u; // FNV-1a
+  for (const unsigned char *p = (const unsigned char *)key; *p; p++)
+    hash = (hash ^ *p) * 16777619u;
+  return hash;
+}
+
+static void update_hook(void *unused, int op, const char *db_name,
+                        const char *table, sqlite3_int64 rowid) {
+  (void)unused;
+  (void)op;
+  (void)db_name;
+  (void)rowid;
+  // Any schema: a branch's BOOKS shows up in federated results too
+  if (strcasecmp(table, "BOOKS") == 0 || strcasecmp(table, "LOANS") == 0)
+    atomic_fetch_add(&version, 1);
+}
+
+int result_cache_init(sqlite3 *db, int size) {
+  if (size <= 0)
+    return 0;
+  entries = calloc(size, sizeof(Entry));
+  if (entries == NULL)
+    return 1;
+  capacity = size;
+  sqlite3_update_hook(db, update_hook, NULL);
+  return 0;
+}
+
+static void drop_entry(Entry *entry) {
+  free_book_list(&entry->list);
+  entry->in_use = 0;
+}
+
+void result_cache_close(void) {
+  for (int i = 0; i < capacity; i++) {
+    if (entries[i].in_use)
+      drop_entry(&entries[i]);
+  }
+  free(entries);
+  entries = NULL;
+  capacity = 0;
+}
+
+unsigned long long result_cache_begin(sqlite3 *db) {
+  // data_version only moves when another connection commits, which the
+  // update hook cannot see
+  sqlite3_stmt *stmt;
+  if (capacity > 0 &&
+      sqlite3_prepare_v2(db, "PRAGMA data_version;", -1, &stmt, 0) ==
+          SQLITE_OK) {
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      sqlite3_int64 current = sqlite3_column_int64(stmt, 0);
+      if (current != last_data_version)
+        atomic_fetch_add(&version, 1);
+      last_data_version = current;
+    }
+    sqlite3_finalize(stmt);
+  }
+  return atomic_load(&version);
+}
+
+static int copy_list(const BookList *from, BookList *to) {
+  to->items = malloc((from->count > 0 ? from->count : 1) * sizeof(Book));
+  if (to->items == NULL)
+    return 1;
+  memcpy(to->items, from->items, from->count * sizeof(Book));
+  to->count = from->count;
+  to->capacity = from->count > 0 ? from->count : 1;
+  return 0;
+}
+
+int result_cache_get(const char *key, BookList *out) {
+  if (capacity == 0)
+    return 0;
+
+  unsigned hash = hash_key(key);
+  unsigned long long current = atomic_load(&version);
+  time_t now = time(NULL);
+  for (int i = 0; i < capacity; i++) {
+    Entry *entry = &entries[i];
+    if (!entry->in_use || entry->hash != hash || strcmp(entry->key, key) != 0)
+      continue;
+    if (entry->version != current ||
+        now - entry->stored_at > RESULT_CACHE_MAX_AGE) {
+      drop_entry(entry);
+      break;
+    }
+    if (copy_list(&entry->list, out) != 0)
+      break;
+    entry->used = ++tick;
+    hits++;
+    return 1;
+  }
+  misses++;
+  return 0;
+}
+
+void result_cache_put(const char *key, const BookList *list,
+                      unsigned long long at_version) {
+  if (capacity == 0 || list->count > RESULT_CACHE_MAX_BOOKS ||
+      strlen(key) >= RESULT_CACHE_MAX_KEY ||
+      at_version != atomic_load(&version))
+    return;
+
+  // A free slot, a stale one, or else the least recently used
+  unsigned hash = hash_key(key);
+  Entry *victim = &entries[0];
+  for (int i = 0; i < capacity; i++) {
+    Entry *entry = &entries[i];
+    if (!entry->in_use || entry->version != at_version ||
+        (entry->hash == hash && strcmp(entry->key, key) == 0)) {
+      victim = entry;
+      break;
+    }
+    if (entry->used < victim->used)
+      victim = entry;
+  }
+  if (victim->in_use)
+    drop_entry(victim);
+
+  if (copy_list(list, &victim->list) != 0)
+    return;
+  strcpy(victim->key, key);
+  victim->hash = hash;
+  victim->version = at_version;
+  victim->stored_at = time(NULL);
+  victim->used = ++tick;
+  victim->in_use = 1;
+}
+
+void result_cache_stats(ResultCacheStats *stats) {
+  stats->hits = hits;
+  stats->misses = misses;
+  stats->version = atomic_load(&version);
+  stats->capacity = capacity;
+  stats->entries = 0;
+  for (int i = 0; i < capacity; i++) {
+    if (entries[i].in_use && entries[i].version == stats->version)
+      stats->entries++;
+  }
+}
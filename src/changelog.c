@@ -0,0 +1,567 @@
+#include "../include/changelog.h"
+#include "../include/migrate.h"
+#include "../include/searchkey.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RECORD_HEADER 8 // u32 length + u32 crc32
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void build_crc_table(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++)
+      c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+    crc_table[i] = c;
+  }
+}
+
+static uint32_t crc32(const unsigned char *data, size_t len) {
+  uint32_t c = 0xFFFFFFFFu;
+  for (size_t i = 0; i < len; i++)
+    c = crc_table[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+  return c ^ 0xFFFFFFFFu;
+}
+
+static unsigned char *put_u32(unsigned char *p, uint32_t v) {
+  for (int i = 0; i < 4; i++)
+    *p++ = (unsigned char)(v >> (8 * i));
+  return p;
+}
+
+static unsigned char *put_u64(unsigned char *p, uint64_t v) {
+  for (int i = 0; i < 8; i++)
+    *p++ = (unsigned char)(v >> (8 * i));
+  return p;
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+  return (uint64_t)get_u32(p) | (uint64_t)get_u32(p + 4) << 32;
+}
+
+static unsigned char *put_str(unsigned char *p, const char *s) {
+  size_t len = strlen(s);
+  *p++ = (unsigned char)len;
+  *p++ = (unsigned char)(len >> 8);
+  memcpy(p, s, len);
+  return p + len;
+}
+
+// Copies a length-prefixed string into dest; returns NULL if it overruns end.
+static const unsigned char *get_str(const unsigned char *p,
+                                    const unsigned char *end, char *dest,
+                                    size_t size) {
+  if (end - p < 2)
+    return NULL;
+  size_t len = p[0] | (size_t)p[1] << 8;
+  p += 2;
+  if ((size_t)(end - p) < len || len >= size)
+    return NULL;
+  memcpy(dest, p, len);
+  dest[len] = '\0';
+  return p + len;
+}
+
+// Writes header and payload into out and returns the record size.
+static size_t encode_event(const ChangeEvent *event, unsigned char *out) {
+  unsigned char *p = out + RECORD_HEADER;
+  *p++ = (unsigned char)event->type;
+  p = put_u64(p, event->seq);
+  p = put_u64(p, (uint64_t)event->time);
+  p = put_u32(p, (uint32_t)event->book.id);
+  p = put_u32(p, (uint32_t)event->book.year);
+  p = put_str(p, event->book.title);
+  p = put_str(p, event->book.author);
+  p = put_str(p, event->book.publisher);
+  p = put_str(p, event->book.borrower);
+  p = put_str(p, event->book.isbn);
+
+  size_t len = p - (out + RECORD_HEADER);
+  put_u32(out, (uint32_t)len);
+  put_u32(out + 4, crc32(out + RECORD_HEADER, len));
+  return RECORD_HEADER + len;
+}
+
+static int decode_event(const unsigned char *p, size_t len,
+                        ChangeEvent *event) {
+  const unsigned char *end = p + len;
+  memset(event, 0, sizeof(*event));
+  if (len < 1 + 8 + 8 + 4 + 4)
+    return 1;
+  event->type = (ChangeType)*p++;
+  event->seq = get_u64(p);
+  event->time = (long long)get_u64(p + 8);
+  event->book.id = (int)get_u32(p + 16);
+  event->book.year = (int)get_u32(p + 20);
+  p += 24;
+  Book *b = &event->book;
+  if (!(p = get_str(p, end, b->title, sizeof(b->title))) ||
+      !(p = get_str(p, end, b->author, sizeof(b->author))) ||
+      !(p = get_str(p, end, b->publisher, sizeof(b->publisher))) ||
+      !(p = get_str(p, end, b->borrower, sizeof(b->borrower))) ||
+      !(p = get_str(p, end, b->isbn, sizeof(b->isbn))))
+    return 1;
+  return event->type < CHANGE_ADD_BOOK || event->type > CHANGE_DELETE_BOOK;
+}
+
+const char *change_type_name(ChangeType type) {
+  switch (type) {
+  case CHANGE_ADD_BOOK:
+    return "add";
+  case CHANGE_UPDATE_BOOK:
+    return "update";
+  case CHANGE_BORROW:
+    return "borrow";
+  case CHANGE_RETURN:
+    return "return";
+  case CHANGE_DELETE_BOOK:
+    return "delete";
+  }
+  return "?";
+}
+
+int changelog_reader_open(ChangeReader *reader, const char *path) {
+  pthread_once(&crc_once, build_crc_table);
+  reader->fd = open(path, O_RDONLY);
+  if (reader->fd < 0) {
+    fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  char magic[CHANGELOG_MAGIC_SIZE];
+  if (pread(reader->fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+      memcmp(magic, CHANGELOG_MAGIC, sizeof(magic)) != 0) {
+    fprintf(stderr, "%s is not a change log\n", path);
+    close(reader->fd);
+    reader->fd = -1;
+    return 1;
+  }
+  reader->offset = CHANGELOG_MAGIC_SIZE;
+  return 0;
+}
+
+int changelog_read(ChangeReader *reader, ChangeEvent *event) {
+  unsigned char header[RECORD_HEADER];
+  if (pread(reader->fd, header, sizeof(header), reader->offset) !=
+      sizeof(header))
+    return 0;
+
+  uint32_t len = get_u32(header);
+  if (len == 0 || len > CHANGELOG_MAX_RECORD)
+    return -1;
+  ssize_t got = pread(reader->fd, reader->buf, len,
+                      reader->offset + RECORD_HEADER);
+  if (got < (ssize_t)len)
+    return 0; // the writer has not finished this record yet
+  if (crc32(reader->buf, len) != get_u32(header + 4) ||
+      decode_event(reader->buf, len, event))
+    return -1;
+
+  reader->offset += RECORD_HEADER + len;
+  return 1;
+}
+
+void changelog_reader_close(ChangeReader *reader) {
+  if (reader->fd >= 0)
+    close(reader->fd);
+  reader->fd = -1;
+}
+
+// Writer state. Appends and the flusher share log_lock.
+static int log_fd = -1;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t flusher_thread;
+static int flusher_running = 0;
+static int pending = 0; // records written since the last fsync
+static unsigned long long next_seq = 1;
+
+static void *flusher_main(void *arg) {
+  (void)arg;
+
+  pthread_mutex_lock(&log_lock);
+  while (flusher_running) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += CHANGELOG_SYNC_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    while (flusher_running && pending < CHANGELOG_GROUP_RECORDS &&
+           pthread_cond_timedwait(&log_wake, &log_lock, &deadline) == 0) {
+    }
+    if (pending == 0)
+      continue;
+
+    // One fsync covers every record written so far; appends carry on
+    // while it runs
+    pending = 0;
+    int fd = log_fd;
+    pthread_mutex_unlock(&log_lock);
+    fdatasync(fd);
+    pthread_mutex_lock(&log_lock);
+  }
+  pthread_mutex_unlock(&log_lock);
+  return NULL;
+}
+
+// Caller holds log_lock.
+static int write_event(ChangeEvent *event) {
+  unsigned char record[RECORD_HEADER + CHANGELOG_MAX_RECORD];
+  event->seq = next_seq;
+  size_t size = encode_event(event, record);
+  if (write(log_fd, record, size) != (ssize_t)size) {
+    fprintf(stderr, "Change log write failed: %s\n", strerror(errno));
+    return 1;
+  }
+  next_seq++;
+  pending++;
+  return 0;
+}
+
+static void append_event(ChangeEvent *event) {
+  pthread_mutex_lock(&log_lock);
+  if (log_fd >= 0 && write_event(event) == 0 &&
+      pending >= CHANGELOG_GROUP_RECORDS)
+    pthread_cond_signal(&log_wake);
+  pthread_mutex_unlock(&log_lock);
+}
+
+void changelog_book(ChangeType type, const Book *book) {
+  if (log_fd < 0)
+    return;
+  ChangeEvent event = {type, 0, (long long)time(NULL), *book};
+  event.book.borrower[0] = '\0';
+  append_event(&event);
+}
+
+void changelog_loan(ChangeType type, int book_id, const char *borrower) {
+  if (log_fd < 0)
+    return;
+  ChangeEvent event;
+  memset(&event, 0, sizeof(event));
+  event.type = type;
+  event.time = (long long)time(NULL);
+  event.book.id = book_id;
+  if (borrower != NULL)
+    snprintf(event.book.borrower, sizeof(event.book.borrower), "%s",
+             borrower);
+  append_event(&event);
+}
+
+// Logs the current books and active loans so a new log is self-contained.
+static int write_snapshot(sqlite3 *db) {
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(db,
+                              "SELECT ID, TITLE, AUTHOR, PUBLISHER, YEAR, "
+                              "'', ISBN FROM BOOKS ORDER BY ID;",
+                              -1, &stmt, 0);
+  if (rc != SQLITE_OK)
+    return rc;
+  BookList books = {0};
+  rc = collect_books(stmt, &books);
+  sqlite3_finalize(stmt);
+
+  ChangeEvent event;
+  memset(&event, 0, sizeof(event));
+  event.time = (long long)time(NULL);
+  event.type = CHANGE_ADD_BOOK;
+  for (int i = 0; rc == SQLITE_OK && i < books.count; i++) {
+    event.book = books.items[i];
+    rc = write_event(&event) ? SQLITE_IOERR : SQLITE_OK;
+  }
+  free_book_list(&books);
+
+  if (rc == SQLITE_OK)
+    rc = sqlite3_prepare_v2(db,
+                            "SELECT BOOK_ID, BORROWER_NAME FROM LOANS "
+                            "WHERE RETURN_DATE IS NULL ORDER BY ID;",
+                            -1, &stmt, 0);
+  if (rc != SQLITE_OK)
+    return rc;
+  memset(&event.book, 0, sizeof(event.book));
+  event.type = CHANGE_BORROW;
+  while (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+    event.book.id = sqlite3_column_int(stmt, 0);
+    snprintf(event.book.borrower, sizeof(event.book.borrower), "%s",
+             (const char *)sqlite3_column_text(stmt, 1));
+    rc = write_event(&event) ? SQLITE_IOERR : SQLITE_OK;
+  }
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+// Finds the end of the valid records and the next sequence number. A bad
+// or partial record is only tolerated at the very end, where an interrupted
+// write leaves it: a length in range must reach the end of the file, and an
+// out-of-range one, which says nothing about where the record ends, is
+// only believed when less than one largest record follows it.
+static int recover_tail(const char *path, off_t size) {
+  ChangeReader reader;
+  if (changelog_reader_open(&reader, path))
+    return 1;
+
+  ChangeEvent event;
+  int result;
+  while ((result = changelog_read(&reader, &event)) == 1)
+    next_seq = event.seq + 1;
+
+  if (result < 0) {
+    unsigned char header[RECORD_HEADER];
+    long long tail = (long long)size - reader.offset;
+    uint32_t len = 0;
+    if (pread(reader.fd, header, sizeof(header), reader.offset) ==
+        sizeof(header))
+      len = get_u32(header);
+    int torn = len > 0 && len <= CHANGELOG_MAX_RECORD
+                   ? RECORD_HEADER + (long long)len >= tail
+                   : tail <= RECORD_HEADER + CHANGELOG_MAX_RECORD;
+    if (!torn) {
+      fprintf(stderr, "%s: bad record at offset %lld\n", path,
+              reader.offset);
+      changelog_reader_close(&reader);
+      return 1;
+    }
+  }
+  long long end = reader.offset;
+  changelog_reader_close(&reader);
+
+  if (end < size) {
+    fprintf(stderr, "%s: dropping %lld bytes of an unfinished record\n", path,
+            (long long)size - end);
+    if (truncate(path, end) != 0)
+      return 1;
+  }
+  return 0;
+}
+
+int changelog_open(sqlite3 *db, const char *path) {
+  if (log_fd >= 0)
+    return 0;
+  pthread_once(&crc_once, build_crc_table);
+
+  int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return 1;
+  }
+
+  pthread_mutex_lock(&log_lock);
+  log_fd = fd;
+  next_seq = 1;
+  int rc = 0;
+  if (st.st_size == 0) {
+    rc = write(fd, CHANGELOG_MAGIC, CHANGELOG_MAGIC_SIZE) !=
+             CHANGELOG_MAGIC_SIZE ||
+         write_snapshot(db) != SQLITE_OK || fdatasync(fd) != 0;
+    pending = 0;
+  } else {
+    rc = recover_tail(path, st.st_size);
+  }
+  if (rc == 0) {
+    flusher_running = 1;
+    if (pthread_create(&flusher_thread, NULL, flusher_main, NULL) != 0) {
+      flusher_running = 0;
+      rc = 1;
+    }
+  }
+  if (rc != 0) {
+    close(fd);
+    log_fd = -1;
+  }
+  pthread_mutex_unlock(&log_lock);
+  return rc;
+}
+
+void changelog_close(void) {
+  pthread_mutex_lock(&log_lock);
+  if (log_fd < 0) {
+    pthread_mutex_unlock(&log_lock);
+    return;
+  }
+  flusher_running = 0;
+  pthread_cond_signal(&log_wake);
+  pthread_mutex_unlock(&log_lock);
+  pthread_join(flusher_thread, NULL);
+
+  pthread_mutex_lock(&log_lock);
+  fdatasync(log_fd);
+  close(log_fd);
+  log_fd = -1;
+  pending = 0;
+  pthread_mutex_unlock(&log_lock);
+}
+
+// In ChangeType order
+enum {
+  APPLY_ADD,
+  APPLY_UPDATE,
+  APPLY_BORROW,
+  APPLY_RETURN,
+  APPLY_DELETE,
+  APPLY_COUNT
+};
+
+static const char *const apply_sql[APPLY_COUNT] = {
+    [APPLY_ADD] = "INSERT INTO BOOKS (ID, TITLE, AUTHOR, PUBLISHER, YEAR, "
+                  "ISBN, TITLE_KEY, AUTHOR_KEY) "
+                  "VALUES (?1, ?2, ?3, ?4, ?5, NULLIF(?6, ''), ?9, ?10) "
+                  "ON CONFLICT(ID) DO UPDATE SET TITLE = ?2, AUTHOR = ?3, "
+                  "PUBLISHER = ?4, YEAR = ?5, ISBN = NULLIF(?6, ''), "
+                  "TITLE_KEY = ?9, AUTHOR_KEY = ?10;",
+    [APPLY_UPDATE] = "UPDATE BOOKS SET TITLE = ?2, AUTHOR = ?3, "
+                     "PUBLISHER = ?4, YEAR = ?5, ISBN = NULLIF(?6, ''), "
+                     "TITLE_KEY = ?9, AUTHOR_KEY = ?10 WHERE ID = ?1;",
+    [APPLY_BORROW] = "INSERT INTO LOANS (BOOK_ID, BORROWER_NAME, BORROW_DATE) "
+                     "VALUES (?1, ?7, ?8);",
+    [APPLY_RETURN] = "DELETE FROM LOANS WHERE BOOK_ID = ?1;",
+    [APPLY_DELETE] = "DELETE FROM BOOKS WHERE ID = ?1;",
+};
+
+static int apply_event(sqlite3_stmt **stmts, const ChangeEvent *event) {
+  sqlite3_stmt *stmt = stmts[event->type - CHANGE_ADD_BOOK];
+  const Book *b = &event->book;
+  // Parameters are numbered alike in every statement: 1 to 6 and 9 to 10
+  // for book rows, 7 and 8 for loans
+  sqlite3_bind_int(stmt, 1, b->id);
+  if (event->type == CHANGE_ADD_BOOK || event->type == CHANGE_UPDATE_BOOK) {
+    sqlite3_bind_text(stmt, 2, b->title, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, b->author, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 4, b->publisher, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 5, b->year);
+    sqlite3_bind_text(stmt, 6, b->isbn, -1, SQLITE_STATIC);
+    bind_search_key(stmt, 9, b->title);
+    bind_search_key(stmt, 10, b->author);
+  }
+  if (event->type == CHANGE_BORROW) {
+    sqlite3_bind_text(stmt, 7, b->borrower, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 8, event->time);
+  }
+  int rc = sqlite3_step(stmt);
+  sqlite3_reset(stmt);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+int changelog_replay(sqlite3 *db, const char *path, ReplayReport *report) {
+  memset(report, 0, sizeof(*report));
+  struct timespec started, finished;
+  clock_gettime(CLOCK_MONOTONIC, &started);
+
+  ChangeReader reader;
+  if (changelog_reader_open(&reader, path))
+    return SQLITE_CANTOPEN;
+
+  sqlite3_stmt *stmts[APPLY_COUNT] = {0};
+  int rc = SQLITE_OK;
+  for (int i = 0; rc == SQLITE_OK && i < APPLY_COUNT; i++)
+    rc = sqlite3_prepare_v2(db, apply_sql[i], -1, &stmts[i], 0);
+
+  ChangeEvent event;
+  int result = 0;
+  int in_batch = 0;
+  while (rc == SQLITE_OK && (result = changelog_read(&reader, &event)) == 1) {
+    if (in_batch == 0)
+      rc = sqlite3_exec(db, "BEGIN;", 0, 0, 0);
+    if (rc == SQLITE_OK)
+      rc = apply_event(stmts, &event);
+    report->events++;
+    if (rc == SQLITE_OK && ++in_batch == CHANGELOG_REPLAY_BATCH) {
+      rc = sqlite3_exec(db, "COMMIT;", 0, 0, 0);
+      in_batch = 0;
+    }
+  }
+  if (result < 0)
+    report->bad_records = 1;
+
+  if (in_batch > 0) {
+    if (rc == SQLITE_OK)
+      rc = sqlite3_exec(db, "COMMIT;", 0, 0, 0);
+    else
+      sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+  }
+  if (rc != SQLITE_OK)
+    fprintf(stderr, "Replay failed at event %llu: %s\n", event.seq,
+            sqlite3_errmsg(db));
+
+  for (int i = 0; i < APPLY_COUNT; i++)
+    sqlite3_finalize(stmts[i]);
+  changelog_reader_close(&reader);
+
+  clock_gettime(CLOCK_MONOTONIC, &finished);
+  report->seconds = (finished.tv_sec - started.tv_sec) +
+                    (finished.tv_nsec - started.tv_nsec) / 1e9;
+  return rc;
+}
+
+static int print_difference(void *arg, int columns, char **values,
+                            char **names) {
+  (void)names;
+  int *differences = arg;
+  if (++*differences > CHANGELOG_VERIFY_PRINT)
+    return 0;
+  for (int i = 0; i < columns; i++)
+    printf("%s%s", i ? " | " : "", values[i] ? values[i] : "NULL");
+  printf("\n");
+  return 0;
+}
+
+int changelog_verify(const char *db_path, const char *path,
+                     ReplayReport *report, int *differences) {
+  *differences = 0;
+  sqlite3 *db;
+  int rc = sqlite3_open_v2(":memory:", &db,
+                           SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+                               SQLITE_OPEN_URI,
+                           NULL);
+  if (rc == SQLITE_OK)
+    rc = migrate_database(db);
+  if (rc == SQLITE_OK)
+    rc = changelog_replay(db, path, report);
+
+  // Attached read-only, so verifying never touches the live file
+  char *sql = sqlite3_mprintf("ATTACH 'file:%q?mode=ro' AS live;", db_path);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_exec(db, sql, 0, 0, 0);
+  sqlite3_free(sql);
+
+  static const char *const compare =
+      "SELECT 'log', 'book', * FROM (SELECT ID, TITLE, AUTHOR, PUBLISHER, "
+      "  YEAR, ISBN FROM main.BOOKS EXCEPT SELECT ID, TITLE, AUTHOR, "
+      "  PUBLISHER, YEAR, ISBN FROM live.BOOKS);"
+      "SELECT 'db', 'book', * FROM (SELECT ID, TITLE, AUTHOR, PUBLISHER, "
+      "  YEAR, ISBN FROM live.BOOKS EXCEPT SELECT ID, TITLE, AUTHOR, "
+      "  PUBLISHER, YEAR, ISBN FROM main.BOOKS);"
+      "SELECT 'log', 'loan', * FROM (SELECT BOOK_ID, BORROWER_NAME "
+      "  FROM main.LOANS WHERE RETURN_DATE IS NULL EXCEPT "
+      "  SELECT BOOK_ID, BORROWER_NAME FROM live.LOANS "
+      "  WHERE RETURN_DATE IS NULL);"
+      "SELECT 'db', 'loan', * FROM (SELECT BOOK_ID, BORROWER_NAME "
+      "  FROM live.LOANS WHERE RETURN_DATE IS NULL EXCEPT "
+      "  SELECT BOOK_ID, BORROWER_NAME FROM main.LOANS "
+      "  WHERE RETURN_DATE IS NULL);";
+  if (rc == SQLITE_OK)
+    rc = sqlite3_exec(db, compare, print_difference, differences, 0);
+  if (rc != SQLITE_OK)
+    fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+
+  sqlite3_close(db);
+  return rc;
+}
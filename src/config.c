@@ -0,0 +1,163 @@
+#include "../include/config.h"
+#include "../include/db.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+Config config = {
+    .db_path = DB_FILE,
+    .mmap_size = 0,
+    .cache_size = -2000,
+    .page_size = 4096,
+    .temp_store = "default",
+    .journal_mode = "delete",
+    .synchronous = "full",
+    .busy_timeout = 5000,
+    .backup_dir = "",
+    .backup_interval = 0,
+    .changelog_path = "",
+    .recs_interval = 60,
+    .result_cache_entries = 64,
+    .loan_days = 14,
+};
+
+static char *trim(char *s) {
+  while (isspace((unsigned char)*s))
+    s++;
+  char *end = s + strlen(s);
+  while (end > s && isspace((unsigned char)end[-1]))
+    *--end = '\0';
+  return s;
+}
+
+// Returns 1 if value is one of the NULL terminated choices.
+static int one_of(const char *value, const char *const *choices) {
+  for (int i = 0; choices[i] != NULL; i++) {
+    if (strcasecmp(value, choices[i]) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+static int set_word(char *dest, size_t size, const char *value,
+                    const char *const *choices) {
+  if (!one_of(value, choices))
+    return 1;
+  snprintf(dest, size, "%s", value);
+  return 0;
+}
+
+static int set_option(Config *config, const char *key, const char *value) {
+  static const char *const temp_stores[] = {"default", "file", "memory", NULL};
+  static const char *const journal_modes[] = {
+      "delete", "truncate", "persist", "memory", "wal", "off", NULL};
+  static const char *const sync_modes[] = {"off", "normal", "full", "extra",
+                                           NULL};
+  char *end;
+
+  if (strcmp(key, "db_path") == 0) {
+    snprintf(config->db_path, sizeof(config->db_path), "%s", value);
+  } else if (strcmp(key, "mmap_size") == 0) {
+    config->mmap_size = strtoll(value, &end, 10);
+    return *end != '\0' || config->mmap_size < 0;
+  } else if (strcmp(key, "cache_size") == 0) {
+    config->cache_size = (int)strtol(value, &end, 10);
+    return *end != '\0';
+  } else if (strcmp(key, "page_size") == 0) {
+    config->page_size = (int)strtol(value, &end, 10);
+    // SQLite accepts powers of two between 512 and 65536
+    return *end != '\0' || config->page_size < 512 ||
+           config->page_size > 65536 ||
+           (config->page_size & (config->page_size - 1)) != 0;
+  } else if (strcmp(key, "temp_store") == 0) {
+    return set_word(config->temp_store, sizeof(config->temp_store), value,
+                    temp_stores);
+  } else if (strcmp(key, "journal_mode") == 0) {
+    return set_word(config->journal_mode, sizeof(config->journal_mode), value,
+                    journal_modes);
+  } else if (strcmp(key, "synchronous") == 0) {
+    return set_word(config->synchronous, sizeof(config->synchronous), value,
+                    sync_modes);
+  } else if (strcmp(key, "busy_timeout") == 0) {
+    config->busy_timeout = (int)strtol(value, &end, 10);
+    return *end != '\0';
+  } else if (strcmp(key, "backup_dir") == 0) {
+    snprintf(config->backup_dir, sizeof(config->backup_dir), "%s", value);
+  } else if (strcmp(key, "backup_interval") == 0) {
+    config->backup_interval = (unsigned)strtoul(value, &end, 10);
+    return *end != '\0';
+  } else if (strcmp(key, "recs_interval") == 0) {
+    config->recs_interval = (unsigned)strtoul(value, &end, 10);
+    return *end != '\0';
+  } else if (strcmp(key, "result_cache_entries") == 0) {
+    config->result_cache_entries = (int)strtol(value, &end, 10);
+    return *end != '\0' || config->result_cache_entries < 0;
+  } else if (strcmp(key, "loan_days") == 0) {
+    config->loan_days = (int)strtol(value, &end, 10);
+    return *end != '\0' || config->loan_days <= 0;
+  } else if (strcmp(key, "branch") == 0) {
+    // May be repeated, one line per branch
+    if (config->branch_count == CONFIG_MAX_BRANCHES)
+      return 1;
+    BranchConfig *branch = &config->branches[config->branch_count];
+    char extra;
+    if (sscanf(value, "%d %31s %255s %c", &branch->id, branch->name,
+               branch->path, &extra) != 3 ||
+        branch->id <= 0)
+      return 1;
+    for (int i = 0; i < config->branch_count; i++) {
+      if (config->branches[i].id == branch->id)
+        return 1;
+    }
+    config->branch_count++;
+  } else if (strcmp(key, "changelog_path") == 0) {
+    snprintf(config->changelog_path, sizeof(config->changelog_path), "%s",
+             value);
+  } else {
+    return 1;
+  }
+  return 0;
+}
+
+// Reads "key = value" lines; '#' starts a comment. A missing file is not an
+// error, the defaults are used instead.
+int load_config(const char *path, Config *config) {
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return 0;
+
+  char line[512];
+  int line_no = 0;
+  int errors = 0;
+  while (fgets(line, sizeof(line), f)) {
+    line_no++;
+    char *comment = strchr(line, '#');
+    if (comment)
+      *comment = '\0';
+
+    char *key = trim(line);
+    if (*key == '\0')
+      continue;
+
+    char *eq = strchr(key, '=');
+    if (eq == NULL) {
+      fprintf(stderr, "%s:%d: expected key = value\n", path, line_no);
+      errors++;
+      continue;
+    }
+    *eq = '\0';
+    key = trim(key);
+    char *value = trim(eq + 1);
+
+    if (set_option(config, key, value)) {
+      fprintf(stderr, "%s:%d: invalid setting %s = %s\n", path, line_no, key,
+              value);
+      errors++;
+    }
+  }
+
+  fclose(f);
+  return errors;
+}
@@ -1,20 +1,91 @@
 #include "../include/db.h"
+#include "../include/audit.h"
+#include "../include/changelog.h"
+#include "../include/config.h"
+#include "../include/migrate.h"
+#include "../include/searchkey.h"
 #include <sqlite3.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-int connect_to_database(const char *db_name) {
-  sqlite3 *db;
-  int rc = sqlite3_open(db_name, &db);
+static sqlite3 *shared_db = NULL;
+
+sqlite3 *get_database(void) { return shared_db; }
+
+void close_database(void) {
+  sqlite3_close(shared_db);
+  shared_db = NULL;
+}
+
+// Applies the tuning from the configuration file. page_size has to come first
+// because it only takes effect before the database file is initialised.
+static int apply_pragmas(sqlite3 *db) {
+  char sql[512];
+  snprintf(sql, sizeof(sql),
+           "PRAGMA page_size = %d;"
+           "PRAGMA journal_mode = %s;"
+           "PRAGMA synchronous = %s;"
+           "PRAGMA temp_store = %s;"
+           "PRAGMA cache_size = %d;"
+           "PRAGMA mmap_size = %lld;",
+           config.page_size, config.journal_mode, config.synchronous,
+           config.temp_store, config.cache_size, config.mmap_size);
+
+  sqlite3_busy_timeout(db, config.busy_timeout);
+
+  char *zErrMsg = 0;
+  int rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "SQL error: %s\n", zErrMsg);
+    sqlite3_free(zErrMsg);
+    return rc;
+  }
+  return 0;
+}
+
+// Opens a connection tuned like the shared one, without migrating. Tools
+// that need a connection per thread use this.
+int open_connection(const char *db_name, sqlite3 **db) {
+  int rc = sqlite3_open(db_name, db);
   if (rc) {
-    fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
+    fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(*db));
+    sqlite3_close(*db);
+    *db = NULL;
+    return rc;
+  }
+
+  // A connection without the configured journal mode or synchronous level
+  // would not give the durability the configuration asks for
+  rc = apply_pragmas(*db);
+  if (rc != SQLITE_OK) {
+    sqlite3_close(*db);
+    *db = NULL;
     return rc;
   }
+  // Databases older than migration 14 still have triggers that call it
+  register_search_key_function(*db);
+  return 0;
+}
 
-  create_book_table(db);
-  create_loans_table(db);
+// Opens the shared connection used by every screen. It stays open until
+// close_database is called.
+int connect_to_database(const char *db_name) {
+  if (shared_db != NULL)
+    return 0;
 
-  sqlite3_close(db);
+  sqlite3 *db;
+  int rc = open_connection(db_name, &db);
+  if (rc)
+    return rc;
+
+  rc = migrate_database(db);
+  if (rc != SQLITE_OK) {
+    sqlite3_close(db);
+    return rc;
+  }
+
+  shared_db = db;
   return 0;
 }
 
@@ -53,47 +124,438 @@ int create_loans_table(sqlite3 *db) {
   return 0;
 }
 
+// Returns 1 if the book is missing or already borrowed. The check and the
+// insert share borrow_books' IMMEDIATE transaction, and LOANS_ONE_ACTIVE
+// rejects a second active loan even from writers that skip the check.
 int borrow_book(sqlite3 *db, int book_id, const char *borrower_name) {
-  // Check if the book is already borrowed
-  char sql1[256];
-  snprintf(sql1, sizeof(sql1),
-           "SELECT * FROM LOANS WHERE BOOK_ID = %d AND RETURN_DATE IS NULL;",
-           book_id);
-
-  sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, sql1, -1, &stmt, 0);
-  if (sqlite3_step(stmt) == SQLITE_ROW) {
-    fprintf(stderr, "Book is already borrowed\n");
-    return 1;
-  }
+  LoanStatus status = LOAN_OK;
+  int rc = borrow_books(db, &book_id, 1, borrower_name, &status);
+  return rc == SQLITE_CONSTRAINT ? 1 : rc;
+}
 
-  // Insert the loan record
-  char sql[256];
-  snprintf(sql, sizeof(sql),
-           "INSERT INTO LOANS (BOOK_ID, BORROWER_NAME, BORROW_DATE) "
-           "VALUES (%d, '%s', datetime('now'));",
-           book_id, borrower_name);
+// Returns 1 if the book is missing, not on loan, or on loan to someone other
+// than borrower_name, like borrow_book.
+int return_book(sqlite3 *db, int book_id, const char *borrower_name) {
+  LoanStatus status = LOAN_OK;
+  int rc = return_books(db, &book_id, 1, borrower_name, &status);
+  return rc == SQLITE_CONSTRAINT ? 1 : rc;
+}
 
+static int exec_sql(sqlite3 *db, const char *sql) {
   char *zErrMsg = 0;
   int rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
   if (rc != SQLITE_OK) {
     fprintf(stderr, "SQL error: %s\n", zErrMsg);
     sqlite3_free(zErrMsg);
+  }
+  return rc;
+}
+
+// borrower_name takes the basket out, or when returning limits it to that
+// borrower's loans; NULL returns whoever holds the books
+static int loan_batch(sqlite3 *db, const int *book_ids, int count,
+                      int borrowing, const char *borrower_name,
+                      LoanStatus *statuses) {
+  // IMMEDIATE takes the write lock up front, so no other desk can change
+  // these books between the checks and the writes
+  int rc = exec_sql(db, "BEGIN IMMEDIATE;");
+  if (rc != SQLITE_OK)
     return rc;
+
+  sqlite3_stmt *check = NULL, *write = NULL;
+  rc = sqlite3_prepare_v2(db,
+                          "SELECT ON_LOAN, ?2 IS NOT NULL AND ON_LOAN AND "
+                          "NOT EXISTS (SELECT 1 FROM LOANS WHERE BOOK_ID = ?1 "
+                          "AND RETURN_DATE IS NULL AND BORROWER_NAME = ?2) "
+                          "FROM BOOKS WHERE ID = ?1;",
+                          -1, &check, 0);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_prepare_v2(
+        db,
+        borrowing
+            ? "INSERT INTO LOANS (BOOK_ID, BORROWER_NAME, BORROW_DATE) "
+              "VALUES (?1, ?2, unixepoch());"
+            : "DELETE FROM LOANS WHERE BOOK_ID = ?1;",
+        -1, &write, 0);
+
+  int conflicts = 0;
+  for (int i = 0; rc == SQLITE_OK && i < count; i++) {
+    // ON_LOAN is kept by the LOANS triggers, so it already reflects the
+    // earlier items of this basket, including a repeated id
+    sqlite3_bind_int(check, 1, book_ids[i]);
+    if (!borrowing && borrower_name != NULL)
+      sqlite3_bind_text(check, 2, borrower_name, -1, SQLITE_STATIC);
+    int step = sqlite3_step(check);
+    int on_loan = step == SQLITE_ROW && sqlite3_column_int(check, 0);
+    int other = step == SQLITE_ROW && sqlite3_column_int(check, 1);
+    sqlite3_reset(check);
+
+    if (step != SQLITE_ROW && step != SQLITE_DONE) {
+      rc = step;
+    } else if (step == SQLITE_DONE) {
+      statuses[i] = LOAN_NOT_FOUND;
+    } else if (borrowing && on_loan) {
+      statuses[i] = LOAN_ALREADY_BORROWED;
+    } else if (!borrowing && !on_loan) {
+      statuses[i] = LOAN_NOT_BORROWED;
+    } else if (other) {
+      statuses[i] = LOAN_BORROWED_BY_OTHER;
+    } else {
+      sqlite3_bind_int(write, 1, book_ids[i]);
+      if (borrowing)
+        sqlite3_bind_text(write, 2, borrower_name, -1, SQLITE_STATIC);
+      step = sqlite3_step(write);
+      sqlite3_reset(write);
+      if (step != SQLITE_DONE)
+        rc = step;
+      statuses[i] = LOAN_OK;
+    }
+    if (rc == SQLITE_OK && statuses[i] != LOAN_OK)
+      conflicts++;
   }
-  return 0;
+  sqlite3_finalize(check);
+  sqlite3_finalize(write);
+
+  if (rc == SQLITE_OK && conflicts == 0) {
+    rc = exec_sql(db, "COMMIT;");
+    if (rc == SQLITE_OK) {
+      // Logged only once the basket is durable in the database
+      for (int i = 0; i < count; i++)
+        changelog_loan(borrowing ? CHANGE_BORROW : CHANGE_RETURN, book_ids[i],
+                       borrowing ? borrower_name : NULL);
+      return SQLITE_OK;
+    }
+  }
+  exec_sql(db, "ROLLBACK;");
+  return rc == SQLITE_OK ? SQLITE_CONSTRAINT : rc;
 }
 
-int return_book(sqlite3 *db, int loan_id) {
-  char sql[256];
-  snprintf(sql, sizeof(sql), "DELETE FROM LOANS WHERE BOOK_ID = %d;", loan_id);
+int borrow_books(sqlite3 *db, const int *book_ids, int count,
+                 const char *borrower_name, LoanStatus *statuses) {
+  return loan_batch(db, book_ids, count, 1, borrower_name, statuses);
+}
 
-  char *zErrMsg = 0;
-  int rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
+int return_books(sqlite3 *db, const int *book_ids, int count,
+                 const char *borrower_name, LoanStatus *statuses) {
+  return loan_batch(db, book_ids, count, 0, borrower_name, statuses);
+}
+
+static void copy_column(char *dest, size_t size, sqlite3_stmt *stmt, int col);
+
+int count_loans_between(sqlite3 *db, long long from, long long to,
+                        int *count) {
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(
+      db,
+      "SELECT COUNT(*) FROM LOANS WHERE BORROW_DATE >= ? "
+      "AND BORROW_DATE < ? AND RETURN_DATE IS NULL;",
+      -1, &stmt, 0);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  sqlite3_bind_int64(stmt, 1, from);
+  sqlite3_bind_int64(stmt, 2, to);
+  rc = sqlite3_step(stmt);
+  *count = rc == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : 0;
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_ROW ? SQLITE_OK : rc;
+}
+
+int list_overdue_loans(sqlite3 *db, long long borrowed_before, LoanRow *out,
+                       int max, int *total) {
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(
+      db,
+      "SELECT LOANS.BOOK_ID, COALESCE(BOOKS.TITLE, ''), LOANS.BORROWER_NAME, "
+      "LOANS.BORROW_DATE, COUNT(*) OVER () FROM LOANS "
+      "LEFT JOIN BOOKS ON BOOKS.ID = LOANS.BOOK_ID "
+      "WHERE LOANS.BORROW_DATE < ? AND LOANS.RETURN_DATE IS NULL "
+      "ORDER BY LOANS.BORROW_DATE LIMIT ?;",
+      -1, &stmt, 0);
   if (rc != SQLITE_OK) {
-    fprintf(stderr, "SQL error: %s\n", zErrMsg);
-    sqlite3_free(zErrMsg);
+    fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+
+  sqlite3_bind_int64(stmt, 1, borrowed_before);
+  sqlite3_bind_int(stmt, 2, max);
+  int count = 0;
+  *total = 0;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    LoanRow *row = &out[count++];
+    row->book_id = sqlite3_column_int(stmt, 0);
+    copy_column(row->title, sizeof(row->title), stmt, 1);
+    copy_column(row->borrower, sizeof(row->borrower), stmt, 2);
+    row->borrowed_at = sqlite3_column_int64(stmt, 3);
+    *total = sqlite3_column_int(stmt, 4);
+  }
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_DONE ? count : -1;
+}
+
+typedef struct {
+  const char *name;
+  const char *key;   // row value compared against the previous page
+  const char *order; // ascending ORDER BY; descending flips every column
+  const char *order_desc;
+} SortSpec;
+
+static const SortSpec sort_specs[SORT_KEY_COUNT] = {
+    [SORT_BY_ID] = {"ID", "(BOOKS.ID)", "BOOKS.ID", "BOOKS.ID DESC"},
+    [SORT_BY_TITLE] = {"Title", "(BOOKS.TITLE, BOOKS.ID)",
+                       "BOOKS.TITLE, BOOKS.ID",
+                       "BOOKS.TITLE DESC, BOOKS.ID DESC"},
+    [SORT_BY_AUTHOR] = {"Author", "(BOOKS.AUTHOR, BOOKS.ID)",
+                        "BOOKS.AUTHOR, BOOKS.ID",
+                        "BOOKS.AUTHOR DESC, BOOKS.ID DESC"},
+    [SORT_BY_YEAR] = {"Year", "(BOOKS.YEAR, BOOKS.ID)", "BOOKS.YEAR, BOOKS.ID",
+                      "BOOKS.YEAR DESC, BOOKS.ID DESC"},
+    [SORT_BY_AVAILABILITY] = {"Availability",
+                              "(BOOKS.ON_LOAN, BOOKS.TITLE, BOOKS.ID)",
+                              "BOOKS.ON_LOAN, BOOKS.TITLE, BOOKS.ID",
+                              "BOOKS.ON_LOAN DESC, BOOKS.TITLE DESC, "
+                              "BOOKS.ID DESC"},
+};
+
+const char *sort_key_name(SortKey key) { return sort_specs[key].name; }
+
+// A text key goes in as IFNULL((SELECT column WHERE ID = ?), ?). A value
+// that filled its Book field may have been cut short, so the ID is bound and
+// the whole column is read back; otherwise the ID is 0 and the bound text,
+// which is then exact, is used. It is also the fallback for a deleted row.
+static void bind_text_key(sqlite3_stmt *stmt, int *param, const Book *after,
+                          const char *text, size_t size) {
+  int cut = strlen(text) + 1 >= size;
+  sqlite3_bind_int(stmt, (*param)++, cut ? after->id : 0);
+  sqlite3_bind_text(stmt, (*param)++, text, -1, SQLITE_STATIC);
+}
+
+static void bind_sort_key(sqlite3_stmt *stmt, int *param, SortKey key,
+                          const Book *after) {
+  switch (key) {
+  case SORT_BY_TITLE:
+    bind_text_key(stmt, param, after, after->title, sizeof(after->title));
+    break;
+  case SORT_BY_AUTHOR:
+    bind_text_key(stmt, param, after, after->author, sizeof(after->author));
+    break;
+  case SORT_BY_YEAR:
+    sqlite3_bind_int(stmt, (*param)++, after->year);
+    break;
+  case SORT_BY_AVAILABILITY:
+    sqlite3_bind_int(stmt, (*param)++, after->borrower[0] != '\0');
+    bind_text_key(stmt, param, after, after->title, sizeof(after->title));
+    break;
+  default:
+    break;
+  }
+  sqlite3_bind_int(stmt, (*param)++, after->id);
+}
+
+int list_books_page(sqlite3 *db, const ListQuery *query, const Book *after,
+                    BookList *page) {
+  const SortSpec *spec = &sort_specs[query->sort];
+  static const char *const placeholders[SORT_KEY_COUNT] = {
+      [SORT_BY_ID] = "(?)",
+      [SORT_BY_TITLE] =
+          "(IFNULL((SELECT TITLE FROM BOOKS WHERE ID = ?), ?), ?)",
+      [SORT_BY_AUTHOR] =
+          "(IFNULL((SELECT AUTHOR FROM BOOKS WHERE ID = ?), ?), ?)",
+      [SORT_BY_YEAR] = "(?, ?)",
+      [SORT_BY_AVAILABILITY] =
+          "(?, IFNULL((SELECT TITLE FROM BOOKS WHERE ID = ?), ?), ?)",
+  };
+
+  // Only fixed fragments go into the SQL; every value is bound
+  char sql[1024];
+  int len = snprintf(
+      sql, sizeof(sql),
+      "SELECT BOOKS.ID, BOOKS.TITLE, BOOKS.AUTHOR, BOOKS.PUBLISHER, "
+      "BOOKS.YEAR, LOANS.BORROWER_NAME "
+      "FROM BOOKS "
+      "LEFT JOIN LOANS ON BOOKS.ID = LOANS.BOOK_ID AND LOANS.RETURN_DATE IS "
+      "NULL WHERE 1");
+  // BOOKS_BY_AVAILABILITY is ordered by title within ON_LOAN, so only the
+  // title and availability sorts may use it; the others keep their own index
+  // and test ON_LOAN row by row rather than sorting in a temp B-tree
+  if (query->available_only)
+    len += snprintf(sql + len, sizeof(sql) - len, " AND %sBOOKS.ON_LOAN = 0",
+                    query->sort == SORT_BY_TITLE ||
+                            query->sort == SORT_BY_AVAILABILITY
+                        ? ""
+                        : "+");
+  // The unary plus keeps a year range from pulling the planner onto
+  // BOOKS_BY_YEAR (and a sort step) unless the list is sorted by year
+  const char *year = query->sort == SORT_BY_YEAR ? "BOOKS.YEAR" : "+BOOKS.YEAR";
+  if (query->year_from)
+    len += snprintf(sql + len, sizeof(sql) - len, " AND %s >= ?", year);
+  if (query->year_to)
+    len += snprintf(sql + len, sizeof(sql) - len, " AND %s <= ?", year);
+  if (after != NULL)
+    len += snprintf(sql + len, sizeof(sql) - len, " AND %s %c %s", spec->key,
+                    query->descending ? '<' : '>', placeholders[query->sort]);
+  snprintf(sql + len, sizeof(sql) - len, " ORDER BY %s LIMIT ?;",
+           query->descending ? spec->order_desc : spec->order);
+
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  int param = 1;
+  if (query->year_from)
+    sqlite3_bind_int(stmt, param++, query->year_from);
+  if (query->year_to)
+    sqlite3_bind_int(stmt, param++, query->year_to);
+  if (after != NULL)
+    bind_sort_key(stmt, &param, query->sort, after);
+  sqlite3_bind_int(stmt, param, query->page_size);
+
+  rc = collect_books(stmt, page);
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+int insert_book(sqlite3 *db, const Book *book) {
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(
+      db,
+      "INSERT INTO BOOKS (TITLE, AUTHOR, PUBLISHER, YEAR, ISBN, TITLE_KEY, "
+      "AUTHOR_KEY) VALUES (?, ?, ?, ?, NULLIF(?, ''), ?, ?);",
+      -1, &stmt, 0);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  sqlite3_bind_text(stmt, 1, book->title, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, book->author, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 3, book->publisher, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, 4, book->year);
+  sqlite3_bind_text(stmt, 5, book->isbn, -1, SQLITE_STATIC);
+  bind_search_key(stmt, 6, book->title);
+  bind_search_key(stmt, 7, book->author);
+
+  rc = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE)
+    return rc;
+
+  Book added = *book;
+  added.id = (int)sqlite3_last_insert_rowid(db);
+  changelog_book(CHANGE_ADD_BOOK, &added);
+  return SQLITE_OK;
+}
+
+int update_book_fields(sqlite3 *db, const Book *book, const char *editor) {
+  // The row before the change, for the audit trail
+  sqlite3_stmt *stmt;
+  int rc = exec_sql(db, "BEGIN IMMEDIATE;");
+  if (rc != SQLITE_OK)
     return rc;
+  BookList before = {0};
+  rc = sqlite3_prepare_v2(db,
+                          "SELECT ID, TITLE, AUTHOR, PUBLISHER, YEAR, '', "
+                          "ISBN FROM BOOKS WHERE ID = ?;",
+                          -1, &stmt, 0);
+  if (rc == SQLITE_OK) {
+    sqlite3_bind_int(stmt, 1, book->id);
+    rc = collect_books(stmt, &before);
+    sqlite3_finalize(stmt);
   }
-  return 0;
+
+  if (rc == SQLITE_OK)
+    rc = sqlite3_prepare_v2(db,
+                            "UPDATE BOOKS SET "
+                            "TITLE = COALESCE(NULLIF(?1, ''), TITLE), "
+                            "AUTHOR = COALESCE(NULLIF(?2, ''), AUTHOR), "
+                            "PUBLISHER = COALESCE(NULLIF(?3, ''), PUBLISHER), "
+                            "YEAR = CASE WHEN ?4 = 0 THEN YEAR ELSE ?4 END, "
+                            "ISBN = COALESCE(NULLIF(?6, ''), ISBN), "
+                            "TITLE_KEY = COALESCE(NULLIF(?7, ''), TITLE_KEY), "
+                            "AUTHOR_KEY = COALESCE(NULLIF(?8, ''), "
+                            "AUTHOR_KEY) "
+                            "WHERE ID = ?5 "
+                            "RETURNING ID, TITLE, AUTHOR, PUBLISHER, YEAR, "
+                            "'', ISBN;",
+                            -1, &stmt, 0);
+  // The log gets the row as stored, with the kept fields filled in
+  BookList updated = {0};
+  if (rc == SQLITE_OK) {
+    sqlite3_bind_text(stmt, 1, book->title, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, book->author, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, book->publisher, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 4, book->year);
+    sqlite3_bind_int(stmt, 5, book->id);
+    sqlite3_bind_text(stmt, 6, book->isbn, -1, SQLITE_STATIC);
+    bind_search_key(stmt, 7, book->title);
+    bind_search_key(stmt, 8, book->author);
+    rc = collect_books(stmt, &updated);
+    sqlite3_finalize(stmt);
+  }
+
+  // The diff commits or rolls back with the update itself
+  sqlite3_int64 edit_id;
+  if (rc == SQLITE_OK && before.count > 0 && updated.count > 0)
+    rc = record_book_edit(db, &before.items[0], &updated.items[0], editor,
+                          &edit_id);
+  if (rc == SQLITE_OK)
+    rc = exec_sql(db, "COMMIT;");
+  if (rc != SQLITE_OK)
+    sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+  else if (updated.count > 0)
+    changelog_book(CHANGE_UPDATE_BOOK, &updated.items[0]);
+  free_book_list(&before);
+  free_book_list(&updated);
+  return rc;
+}
+
+int book_exists(sqlite3 *db, int book_id, int *found) {
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(db, "SELECT 1 FROM BOOKS WHERE ID = ?;", -1,
+                              &stmt, 0);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  sqlite3_bind_int(stmt, 1, book_id);
+  rc = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  *found = rc == SQLITE_ROW;
+  return rc == SQLITE_ROW || rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+static void copy_column(char *dest, size_t size, sqlite3_stmt *stmt, int col) {
+  const unsigned char *text = sqlite3_column_text(stmt, col);
+  snprintf(dest, size, "%s", text != NULL ? (const char *)text : "");
+}
+
+int collect_books(sqlite3_stmt *stmt, BookList *list) {
+  int rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    if (list->count == list->capacity) {
+      int capacity = list->capacity ? list->capacity * 2 : 64;
+      Book *items = realloc(list->items, capacity * sizeof(Book));
+      if (items == NULL)
+        return SQLITE_NOMEM;
+      list->items = items;
+      list->capacity = capacity;
+    }
+
+    Book *book = &list->items[list->count++];
+    book->id = sqlite3_column_int(stmt, 0);
+    copy_column(book->title, sizeof(book->title), stmt, 1);
+    copy_column(book->author, sizeof(book->author), stmt, 2);
+    copy_column(book->publisher, sizeof(book->publisher), stmt, 3);
+    book->year = sqlite3_column_int(stmt, 4);
+    copy_column(book->borrower, sizeof(book->borrower), stmt, 5);
+    // The list pages leave ISBN out so they stay on their covering indexes
+    if (sqlite3_column_count(stmt) > 6)
+      copy_column(book->isbn, sizeof(book->isbn), stmt, 6);
+    else
+      book->isbn[0] = '\0';
+  }
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+void free_book_list(BookList *list) {
+  free(list->items);
+  memset(list, 0, sizeof(*list));
 }
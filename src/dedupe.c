@@ -0,0 +1,657 @@
+#include "../include/dedupe.h"
+#include "../include/changelog.h"
+#include "../include/fuzzy.h"
+#include "../include/searchkey.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEDUPE_HASHES (DEDUPE_BANDS * DEDUPE_BAND_ROWS)
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int exec_sql(sqlite3 *db, const char *sql) {
+  char *zErrMsg = 0;
+  int rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "SQL error: %s\n", zErrMsg);
+    sqlite3_free(zErrMsg);
+  }
+  return rc;
+}
+
+// One book, normalized. The strings live in Catalog.text.
+typedef struct {
+  int id;
+  int year;
+  uint32_t title;
+  uint32_t author;
+  uint32_t publisher;
+  uint8_t title_len;
+  uint8_t author_len;
+  uint8_t publisher_len;
+  uint64_t isbn; // FNV-1a of the ISBN, 0 when unknown
+} Record;
+
+typedef struct {
+  int keep_id;
+  int duplicate_id;
+  int similarity;
+} Suggestion;
+
+typedef struct {
+  Record *records;
+  int count;
+  int capacity;
+  char *text;
+  size_t text_size;
+  size_t text_capacity;
+  uint32_t *bands; // DEDUPE_BANDS bucket keys per record
+  int threshold;
+  pthread_mutex_t lock; // guards everything below
+  int next;             // first record (or band) not claimed yet
+  Suggestion *found;
+  int found_count;
+  int found_capacity;
+  long long pairs;
+  int skipped;
+} Catalog;
+
+static uint64_t hash_a[DEDUPE_HASHES];
+static uint64_t hash_b[DEDUPE_HASHES];
+
+static uint64_t fnv1a(const void *data, int len) {
+  uint64_t hash = 14695981039346656037ull;
+  for (const unsigned char *p = data; len-- > 0; p++)
+    hash = (hash ^ *p) * 1099511628211ull;
+  return hash;
+}
+
+// Multiply-shift hash functions, the same on every run
+static void init_hashes(void) {
+  uint64_t state = 0x9e3779b97f4a7c15ull;
+  for (int k = 0; k < DEDUPE_HASHES; k++) {
+    for (int half = 0; half < 2; half++) {
+      uint64_t z = (state += 0x9e3779b97f4a7c15ull); // splitmix64
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+      z ^= z >> 31;
+      if (half == 0)
+        hash_a[k] = z | 1;
+      else
+        hash_b[k] = z;
+    }
+  }
+}
+
+static int compare_words(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Folded, punctuation-free text; with sort_words also in word order
+static int normalize(const char *text, int sort_words, char *out) {
+  char folded[SEARCH_KEY_MAX];
+  fold_search_key(text, folded, sizeof(folded));
+  int len = fuzzy_normalize(folded, out, DEDUPE_FIELD_MAX);
+  if (!sort_words || len == 0)
+    return len;
+
+  char *words[DEDUPE_FIELD_MAX];
+  int count = 0;
+  for (char *word = strtok(out, " "); word != NULL; word = strtok(NULL, " "))
+    words[count++] = word;
+  qsort(words, count, sizeof(char *), compare_words);
+  char sorted[DEDUPE_FIELD_MAX];
+  int used = 0;
+  for (int i = 0; i < count; i++)
+    used += snprintf(sorted + used, sizeof(sorted) - used, "%s%s",
+                     i > 0 ? " " : "", words[i]);
+  memcpy(out, sorted, used + 1);
+  return used;
+}
+
+static int append_text(Catalog *catalog, const char *text, int len,
+                       uint32_t *offset) {
+  if (catalog->text_size + len > UINT32_MAX)
+    return SQLITE_TOOBIG;
+  if (catalog->text_size + len > catalog->text_capacity) {
+    size_t capacity =
+        catalog->text_capacity ? catalog->text_capacity * 2 : 1 << 20;
+    char *text = realloc(catalog->text, capacity);
+    if (text == NULL)
+      return SQLITE_NOMEM;
+    catalog->text = text;
+    catalog->text_capacity = capacity;
+  }
+  memcpy(catalog->text + catalog->text_size, text, len);
+  *offset = (uint32_t)catalog->text_size;
+  catalog->text_size += len;
+  return SQLITE_OK;
+}
+
+static const char *column_text(sqlite3_stmt *stmt, int column) {
+  const char *text = (const char *)sqlite3_column_text(stmt, column);
+  return text != NULL ? text : "";
+}
+
+// Reads and normalizes every book. Normalizing here, on one thread, keeps
+// strtok and the SQLite cursor off the worker threads.
+static int load_records(sqlite3 *db, Catalog *catalog) {
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(
+      db, "SELECT ID, TITLE, AUTHOR, PUBLISHER, YEAR, ISBN FROM BOOKS;", -1,
+      &stmt, 0);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    if (catalog->count == catalog->capacity) {
+      int capacity = catalog->capacity ? catalog->capacity * 2 : 4096;
+      Record *records =
+          realloc(catalog->records, capacity * sizeof(Record));
+      if (records == NULL) {
+        rc = SQLITE_NOMEM;
+        break;
+      }
+      catalog->records = records;
+      catalog->capacity = capacity;
+    }
+    Record *record = &catalog->records[catalog->count];
+    char title[DEDUPE_FIELD_MAX], author[DEDUPE_FIELD_MAX],
+        publisher[DEDUPE_FIELD_MAX];
+    record->id = sqlite3_column_int(stmt, 0);
+    record->title_len = normalize(column_text(stmt, 1), 0, title);
+    record->author_len = normalize(column_text(stmt, 2), 1, author);
+    record->publisher_len = normalize(column_text(stmt, 3), 0, publisher);
+    record->year = sqlite3_column_int(stmt, 4);
+    const char *isbn = column_text(stmt, 5);
+    record->isbn = isbn[0] != '\0' ? fnv1a(isbn, strlen(isbn)) : 0;
+    rc = append_text(catalog, title, record->title_len, &record->title);
+    if (rc == SQLITE_OK)
+      rc = append_text(catalog, author, record->author_len, &record->author);
+    if (rc == SQLITE_OK)
+      rc = append_text(catalog, publisher, record->publisher_len,
+                       &record->publisher);
+    if (rc != SQLITE_OK)
+      break;
+    catalog->count++;
+  }
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+// MinHash of the title's shingles, folded into one bucket key per band
+static void sign_record(const Catalog *catalog, const Record *record,
+                        uint32_t *keys) {
+  uint32_t mins[DEDUPE_HASHES];
+  memset(mins, 0xff, sizeof(mins));
+  const char *title = catalog->text + record->title;
+  int len = record->title_len;
+  int width = len < DEDUPE_SHINGLE ? len : DEDUPE_SHINGLE;
+  for (int s = 0; s + width <= len && (s == 0 || width == DEDUPE_SHINGLE);
+       s++) {
+    uint64_t shingle = fnv1a(title + s, width) >> 32;
+    for (int k = 0; k < DEDUPE_HASHES; k++) {
+      uint32_t value = (uint32_t)((shingle * hash_a[k] + hash_b[k]) >> 32);
+      if (value < mins[k])
+        mins[k] = value;
+    }
+  }
+  for (int band = 0; band < DEDUPE_BANDS; band++)
+    keys[band] = (uint32_t)fnv1a(&mins[band * DEDUPE_BAND_ROWS],
+                                 DEDUPE_BAND_ROWS * sizeof(uint32_t));
+}
+
+static void *sign_main(void *arg) {
+  Catalog *catalog = arg;
+  while (1) {
+    pthread_mutex_lock(&catalog->lock);
+    int first = catalog->next;
+    catalog->next += DEDUPE_CHUNK;
+    pthread_mutex_unlock(&catalog->lock);
+    if (first >= catalog->count)
+      break;
+    int last = first + DEDUPE_CHUNK < catalog->count ? first + DEDUPE_CHUNK
+                                                     : catalog->count;
+    for (int i = first; i < last; i++)
+      sign_record(catalog, &catalog->records[i],
+                  &catalog->bands[(size_t)i * DEDUPE_BANDS]);
+  }
+  return NULL;
+}
+
+static int edit_distance(const char *a, int la, const char *b, int lb) {
+  int row[DEDUPE_FIELD_MAX + 1];
+  for (int j = 0; j <= lb; j++)
+    row[j] = j;
+  for (int i = 1; i <= la; i++) {
+    int diagonal = row[0];
+    row[0] = i;
+    for (int j = 1; j <= lb; j++) {
+      int above = row[j];
+      int best = diagonal + (a[i - 1] != b[j - 1]);
+      if (above + 1 < best)
+        best = above + 1;
+      if (row[j - 1] + 1 < best)
+        best = row[j - 1] + 1;
+      row[j] = best;
+      diagonal = above;
+    }
+  }
+  return row[lb];
+}
+
+// Percent alike; 0 as soon as the lengths alone rule out threshold
+static int similarity(const char *a, int la, const char *b, int lb,
+                      int threshold) {
+  int longest = la > lb ? la : lb;
+  if (longest == 0)
+    return 100;
+  if (abs(la - lb) * 100 > longest * (100 - threshold))
+    return 0;
+  return 100 - edit_distance(a, la, b, lb) * 100 / longest;
+}
+
+// Returns the pair's score, or 0 when it is not a duplicate
+static int compare_records(const Catalog *catalog, const Record *x,
+                           const Record *y) {
+  if (x->year != 0 && y->year != 0 && x->year != y->year)
+    return 0;
+  if (x->isbn != 0 && y->isbn != 0 && x->isbn != y->isbn)
+    return 0;
+  if (x->title_len == 0 || y->title_len == 0)
+    return 0;
+
+  const char *text = catalog->text;
+  int threshold = catalog->threshold;
+  int title = similarity(text + x->title, x->title_len, text + y->title,
+                         y->title_len, threshold);
+  if (title < threshold)
+    return 0;
+  int author = similarity(text + x->author, x->author_len, text + y->author,
+                          y->author_len, threshold);
+  if (author < threshold)
+    return 0;
+  // The publisher only ranks suggestions; reprints change it
+  int publisher = similarity(text + x->publisher, x->publisher_len,
+                             text + y->publisher, y->publisher_len, 0);
+  return (2 * title + 2 * author + publisher) / 5;
+}
+
+typedef struct {
+  uint32_t key;
+  int record;
+} BucketEntry;
+
+static int compare_entries(const void *a, const void *b) {
+  const BucketEntry *x = a, *y = b;
+  if (x->key != y->key)
+    return x->key < y->key ? -1 : 1;
+  return (x->record > y->record) - (x->record < y->record);
+}
+
+static int push_suggestion(Suggestion **items, int *count, int *capacity,
+                           Suggestion suggestion) {
+  if (*count == *capacity) {
+    int more = *capacity ? *capacity * 2 : 256;
+    Suggestion *grown = realloc(*items, more * sizeof(Suggestion));
+    if (grown == NULL)
+      return SQLITE_NOMEM;
+    *items = grown;
+    *capacity = more;
+  }
+  (*items)[(*count)++] = suggestion;
+  return SQLITE_OK;
+}
+
+// Buckets every record by one band's key and compares the records that
+// share a bucket. A pair that also shares an earlier band was compared
+// there, so each pair is compared once without a set of seen pairs.
+static int compare_band(Catalog *catalog, int band, BucketEntry *entries) {
+  for (int i = 0; i < catalog->count; i++) {
+    entries[i].key = catalog->bands[(size_t)i * DEDUPE_BANDS + band];
+    entries[i].record = i;
+  }
+  qsort(entries, catalog->count, sizeof(BucketEntry), compare_entries);
+
+  Suggestion *found = NULL;
+  int count = 0, capacity = 0, skipped = 0;
+  long long pairs = 0;
+  int rc = SQLITE_OK;
+  for (int start = 0; rc == SQLITE_OK && start < catalog->count;) {
+    int end = start + 1;
+    while (end < catalog->count && entries[end].key == entries[start].key)
+      end++;
+    if (end - start > DEDUPE_MAX_BUCKET) {
+      skipped++;
+      start = end;
+      continue;
+    }
+
+    for (int i = start; rc == SQLITE_OK && i < end; i++) {
+      const uint32_t *x_keys =
+          &catalog->bands[(size_t)entries[i].record * DEDUPE_BANDS];
+      for (int j = i + 1; rc == SQLITE_OK && j < end; j++) {
+        const uint32_t *y_keys =
+            &catalog->bands[(size_t)entries[j].record * DEDUPE_BANDS];
+        int earlier = 0;
+        while (earlier < band && x_keys[earlier] != y_keys[earlier])
+          earlier++;
+        if (earlier < band)
+          continue;
+
+        const Record *x = &catalog->records[entries[i].record];
+        const Record *y = &catalog->records[entries[j].record];
+        pairs++;
+        int score = compare_records(catalog, x, y);
+        if (score == 0)
+          continue;
+        Suggestion suggestion = {x->id < y->id ? x->id : y->id,
+                                 x->id < y->id ? y->id : x->id, score};
+        rc = push_suggestion(&found, &count, &capacity, suggestion);
+      }
+    }
+    start = end;
+  }
+
+  pthread_mutex_lock(&catalog->lock);
+  for (int i = 0; rc == SQLITE_OK && i < count; i++)
+    rc = push_suggestion(&catalog->found, &catalog->found_count,
+                         &catalog->found_capacity, found[i]);
+  catalog->pairs += pairs;
+  catalog->skipped += skipped;
+  pthread_mutex_unlock(&catalog->lock);
+  free(found);
+  return rc;
+}
+
+static void *compare_main(void *arg) {
+  Catalog *catalog = arg;
+  BucketEntry *entries =
+      malloc((catalog->count > 0 ? catalog->count : 1) * sizeof(BucketEntry));
+  if (entries == NULL)
+    return (void *)1;
+
+  int rc = SQLITE_OK;
+  while (rc == SQLITE_OK) {
+    pthread_mutex_lock(&catalog->lock);
+    int band = catalog->next++;
+    pthread_mutex_unlock(&catalog->lock);
+    if (band >= DEDUPE_BANDS)
+      break;
+    rc = compare_band(catalog, band, entries);
+  }
+  free(entries);
+  return rc == SQLITE_OK ? NULL : (void *)1;
+}
+
+// Runs worker on the calling thread and threads - 1 more, all claiming work
+// through catalog->next.
+static int run_workers(Catalog *catalog, void *(*worker)(void *),
+                       int threads) {
+  pthread_t ids[DEDUPE_MAX_THREADS];
+  int started = 0;
+  int failed = 0;
+  catalog->next = 0;
+  for (int i = 1; i < threads; i++) {
+    if (pthread_create(&ids[started], NULL, worker, catalog) == 0)
+      started++;
+  }
+  failed |= worker(catalog) != NULL;
+  for (int i = 0; i < started; i++) {
+    void *result;
+    pthread_join(ids[i], &result);
+    failed |= result != NULL;
+  }
+  return failed ? SQLITE_NOMEM : SQLITE_OK;
+}
+
+static int write_suggestions(sqlite3 *db, const Catalog *catalog) {
+  int rc = exec_sql(db, "BEGIN IMMEDIATE;");
+  if (rc != SQLITE_OK)
+    return rc;
+
+  sqlite3_stmt *insert = NULL;
+  rc = exec_sql(db, "DELETE FROM BOOK_DUPLICATES;");
+  if (rc == SQLITE_OK)
+    rc = sqlite3_prepare_v2(db,
+                            "INSERT OR IGNORE INTO BOOK_DUPLICATES "
+                            "(BOOK_ID, DUPLICATE_ID, SIMILARITY) "
+                            "VALUES (?, ?, ?);",
+                            -1, &insert, 0);
+  for (int i = 0; rc == SQLITE_OK && i < catalog->found_count; i++) {
+    const Suggestion *suggestion = &catalog->found[i];
+    sqlite3_bind_int(insert, 1, suggestion->keep_id);
+    sqlite3_bind_int(insert, 2, suggestion->duplicate_id);
+    sqlite3_bind_int(insert, 3, suggestion->similarity);
+    rc = sqlite3_step(insert) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode(db);
+    sqlite3_reset(insert);
+  }
+  sqlite3_finalize(insert);
+
+  if (rc == SQLITE_OK)
+    rc = exec_sql(db, "COMMIT;");
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+    sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+  }
+  return rc;
+}
+
+int find_duplicates(sqlite3 *db, int threshold, DedupeReport *report) {
+  memset(report, 0, sizeof(*report));
+  Catalog catalog;
+  memset(&catalog, 0, sizeof(catalog));
+  catalog.threshold = threshold;
+  pthread_mutex_init(&catalog.lock, NULL);
+  init_hashes();
+
+  double started = now_seconds();
+  int rc = load_records(db, &catalog);
+  report->load_seconds = now_seconds() - started;
+  report->books = catalog.count;
+
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = cores > 0 ? (int)cores : 1;
+  if (threads > DEDUPE_MAX_THREADS)
+    threads = DEDUPE_MAX_THREADS;
+  report->threads = threads;
+
+  started = now_seconds();
+  if (rc == SQLITE_OK) {
+    catalog.bands =
+        malloc(((size_t)catalog.count * DEDUPE_BANDS + 1) * sizeof(uint32_t));
+    rc = catalog.bands != NULL ? run_workers(&catalog, sign_main, threads)
+                               : SQLITE_NOMEM;
+  }
+  report->block_seconds = now_seconds() - started;
+
+  // One band per thread, so more threads than bands would only idle
+  started = now_seconds();
+  if (rc == SQLITE_OK)
+    rc = run_workers(&catalog, compare_main,
+                     threads < DEDUPE_BANDS ? threads : DEDUPE_BANDS);
+  report->compare_seconds = now_seconds() - started;
+  report->pairs = catalog.pairs;
+  report->skipped = catalog.skipped;
+
+  started = now_seconds();
+  if (rc == SQLITE_OK)
+    rc = write_suggestions(db, &catalog);
+  report->write_seconds = now_seconds() - started;
+  report->suggestions = catalog.found_count;
+
+  free(catalog.records);
+  free(catalog.text);
+  free(catalog.bands);
+  free(catalog.found);
+  pthread_mutex_destroy(&catalog.lock);
+  return rc;
+}
+
+int list_duplicates(sqlite3 *db, DuplicateRow *out, int max, int *total) {
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(
+      db,
+      "SELECT d.BOOK_ID, d.DUPLICATE_ID, d.SIMILARITY, k.TITLE, k.AUTHOR, "
+      "b.TITLE, b.AUTHOR, COUNT(*) OVER () FROM BOOK_DUPLICATES d "
+      "JOIN BOOKS k ON k.ID = d.BOOK_ID JOIN BOOKS b ON b.ID = d.DUPLICATE_ID "
+      "ORDER BY d.SIMILARITY DESC, d.BOOK_ID, d.DUPLICATE_ID LIMIT ?;",
+      -1, &stmt, 0);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+
+  sqlite3_bind_int(stmt, 1, max);
+  int count = 0;
+  *total = 0;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    DuplicateRow *row = &out[count++];
+    row->keep_id = sqlite3_column_int(stmt, 0);
+    row->duplicate_id = sqlite3_column_int(stmt, 1);
+    row->similarity = sqlite3_column_int(stmt, 2);
+    snprintf(row->keep_title, sizeof(row->keep_title), "%s",
+             column_text(stmt, 3));
+    snprintf(row->keep_author, sizeof(row->keep_author), "%s",
+             column_text(stmt, 4));
+    snprintf(row->duplicate_title, sizeof(row->duplicate_title), "%s",
+             column_text(stmt, 5));
+    snprintf(row->duplicate_author, sizeof(row->duplicate_author), "%s",
+             column_text(stmt, 6));
+    *total = sqlite3_column_int(stmt, 7);
+  }
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_DONE ? count : -1;
+}
+
+// Runs one statement with ?1 = keep_id and ?2 = duplicate_id. Returns the
+// first column of the first row in value, if there is one.
+static int run_merge_step(sqlite3 *db, const char *sql, int keep_id,
+                          int duplicate_id, int *value) {
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+  sqlite3_bind_int(stmt, 1, keep_id);
+  sqlite3_bind_int(stmt, 2, duplicate_id);
+  rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW && value != NULL)
+    *value = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_ROW || rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+// Reads the row of book_id as it is now, for the change log
+static int read_book(sqlite3 *db, int book_id, Book *book) {
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(
+      db,
+      "SELECT BOOKS.ID, TITLE, AUTHOR, PUBLISHER, YEAR, "
+      "COALESCE(LOANS.BORROWER_NAME, ''), ISBN FROM BOOKS "
+      "LEFT JOIN LOANS ON BOOKS.ID = LOANS.BOOK_ID AND LOANS.RETURN_DATE IS "
+      "NULL WHERE BOOKS.ID = ?;",
+      -1, &stmt, 0);
+  if (rc != SQLITE_OK)
+    return rc;
+  sqlite3_bind_int(stmt, 1, book_id);
+  BookList list = {0};
+  rc = collect_books(stmt, &list);
+  sqlite3_finalize(stmt);
+  if (rc == SQLITE_OK && list.count == 0)
+    rc = SQLITE_NOTFOUND;
+  if (rc == SQLITE_OK)
+    *book = list.items[0];
+  free_book_list(&list);
+  return rc;
+}
+
+int merge_books(sqlite3 *db, int keep_id, int duplicate_id, int *moved) {
+  // The order matters: the counts and history are moved before the
+  // duplicate's rows go, and its ISBN is freed before keep_id takes it
+  static const char *const steps[] = {
+      "UPDATE LOANS SET BOOK_ID = ?1 WHERE BOOK_ID = ?2;",
+      "INSERT INTO BOOK_LOAN_COUNTS SELECT ?1, LOANS FROM BOOK_LOAN_COUNTS "
+      "  WHERE BOOK_ID = ?2 "
+      "  ON CONFLICT(BOOK_ID) DO UPDATE SET LOANS = LOANS + excluded.LOANS;",
+      "DELETE FROM BOOK_LOAN_COUNTS WHERE BOOK_ID = ?2;",
+      // The insert trigger marks the affected baskets for the next
+      // recommendations refresh
+      "INSERT OR IGNORE INTO BORROWER_BOOKS (BORROWER_NAME, BOOK_ID) "
+      "  SELECT BORROWER_NAME, ?1 FROM BORROWER_BOOKS WHERE BOOK_ID = ?2;",
+      "DELETE FROM BORROWER_BOOKS WHERE BOOK_ID = ?2;",
+      "DELETE FROM BOOK_NEIGHBOURS WHERE BOOK_ID = ?2;",
+      "DELETE FROM RECS_DIRTY WHERE BOOK_ID = ?2;",
+      "UPDATE ATTACHMENTS SET BOOK_ID = ?1 WHERE BOOK_ID = ?2;",
+      "UPDATE LOAN_FEES SET BOOK_ID = ?1 WHERE BOOK_ID = ?2;",
+      "UPDATE BOOK_EDITS SET BOOK_ID = ?1 WHERE BOOK_ID = ?2;",
+      "DELETE FROM BOOK_DUPLICATES WHERE ?2 IN (BOOK_ID, DUPLICATE_ID);",
+      "CREATE TEMP TABLE MERGED_ISBN AS "
+      "  SELECT ISBN FROM BOOKS WHERE ID = ?2;",
+      "DELETE FROM BOOKS WHERE ID = ?2;",
+      "UPDATE BOOKS SET ISBN = (SELECT ISBN FROM temp.MERGED_ISBN) "
+      "  WHERE ID = ?1 AND ISBN IS NULL;",
+      "DROP TABLE temp.MERGED_ISBN;",
+  };
+
+  *moved = 0;
+  if (keep_id == duplicate_id)
+    return SQLITE_MISUSE;
+  int rc = exec_sql(db, "BEGIN IMMEDIATE;");
+  if (rc != SQLITE_OK)
+    return rc;
+
+  int found = 0, out = 0;
+  rc = run_merge_step(db, "SELECT COUNT(*) FROM BOOKS WHERE ID IN (?1, ?2);",
+                      keep_id, duplicate_id, &found);
+  if (rc == SQLITE_OK && found != 2)
+    rc = SQLITE_NOTFOUND;
+  // One record can only be out once
+  if (rc == SQLITE_OK)
+    rc = run_merge_step(db,
+                        "SELECT COUNT(*) FROM LOANS WHERE BOOK_ID IN (?1, ?2) "
+                        "AND RETURN_DATE IS NULL;",
+                        keep_id, duplicate_id, &out);
+  if (rc == SQLITE_OK && out > 1)
+    rc = SQLITE_CONSTRAINT;
+
+  // The duplicate's loan, if any, and keep_id's row after the merge
+  Book duplicate, kept;
+  if (rc == SQLITE_OK)
+    rc = read_book(db, duplicate_id, &duplicate);
+
+  int steps_count = sizeof(steps) / sizeof(steps[0]);
+  for (int i = 0; rc == SQLITE_OK && i < steps_count; i++) {
+    rc = run_merge_step(db, steps[i], keep_id, duplicate_id, NULL);
+    if (i == 0)
+      *moved = sqlite3_changes(db);
+  }
+  if (rc == SQLITE_OK)
+    rc = read_book(db, keep_id, &kept);
+  if (rc == SQLITE_OK)
+    rc = exec_sql(db, "COMMIT;");
+  if (rc != SQLITE_OK) {
+    sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+    return rc;
+  }
+
+  // Replayed in this order, the loan moves before its book is deleted and
+  // the ISBN is free before keep_id takes it over
+  if (duplicate.borrower[0] != '\0') {
+    changelog_loan(CHANGE_RETURN, duplicate_id, NULL);
+    changelog_loan(CHANGE_BORROW, keep_id, duplicate.borrower);
+  }
+  changelog_book(CHANGE_DELETE_BOOK, &duplicate);
+  changelog_book(CHANGE_UPDATE_BOOK, &kept);
+  return SQLITE_OK;
+}
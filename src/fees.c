@@ -0,0 +1,288 @@
+#include "../include/fees.h"
+#include "../include/config.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SECONDS_PER_DAY 86400
+
+// Active loans of one schema, one array per column. After load_loans the
+// rows are grouped by item type: type t owns [start[t], start[t + 1]).
+typedef struct {
+  sqlite3_int64 *loan_ids;
+  int32_t *days_out; // whole days between borrowing and as_of
+  int32_t *days_late;
+  int32_t *fees;
+  int count;
+  int start[FEE_MAX_TYPES + 1];
+} LoanColumns;
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int exec_sql(sqlite3 *db, const char *sql) {
+  char *zErrMsg = 0;
+  int rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "SQL error: %s\n", zErrMsg);
+    sqlite3_free(zErrMsg);
+  }
+  return rc;
+}
+
+// sql has two %s for the schema, like branch.c's routed statements
+static int prepare_in(sqlite3 *db, const char *schema, const char *sql,
+                      sqlite3_stmt **stmt) {
+  char *routed = sqlite3_mprintf(sql, schema, schema);
+  if (routed == NULL)
+    return SQLITE_NOMEM;
+  int rc = sqlite3_prepare_v2(db, routed, -1, stmt, 0);
+  if (rc != SQLITE_OK)
+    fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+  sqlite3_free(routed);
+  return rc;
+}
+
+// Types missing from the schedule keep an all-zero rule and owe nothing.
+static int load_rules(sqlite3 *db, const char *schema,
+                      FeeRule rules[FEE_MAX_TYPES]) {
+  memset(rules, 0, FEE_MAX_TYPES * sizeof(FeeRule));
+  sqlite3_stmt *stmt;
+  int rc = prepare_in(db, schema,
+                      "SELECT ITEM_TYPE, GRACE_DAYS, DAILY_FEE, MAX_FEE "
+                      "FROM %s.FEE_SCHEDULE;",
+                      &stmt);
+  if (rc != SQLITE_OK)
+    return rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    int type = sqlite3_column_int(stmt, 0);
+    if (type < 0 || type >= FEE_MAX_TYPES)
+      continue;
+    rules[type].grace_days = sqlite3_column_int(stmt, 1);
+    rules[type].daily_fee = sqlite3_column_int(stmt, 2);
+    rules[type].max_fee = sqlite3_column_int(stmt, 3);
+  }
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+static void free_columns(LoanColumns *columns) {
+  free(columns->loan_ids);
+  free(columns->days_out);
+  free(columns->days_late);
+  free(columns->fees);
+  memset(columns, 0, sizeof(*columns));
+}
+
+// Reads every active loan once, then counting-sorts the rows by item type
+// into the final columns.
+static int load_loans(sqlite3 *db, const char *schema, long long as_of,
+                      LoanColumns *columns) {
+  sqlite3_stmt *stmt;
+  int rc = prepare_in(
+      db, schema,
+      "SELECT LOANS.ID, LOANS.BORROW_DATE, BOOKS.ITEM_TYPE "
+      "FROM %s.LOANS AS LOANS "
+      "LEFT JOIN %s.BOOKS AS BOOKS ON BOOKS.ID = LOANS.BOOK_ID "
+      "WHERE LOANS.RETURN_DATE IS NULL;",
+      &stmt);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  sqlite3_int64 *ids = NULL;
+  int32_t *days_out = NULL;
+  unsigned char *types = NULL;
+  int count = 0, capacity = 0;
+  int per_type[FEE_MAX_TYPES] = {0};
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 4096;
+      sqlite3_int64 *more_ids = realloc(ids, capacity * sizeof(*ids));
+      if (more_ids != NULL)
+        ids = more_ids;
+      int32_t *more_days =
+          realloc(days_out, capacity * sizeof(*days_out));
+      if (more_days != NULL)
+        days_out = more_days;
+      unsigned char *more_types = realloc(types, capacity);
+      if (more_types != NULL)
+        types = more_types;
+      if (more_ids == NULL || more_days == NULL || more_types == NULL) {
+        rc = SQLITE_NOMEM;
+        break;
+      }
+    }
+    long long age = as_of - sqlite3_column_int64(stmt, 1);
+    int type = sqlite3_column_int(stmt, 2);
+    ids[count] = sqlite3_column_int64(stmt, 0);
+    // Divided here, while scanning, since SSE2 has no vector division
+    days_out[count] = age < 0 ? 0 : (int32_t)(age / SECONDS_PER_DAY);
+    // A book of an unknown type (or a deleted book) falls in type 0
+    types[count] = type >= 0 && type < FEE_MAX_TYPES ? type : 0;
+    per_type[types[count]]++;
+    count++;
+  }
+  sqlite3_finalize(stmt);
+
+  if (rc == SQLITE_DONE) {
+    rc = SQLITE_OK;
+    int rows = count > 0 ? count : 1;
+    columns->loan_ids = malloc(rows * sizeof(*columns->loan_ids));
+    columns->days_out = malloc(rows * sizeof(*columns->days_out));
+    columns->days_late = malloc(rows * sizeof(*columns->days_late));
+    columns->fees = malloc(rows * sizeof(*columns->fees));
+    if (columns->loan_ids == NULL || columns->days_out == NULL ||
+        columns->days_late == NULL || columns->fees == NULL)
+      rc = SQLITE_NOMEM;
+  }
+  if (rc == SQLITE_OK) {
+    int next[FEE_MAX_TYPES];
+    for (int t = 0; t < FEE_MAX_TYPES; t++) {
+      next[t] = columns->start[t];
+      columns->start[t + 1] = columns->start[t] + per_type[t];
+    }
+    for (int i = 0; i < count; i++) {
+      int row = next[types[i]]++;
+      columns->loan_ids[row] = ids[i];
+      columns->days_out[row] = days_out[i];
+    }
+    columns->count = count;
+  }
+  free(ids);
+  free(days_out);
+  free(types);
+  return rc;
+}
+
+// One item type: no branches and no lookups, only int32 arithmetic on
+// contiguous arrays, so the compiler vectorizes it (see the Makefile for the
+// flag GCC needs at -O2). Days past the free
+// period are capped before the multiply so the product cannot overflow.
+static void fee_kernel(const int32_t *restrict days_out,
+                       int32_t *restrict days_late, int32_t *restrict fees,
+                       int n, int32_t free_days, int32_t daily_fee,
+                       int32_t max_fee) {
+  int32_t max_days = daily_fee > 0 ? max_fee / daily_fee + 1 : 0;
+  for (int i = 0; i < n; i++) {
+    int32_t late = days_out[i] - free_days;
+    late = late > 0 ? late : 0;
+    int32_t billed = late < max_days ? late : max_days;
+    int32_t fee = billed * daily_fee;
+    days_late[i] = late;
+    fees[i] = fee < max_fee ? fee : max_fee;
+  }
+}
+
+// Replaces the schema's LOAN_FEES with the loans that owe something. The
+// caller holds the transaction, so this is one commit however many rows.
+static int write_fees(sqlite3 *db, const char *schema, long long as_of,
+                      const LoanColumns *columns) {
+  sqlite3_stmt *clear, *insert = NULL;
+  int rc = prepare_in(db, schema, "DELETE FROM %s.LOAN_FEES;", &clear);
+  if (rc != SQLITE_OK)
+    return rc;
+  rc = sqlite3_step(clear) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode(db);
+  sqlite3_finalize(clear);
+
+  // Book and borrower are copied so the row survives the loan's return
+  if (rc == SQLITE_OK)
+    rc = prepare_in(db, schema,
+                    "INSERT INTO %s.LOAN_FEES SELECT ID, BOOK_ID, "
+                    "BORROWER_NAME, ?2, ?3, ?4 FROM %s.LOANS WHERE ID = ?1;",
+                    &insert);
+  sqlite3_bind_int64(insert, 4, as_of);
+  for (int i = 0; rc == SQLITE_OK && i < columns->count; i++) {
+    if (columns->fees[i] == 0)
+      continue;
+    sqlite3_bind_int64(insert, 1, columns->loan_ids[i]);
+    sqlite3_bind_int(insert, 2, columns->days_late[i]);
+    sqlite3_bind_int(insert, 3, columns->fees[i]);
+    if (sqlite3_step(insert) != SQLITE_DONE)
+      rc = sqlite3_errcode(db);
+    sqlite3_reset(insert);
+  }
+  sqlite3_finalize(insert);
+  return rc;
+}
+
+int compute_late_fees(sqlite3 *db, const char *schema, long long as_of,
+                      FeeReport *report) {
+  memset(report, 0, sizeof(*report));
+  double started = now_seconds();
+
+  // IMMEDIATE so the loans read are the loans written back
+  int rc = exec_sql(db, "BEGIN IMMEDIATE;");
+  if (rc != SQLITE_OK)
+    return rc;
+  FeeRule rules[FEE_MAX_TYPES];
+  LoanColumns columns = {0};
+  rc = load_rules(db, schema, rules);
+  if (rc == SQLITE_OK)
+    rc = load_loans(db, schema, as_of, &columns);
+  double loaded = now_seconds();
+
+  if (rc == SQLITE_OK) {
+    for (int t = 0; t < FEE_MAX_TYPES; t++) {
+      int from = columns.start[t];
+      fee_kernel(columns.days_out + from, columns.days_late + from,
+                 columns.fees + from, columns.start[t + 1] - from,
+                 config.loan_days + rules[t].grace_days, rules[t].daily_fee,
+                 rules[t].max_fee);
+    }
+  }
+  double computed = now_seconds();
+
+  if (rc == SQLITE_OK)
+    rc = write_fees(db, schema, as_of, &columns);
+  if (rc == SQLITE_OK)
+    rc = exec_sql(db, "COMMIT;");
+  if (rc != SQLITE_OK)
+    sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+
+  report->loans = columns.count;
+  for (int i = 0; i < columns.count; i++) {
+    if (columns.fees[i] > 0) {
+      report->late++;
+      report->total_fee += columns.fees[i];
+    }
+  }
+  report->load_seconds = loaded - started;
+  report->compute_seconds = computed - loaded;
+  report->write_seconds = now_seconds() - computed;
+  free_columns(&columns);
+  return rc;
+}
+
+int set_item_type(sqlite3 *db, int item_type, const int *book_ids,
+                  int count) {
+  int rc = exec_sql(db, "BEGIN IMMEDIATE;");
+  if (rc != SQLITE_OK)
+    return rc;
+
+  sqlite3_stmt *stmt;
+  rc = sqlite3_prepare_v2(db,
+                          "UPDATE BOOKS SET ITEM_TYPE = ?1 WHERE ID = ?2 AND "
+                          "EXISTS (SELECT 1 FROM FEE_SCHEDULE "
+                          "WHERE ITEM_TYPE = ?1);",
+                          -1, &stmt, 0);
+  for (int i = 0; rc == SQLITE_OK && i < count; i++) {
+    sqlite3_bind_int(stmt, 1, item_type);
+    sqlite3_bind_int(stmt, 2, book_ids[i]);
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+      rc = sqlite3_errcode(db);
+    else if (sqlite3_changes(db) == 0)
+      rc = SQLITE_NOTFOUND;
+    sqlite3_reset(stmt);
+  }
+  sqlite3_finalize(stmt);
+
+  if (rc == SQLITE_OK)
+    return exec_sql(db, "COMMIT;");
+  sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+  return rc;
+}
@@ -0,0 +1,411 @@
+#include "../include/fuzzy.h"
+#include "../include/searchkey.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LANES 4
+
+// Four 64-bit lanes; each lane runs the Myers kernel over a different title.
+// GCC and Clang lower this to SIMD where the target has it.
+typedef uint64_t Lanes __attribute__((vector_size(LANES * sizeof(uint64_t))));
+
+#define FILTER_BLOCK 256
+
+// 128-bit Bloom signature of the character bigrams in an entry.
+typedef struct {
+  uint64_t bits[2];
+} Signature;
+
+// Normalized titles and authors packed into one arena. Entry 2n is a
+// title and 2n + 1 the author of the same book.
+static struct {
+  int loaded;
+  sqlite3_int64 data_version;
+  sqlite3_int64 total_changes;
+  int count;
+  int capacity;
+  int *ids;
+  uint32_t *offsets;
+  uint16_t *lengths;
+  Signature *signatures;
+  char *arena;
+  size_t arena_used;
+  size_t arena_capacity;
+} column;
+
+typedef struct {
+  int id;
+  int distance;
+  int length;
+} Candidate;
+
+typedef struct {
+  const uint64_t *peq;
+  Signature pattern_grams;
+  int min_grams; // bigrams an entry must share to be worth verifying
+  int pattern_len;
+  int max_distance;
+  int start;
+  int end;
+  int max_results;
+  Candidate *results;
+  int count;
+} ScanTask;
+
+int fuzzy_normalize(const char *text, char *out, int size) {
+  int len = 0;
+  int space = 1; // drops leading spaces
+  for (const unsigned char *p = (const unsigned char *)text;
+       *p != '\0' && len < size - 1; p++) {
+    unsigned char c = *p;
+    if (c < 0x80 && !isalnum(c)) {
+      if (!space)
+        out[len++] = ' ';
+      space = 1;
+      continue;
+    }
+    out[len++] = c < 0x80 ? (char)tolower(c) : (char)c;
+    space = 0;
+  }
+  if (len > 0 && out[len - 1] == ' ')
+    len--;
+  out[len] = '\0';
+  return len;
+}
+
+static int bigram_bit(unsigned char a, unsigned char b) {
+  return (int)(((a * 31u + b) * 2654435761u) >> 25); // 0..127
+}
+
+static Signature signature_of(const char *text, int len) {
+  Signature sig = {{0, 0}};
+  for (int i = 0; i + 1 < len; i++) {
+    int bit = bigram_bit(text[i], text[i + 1]);
+    sig.bits[bit >> 6] |= 1ull << (bit & 63);
+  }
+  return sig;
+}
+
+static sqlite3_int64 data_version(sqlite3 *db) {
+  sqlite3_stmt *stmt;
+  sqlite3_int64 version = -1;
+  if (sqlite3_prepare_v2(db, "PRAGMA data_version;", -1, &stmt, 0) ==
+      SQLITE_OK) {
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+      version = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+  }
+  return version;
+}
+
+static int add_entry(int id, const char *text) {
+  char normalized[256];
+  int len = fuzzy_normalize(text != NULL ? text : "", normalized,
+                            sizeof(normalized));
+
+  if (column.count == column.capacity) {
+    int capacity = column.capacity ? column.capacity * 2 : 1024;
+    int *ids = realloc(column.ids, capacity * sizeof(int));
+    if (ids == NULL)
+      return 1;
+    column.ids = ids;
+    uint32_t *offsets = realloc(column.offsets, capacity * sizeof(uint32_t));
+    if (offsets == NULL)
+      return 1;
+    column.offsets = offsets;
+    uint16_t *lengths = realloc(column.lengths, capacity * sizeof(uint16_t));
+    if (lengths == NULL)
+      return 1;
+    column.lengths = lengths;
+    Signature *signatures =
+        realloc(column.signatures, capacity * sizeof(Signature));
+    if (signatures == NULL)
+      return 1;
+    column.signatures = signatures;
+    column.capacity = capacity;
+  }
+  if (column.arena_used + len > column.arena_capacity) {
+    size_t capacity = column.arena_capacity ? column.arena_capacity * 2 : 65536;
+    while (capacity < column.arena_used + len)
+      capacity *= 2;
+    char *arena = realloc(column.arena, capacity);
+    if (arena == NULL)
+      return 1;
+    column.arena = arena;
+    column.arena_capacity = capacity;
+  }
+
+  memcpy(column.arena + column.arena_used, normalized, len);
+  column.ids[column.count] = id;
+  column.offsets[column.count] = (uint32_t)column.arena_used;
+  column.lengths[column.count] = (uint16_t)len;
+  column.signatures[column.count] = signature_of(normalized, len);
+  column.arena_used += len;
+  column.count++;
+  return 0;
+}
+
+// Reloads the column if BOOKS may have changed since the last load.
+static int load_column(sqlite3 *db) {
+  sqlite3_int64 version = data_version(db);
+  sqlite3_int64 changes = sqlite3_total_changes64(db);
+  if (column.loaded && version == column.data_version &&
+      changes == column.total_changes)
+    return SQLITE_OK;
+
+  column.count = 0;
+  column.arena_used = 0;
+  column.loaded = 0;
+
+  sqlite3_stmt *stmt;
+  int rc =
+      sqlite3_prepare_v2(db, "SELECT ID, TITLE_KEY, AUTHOR_KEY FROM BOOKS;",
+                         -1, &stmt, 0);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    int id = sqlite3_column_int(stmt, 0);
+    if (add_entry(id, (const char *)sqlite3_column_text(stmt, 1)) ||
+        add_entry(id, (const char *)sqlite3_column_text(stmt, 2))) {
+      rc = SQLITE_NOMEM;
+      break;
+    }
+  }
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE)
+    return rc;
+
+  column.loaded = 1;
+  column.data_version = version;
+  column.total_changes = changes;
+  return SQLITE_OK;
+}
+
+static int compare_candidates(const void *a, const void *b) {
+  const Candidate *x = a, *y = b;
+  if (x->distance != y->distance)
+    return x->distance - y->distance;
+  return x->length - y->length;
+}
+
+// Keeps results sorted by distance, then by shorter text, dropping the worst.
+static void keep_candidate(ScanTask *task, Candidate c) {
+  int i = task->count;
+  if (i == task->max_results) {
+    Candidate *last = &task->results[i - 1];
+    if (c.distance > last->distance ||
+        (c.distance == last->distance && c.length >= last->length))
+      return;
+    i--;
+  } else {
+    task->count++;
+  }
+
+  while (i > 0 && (task->results[i - 1].distance > c.distance ||
+                   (task->results[i - 1].distance == c.distance &&
+                    task->results[i - 1].length > c.length))) {
+    task->results[i] = task->results[i - 1];
+    i--;
+  }
+  task->results[i] = c;
+}
+
+// Myers' bit-parallel edit distance in its search form (Hyyrö's notation):
+// the top row stays zero so a match may start anywhere in the text. Each
+// lane scores one entry; shorter entries are padded with byte 0, whose
+// match mask is empty, which can never lower a lane's best score. Only
+// shifts, adds and logic ops are used so plain SSE2 handles every step.
+static void verify_entries(ScanTask *task, const int *entries, int count) {
+  const uint64_t *peq = task->peq;
+  const int shift = task->pattern_len - 1;
+
+  for (int i = 0; i < count; i += LANES) {
+    const unsigned char *text[LANES];
+    int len[LANES];
+    int max_len = 0;
+    for (int lane = 0; lane < LANES; lane++) {
+      if (i + lane < count) {
+        int entry = entries[i + lane];
+        text[lane] = (const unsigned char *)column.arena + column.offsets[entry];
+        len[lane] = column.lengths[entry];
+      } else {
+        text[lane] = NULL;
+        len[lane] = 0;
+      }
+      if (len[lane] > max_len)
+        max_len = len[lane];
+    }
+
+    Lanes pv = {~0ull, ~0ull, ~0ull, ~0ull};
+    Lanes mv = {0, 0, 0, 0};
+    uint64_t m = task->pattern_len;
+    Lanes score = {m, m, m, m};
+    Lanes best = score;
+
+    for (int j = 0; j < max_len; j++) {
+      Lanes eq;
+      for (int lane = 0; lane < LANES; lane++)
+        eq[lane] = j < len[lane] ? peq[text[lane][j]] : 0;
+
+      Lanes xv = eq | mv;
+      Lanes xh = (((eq & pv) + pv) ^ pv) | eq;
+      Lanes ph = mv | ~(xh | pv);
+      Lanes mh = pv & xh;
+
+      score += (ph >> shift) & 1;
+      score -= (mh >> shift) & 1;
+
+      ph <<= 1;
+      mh <<= 1;
+      pv = mh | ~(xv | ph);
+      mv = ph & xv;
+
+      // All ones where score < best: the sign bit of score - best
+      Lanes lower = -((score - best) >> 63);
+      best ^= (best ^ score) & lower;
+    }
+
+    for (int lane = 0; lane < LANES && i + lane < count; lane++) {
+      if ((int)best[lane] <= task->max_distance) {
+        Candidate c = {column.ids[entries[i + lane]], (int)best[lane],
+                       len[lane]};
+        keep_candidate(task, c);
+      }
+    }
+  }
+}
+
+// q-gram count filter: a match with k edits keeps all but at most 2k of the
+// pattern's bigrams, so entries sharing fewer are skipped before the kernel.
+// The survivors are verified in blocks so the lanes stay full.
+static void *scan_range(void *arg) {
+  ScanTask *task = arg;
+  int entries[FILTER_BLOCK];
+  int count = 0;
+
+  for (int i = task->start; i < task->end; i++) {
+    const Signature *sig = &column.signatures[i];
+    int shared =
+        __builtin_popcountll(sig->bits[0] & task->pattern_grams.bits[0]) +
+        __builtin_popcountll(sig->bits[1] & task->pattern_grams.bits[1]);
+    if (shared < task->min_grams)
+      continue;
+
+    entries[count++] = i;
+    if (count == FILTER_BLOCK) {
+      verify_entries(task, entries, count);
+      count = 0;
+    }
+  }
+  verify_entries(task, entries, count);
+  return NULL;
+}
+
+static int thread_count(int entries) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = cpus > 0 ? (int)cpus : 1;
+  if (threads > FUZZY_MAX_THREADS)
+    threads = FUZZY_MAX_THREADS;
+  // Small catalogs are not worth the thread start-up cost
+  int useful = entries / 16384 + 1;
+  return threads < useful ? threads : useful;
+}
+
+int fuzzy_search(sqlite3 *db, const char *query, FuzzyMatch *results,
+                 int max_results) {
+  // Folded like the stored keys, so "IŞIK" and "ışık" are the same pattern
+  char folded[SEARCH_KEY_MAX];
+  fold_search_key(query, folded, sizeof(folded));
+  char pattern[FUZZY_MAX_PATTERN + 1];
+  int m = fuzzy_normalize(folded, pattern, sizeof(pattern));
+  if (m == 0 || max_results <= 0)
+    return 0;
+
+  if (load_column(db) != SQLITE_OK)
+    return -1;
+
+  uint64_t peq[256] = {0};
+  for (int i = 0; i < m; i++)
+    peq[(unsigned char)pattern[i]] |= 1ull << i;
+
+  // Allow roughly one typo per four characters
+  int max_distance = m / 4;
+
+  // Distinct pattern bigrams, counted through the same Bloom mapping
+  Signature pattern_grams = signature_of(pattern, m);
+  int grams = __builtin_popcountll(pattern_grams.bits[0]) +
+              __builtin_popcountll(pattern_grams.bits[1]);
+  int min_grams = grams - 2 * max_distance;
+
+  int threads = thread_count(column.count);
+  ScanTask tasks[FUZZY_MAX_THREADS];
+  pthread_t handles[FUZZY_MAX_THREADS];
+  Candidate *buffer = malloc(sizeof(Candidate) * max_results * threads);
+  if (buffer == NULL)
+    return -1;
+
+  int chunk = (column.count + threads - 1) / threads;
+  for (int t = 0; t < threads; t++) {
+    int start = t * chunk;
+    int end = t == threads - 1 ? column.count : start + chunk;
+    if (start > column.count)
+      start = column.count;
+    if (end > column.count)
+      end = column.count;
+    tasks[t] = (ScanTask){peq,   pattern_grams, min_grams,
+                          m,     max_distance,  start,
+                          end,   max_results,   buffer + t * max_results,
+                          0};
+  }
+
+  // The calling thread scans the first chunk itself
+  int started[FUZZY_MAX_THREADS] = {0};
+  for (int t = 1; t < threads; t++)
+    started[t] = pthread_create(&handles[t], NULL, scan_range, &tasks[t]) == 0;
+  scan_range(&tasks[0]);
+  for (int t = 1; t < threads; t++) {
+    if (started[t])
+      pthread_join(handles[t], NULL);
+    else
+      scan_range(&tasks[t]);
+  }
+
+  // Merge the per-thread lists; a book may match on title and author
+  ScanTask merged = {0};
+  merged.max_results = max_results;
+  merged.results = malloc(sizeof(Candidate) * max_results);
+  if (merged.results == NULL) {
+    free(buffer);
+    return -1;
+  }
+
+  int total = 0;
+  for (int t = 0; t < threads; t++) {
+    memmove(buffer + total, tasks[t].results,
+            tasks[t].count * sizeof(Candidate));
+    total += tasks[t].count;
+  }
+  qsort(buffer, total, sizeof(Candidate), compare_candidates);
+
+  for (int i = 0; i < total && merged.count < max_results; i++) {
+    int seen = 0;
+    for (int j = 0; j < merged.count && !seen; j++)
+      seen = merged.results[j].id == buffer[i].id;
+    if (!seen)
+      keep_candidate(&merged, buffer[i]);
+  }
+
+  for (int i = 0; i < merged.count; i++) {
+    results[i].id = merged.results[i].id;
+    results[i].distance = merged.results[i].distance;
+  }
+  int count = merged.count;
+  free(merged.results);
+  free(buffer);
+  return count;
+}
@@ -1,11 +1,669 @@
+#include "../include/attach.h"
+#include "../include/audit.h"
+#include "../include/auth.h"
+#include "../include/backup.h"
+#include "../include/branch.h"
+#include "../include/cache.h"
+#include "../include/bulk.h"
+#include "../include/changelog.h"
+#include "../include/config.h"
 #include "../include/db.h"
+#include "../include/dedupe.h"
+#include "../include/fees.h"
+#include "../include/marc.h"
+#include "../include/migrate.h"
+#include "../include/recs.h"
+#include "../include/searchkey.h"
 #include "../include/window.h"
 #include <ncurses.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
-int main() {
-  connect_to_database(DB_FILE);
+static int add_user_command(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: adduser <username> <admin|librarian|user>\n");
+    return 1;
+  }
 
-  start_window();
+  UserRole role;
+  if (strcmp(argv[1], "admin") == 0) {
+    role = ROLE_ADMIN;
+  } else if (strcmp(argv[1], "librarian") == 0) {
+    role = ROLE_LIBRARIAN;
+  } else if (strcmp(argv[1], "user") == 0) {
+    role = ROLE_USER;
+  } else {
+    fprintf(stderr, "Unknown role: %s\n", argv[1]);
+    return 1;
+  }
 
+  char *password = getpass("Password: ");
+  if (password == NULL || password[0] == '\0') {
+    fprintf(stderr, "Password cannot be empty\n");
+    return 1;
+  }
+
+  int rc = create_user(get_database(), argv[0], password, role);
+  memset(password, 0, strlen(password));
+
+  if (rc == 0)
+    printf("User %s saved\n", argv[0]);
+  return rc ? 1 : 0;
+}
+
+static void print_backup_progress(const BackupStatus *status, void *arg) {
+  (void)arg;
+  printf("\r%d/%d pages, %.0f pages/s", status->pages_done,
+         status->pages_total, status->pages_per_second);
+  fflush(stdout);
+}
+
+static int backup_command(int argc, char *argv[]) {
+  if (argc != 1) {
+    fprintf(stderr, "usage: backup <destination>\n");
+    return 1;
+  }
+
+  BackupStatus status;
+  int rc = backup_database(config.db_path, argv[0], BACKUP_PAGES_PER_STEP,
+                           BACKUP_STEP_SLEEP_MS, print_backup_progress, NULL,
+                           &status);
+  printf("\n");
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "%s\n", status.error);
+    return 1;
+  }
+
+  printf("Copied %d pages in %.2f s, verification %s\n", status.pages_total,
+         status.seconds, status.verified ? "passed" : "FAILED");
+  return status.verified ? 0 : 1;
+}
+
+static int attach_command(int argc, char *argv[]) {
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr, "usage: attach <book id> <file> [name]\n");
+    return 1;
+  }
+
+  sqlite3_int64 id;
+  int rc = import_attachment(get_database(), atoi(argv[0]), argv[1],
+                             argc == 3 ? argv[2] : NULL, &id);
+  if (rc != SQLITE_OK)
+    return 1;
+  printf("Attachment %lld saved\n", (long long)id);
+  return 0;
+}
+
+static int export_command(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: export <attachment id> <file>\n");
+    return 1;
+  }
+  return export_attachment(get_database(), atoll(argv[0]), argv[1]) ? 1 : 0;
+}
+
+static int detach_command(int argc, char *argv[]) {
+  if (argc != 1) {
+    fprintf(stderr, "usage: detach <attachment id>\n");
+    return 1;
+  }
+  int rc = delete_attachment(get_database(), atoll(argv[0]));
+  if (rc == SQLITE_NOTFOUND)
+    fprintf(stderr, "Attachment %s not found\n", argv[0]);
+  return rc ? 1 : 0;
+}
+
+static int attachments_command(int argc, char *argv[]) {
+  if (argc != 1) {
+    fprintf(stderr, "usage: attachments <book id>\n");
+    return 1;
+  }
+
+  Attachment items[ATTACH_MAX_LIST];
+  int count =
+      list_attachments(get_database(), atoi(argv[0]), items, ATTACH_MAX_LIST);
+  if (count < 0)
+    return 1;
+  for (int i = 0; i < count; i++)
+    printf("%-6lld %-40s %-24s %12lld\n", (long long)items[i].id,
+           items[i].name, items[i].mime, (long long)items[i].size);
+  return 0;
+}
+
+static void print_edit_field(const char *name, const char *before,
+                             const char *after) {
+  printf("    %-10s '%s' -> '%s'\n", name, before, after);
+}
+
+static int history_command(int argc, char *argv[]) {
+  if (argc != 1) {
+    fprintf(stderr, "usage: history <book id>\n");
+    return 1;
+  }
+
+  static BookEdit edits[AUDIT_HISTORY_ROWS];
+  int count = list_book_edits(get_database(), atoi(argv[0]), edits,
+                              AUDIT_HISTORY_ROWS);
+  if (count < 0)
+    return 1;
+  for (int i = 0; i < count; i++) {
+    const BookEdit *edit = &edits[i];
+    char stamp[32];
+    time_t when = (time_t)edit->edited_at;
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&when));
+    printf("#%lld %s by %s", (long long)edit->id, stamp,
+           edit->editor[0] ? edit->editor : "-");
+    if (edit->undone_by)
+      printf(" (undone by #%lld)", (long long)edit->undone_by);
+    printf("\n");
+    if (edit->fields & AUDIT_TITLE)
+      print_edit_field("title", edit->before.title, edit->after.title);
+    if (edit->fields & AUDIT_AUTHOR)
+      print_edit_field("author", edit->before.author, edit->after.author);
+    if (edit->fields & AUDIT_PUBLISHER)
+      print_edit_field("publisher", edit->before.publisher,
+                       edit->after.publisher);
+    if (edit->fields & AUDIT_YEAR)
+      printf("    %-10s %d -> %d\n", "year", edit->before.year,
+             edit->after.year);
+    if (edit->fields & AUDIT_ISBN)
+      print_edit_field("isbn", edit->before.isbn, edit->after.isbn);
+  }
   return 0;
 }
+
+static int undo_command(int argc, char *argv[]) {
+  if (argc != 1) {
+    fprintf(stderr, "usage: undo <edit id>\n");
+    return 1;
+  }
+
+  // The revert is itself an audited edit, credited to the shell user
+  const char *user = getenv("USER");
+  char editor[100];
+  snprintf(editor, sizeof(editor), "%s (undo)", user ? user : "cli");
+  if (undo_book_edit(get_database(), atoll(argv[0]), editor) != SQLITE_OK)
+    return 1;
+  printf("Edit %s undone\n", argv[0]);
+  return 0;
+}
+
+static int bulk_update_command(int argc, char *argv[]) {
+  BookFilter filter = {0};
+  const char *assignment = NULL;
+  int confirmed = 0, bad = 0;
+  for (int i = 0; i < argc && !bad; i++) {
+    const char *arg = argv[i];
+    const char *next = i + 1 < argc ? argv[i + 1] : NULL;
+    if (strcmp(arg, "--yes") == 0) {
+      confirmed = 1;
+    } else if (strcmp(arg, "--author") == 0 && next != NULL) {
+      snprintf(filter.author, sizeof(filter.author), "%s", argv[++i]);
+    } else if (strcmp(arg, "--publisher") == 0 && next != NULL) {
+      snprintf(filter.publisher, sizeof(filter.publisher), "%s", argv[++i]);
+    } else if (strcmp(arg, "--title") == 0 && next != NULL) {
+      snprintf(filter.title_like, sizeof(filter.title_like), "%s", argv[++i]);
+    } else if (strcmp(arg, "--years") == 0 && next != NULL) {
+      bad = parse_year_range(argv[++i], &filter.year_from, &filter.year_to);
+    } else if (assignment == NULL && strchr(arg, '=') != NULL) {
+      assignment = arg;
+    } else {
+      bad = 1;
+    }
+  }
+
+  char name[16] = "";
+  const char *value = assignment ? strchr(assignment, '=') + 1 : NULL;
+  if (assignment != NULL)
+    snprintf(name, sizeof(name), "%.*s", (int)(value - assignment - 1),
+             assignment);
+  int field = bulk_field_from_name(name);
+  if (bad || field < 0) {
+    fprintf(stderr, "usage: bulkupdate [--author A] [--publisher P] "
+                    "[--title PATTERN] [--years FROM-TO|FROM-|-TO|YEAR] "
+                    "<title|author|publisher|year>=VALUE [--yes]\n");
+    return 1;
+  }
+
+  // Without --yes this is a dry run that only reports the count
+  int count;
+  if (count_bulk_update(get_database(), &filter, field, value, &count) !=
+      SQLITE_OK)
+    return 1;
+  printf("%d book(s) match\n", count);
+  if (!confirmed || count == 0)
+    return 0;
+
+  const char *user = getenv("USER");
+  if (bulk_update_books(get_database(), &filter, field, value,
+                        user ? user : "cli", &count) != SQLITE_OK)
+    return 1;
+  printf("%d book(s) updated\n", count);
+  return 0;
+}
+
+#define OVERDUE_REPORT_ROWS 100
+
+// Midnight (local time) of the given day; day 1 of month when day is 0
+static long long local_midnight(int year, int month, int day) {
+  struct tm tm = {0};
+  tm.tm_year = year - 1900;
+  tm.tm_mon = month - 1;
+  tm.tm_mday = day > 0 ? day : 1;
+  tm.tm_isdst = -1;
+  return (long long)mktime(&tm);
+}
+
+static int loans_command(int argc, char *argv[]) {
+  time_t now = time(NULL);
+  struct tm today = *localtime(&now);
+  int year = today.tm_year + 1900, month = today.tm_mon + 1,
+      day = today.tm_mday;
+  int ok = argc >= 1 && argc <= 2;
+  if (ok && strcmp(argv[0], "month") == 0) {
+    ok = argc == 1 || sscanf(argv[1], "%d-%d", &year, &month) == 2;
+  } else if (ok && strcmp(argv[0], "overdue") == 0) {
+    ok = argc == 1 || sscanf(argv[1], "%d-%d-%d", &year, &month, &day) == 3;
+  } else {
+    ok = 0;
+  }
+  if (!ok) {
+    fprintf(stderr, "usage: loans month [YYYY-MM] | loans overdue "
+                    "[YYYY-MM-DD]\n");
+    return 1;
+  }
+
+  if (strcmp(argv[0], "month") == 0) {
+    int count;
+    if (count_loans_between(get_database(), local_midnight(year, month, 1),
+                            local_midnight(year, month + 1, 1),
+                            &count) != SQLITE_OK)
+      return 1;
+    printf("%04d-%02d: %d loan(s) still out\n", year, month, count);
+    return 0;
+  }
+
+  // Overdue on that day: due (borrowed + loan_days) before its midnight
+  static LoanRow rows[OVERDUE_REPORT_ROWS];
+  long long as_of = local_midnight(year, month, day);
+  int total;
+  int count = list_overdue_loans(get_database(),
+                                 as_of - config.loan_days * 86400LL, rows,
+                                 OVERDUE_REPORT_ROWS, &total);
+  if (count < 0)
+    return 1;
+  for (int i = 0; i < count; i++) {
+    char borrowed[16];
+    time_t when = (time_t)rows[i].borrowed_at;
+    strftime(borrowed, sizeof(borrowed), "%Y-%m-%d", localtime(&when));
+    long long late = (as_of - rows[i].borrowed_at) / 86400 - config.loan_days;
+    printf("%-6d %-30.30s %-20.20s %s  %lld day(s) late\n", rows[i].book_id,
+           rows[i].title, rows[i].borrower, borrowed, late);
+  }
+  printf("%d overdue loan(s) on %04d-%02d-%02d", total, year, month, day);
+  if (total > count)
+    printf(", oldest %d shown", count);
+  printf("\n");
+  return 0;
+}
+
+static void print_fee_report(const char *name, const FeeReport *report) {
+  printf("%-12s %7d loan(s), %6d late, %9.2f owed  "
+         "(load %.3f s, compute %.3f s, write %.3f s)\n",
+         name, report->loans, report->late, report->total_fee / 100.0,
+         report->load_seconds, report->compute_seconds,
+         report->write_seconds);
+}
+
+static int fees_command(int argc, char *argv[]) {
+  time_t now = time(NULL);
+  struct tm today = *localtime(&now);
+  int year = today.tm_year + 1900, month = today.tm_mon + 1,
+      day = today.tm_mday;
+  if (argc > 1 ||
+      (argc == 1 && sscanf(argv[0], "%d-%d-%d", &year, &month, &day) != 3)) {
+    fprintf(stderr, "usage: fees [YYYY-MM-DD]\n");
+    return 1;
+  }
+
+  // Each branch bills from its own FEE_SCHEDULE into its own LOAN_FEES
+  if (attach_branches(get_database()) != 0)
+    return 1;
+  long long as_of = local_midnight(year, month, day);
+  FeeReport report;
+  int rc = compute_late_fees(get_database(), "main", as_of, &report);
+  if (rc == SQLITE_OK)
+    print_fee_report("main", &report);
+  for (int i = 0; rc == SQLITE_OK && i < branch_count(); i++) {
+    char schema[32];
+    snprintf(schema, sizeof(schema), "branch_%d", config.branches[i].id);
+    rc = compute_late_fees(get_database(), schema, as_of, &report);
+    if (rc == SQLITE_OK)
+      print_fee_report(config.branches[i].name, &report);
+  }
+  detach_branches();
+  return rc == SQLITE_OK ? 0 : 1;
+}
+
+static int set_type_command(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: settype <item type> <book id>...\n");
+    return 1;
+  }
+
+  int count = argc - 1;
+  int *book_ids = malloc(count * sizeof(int));
+  if (book_ids == NULL)
+    return 1;
+  for (int i = 0; i < count; i++)
+    book_ids[i] = atoi(argv[i + 1]);
+  int rc = set_item_type(get_database(), atoi(argv[0]), book_ids, count);
+  free(book_ids);
+  if (rc == SQLITE_NOTFOUND)
+    fprintf(stderr, "No such book, or type %s is not in FEE_SCHEDULE\n",
+            argv[0]);
+  if (rc != SQLITE_OK)
+    return 1;
+  printf("%d book(s) set to type %s\n", count, argv[0]);
+  return 0;
+}
+
+static int import_marc_command(int argc, char *argv[]) {
+  if (argc < 1 || argc > 2) {
+    fprintf(stderr,
+            "usage: importmarc <file.mrc> [records per transaction]\n");
+    return 1;
+  }
+  int batch = argc == 2 ? atoi(argv[1]) : MARC_BATCH;
+  if (batch < 1) {
+    fprintf(stderr, "Records per transaction must be positive\n");
+    return 1;
+  }
+
+  MarcReport report;
+  int rc = import_marc(get_database(), argv[0], batch, &report);
+  double seconds = report.seconds > 0 ? report.seconds : 1e-9;
+  printf("Read %lld record(s): %lld imported, %lld duplicate ISBN(s), "
+         "%lld rejected, %lld malformed\n",
+         report.records, report.imported, report.duplicates, report.rejected,
+         report.malformed);
+  printf("%.2f s, %.0f records/s, %.1f MB/s\n", report.seconds,
+         report.records / seconds, report.bytes / seconds / 1e6);
+  return rc == SQLITE_OK ? 0 : 1;
+}
+
+static int dedupe_command(int argc, char *argv[]) {
+  if (argc > 1) {
+    fprintf(stderr, "usage: dedupe [threshold percent]\n");
+    return 1;
+  }
+  int threshold = argc == 1 ? atoi(argv[0]) : DEDUPE_DEFAULT_THRESHOLD;
+  if (threshold < 1 || threshold > 100) {
+    fprintf(stderr, "Threshold must be between 1 and 100\n");
+    return 1;
+  }
+
+  DedupeReport report;
+  if (find_duplicates(get_database(), threshold, &report) != SQLITE_OK)
+    return 1;
+  printf("Compared %lld pair(s) of %d books on %d threads: %d suggestion(s)",
+         report.pairs, report.books, report.threads, report.suggestions);
+  if (report.skipped > 0)
+    printf(", %d oversized bucket(s) skipped", report.skipped);
+  printf("\nload %.3f s, block %.3f s, compare %.3f s, write %.3f s\n",
+         report.load_seconds, report.block_seconds, report.compare_seconds,
+         report.write_seconds);
+
+  DuplicateRow rows[DEDUPE_REPORT_ROWS];
+  int total;
+  int count = list_duplicates(get_database(), rows, DEDUPE_REPORT_ROWS, &total);
+  if (count < 0)
+    return 1;
+  for (int i = 0; i < count; i++)
+    printf("%3d%%  keep %d %s / %s\n      dup  %d %s / %s\n",
+           rows[i].similarity, rows[i].keep_id, rows[i].keep_title,
+           rows[i].keep_author, rows[i].duplicate_id, rows[i].duplicate_title,
+           rows[i].duplicate_author);
+  if (total > count)
+    printf("... %d more in BOOK_DUPLICATES\n", total - count);
+  return 0;
+}
+
+static int merge_command(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: merge <book id to keep> <duplicate book id>\n");
+    return 1;
+  }
+
+  int moved;
+  int rc = merge_books(get_database(), atoi(argv[0]), atoi(argv[1]), &moved);
+  if (rc == SQLITE_MISUSE)
+    fprintf(stderr, "A book cannot be merged into itself\n");
+  else if (rc == SQLITE_NOTFOUND)
+    fprintf(stderr, "No such book\n");
+  else if (rc == SQLITE_CONSTRAINT)
+    fprintf(stderr, "Both books are on loan; return one first\n");
+  if (rc != SQLITE_OK)
+    return 1;
+  printf("Merged book %s into %s, moving %d loan(s)\n", argv[1], argv[0],
+         moved);
+  return 0;
+}
+
+static int recommend_command(int argc, char *argv[]) {
+  (void)argv;
+  if (argc != 0) {
+    fprintf(stderr, "usage: recommend\n");
+    return 1;
+  }
+
+  RecsReport report;
+  int rc = refresh_recommendations(get_database(), 1, &report);
+  if (rc != SQLITE_OK)
+    return 1;
+
+  printf("Rebuilt %d books from %d baskets on %d threads: %lld rows\n",
+         report.targets, report.baskets, report.threads, report.rows);
+  printf("load %.3f s, count %.3f s, write %.3f s\n", report.load_seconds,
+         report.count_seconds, report.write_seconds);
+  return 0;
+}
+
+static int rebuild_keys_command(int argc, char *argv[]) {
+  (void)argv;
+  if (argc != 0) {
+    fprintf(stderr, "usage: rebuildkeys\n");
+    return 1;
+  }
+
+  // Branch files take books too, so they are refolded with main
+  int rows;
+  int rc = attach_branches(get_database());
+  if (rc == SQLITE_OK)
+    rc = rebuild_search_keys(get_database(), &rows);
+  detach_branches();
+  if (rc != SQLITE_OK)
+    return 1;
+  printf("Rebuilt search keys of %d book(s)\n", rows);
+  return 0;
+}
+
+static int replay_log_command(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: replaylog <log> <new database>\n");
+    return 1;
+  }
+  if (access(argv[1], F_OK) == 0) {
+    fprintf(stderr, "%s already exists\n", argv[1]);
+    return 1;
+  }
+
+  sqlite3 *db;
+  int rc = sqlite3_open(argv[1], &db);
+  if (rc == SQLITE_OK)
+    rc = migrate_database(db);
+  ReplayReport report = {0};
+  if (rc == SQLITE_OK)
+    rc = changelog_replay(db, argv[0], &report);
+  sqlite3_close(db);
+
+  printf("Replayed %lld events in %.2f s%s\n", report.events, report.seconds,
+         report.bad_records ? ", stopped at a corrupt record" : "");
+  return rc == SQLITE_OK && !report.bad_records ? 0 : 1;
+}
+
+static int verify_log_command(int argc, char *argv[]) {
+  if (argc != 1) {
+    fprintf(stderr, "usage: verifylog <log>\n");
+    return 1;
+  }
+
+  ReplayReport report;
+  int differences;
+  int rc = changelog_verify(config.db_path, argv[0], &report, &differences);
+  if (rc != SQLITE_OK)
+    return 1;
+
+  printf("Replayed %lld events in %.2f s, %d difference(s)%s\n",
+         report.events, report.seconds, differences,
+         report.bad_records ? ", stopped at a corrupt record" : "");
+  return differences == 0 && !report.bad_records ? 0 : 1;
+}
+
+// Prints every event and keeps following the file as it grows, like tail -f.
+static int tail_log_command(int argc, char *argv[]) {
+  if (argc != 1) {
+    fprintf(stderr, "usage: taillog <log>\n");
+    return 1;
+  }
+
+  ChangeReader reader;
+  if (changelog_reader_open(&reader, argv[0]))
+    return 1;
+
+  ChangeEvent event;
+  int bad_polls = 0;
+  while (1) {
+    int result = changelog_read(&reader, &event);
+    if (result == 1) {
+      bad_polls = 0;
+      char stamp[32];
+      time_t when = (time_t)event.time;
+      struct tm tm;
+      localtime_r(&when, &tm);
+      strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+      const Book *b = &event.book;
+      printf("%llu %s %-6s book %d", event.seq, stamp,
+             change_type_name(event.type), b->id);
+      if (event.type == CHANGE_BORROW)
+        printf(" by %s", b->borrower);
+      else if (event.type != CHANGE_RETURN)
+        printf(" \"%s\" %s, %s %d %s", b->title, b->author, b->publisher,
+               b->year, b->isbn);
+      printf("\n");
+      fflush(stdout);
+      continue;
+    }
+
+    // A record that is still being copied can look corrupt for a moment
+    if (result < 0 && ++bad_polls > 20) {
+      fprintf(stderr, "Corrupt record at offset %lld\n", reader.offset);
+      changelog_reader_close(&reader);
+      return 1;
+    }
+    usleep(100000);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  start_startup_timer();
+
+  // logged commands write books or loans, so they append to the change log
+  // like the desk does; the others never open it, which keeps taillog and
+  // verifylog from touching a log another process is writing
+  typedef struct {
+    char *name;
+    int (*func)(int argc, char *argv[]);
+    int logged;
+  } Command;
+
+  Command commands[] = {{"adduser", add_user_command, 0},
+                        {"attach", attach_command, 0},
+                        {"attachments", attachments_command, 0},
+                        {"dedupe", dedupe_command, 0},
+                        {"detach", detach_command, 0},
+                        {"export", export_command, 0},
+                        {"fees", fees_command, 0},
+                        {"history", history_command, 0},
+                        {"importmarc", import_marc_command, 1},
+                        {"loans", loans_command, 0},
+                        {"merge", merge_command, 1},
+                        {"backup", backup_command, 0},
+                        {"bulkupdate", bulk_update_command, 1},
+                        {"recommend", recommend_command, 0},
+                        {"rebuildkeys", rebuild_keys_command, 0},
+                        {"settype", set_type_command, 1},
+                        {"replaylog", replay_log_command, 0},
+                        {"verifylog", verify_log_command, 0},
+                        {"taillog", tail_log_command, 0},
+                        {"undo", undo_command, 1}};
+
+  const char *config_path = getenv("LIBRARY_CONFIG");
+  if (load_config(config_path ? config_path : CONFIG_FILE, &config) != 0)
+    return 1;
+
+  if (connect_to_database(config.db_path) != 0)
+    return 1;
+
+  if (argc > 1) {
+    int rc = 1;
+    int size = sizeof(commands) / sizeof(commands[0]);
+    int i = 0;
+    while (i < size && strcmp(argv[1], commands[i].name) != 0)
+      i++;
+    if (i == size)
+      fprintf(stderr, "Unknown command: %s\n", argv[1]);
+    else if (!commands[i].logged || config.changelog_path[0] == '\0' ||
+             changelog_open(get_database(), config.changelog_path) == 0)
+      rc = commands[i].func(argc - 2, argv + 2);
+    changelog_close();
+    close_database();
+    return rc;
+  }
+
+  // Other branches are only reachable from the desk
+  if (attach_branches(get_database()) != 0) {
+    close_database();
+    return 1;
+  }
+
+  // Optional scheduled backups while the desk is running
+  if (config.backup_dir[0] != '\0' && config.backup_interval > 0)
+    backup_scheduler_start(config.db_path, config.backup_dir,
+                           config.backup_interval);
+
+  // Neighbour lists follow new loans in the background
+  if (config.recs_interval > 0)
+    recs_refresher_start(config.db_path, config.recs_interval);
+
+  int rc = 0;
+  if (config.changelog_path[0] != '\0' &&
+      changelog_open(get_database(), config.changelog_path) != 0)
+    rc = 1;
+  else if (result_cache_init(get_database(), config.result_cache_entries) != 0)
+    rc = 1;
+  else
+    start_window();
+
+  result_cache_close();
+  changelog_close();
+  backup_scheduler_stop();
+  recs_refresher_stop();
+  detach_branches();
+  close_database();
+
+  return rc;
+}
@@ -1,5 +1,7 @@
+#include "../include/backup.h"
 #include "../include/bookwindow.h"
 #include "../include/db.h"
+#include "../include/statswindow.h"
 #include "../include/userwindow.h"
 #include "../include/window.h"
 #include <ncurses.h>
@@ -14,7 +16,8 @@ void main_menu() {
                               "Books",
                               book_menu,
                           },
-                          {"Users", user_menu}};
+                          {"Users", user_menu},
+                          {"Statistics", stats_menu}};
 
   int size = sizeof(main_menu) / sizeof(main_menu[0]);
   int highlight = 0;
@@ -33,9 +36,27 @@ void main_menu() {
         attroff(A_REVERSE); // Remove highlighting
     }
 
+    BackupStatus backup;
+    if (backup_scheduler_status(&backup) == 0) {
+      printw("\nLast backup: %d pages in %.2f s (%.0f pages/s), %s\n",
+             backup.pages_total, backup.seconds, backup.pages_per_second,
+             backup.rc != SQLITE_OK ? "failed"
+             : backup.verified      ? "verified"
+                                    : "verification failed");
+      if (backup.error[0] != '\0')
+        printw("%s\n", backup.error);
+    }
+
+    if (startup_time_ms() >= 0)
+      printw("\nStartup: %.1f ms\n", startup_time_ms());
+
     printw("\nUse Arrow Keys to navigate, Enter to select, q to quit: ");
     refresh();
 
+    // The first paint ends the startup measurement; repaint to show it
+    if (stop_startup_timer())
+      continue;
+
     int ch = getch();
     switch (ch) {
     case KEY_UP:
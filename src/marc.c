@@ -0,0 +1,427 @@
+#include "../include/marc.h"
+#include "../include/changelog.h"
+#include "../include/db.h"
+#include "../include/scan.h"
+#include "../include/searchkey.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RECORD_TERMINATOR 0x1d
+#define FIELD_TERMINATOR 0x1e
+#define SUBFIELD_DELIMITER 0x1f
+#define LEADER_SIZE 24
+#define DIRECTORY_ENTRY 12 // tag, four-digit length, five-digit start
+
+static int exec_sql(sqlite3 *db, const char *sql) {
+  char *zErrMsg = 0;
+  int rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "SQL error: %s\n", zErrMsg);
+    sqlite3_free(zErrMsg);
+  }
+  return rc;
+}
+
+// Sequential reader. A record is parsed in place and stays valid until the
+// next call, which may move the unread bytes to the front of buf.
+typedef struct {
+  int fd;
+  unsigned char *buf; // MARC_BUFFER bytes
+  size_t start;       // first unread byte
+  size_t end;         // end of the bytes read so far
+  int eof;
+  long long offset; // file offset of buf[start]
+} MarcReader;
+
+typedef enum {
+  READ_END,
+  READ_RECORD,
+  READ_MALFORMED,
+  READ_FAILED,
+} ReadResult;
+
+typedef enum {
+  RECORD_OK,
+  RECORD_MALFORMED,
+  RECORD_REJECTED,
+} RecordStatus;
+
+static int fill(MarcReader *reader) {
+  memmove(reader->buf, reader->buf + reader->start,
+          reader->end - reader->start);
+  reader->end -= reader->start;
+  reader->start = 0;
+  while (!reader->eof && reader->end < MARC_BUFFER) {
+    ssize_t got =
+        read(reader->fd, reader->buf + reader->end, MARC_BUFFER - reader->end);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got < 0)
+      return 1;
+    if (got == 0)
+      reader->eof = 1;
+    reader->end += got;
+  }
+  return 0;
+}
+
+// Makes at least size unread bytes available unless the file ends first
+static int want(MarcReader *reader, size_t size) {
+  if (reader->end - reader->start >= size || reader->eof)
+    return 0;
+  return fill(reader);
+}
+
+static void consume(MarcReader *reader, size_t size) {
+  reader->start += size;
+  reader->offset += size;
+}
+
+// Skips past the next record terminator, where the next record should start
+static int resync(MarcReader *reader) {
+  while (1) {
+    unsigned char *found =
+        memchr(reader->buf + reader->start, RECORD_TERMINATOR,
+               reader->end - reader->start);
+    if (found != NULL) {
+      consume(reader, found - (reader->buf + reader->start) + 1);
+      return 0;
+    }
+    consume(reader, reader->end - reader->start);
+    if (reader->eof)
+      return 0;
+    if (fill(reader))
+      return 1;
+  }
+}
+
+static int read_digits(const unsigned char *text, int count) {
+  int value = 0;
+  for (int i = 0; i < count; i++) {
+    if (!isdigit(text[i]))
+      return -1;
+    value = value * 10 + (text[i] - '0');
+  }
+  return value;
+}
+
+static ReadResult next_record(MarcReader *reader, const unsigned char **record,
+                              int *length, const char **reason) {
+  // Some exports end every record with a newline as well
+  while (1) {
+    if (want(reader, 1))
+      return READ_FAILED;
+    if (reader->start == reader->end)
+      return READ_END;
+    unsigned char c = reader->buf[reader->start];
+    if (c != '\n' && c != '\r')
+      break;
+    consume(reader, 1);
+  }
+
+  if (want(reader, 5))
+    return READ_FAILED;
+  size_t available = reader->end - reader->start;
+  int size = available >= 5 ? read_digits(reader->buf + reader->start, 5) : -1;
+  if (size <= LEADER_SIZE) {
+    *reason = "bad record length";
+    return resync(reader) ? READ_FAILED : READ_MALFORMED;
+  }
+  if (want(reader, size))
+    return READ_FAILED;
+  if (reader->end - reader->start < (size_t)size) {
+    *reason = "truncated record";
+    consume(reader, reader->end - reader->start);
+    return READ_MALFORMED;
+  }
+  if (reader->buf[reader->start + size - 1] != RECORD_TERMINATOR) {
+    *reason = "record length does not end at a record terminator";
+    return resync(reader) ? READ_FAILED : READ_MALFORMED;
+  }
+
+  *record = reader->buf + reader->start;
+  *length = size;
+  consume(reader, size);
+  return READ_RECORD;
+}
+
+// Drops ISBD punctuation and spaces from the end of text
+static void trim_end(char *text) {
+  size_t len = strlen(text);
+  while (len > 0 && strchr(" /:;,=.", text[len - 1]) != NULL)
+    len--;
+  text[len] = '\0';
+}
+
+// Appends bytes to the string in out, space-separated and cut at a UTF-8
+// character boundary when it does not fit
+static void append_text(char *out, size_t size, const unsigned char *bytes,
+                        int count) {
+  while (count > 0 && *bytes == ' ') {
+    bytes++;
+    count--;
+  }
+  size_t used = strlen(out);
+  if (count == 0 || used + 2 >= size)
+    return;
+  if (used > 0)
+    out[used++] = ' ';
+  size_t room = size - 1 - used;
+  size_t copy = (size_t)count;
+  if (copy > room) {
+    copy = room;
+    while (copy > 0 && (bytes[copy] & 0xc0) == 0x80)
+      copy--;
+  }
+  memcpy(out + used, bytes, copy);
+  out[used + copy] = '\0';
+  trim_end(out);
+}
+
+// Appends the first $code of a data field (indicators included, field
+// terminator excluded) to out
+static void append_subfield(const unsigned char *field, int len, char code,
+                            char *out, size_t size) {
+  for (int i = 2; i + 1 < len; i++) {
+    if (field[i] != SUBFIELD_DELIMITER || field[i + 1] != code)
+      continue;
+    int end = i + 2;
+    while (end < len && field[end] != SUBFIELD_DELIMITER)
+      end++;
+    append_text(out, size, field + i + 2, end - i - 2);
+    return;
+  }
+}
+
+// First four-digit run, e.g. 1999 in "c1999." or 2003 in "[2003?]"
+static int find_year(const char *text) {
+  for (; *text != '\0'; text++)
+    if (read_digits((const unsigned char *)text, 4) >= 0)
+      return read_digits((const unsigned char *)text, 4);
+  return 0;
+}
+
+static int has_high_bytes(const char *text) {
+  for (; *text != '\0'; text++)
+    if ((unsigned char)*text >= 0x80)
+      return 1;
+  return 0;
+}
+
+// Walks the directory and maps the fields BOOKS needs onto book
+static RecordStatus parse_record(const unsigned char *record, int length,
+                                 Book *book, const char **reason) {
+  memset(book, 0, sizeof(*book));
+  int base = read_digits(record + 12, 5);
+  if (base <= LEADER_SIZE || base >= length ||
+      record[base - 1] != FIELD_TERMINATOR ||
+      (base - 1 - LEADER_SIZE) % DIRECTORY_ENTRY != 0) {
+    *reason = "bad directory";
+    return RECORD_MALFORMED;
+  }
+
+  const unsigned char *publication = NULL, *fixed = NULL;
+  int publication_len = 0, fixed_len = 0, have_isbn = 0;
+  char isbn[64] = "";
+  for (int entry = LEADER_SIZE; entry < base - 1; entry += DIRECTORY_ENTRY) {
+    const unsigned char *tag = record + entry;
+    int len = read_digits(tag + 3, 4);
+    int start = read_digits(tag + 7, 5);
+    if (len < 1 || start < 0 || base + start + len > length - 1 ||
+        record[base + start + len - 1] != FIELD_TERMINATOR) {
+      *reason = "field outside its record";
+      return RECORD_MALFORMED;
+    }
+    const unsigned char *field = record + base + start;
+    len--; // the field terminator
+
+    if (memcmp(tag, "008", 3) == 0) {
+      fixed = field;
+      fixed_len = len;
+    } else if (len < 2) {
+      continue; // a data field needs its two indicators
+    } else if (memcmp(tag, "245", 3) == 0 && book->title[0] == '\0') {
+      append_subfield(field, len, 'a', book->title, sizeof(book->title));
+      append_subfield(field, len, 'b', book->title, sizeof(book->title));
+    } else if (memcmp(tag, "100", 3) == 0 && book->author[0] == '\0') {
+      append_subfield(field, len, 'a', book->author, sizeof(book->author));
+    } else if (memcmp(tag, "264", 3) == 0 && field[1] == '1') {
+      // RDA publication statement; it wins over 260
+      publication = field;
+      publication_len = len;
+    } else if (memcmp(tag, "260", 3) == 0 && publication == NULL) {
+      publication = field;
+      publication_len = len;
+    } else if (memcmp(tag, "020", 3) == 0 && !have_isbn) {
+      append_subfield(field, len, 'a', isbn, sizeof(isbn));
+      have_isbn = isbn[0] != '\0';
+    }
+  }
+
+  if (publication != NULL) {
+    char date[32] = "";
+    append_subfield(publication, publication_len, 'b', book->publisher,
+                    sizeof(book->publisher));
+    append_subfield(publication, publication_len, 'c', date, sizeof(date));
+    book->year = find_year(date);
+  }
+  // 008/07-10 is the first date of publication
+  if (book->year == 0 && fixed_len >= 11)
+    book->year = read_digits(fixed + 7, 4) > 0 ? read_digits(fixed + 7, 4) : 0;
+  // "9780306406157 (pbk.)": the qualifier is not part of the number
+  isbn[strcspn(isbn, " (")] = '\0';
+  if (normalize_code(isbn, book->isbn, sizeof(book->isbn)))
+    book->isbn[0] = '\0';
+
+  if (book->title[0] == '\0') {
+    *reason = "no title in 245 $a";
+    return RECORD_REJECTED;
+  }
+  // Leader/09 'a' is UCS/Unicode; anything else is MARC-8, which is only
+  // stored when it is plain ASCII
+  if (record[9] != 'a' &&
+      (has_high_bytes(book->title) || has_high_bytes(book->author) ||
+       has_high_bytes(book->publisher))) {
+    *reason = "MARC-8 text outside ASCII";
+    return RECORD_REJECTED;
+  }
+  return RECORD_OK;
+}
+
+static void print_problem(const MarcReport *report, long long offset,
+                          const char *reason) {
+  long long problems = report->malformed + report->rejected;
+  if (problems <= MARC_ERROR_PRINT)
+    fprintf(stderr, "record %lld at byte %lld: %s\n", report->records, offset,
+            reason);
+  if (problems == MARC_ERROR_PRINT)
+    fprintf(stderr, "further problems are only counted\n");
+}
+
+// Inserts book, adding the stored row to added; an ISBN that is already
+// taken is counted, not an error
+static int insert_record(sqlite3_stmt *insert, const Book *book,
+                         MarcReport *report, BookList *added) {
+  sqlite3_bind_text(insert, 1, book->title, -1, SQLITE_STATIC);
+  sqlite3_bind_text(insert, 2, book->author, -1, SQLITE_STATIC);
+  sqlite3_bind_text(insert, 3, book->publisher, -1, SQLITE_STATIC);
+  sqlite3_bind_int(insert, 4, book->year);
+  sqlite3_bind_text(insert, 5, book->isbn, -1, SQLITE_STATIC);
+  bind_search_key(insert, 6, book->title);
+  bind_search_key(insert, 7, book->author);
+  int rc = collect_books(insert, added);
+  sqlite3_reset(insert);
+  if (rc == SQLITE_CONSTRAINT && book->isbn[0] != '\0') {
+    report->duplicates++;
+    return SQLITE_OK;
+  }
+  return rc;
+}
+
+// Commits the open batch. Its rows reach the change log only once they are
+// durable, so a failed batch leaves no records behind.
+static int commit_batch(sqlite3 *db, BookList *added, MarcReport *report) {
+  int rc = exec_sql(db, "COMMIT;");
+  if (rc != SQLITE_OK) {
+    sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+  } else {
+    for (int i = 0; i < added->count; i++)
+      changelog_book(CHANGE_ADD_BOOK, &added->items[i]);
+    report->imported += added->count;
+  }
+  added->count = 0;
+  return rc;
+}
+
+int import_marc(sqlite3 *db, const char *path, int batch,
+                MarcReport *report) {
+  memset(report, 0, sizeof(*report));
+  struct timespec started, finished;
+  clock_gettime(CLOCK_MONOTONIC, &started);
+
+  MarcReader reader = {0};
+  reader.fd = open(path, O_RDONLY);
+  if (reader.fd < 0) {
+    fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+    return SQLITE_CANTOPEN;
+  }
+  reader.buf = malloc(MARC_BUFFER);
+  sqlite3_stmt *insert = NULL;
+  int rc = reader.buf != NULL ? SQLITE_OK : SQLITE_NOMEM;
+  if (rc == SQLITE_OK)
+    rc = sqlite3_prepare_v2(
+        db,
+        "INSERT INTO BOOKS (TITLE, AUTHOR, PUBLISHER, YEAR, ISBN, "
+        "TITLE_KEY, AUTHOR_KEY) VALUES (?, ?, ?, ?, NULLIF(?, ''), ?, ?) "
+        "RETURNING ID, TITLE, AUTHOR, PUBLISHER, YEAR, '', ISBN;",
+        -1, &insert, 0);
+
+  int in_batch = 0;     // records inserted since BEGIN
+  BookList added = {0}; // of those, the rows actually added
+  while (rc == SQLITE_OK) {
+    long long offset = reader.offset;
+    const unsigned char *record;
+    int length;
+    const char *reason = NULL;
+    ReadResult result = next_record(&reader, &record, &length, &reason);
+    if (result == READ_END)
+      break;
+    if (result == READ_FAILED) {
+      fprintf(stderr, "Can't read %s: %s\n", path, strerror(errno));
+      rc = SQLITE_IOERR;
+      break;
+    }
+    report->records++;
+    if (result == READ_MALFORMED) {
+      report->malformed++;
+      print_problem(report, offset, reason);
+      continue;
+    }
+
+    Book book;
+    RecordStatus status = parse_record(record, length, &book, &reason);
+    if (status != RECORD_OK) {
+      if (status == RECORD_MALFORMED)
+        report->malformed++;
+      else
+        report->rejected++;
+      print_problem(report, offset, reason);
+      continue;
+    }
+
+    if (in_batch == 0)
+      rc = exec_sql(db, "BEGIN IMMEDIATE;");
+    if (rc == SQLITE_OK)
+      rc = insert_record(insert, &book, report, &added);
+    if (rc == SQLITE_OK && ++in_batch == batch) {
+      rc = commit_batch(db, &added, report);
+      in_batch = 0;
+    }
+  }
+
+  if (in_batch > 0) {
+    if (rc == SQLITE_OK)
+      rc = commit_batch(db, &added, report);
+    else
+      sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+  }
+  free_book_list(&added);
+  if (rc != SQLITE_OK && rc != SQLITE_IOERR)
+    fprintf(stderr, "Import failed at record %lld: %s\n", report->records,
+            sqlite3_errmsg(db));
+
+  sqlite3_finalize(insert);
+  free(reader.buf);
+  close(reader.fd);
+  report->bytes = reader.offset;
+  clock_gettime(CLOCK_MONOTONIC, &finished);
+  report->seconds = (finished.tv_sec - started.tv_sec) +
+                    (finished.tv_nsec - started.tv_nsec) / 1e9;
+  return rc;
+}
@@ -0,0 +1,450 @@
+#include "../include/migrate.h"
+#include "../include/auth.h"
+#include "../include/db.h"
+#include "../include/searchkey.h"
+#include <sqlite3.h>
+#include <stdio.h>
+
+static int create_base_tables(sqlite3 *db) {
+  int rc = create_book_table(db);
+  if (rc == 0)
+    rc = create_loans_table(db);
+  if (rc == 0)
+    rc = create_users_table(db);
+  return rc;
+}
+
+static int exec_sql(sqlite3 *db, const char *sql);
+
+// Racing desks could lend a book twice before borrow_book took the write
+// lock. The first loan stands; the later ones move, unchanged, to
+// LOAN_CONFLICTS for the staff to settle, so the index can be built.
+static int one_active_loan(sqlite3 *db) {
+  int rc = exec_sql(
+      db,
+      "CREATE TABLE IF NOT EXISTS LOAN_CONFLICTS("
+      "  ID INTEGER PRIMARY KEY,"
+      "  BOOK_ID INT NOT NULL,"
+      "  BORROWER_NAME TEXT NOT NULL,"
+      "  BORROW_DATE INT NOT NULL,"
+      "  FOUND_AT INT NOT NULL);"
+      "INSERT INTO LOAN_CONFLICTS "
+      "  SELECT ID, BOOK_ID, BORROWER_NAME, BORROW_DATE, unixepoch() "
+      "  FROM LOANS WHERE RETURN_DATE IS NULL AND ID NOT IN ("
+      "    SELECT MIN(ID) FROM LOANS WHERE RETURN_DATE IS NULL "
+      "    GROUP BY BOOK_ID);");
+  if (rc != SQLITE_OK)
+    return rc;
+  int moved = sqlite3_changes(db);
+
+  rc = exec_sql(db, "DELETE FROM LOANS WHERE ID IN "
+                    "  (SELECT ID FROM LOAN_CONFLICTS);"
+                    "CREATE UNIQUE INDEX IF NOT EXISTS LOANS_ONE_ACTIVE "
+                    "  ON LOANS(BOOK_ID) WHERE RETURN_DATE IS NULL;");
+  if (rc == SQLITE_OK && moved > 0)
+    fprintf(stderr,
+            "%d duplicate active loan(s) moved to LOAN_CONFLICTS for "
+            "review\n",
+            moved);
+  return rc;
+}
+
+// SQLite cannot change a column's type, and TEXT affinity would turn the
+// epochs back into strings, so LOANS is rebuilt. Dropping it drops its
+// triggers too; they are saved and recreated, except the per-day counter,
+// whose date() now has to be told its input is a Unix time.
+static int epoch_loan_dates(sqlite3 *db) {
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(db,
+                              "SELECT sql FROM sqlite_schema "
+                              "WHERE type = 'trigger' AND tbl_name = 'LOANS' "
+                              "AND name != 'LOANS_COUNT_INSERT' "
+                              "ORDER BY rowid;",
+                              -1, &stmt, 0);
+  if (rc != SQLITE_OK)
+    return rc;
+  char *triggers = sqlite3_mprintf("%s", "");
+  while (triggers != NULL && sqlite3_step(stmt) == SQLITE_ROW) {
+    char *more = sqlite3_mprintf("%s%s;", triggers,
+                                 (const char *)sqlite3_column_text(stmt, 0));
+    sqlite3_free(triggers);
+    triggers = more;
+  }
+  sqlite3_finalize(stmt);
+  if (triggers == NULL)
+    return SQLITE_NOMEM;
+
+  // Returned loans are deleted, so the highest ID may be gone; keep the
+  // AUTOINCREMENT counter where it was
+  rc = exec_sql(
+      db,
+      "CREATE TABLE LOANS_EPOCH("
+      "  ID INTEGER PRIMARY KEY AUTOINCREMENT,"
+      "  BOOK_ID INT NOT NULL,"
+      "  BORROWER_NAME TEXT NOT NULL,"
+      "  BORROW_DATE INT NOT NULL,"
+      "  RETURN_DATE INT,"
+      "  FOREIGN KEY (BOOK_ID) REFERENCES BOOKS(ID));"
+      "INSERT INTO LOANS_EPOCH "
+      "  SELECT ID, BOOK_ID, BORROWER_NAME, COALESCE(unixepoch(BORROW_DATE), 0),"
+      "  unixepoch(RETURN_DATE) FROM LOANS;"
+      "CREATE TEMP TABLE LOANS_SEQUENCE AS "
+      "  SELECT seq FROM sqlite_sequence WHERE name = 'LOANS';"
+      "DROP TABLE LOANS;"
+      "ALTER TABLE LOANS_EPOCH RENAME TO LOANS;"
+      "INSERT INTO sqlite_sequence (name, seq) SELECT 'LOANS', 0 "
+      "  WHERE NOT EXISTS (SELECT 1 FROM sqlite_sequence WHERE name = 'LOANS');"
+      "UPDATE sqlite_sequence SET seq = MAX(seq, "
+      "  COALESCE((SELECT seq FROM LOANS_SEQUENCE), 0)) WHERE name = 'LOANS';"
+      "DROP TABLE LOANS_SEQUENCE;"
+      "CREATE INDEX LOANS_BY_BOOK ON LOANS(BOOK_ID, RETURN_DATE);"
+      // Period reports range over the epoch; RETURN_DATE rides along so
+      // whether a loan is still out is decided inside the index
+      "CREATE INDEX LOANS_BY_BORROW_DATE ON LOANS(BORROW_DATE, RETURN_DATE);"
+      "CREATE TRIGGER LOANS_COUNT_INSERT AFTER INSERT ON LOANS "
+      "BEGIN "
+      "  INSERT INTO BOOK_LOAN_COUNTS VALUES (NEW.BOOK_ID, 1) "
+      "    ON CONFLICT(BOOK_ID) DO UPDATE SET LOANS = LOANS + 1; "
+      "  INSERT INTO LOANS_PER_DAY "
+      "    SELECT date(NEW.BORROW_DATE, 'unixepoch'), 1 "
+      "    ON CONFLICT(DAY) DO UPDATE SET LOANS = LOANS + 1; "
+      "  INSERT INTO ACTIVE_LOANS SELECT NEW.BORROWER_NAME, 1 "
+      "    WHERE NEW.RETURN_DATE IS NULL "
+      "    ON CONFLICT(BORROWER_NAME) DO UPDATE SET ACTIVE = ACTIVE + 1; "
+      "END;");
+  if (rc == SQLITE_OK)
+    rc = exec_sql(db, triggers);
+  sqlite3_free(triggers);
+  return rc;
+}
+
+// Append new steps to the end with the next version number. Never edit a
+// step that has shipped; write a new one instead.
+static const Migration migrations[] = {
+    {1, "books, loans and users tables", NULL, create_base_tables},
+    {2, "availability flag and covering indexes for the book list",
+     "ALTER TABLE BOOKS ADD COLUMN ON_LOAN INT NOT NULL DEFAULT 0;"
+     "CREATE INDEX IF NOT EXISTS LOANS_BY_BOOK ON LOANS(BOOK_ID, RETURN_DATE);"
+     "UPDATE BOOKS SET ON_LOAN = EXISTS(SELECT 1 FROM LOANS "
+     "  WHERE BOOK_ID = BOOKS.ID AND RETURN_DATE IS NULL);"
+     // ON_LOAN mirrors LOANS so availability can be sorted by an index
+     "CREATE TRIGGER IF NOT EXISTS LOANS_SET_ON_LOAN AFTER INSERT ON LOANS "
+     "WHEN NEW.RETURN_DATE IS NULL BEGIN "
+     "  UPDATE BOOKS SET ON_LOAN = 1 WHERE ID = NEW.BOOK_ID; "
+     "END;"
+     "CREATE TRIGGER IF NOT EXISTS LOANS_UPDATE_ON_LOAN AFTER UPDATE ON LOANS "
+     "BEGIN "
+     "  UPDATE BOOKS SET ON_LOAN = EXISTS(SELECT 1 FROM LOANS "
+     "    WHERE BOOK_ID = BOOKS.ID AND RETURN_DATE IS NULL) "
+     "  WHERE ID IN (OLD.BOOK_ID, NEW.BOOK_ID); "
+     "END;"
+     "CREATE TRIGGER IF NOT EXISTS LOANS_CLEAR_ON_LOAN AFTER DELETE ON LOANS "
+     "BEGIN "
+     "  UPDATE BOOKS SET ON_LOAN = EXISTS(SELECT 1 FROM LOANS "
+     "    WHERE BOOK_ID = BOOKS.ID AND RETURN_DATE IS NULL) "
+     "  WHERE ID = OLD.BOOK_ID; "
+     "END;"
+     // One covering index per sort key; ID breaks ties for keyset paging
+     "CREATE INDEX IF NOT EXISTS BOOKS_BY_TITLE "
+     "  ON BOOKS(TITLE, ID, AUTHOR, PUBLISHER, YEAR, ON_LOAN);"
+     "CREATE INDEX IF NOT EXISTS BOOKS_BY_AUTHOR "
+     "  ON BOOKS(AUTHOR, ID, TITLE, PUBLISHER, YEAR, ON_LOAN);"
+     "CREATE INDEX IF NOT EXISTS BOOKS_BY_YEAR "
+     "  ON BOOKS(YEAR, ID, TITLE, AUTHOR, PUBLISHER, ON_LOAN);"
+     "CREATE INDEX IF NOT EXISTS BOOKS_BY_AVAILABILITY "
+     "  ON BOOKS(ON_LOAN, TITLE, ID, AUTHOR, PUBLISHER, YEAR);",
+     NULL},
+    {3, "ISBN/barcode column",
+     "ALTER TABLE BOOKS ADD COLUMN ISBN TEXT;"
+     // NULLs do not collide, so books without a code are fine
+     "CREATE UNIQUE INDEX IF NOT EXISTS BOOKS_BY_ISBN ON BOOKS(ISBN);",
+     NULL},
+    {4, "circulation aggregates for the statistics dashboard",
+     // Lifetime counts only ever grow, so they survive return_book deleting
+     // the loan rows
+     "CREATE TABLE IF NOT EXISTS BOOK_LOAN_COUNTS("
+     "  BOOK_ID INTEGER PRIMARY KEY, LOANS INT NOT NULL);"
+     "CREATE INDEX IF NOT EXISTS BOOK_LOAN_COUNTS_BY_LOANS "
+     "  ON BOOK_LOAN_COUNTS(LOANS);"
+     "CREATE TABLE IF NOT EXISTS LOANS_PER_DAY("
+     "  DAY TEXT PRIMARY KEY, LOANS INT NOT NULL) WITHOUT ROWID;"
+     "CREATE TABLE IF NOT EXISTS ACTIVE_LOANS("
+     "  BORROWER_NAME TEXT PRIMARY KEY, ACTIVE INT NOT NULL) WITHOUT ROWID;"
+     "CREATE INDEX IF NOT EXISTS ACTIVE_LOANS_BY_COUNT "
+     "  ON ACTIVE_LOANS(ACTIVE);"
+     "INSERT INTO BOOK_LOAN_COUNTS "
+     "  SELECT BOOK_ID, COUNT(*) FROM LOANS GROUP BY BOOK_ID;"
+     "INSERT INTO LOANS_PER_DAY "
+     "  SELECT date(BORROW_DATE), COUNT(*) FROM LOANS "
+     "  WHERE date(BORROW_DATE) IS NOT NULL GROUP BY 1;"
+     "INSERT INTO ACTIVE_LOANS "
+     "  SELECT BORROWER_NAME, COUNT(*) FROM LOANS "
+     "  WHERE RETURN_DATE IS NULL GROUP BY 1;"
+     "CREATE TRIGGER IF NOT EXISTS LOANS_COUNT_INSERT AFTER INSERT ON LOANS "
+     "BEGIN "
+     "  INSERT INTO BOOK_LOAN_COUNTS VALUES (NEW.BOOK_ID, 1) "
+     "    ON CONFLICT(BOOK_ID) DO UPDATE SET LOANS = LOANS + 1; "
+     "  INSERT INTO LOANS_PER_DAY SELECT date(NEW.BORROW_DATE), 1 "
+     "    WHERE date(NEW.BORROW_DATE) IS NOT NULL "
+     "    ON CONFLICT(DAY) DO UPDATE SET LOANS = LOANS + 1; "
+     "  INSERT INTO ACTIVE_LOANS SELECT NEW.BORROWER_NAME, 1 "
+     "    WHERE NEW.RETURN_DATE IS NULL "
+     "    ON CONFLICT(BORROWER_NAME) DO UPDATE SET ACTIVE = ACTIVE + 1; "
+     "END;"
+     "CREATE TRIGGER IF NOT EXISTS LOANS_COUNT_UPDATE "
+     "AFTER UPDATE OF BORROWER_NAME, RETURN_DATE ON LOANS "
+     "BEGIN "
+     "  UPDATE ACTIVE_LOANS SET ACTIVE = ACTIVE - 1 "
+     "    WHERE BORROWER_NAME = OLD.BORROWER_NAME "
+     "    AND OLD.RETURN_DATE IS NULL; "
+     "  INSERT INTO ACTIVE_LOANS SELECT NEW.BORROWER_NAME, 1 "
+     "    WHERE NEW.RETURN_DATE IS NULL "
+     "    ON CONFLICT(BORROWER_NAME) DO UPDATE SET ACTIVE = ACTIVE + 1; "
+     "  DELETE FROM ACTIVE_LOANS "
+     "    WHERE BORROWER_NAME = OLD.BORROWER_NAME AND ACTIVE <= 0; "
+     "END;"
+     "CREATE TRIGGER IF NOT EXISTS LOANS_COUNT_DELETE AFTER DELETE ON LOANS "
+     "WHEN OLD.RETURN_DATE IS NULL BEGIN "
+     "  UPDATE ACTIVE_LOANS SET ACTIVE = ACTIVE - 1 "
+     "    WHERE BORROWER_NAME = OLD.BORROWER_NAME; "
+     "  DELETE FROM ACTIVE_LOANS "
+     "    WHERE BORROWER_NAME = OLD.BORROWER_NAME AND ACTIVE <= 0; "
+     "END;",
+     NULL},
+    {5, "borrowed-together recommendations",
+     // Loan rows are deleted on return, so who borrowed what is kept here.
+     // New pairs get increasing rowids, which double as dirty stamps.
+     "CREATE TABLE IF NOT EXISTS BORROWER_BOOKS("
+     "  BORROWER_NAME TEXT NOT NULL, BOOK_ID INT NOT NULL,"
+     "  UNIQUE(BORROWER_NAME, BOOK_ID));"
+     "CREATE INDEX IF NOT EXISTS BORROWER_BOOKS_BY_BOOK "
+     "  ON BORROWER_BOOKS(BOOK_ID, BORROWER_NAME);"
+     "CREATE TABLE IF NOT EXISTS BOOK_NEIGHBOURS("
+     "  BOOK_ID INT NOT NULL, RANK INT NOT NULL, NEIGHBOUR_ID INT NOT NULL,"
+     "  SHARED INT NOT NULL, PRIMARY KEY(BOOK_ID, RANK)) WITHOUT ROWID;"
+     "CREATE TABLE IF NOT EXISTS RECS_DIRTY("
+     "  BOOK_ID INTEGER PRIMARY KEY, STAMP INT NOT NULL);"
+     "INSERT OR IGNORE INTO BORROWER_BOOKS(BORROWER_NAME, BOOK_ID) "
+     "  SELECT BORROWER_NAME, BOOK_ID FROM LOANS ORDER BY ID;"
+     "INSERT INTO RECS_DIRTY "
+     "  SELECT BOOK_ID, MAX(rowid) FROM BORROWER_BOOKS GROUP BY BOOK_ID;"
+     "CREATE TRIGGER IF NOT EXISTS LOANS_BORROWER_BOOKS AFTER INSERT ON LOANS "
+     "BEGIN "
+     "  INSERT OR IGNORE INTO BORROWER_BOOKS(BORROWER_NAME, BOOK_ID) "
+     "    VALUES (NEW.BORROWER_NAME, NEW.BOOK_ID); "
+     "END;"
+     // A new pair changes the counts of every book in that borrower's basket
+     "CREATE TRIGGER IF NOT EXISTS BORROWER_BOOKS_DIRTY "
+     "AFTER INSERT ON BORROWER_BOOKS BEGIN "
+     "  INSERT OR REPLACE INTO RECS_DIRTY "
+     "    SELECT BOOK_ID, NEW.rowid FROM BORROWER_BOOKS "
+     "    WHERE BORROWER_NAME = NEW.BORROWER_NAME; "
+     "END;",
+     NULL},
+    {6, "attachments table",
+     // DATA stays the last column so reading a row's metadata stops before
+     // its overflow pages; listings are covered by the index alone
+     "CREATE TABLE IF NOT EXISTS ATTACHMENTS("
+     "  ID INTEGER PRIMARY KEY AUTOINCREMENT,"
+     "  BOOK_ID INT NOT NULL,"
+     "  NAME TEXT NOT NULL,"
+     "  MIME TEXT NOT NULL,"
+     "  SIZE INT NOT NULL,"
+     "  DATA BLOB NOT NULL,"
+     "  FOREIGN KEY (BOOK_ID) REFERENCES BOOKS(ID));"
+     "CREATE INDEX IF NOT EXISTS ATTACHMENTS_BY_BOOK "
+     "  ON ATTACHMENTS(BOOK_ID, NAME, MIME, SIZE);",
+     NULL},
+    {7, "edit audit trail",
+     // DIFF holds only the changed fields, see audit_encode
+     "CREATE TABLE IF NOT EXISTS BOOK_EDITS("
+     "  ID INTEGER PRIMARY KEY AUTOINCREMENT,"
+     "  BOOK_ID INT NOT NULL,"
+     "  EDITED_AT INT NOT NULL,"
+     "  EDITOR TEXT NOT NULL,"
+     "  UNDONE_BY INT,"
+     "  DIFF BLOB NOT NULL,"
+     "  FOREIGN KEY (BOOK_ID) REFERENCES BOOKS(ID));"
+     "CREATE INDEX IF NOT EXISTS BOOK_EDITS_BY_BOOK ON BOOK_EDITS(BOOK_ID);",
+     NULL},
+    {8, "Turkish case-folded search keys",
+     // Folded once per write by search_key(), so searches compare bytes
+     "ALTER TABLE BOOKS ADD COLUMN TITLE_KEY TEXT;"
+     "ALTER TABLE BOOKS ADD COLUMN AUTHOR_KEY TEXT;"
+     "UPDATE BOOKS SET TITLE_KEY = search_key(TITLE), "
+     "  AUTHOR_KEY = search_key(AUTHOR);"
+     "CREATE INDEX IF NOT EXISTS BOOKS_BY_TITLE_KEY ON BOOKS(TITLE_KEY);"
+     "CREATE INDEX IF NOT EXISTS BOOKS_BY_AUTHOR_KEY ON BOOKS(AUTHOR_KEY);"
+     "CREATE TRIGGER IF NOT EXISTS BOOKS_KEYS_INSERT AFTER INSERT ON BOOKS "
+     "BEGIN "
+     "  UPDATE BOOKS SET TITLE_KEY = search_key(NEW.TITLE), "
+     "    AUTHOR_KEY = search_key(NEW.AUTHOR) WHERE ID = NEW.ID; "
+     "END;"
+     "CREATE TRIGGER IF NOT EXISTS BOOKS_KEYS_UPDATE "
+     "AFTER UPDATE OF TITLE, AUTHOR ON BOOKS "
+     "BEGIN "
+     "  UPDATE BOOKS SET TITLE_KEY = search_key(NEW.TITLE), "
+     "    AUTHOR_KEY = search_key(NEW.AUTHOR) WHERE ID = NEW.ID; "
+     "END;",
+     NULL},
+    {9, "loan dates as Unix epochs", NULL, epoch_loan_dates},
+    {10, "item types, fee schedule and late fees",
+     // Each database carries its own schedule, so every branch sets its fees
+     "ALTER TABLE BOOKS ADD COLUMN ITEM_TYPE INT NOT NULL DEFAULT 0;"
+     "CREATE TABLE IF NOT EXISTS FEE_SCHEDULE("
+     "  ITEM_TYPE INTEGER PRIMARY KEY,"
+     "  NAME TEXT NOT NULL,"
+     "  GRACE_DAYS INT NOT NULL,"
+     "  DAILY_FEE INT NOT NULL,"
+     "  MAX_FEE INT NOT NULL);"
+     "INSERT OR IGNORE INTO FEE_SCHEDULE VALUES "
+     "  (0, 'book', 2, 100, 5000), (1, 'periodical', 0, 200, 3000),"
+     "  (2, 'media', 0, 500, 10000), (3, 'reference', 0, 1000, 20000);"
+     // Snapshot of the last fee run; it outlives the loan rows it names
+     "CREATE TABLE IF NOT EXISTS LOAN_FEES("
+     "  LOAN_ID INTEGER PRIMARY KEY,"
+     "  BOOK_ID INT NOT NULL,"
+     "  BORROWER_NAME TEXT NOT NULL,"
+     "  DAYS_LATE INT NOT NULL,"
+     "  FEE INT NOT NULL,"
+     "  AS_OF INT NOT NULL);",
+     NULL},
+    {11, "author and publisher counts for browsing",
+     // Browsing pages through these instead of grouping BOOKS; the
+     // triggers keep them exact and drop names with no books left
+     "CREATE TABLE IF NOT EXISTS AUTHOR_COUNTS("
+     "  AUTHOR TEXT PRIMARY KEY, BOOKS INT NOT NULL) WITHOUT ROWID;"
+     "CREATE TABLE IF NOT EXISTS PUBLISHER_COUNTS("
+     "  PUBLISHER TEXT PRIMARY KEY, BOOKS INT NOT NULL) WITHOUT ROWID;"
+     "INSERT INTO AUTHOR_COUNTS "
+     "  SELECT AUTHOR, COUNT(*) FROM BOOKS GROUP BY AUTHOR;"
+     "INSERT INTO PUBLISHER_COUNTS "
+     "  SELECT PUBLISHER, COUNT(*) FROM BOOKS GROUP BY PUBLISHER;"
+     // A publisher's books in ID order, like BOOKS_BY_AUTHOR for an author
+     "CREATE INDEX IF NOT EXISTS BOOKS_BY_PUBLISHER "
+     "  ON BOOKS(PUBLISHER, ID, TITLE, AUTHOR, YEAR, ON_LOAN);"
+     "CREATE TRIGGER IF NOT EXISTS BOOKS_GROUP_COUNTS_INSERT "
+     "AFTER INSERT ON BOOKS BEGIN "
+     "  INSERT INTO AUTHOR_COUNTS VALUES (NEW.AUTHOR, 1) "
+     "    ON CONFLICT(AUTHOR) DO UPDATE SET BOOKS = BOOKS + 1; "
+     "  INSERT INTO PUBLISHER_COUNTS VALUES (NEW.PUBLISHER, 1) "
+     "    ON CONFLICT(PUBLISHER) DO UPDATE SET BOOKS = BOOKS + 1; "
+     "END;"
+     "CREATE TRIGGER IF NOT EXISTS BOOKS_GROUP_COUNTS_UPDATE "
+     "AFTER UPDATE OF AUTHOR, PUBLISHER ON BOOKS BEGIN "
+     "  UPDATE AUTHOR_COUNTS SET BOOKS = BOOKS - 1 "
+     "    WHERE AUTHOR = OLD.AUTHOR AND OLD.AUTHOR IS NOT NEW.AUTHOR; "
+     "  DELETE FROM AUTHOR_COUNTS WHERE AUTHOR = OLD.AUTHOR AND BOOKS <= 0; "
+     "  INSERT INTO AUTHOR_COUNTS SELECT NEW.AUTHOR, 1 "
+     "    WHERE OLD.AUTHOR IS NOT NEW.AUTHOR "
+     "    ON CONFLICT(AUTHOR) DO UPDATE SET BOOKS = BOOKS + 1; "
+     "  UPDATE PUBLISHER_COUNTS SET BOOKS = BOOKS - 1 "
+     "    WHERE PUBLISHER = OLD.PUBLISHER "
+     "    AND OLD.PUBLISHER IS NOT NEW.PUBLISHER; "
+     "  DELETE FROM PUBLISHER_COUNTS "
+     "    WHERE PUBLISHER = OLD.PUBLISHER AND BOOKS <= 0; "
+     "  INSERT INTO PUBLISHER_COUNTS SELECT NEW.PUBLISHER, 1 "
+     "    WHERE OLD.PUBLISHER IS NOT NEW.PUBLISHER "
+     "    ON CONFLICT(PUBLISHER) DO UPDATE SET BOOKS = BOOKS + 1; "
+     "END;"
+     "CREATE TRIGGER IF NOT EXISTS BOOKS_GROUP_COUNTS_DELETE "
+     "AFTER DELETE ON BOOKS BEGIN "
+     "  UPDATE AUTHOR_COUNTS SET BOOKS = BOOKS - 1 WHERE AUTHOR = OLD.AUTHOR; "
+     "  DELETE FROM AUTHOR_COUNTS WHERE AUTHOR = OLD.AUTHOR AND BOOKS <= 0; "
+     "  UPDATE PUBLISHER_COUNTS SET BOOKS = BOOKS - 1 "
+     "    WHERE PUBLISHER = OLD.PUBLISHER; "
+     "  DELETE FROM PUBLISHER_COUNTS "
+     "    WHERE PUBLISHER = OLD.PUBLISHER AND BOOKS <= 0; "
+     "END;",
+     NULL},
+    {12, "duplicate suggestions",
+     // Rebuilt by find_duplicates; BOOK_ID is the record a merge keeps
+     "CREATE TABLE IF NOT EXISTS BOOK_DUPLICATES("
+     "  BOOK_ID INT NOT NULL, DUPLICATE_ID INT NOT NULL,"
+     "  SIMILARITY INT NOT NULL,"
+     "  PRIMARY KEY(BOOK_ID, DUPLICATE_ID)) WITHOUT ROWID;"
+     "CREATE INDEX IF NOT EXISTS BOOK_DUPLICATES_BY_DUPLICATE "
+     "  ON BOOK_DUPLICATES(DUPLICATE_ID);",
+     NULL},
+    {13, "one active loan per book", NULL, one_active_loan},
+    {14, "search keys written by the program, I and i folded together",
+     // The triggers needed search_key(), which only this program defines,
+     // so any other writer failed; the write paths now bind the keys
+     "DROP TRIGGER IF EXISTS BOOKS_KEYS_INSERT;"
+     "DROP TRIGGER IF EXISTS BOOKS_KEYS_UPDATE;"
+     "UPDATE BOOKS SET TITLE_KEY = search_key(TITLE), "
+     "  AUTHOR_KEY = search_key(AUTHOR) "
+     "WHERE TITLE_KEY IS NOT search_key(TITLE) "
+     "  OR AUTHOR_KEY IS NOT search_key(AUTHOR);",
+     NULL},
+};
+
+int schema_version(sqlite3 *db) {
+  sqlite3_stmt *stmt;
+  int version = -1;
+  if (sqlite3_prepare_v2(db, "PRAGMA user_version;", -1, &stmt, 0) ==
+      SQLITE_OK) {
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+      version = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+  }
+  return version;
+}
+
+static int exec_sql(sqlite3 *db, const char *sql) {
+  char *zErrMsg = 0;
+  int rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "SQL error: %s\n", zErrMsg);
+    sqlite3_free(zErrMsg);
+  }
+  return rc;
+}
+
+// Runs one step and bumps user_version inside the same transaction, so a
+// failed step leaves the database at the previous version.
+static int run_migration(sqlite3 *db, const Migration *m) {
+  int rc = exec_sql(db, "BEGIN IMMEDIATE;");
+  if (rc != SQLITE_OK)
+    return rc;
+
+  // Another process may have migrated while we waited for the lock
+  if (schema_version(db) >= m->version)
+    return exec_sql(db, "COMMIT;");
+
+  rc = m->sql != NULL ? exec_sql(db, m->sql) : m->apply(db);
+  if (rc == SQLITE_OK) {
+    char sql[64];
+    snprintf(sql, sizeof(sql), "PRAGMA user_version = %d;", m->version);
+    rc = exec_sql(db, sql);
+  }
+
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Migration %d (%s) failed\n", m->version, m->description);
+    exec_sql(db, "ROLLBACK;");
+    return rc;
+  }
+  return exec_sql(db, "COMMIT;");
+}
+
+// Brings the schema up to date. On a current database this is a single
+// PRAGMA read.
+int migrate_database(sqlite3 *db) {
+  // Needed by migrations 8 and 14
+  if (register_search_key_function(db) != SQLITE_OK)
+    return SQLITE_ERROR;
+
+  int version = schema_version(db);
+  if (version < 0)
+    return SQLITE_ERROR;
+
+  int count = sizeof(migrations) / sizeof(migrations[0]);
+  for (int i = 0; i < count; i++) {
+    if (migrations[i].version <= version)
+      continue;
+    int rc = run_migration(db, &migrations[i]);
+    if (rc != SQLITE_OK)
+      return rc;
+  }
+  return SQLITE_OK;
+}
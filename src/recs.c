@@ -0,0 +1,497 @@
+#include "../include/recs.h"
+#include "../include/config.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct {
+  int *items;
+  int count;
+  int capacity;
+} IntArray;
+
+static int push_int(IntArray *array, int value) {
+  if (array->count == array->capacity) {
+    int capacity = array->capacity ? array->capacity * 2 : 1024;
+    int *items = realloc(array->items, capacity * sizeof(int));
+    if (items == NULL)
+      return SQLITE_NOMEM;
+    array->items = items;
+    array->capacity = capacity;
+  }
+  array->items[array->count++] = value;
+  return SQLITE_OK;
+}
+
+static int compare_ints(const void *a, const void *b) {
+  int x = *(const int *)a, y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+typedef struct {
+  int book;   // dense index
+  int shared; // co-occurrence count
+} Neighbour;
+
+// Everything the counting threads need, in compressed sparse row form. Books
+// are renumbered densely in id order, so comparing dense indexes compares ids.
+typedef struct {
+  IntArray ids;           // dense index -> book id
+  IntArray basket_start;  // basket b holds basket_items[start[b]..start[b+1])
+  IntArray basket_items;  // dense book indexes
+  int *book_start;        // book k is in book_baskets[start[k]..start[k+1])
+  int *book_baskets;      // basket numbers
+  IntArray targets;       // dense indexes whose lists are rebuilt
+  Neighbour *out;         // RECS_TOP_K slots per target
+  int *out_count;
+  pthread_mutex_t lock;   // guards next
+  int next;               // first target not claimed by a thread yet
+} CoBuild;
+
+static int dense_index(const CoBuild *build, int id) {
+  const int *found = bsearch(&id, build->ids.items, build->ids.count,
+                             sizeof(int), compare_ints);
+  return found != NULL ? (int)(found - build->ids.items) : -1;
+}
+
+static int step_int_rows(sqlite3_stmt *stmt, IntArray *array) {
+  int rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    if (push_int(array, sqlite3_column_int(stmt, 0)) != SQLITE_OK)
+      return SQLITE_NOMEM;
+  }
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+// Reads the target books and the baskets that contain them. Baskets come
+// ordered by borrower, so each one is a run of consecutive rows; runs that
+// are too small to pair anything or too big to be a real patron are dropped.
+static int load_baskets(sqlite3 *db, int full, sqlite3_int64 stamp,
+                        CoBuild *build, RecsReport *report) {
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(
+      db,
+      full ? "SELECT DISTINCT BOOK_ID FROM BORROWER_BOOKS WHERE rowid <= ?;"
+           : "SELECT BOOK_ID FROM RECS_DIRTY WHERE STAMP <= ?;",
+      -1, &stmt, 0);
+  if (rc != SQLITE_OK)
+    return rc;
+  sqlite3_bind_int64(stmt, 1, stamp);
+  IntArray raw_targets = {0};
+  rc = step_int_rows(stmt, &raw_targets);
+  sqlite3_finalize(stmt);
+
+  const char *sql =
+      full ? "SELECT BORROWER_NAME, BOOK_ID FROM BORROWER_BOOKS "
+             "ORDER BY BORROWER_NAME;"
+           : "SELECT BORROWER_NAME, BOOK_ID FROM BORROWER_BOOKS "
+             "WHERE BORROWER_NAME IN (SELECT b.BORROWER_NAME FROM RECS_DIRTY d "
+             "  JOIN BORROWER_BOOKS b ON b.BOOK_ID = d.BOOK_ID) "
+             "ORDER BY BORROWER_NAME;";
+  if (rc == SQLITE_OK && raw_targets.count > 0)
+    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+  else
+    stmt = NULL;
+
+  // Raw ids first; they are renumbered once every id is known
+  char borrower[100] = "";
+  int basket_begin = 0;
+  while (stmt != NULL && rc == SQLITE_OK) {
+    int step = sqlite3_step(stmt);
+    const char *name =
+        step == SQLITE_ROW ? (const char *)sqlite3_column_text(stmt, 0) : NULL;
+    if (name == NULL || strcmp(name, borrower) != 0) {
+      int size = build->basket_items.count - basket_begin;
+      if (size < 2 || size > RECS_MAX_BASKET)
+        build->basket_items.count = basket_begin;
+      else if (push_int(&build->basket_start, basket_begin) != SQLITE_OK)
+        rc = SQLITE_NOMEM;
+      basket_begin = build->basket_items.count;
+      snprintf(borrower, sizeof(borrower), "%s", name ? name : "");
+    }
+    if (step != SQLITE_ROW) {
+      rc = step == SQLITE_DONE ? rc : step;
+      break;
+    }
+    if (rc == SQLITE_OK)
+      rc = push_int(&build->basket_items, sqlite3_column_int(stmt, 1));
+  }
+  sqlite3_finalize(stmt);
+  if (rc == SQLITE_OK)
+    rc = push_int(&build->basket_start, build->basket_items.count);
+
+  // Dense numbering over every basket item and target
+  for (int i = 0; rc == SQLITE_OK && i < build->basket_items.count; i++)
+    rc = push_int(&build->ids, build->basket_items.items[i]);
+  for (int i = 0; rc == SQLITE_OK && i < raw_targets.count; i++)
+    rc = push_int(&build->ids, raw_targets.items[i]);
+  if (rc == SQLITE_OK && build->ids.count > 0) {
+    qsort(build->ids.items, build->ids.count, sizeof(int), compare_ints);
+    int unique = 1;
+    for (int i = 1; i < build->ids.count; i++) {
+      if (build->ids.items[i] != build->ids.items[unique - 1])
+        build->ids.items[unique++] = build->ids.items[i];
+    }
+    build->ids.count = unique;
+  }
+  for (int i = 0; rc == SQLITE_OK && i < build->basket_items.count; i++)
+    build->basket_items.items[i] =
+        dense_index(build, build->basket_items.items[i]);
+  for (int i = 0; rc == SQLITE_OK && i < raw_targets.count; i++)
+    rc = push_int(&build->targets, dense_index(build, raw_targets.items[i]));
+  free(raw_targets.items);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  // Inverted index: the baskets each book appears in
+  int books = build->ids.count;
+  int baskets = build->basket_start.count - 1;
+  build->book_start = calloc(books + 1, sizeof(int));
+  build->book_baskets = malloc((build->basket_items.count + 1) * sizeof(int));
+  if (build->book_start == NULL || build->book_baskets == NULL)
+    return SQLITE_NOMEM;
+  for (int i = 0; i < build->basket_items.count; i++)
+    build->book_start[build->basket_items.items[i] + 1]++;
+  for (int k = 0; k < books; k++)
+    build->book_start[k + 1] += build->book_start[k];
+  int *fill = malloc((books + 1) * sizeof(int));
+  if (fill == NULL)
+    return SQLITE_NOMEM;
+  memcpy(fill, build->book_start, (books + 1) * sizeof(int));
+  for (int b = 0; b < baskets; b++) {
+    for (int i = build->basket_start.items[b];
+         i < build->basket_start.items[b + 1]; i++)
+      build->book_baskets[fill[build->basket_items.items[i]]++] = b;
+  }
+  free(fill);
+
+  report->targets = build->targets.count;
+  report->baskets = baskets;
+  return SQLITE_OK;
+}
+
+// Orders neighbours by shared borrowers, then by lower book id.
+static int ranks_before(int shared, int book, const Neighbour *other) {
+  return shared > other->shared ||
+         (shared == other->shared && book < other->book);
+}
+
+static void *count_main(void *arg) {
+  CoBuild *build = arg;
+  int books = build->ids.count;
+  int *counts = calloc(books, sizeof(int));
+  int *touched = malloc(books * sizeof(int));
+  if (counts == NULL || touched == NULL) {
+    free(counts);
+    free(touched);
+    return (void *)1;
+  }
+
+  while (1) {
+    pthread_mutex_lock(&build->lock);
+    int first = build->next;
+    build->next += RECS_CHUNK;
+    pthread_mutex_unlock(&build->lock);
+    if (first >= build->targets.count)
+      break;
+    int last = first + RECS_CHUNK < build->targets.count ? first + RECS_CHUNK
+                                                          : build->targets.count;
+
+    for (int t = first; t < last; t++) {
+      int book = build->targets.items[t];
+      int n_touched = 0;
+      for (int j = build->book_start[book]; j < build->book_start[book + 1];
+           j++) {
+        int basket = build->book_baskets[j];
+        for (int i = build->basket_start.items[basket];
+             i < build->basket_start.items[basket + 1]; i++) {
+          int other = build->basket_items.items[i];
+          if (other != book && counts[other]++ == 0)
+            touched[n_touched++] = other;
+        }
+      }
+
+      // Keep the best RECS_TOP_K with an insertion into a tiny sorted array
+      Neighbour *top = &build->out[(size_t)t * RECS_TOP_K];
+      int n = 0;
+      for (int i = 0; i < n_touched; i++) {
+        int other = touched[i];
+        int shared = counts[other];
+        counts[other] = 0;
+        if (n == RECS_TOP_K && !ranks_before(shared, other, &top[n - 1]))
+          continue;
+        int pos = n < RECS_TOP_K ? n++ : n - 1;
+        while (pos > 0 && ranks_before(shared, other, &top[pos - 1])) {
+          top[pos] = top[pos - 1];
+          pos--;
+        }
+        top[pos].book = other;
+        top[pos].shared = shared;
+      }
+      build->out_count[t] = n;
+    }
+  }
+
+  free(counts);
+  free(touched);
+  return NULL;
+}
+
+static int count_neighbours(CoBuild *build, RecsReport *report) {
+  int targets = build->targets.count;
+  build->out = malloc(((size_t)targets * RECS_TOP_K + 1) * sizeof(Neighbour));
+  build->out_count = calloc(targets + 1, sizeof(int));
+  if (build->out == NULL || build->out_count == NULL)
+    return SQLITE_NOMEM;
+
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = cores > 0 ? (int)cores : 1;
+  if (threads > RECS_MAX_THREADS)
+    threads = RECS_MAX_THREADS;
+  // Small incremental refreshes are not worth a thread per core
+  if (threads > (targets + RECS_CHUNK - 1) / RECS_CHUNK)
+    threads = (targets + RECS_CHUNK - 1) / RECS_CHUNK;
+  if (threads < 1)
+    threads = 1;
+
+  pthread_t ids[RECS_MAX_THREADS];
+  int started = 0;
+  int failed = 0;
+  build->next = 0;
+  for (int i = 1; i < threads; i++) {
+    if (pthread_create(&ids[started], NULL, count_main, build) == 0)
+      started++;
+  }
+  // The calling thread counts too
+  failed |= count_main(build) != NULL;
+  for (int i = 0; i < started; i++) {
+    void *result;
+    pthread_join(ids[i], &result);
+    failed |= result != NULL;
+  }
+  report->threads = started + 1;
+  return failed ? SQLITE_NOMEM : SQLITE_OK;
+}
+
+static int exec_sql(sqlite3 *db, const char *sql) {
+  char *zErrMsg = 0;
+  int rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "SQL error: %s\n", zErrMsg);
+    sqlite3_free(zErrMsg);
+  }
+  return rc;
+}
+
+// Replaces the neighbour lists of the targets and clears the dirty marks the
+// snapshot covered. Books marked again after the snapshot keep a newer stamp
+// and stay dirty for the next refresh.
+static int write_neighbours(sqlite3 *db, int full, sqlite3_int64 stamp,
+                            const CoBuild *build, RecsReport *report) {
+  int rc = exec_sql(db, "BEGIN IMMEDIATE;");
+  if (rc != SQLITE_OK)
+    return rc;
+
+  sqlite3_stmt *clear = NULL, *insert = NULL, *clean = NULL;
+  if (full)
+    rc = exec_sql(db, "DELETE FROM BOOK_NEIGHBOURS;");
+  else
+    rc = sqlite3_prepare_v2(db, "DELETE FROM BOOK_NEIGHBOURS WHERE BOOK_ID = ?;",
+                            -1, &clear, 0);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_prepare_v2(db,
+                            "INSERT INTO BOOK_NEIGHBOURS (BOOK_ID, RANK, "
+                            "NEIGHBOUR_ID, SHARED) VALUES (?, ?, ?, ?);",
+                            -1, &insert, 0);
+
+  for (int t = 0; rc == SQLITE_OK && t < build->targets.count; t++) {
+    int book_id = build->ids.items[build->targets.items[t]];
+    if (clear != NULL) {
+      sqlite3_bind_int(clear, 1, book_id);
+      rc = sqlite3_step(clear) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode(db);
+      sqlite3_reset(clear);
+    }
+    const Neighbour *top = &build->out[(size_t)t * RECS_TOP_K];
+    for (int r = 0; rc == SQLITE_OK && r < build->out_count[t]; r++) {
+      sqlite3_bind_int(insert, 1, book_id);
+      sqlite3_bind_int(insert, 2, r);
+      sqlite3_bind_int(insert, 3, build->ids.items[top[r].book]);
+      sqlite3_bind_int(insert, 4, top[r].shared);
+      rc = sqlite3_step(insert) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode(db);
+      sqlite3_reset(insert);
+      report->rows++;
+    }
+  }
+
+  if (rc == SQLITE_OK)
+    rc = sqlite3_prepare_v2(db, "DELETE FROM RECS_DIRTY WHERE STAMP <= ?;", -1,
+                            &clean, 0);
+  if (rc == SQLITE_OK) {
+    sqlite3_bind_int64(clean, 1, stamp);
+    rc = sqlite3_step(clean) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode(db);
+  }
+  sqlite3_finalize(clear);
+  sqlite3_finalize(insert);
+  sqlite3_finalize(clean);
+
+  if (rc == SQLITE_OK)
+    rc = exec_sql(db, "COMMIT;");
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+    sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+  }
+  return rc;
+}
+
+int refresh_recommendations(sqlite3 *db, int full, RecsReport *report) {
+  memset(report, 0, sizeof(*report));
+  CoBuild build;
+  memset(&build, 0, sizeof(build));
+  pthread_mutex_init(&build.lock, NULL);
+
+  // One read transaction so the stamp and the baskets match
+  double started = now_seconds();
+  int rc = exec_sql(db, "BEGIN;");
+  sqlite3_int64 stamp = 0;
+  if (rc == SQLITE_OK) {
+    sqlite3_stmt *stmt;
+    rc = sqlite3_prepare_v2(
+        db, "SELECT IFNULL(MAX(rowid), 0) FROM BORROWER_BOOKS;", -1, &stmt, 0);
+    if (rc == SQLITE_OK) {
+      if (sqlite3_step(stmt) == SQLITE_ROW)
+        stamp = sqlite3_column_int64(stmt, 0);
+      sqlite3_finalize(stmt);
+      rc = load_baskets(db, full, stamp, &build, report);
+    }
+    sqlite3_exec(db, "COMMIT;", 0, 0, 0);
+  }
+  report->load_seconds = now_seconds() - started;
+
+  if (rc == SQLITE_OK && (full || build.targets.count > 0)) {
+    started = now_seconds();
+    rc = count_neighbours(&build, report);
+    report->count_seconds = now_seconds() - started;
+
+    started = now_seconds();
+    if (rc == SQLITE_OK)
+      rc = write_neighbours(db, full, stamp, &build, report);
+    report->write_seconds = now_seconds() - started;
+  }
+
+  free(build.ids.items);
+  free(build.basket_start.items);
+  free(build.basket_items.items);
+  free(build.book_start);
+  free(build.book_baskets);
+  free(build.targets.items);
+  free(build.out);
+  free(build.out_count);
+  pthread_mutex_destroy(&build.lock);
+  return rc;
+}
+
+int book_recommendations(sqlite3 *db, int book_id,
+                         Recommendation out[RECS_TOP_K]) {
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(
+      db,
+      "SELECT BOOKS.ID, BOOKS.TITLE, BOOKS.AUTHOR, BOOK_NEIGHBOURS.SHARED "
+      "FROM BOOK_NEIGHBOURS JOIN BOOKS ON BOOKS.ID = "
+      "BOOK_NEIGHBOURS.NEIGHBOUR_ID "
+      "WHERE BOOK_NEIGHBOURS.BOOK_ID = ? ORDER BY BOOK_NEIGHBOURS.RANK;",
+      -1, &stmt, 0);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+
+  sqlite3_bind_int(stmt, 1, book_id);
+  int count = 0;
+  while (count < RECS_TOP_K && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    Recommendation *rec = &out[count++];
+    rec->id = sqlite3_column_int(stmt, 0);
+    snprintf(rec->title, sizeof(rec->title), "%s",
+             (const char *)sqlite3_column_text(stmt, 1));
+    snprintf(rec->author, sizeof(rec->author), "%s",
+             (const char *)sqlite3_column_text(stmt, 2));
+    rec->shared = sqlite3_column_int(stmt, 3);
+  }
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_ROW || rc == SQLITE_DONE ? count : -1;
+}
+
+static pthread_t refresher_thread;
+static pthread_mutex_t refresher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t refresher_wake = PTHREAD_COND_INITIALIZER;
+static int refresher_running = 0;
+static unsigned refresher_interval;
+static sqlite3 *refresher_db;
+
+static void *refresher_main(void *arg) {
+  (void)arg;
+
+  pthread_mutex_lock(&refresher_lock);
+  while (refresher_running) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += refresher_interval;
+    while (refresher_running &&
+           pthread_cond_timedwait(&refresher_wake, &refresher_lock,
+                                  &deadline) == 0) {
+    }
+    if (!refresher_running)
+      break;
+    pthread_mutex_unlock(&refresher_lock);
+
+    RecsReport report;
+    refresh_recommendations(refresher_db, 0, &report);
+
+    pthread_mutex_lock(&refresher_lock);
+  }
+  pthread_mutex_unlock(&refresher_lock);
+  return NULL;
+}
+
+int recs_refresher_start(const char *db_path, unsigned interval) {
+  if (refresher_running || interval == 0)
+    return 1;
+
+  if (sqlite3_open(db_path, &refresher_db) != SQLITE_OK) {
+    fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(refresher_db));
+    sqlite3_close(refresher_db);
+    return 1;
+  }
+  sqlite3_busy_timeout(refresher_db, config.busy_timeout);
+  refresher_interval = interval;
+  refresher_running = 1;
+
+  if (pthread_create(&refresher_thread, NULL, refresher_main, NULL) != 0) {
+    refresher_running = 0;
+    sqlite3_close(refresher_db);
+    return 1;
+  }
+  return 0;
+}
+
+void recs_refresher_stop(void) {
+  pthread_mutex_lock(&refresher_lock);
+  if (!refresher_running) {
+    pthread_mutex_unlock(&refresher_lock);
+    return;
+  }
+  refresher_running = 0;
+  pthread_cond_signal(&refresher_wake);
+  pthread_mutex_unlock(&refresher_lock);
+
+  pthread_join(refresher_thread, NULL);
+  sqlite3_close(refresher_db);
+}
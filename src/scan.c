@@ -0,0 +1,135 @@
+#include "../include/scan.h"
+#include "../include/changelog.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+int normalize_code(const char *code, char *out, size_t size) {
+  size_t len = 0;
+  for (; *code != '\0'; code++) {
+    unsigned char c = (unsigned char)*code;
+    if (!isalnum(c))
+      continue;
+    if (len + 1 >= size)
+      return 1;
+    out[len++] = (char)toupper(c);
+  }
+  out[len] = '\0';
+  if (len == 0)
+    return 1;
+
+  // ISBN-10: nine digits and a check character, weighted 10 down to 1
+  if (len == 10 && size > 13) {
+    int sum = 0;
+    for (int i = 0; i < 10; i++) {
+      int digit;
+      if (isdigit((unsigned char)out[i]))
+        digit = out[i] - '0';
+      else if (i == 9 && out[i] == 'X')
+        digit = 10;
+      else
+        return 0; // some other ten character barcode
+      sum += digit * (10 - i);
+    }
+    if (sum % 11 != 0)
+      return 0;
+
+    // Same book as 978 + the first nine digits with an EAN-13 check digit
+    char isbn13[14] = "978";
+    memcpy(isbn13 + 3, out, 9);
+    sum = 0;
+    for (int i = 0; i < 12; i++)
+      sum += (isbn13[i] - '0') * (i % 2 ? 3 : 1);
+    isbn13[12] = (char)('0' + (10 - sum % 10) % 10);
+    isbn13[13] = '\0';
+    memcpy(out, isbn13, sizeof(isbn13));
+  }
+  return 0;
+}
+
+int scanner_open(sqlite3 *db, Scanner *scanner) {
+  memset(scanner, 0, sizeof(*scanner));
+  int rc = sqlite3_prepare_v3(
+      db,
+      "SELECT BOOKS.ID, BOOKS.TITLE, BOOKS.AUTHOR, BOOKS.PUBLISHER, "
+      "BOOKS.YEAR, LOANS.BORROWER_NAME, BOOKS.ISBN "
+      "FROM BOOKS "
+      "LEFT JOIN LOANS ON BOOKS.ID = LOANS.BOOK_ID AND LOANS.RETURN_DATE IS "
+      "NULL WHERE BOOKS.ISBN = ?;",
+      -1, SQLITE_PREPARE_PERSISTENT, &scanner->lookup, 0);
+  // The NOT EXISTS guard makes check-and-insert one atomic statement
+  if (rc == SQLITE_OK)
+    rc = sqlite3_prepare_v3(
+        db,
+        "INSERT INTO LOANS (BOOK_ID, BORROWER_NAME, BORROW_DATE) "
+        "SELECT ?1, ?2, unixepoch() WHERE NOT EXISTS ("
+        "  SELECT 1 FROM LOANS WHERE BOOK_ID = ?1 AND RETURN_DATE IS NULL);",
+        -1, SQLITE_PREPARE_PERSISTENT, &scanner->borrow, 0);
+  // Same effect as return_book
+  if (rc == SQLITE_OK)
+    rc = sqlite3_prepare_v3(db, "DELETE FROM LOANS WHERE BOOK_ID = ?;", -1,
+                            SQLITE_PREPARE_PERSISTENT, &scanner->give_back, 0);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+    scanner_close(scanner);
+  }
+  return rc;
+}
+
+void scanner_close(Scanner *scanner) {
+  sqlite3_finalize(scanner->lookup);
+  sqlite3_finalize(scanner->borrow);
+  sqlite3_finalize(scanner->give_back);
+  memset(scanner, 0, sizeof(*scanner));
+}
+
+static int lookup_code(Scanner *scanner, const char *code, Book *book,
+                       int *found) {
+  BookList list = {0};
+  sqlite3_bind_text(scanner->lookup, 1, code, -1, SQLITE_STATIC);
+  int rc = collect_books(scanner->lookup, &list);
+  sqlite3_reset(scanner->lookup);
+  *found = list.count > 0;
+  if (*found)
+    *book = list.items[0];
+  free_book_list(&list);
+  return rc;
+}
+
+static int step_write(sqlite3_stmt *stmt, int *changed) {
+  int rc = sqlite3_step(stmt);
+  *changed = sqlite3_changes(sqlite3_db_handle(stmt)) > 0;
+  sqlite3_reset(stmt);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+int scan_item(Scanner *scanner, ScanMode mode, const char *code,
+              const char *borrower, ScanOutcome *outcome, Book *book) {
+  char key[sizeof(book->isbn)];
+  int found = 0;
+  int rc = SQLITE_OK;
+
+  memset(book, 0, sizeof(*book));
+  if (normalize_code(code, key, sizeof(key)) == 0)
+    rc = lookup_code(scanner, key, book, &found);
+  if (rc != SQLITE_OK || !found) {
+    *outcome = SCAN_UNKNOWN_CODE;
+    return rc;
+  }
+
+  int changed;
+  if (mode == SCAN_BORROW) {
+    sqlite3_bind_int(scanner->borrow, 1, book->id);
+    sqlite3_bind_text(scanner->borrow, 2, borrower, -1, SQLITE_STATIC);
+    rc = step_write(scanner->borrow, &changed);
+    *outcome = changed ? SCAN_DONE : SCAN_ALREADY_BORROWED;
+  } else {
+    sqlite3_bind_int(scanner->give_back, 1, book->id);
+    rc = step_write(scanner->give_back, &changed);
+    *outcome = changed ? SCAN_DONE : SCAN_NOT_BORROWED;
+  }
+  if (rc == SQLITE_OK && changed)
+    changelog_loan(mode == SCAN_BORROW ? CHANGE_BORROW : CHANGE_RETURN,
+                   book->id, borrower);
+  return rc;
+}
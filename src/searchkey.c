@@ -0,0 +1,184 @@
+#include "../include/searchkey.h"
+#include <stdio.h>
+#include <string.h>
+
+// Decodes one UTF-8 sequence at p into *c. Returns its length, or 0 if the
+// bytes are not a well-formed sequence: overlong forms, surrogates and code
+// points past U+10FFFF count as malformed too.
+static int decode_utf8(const unsigned char *p, unsigned *c) {
+  if (p[0] < 0x80) {
+    *c = p[0];
+    return 1;
+  }
+  int len = p[0] >= 0xF0 ? 4 : p[0] >= 0xE0 ? 3 : p[0] >= 0xC2 ? 2 : 0;
+  if (len == 0 || p[0] >= 0xF5)
+    return 0;
+  unsigned value = p[0] & (0x7F >> len);
+  for (int i = 1; i < len; i++) {
+    if ((p[i] & 0xC0) != 0x80)
+      return 0;
+    value = (value << 6) | (p[i] & 0x3F);
+  }
+  static const unsigned min_value[] = {0, 0, 0x80, 0x800, 0x10000};
+  if (value < min_value[len] || (value >= 0xD800 && value <= 0xDFFF) ||
+      value > 0x10FFFF)
+    return 0;
+  *c = value;
+  return len;
+}
+
+static int encode_utf8(unsigned c, char *out) {
+  if (c < 0x80) {
+    out[0] = (char)c;
+    return 1;
+  }
+  if (c < 0x800) {
+    out[0] = (char)(0xC0 | c >> 6);
+    out[1] = (char)(0x80 | (c & 0x3F));
+    return 2;
+  }
+  if (c < 0x10000) {
+    out[0] = (char)(0xE0 | c >> 12);
+    out[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+    out[2] = (char)(0x80 | (c & 0x3F));
+    return 3;
+  }
+  out[0] = (char)(0xF0 | c >> 18);
+  out[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+  out[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+  out[3] = (char)(0x80 | (c & 0x3F));
+  return 4;
+}
+
+static unsigned fold_code_point(unsigned c) {
+  // I, İ, ı and i share one key letter, so "IŞIK" finds "ışık" and
+  // "INTRODUCTION" still finds "introduction"
+  if (c == 0x130 || c == 0x131)
+    return 'i';
+  if (c >= 'A' && c <= 'Z')
+    return c + 32;
+  if (c >= 0xC0 && c <= 0xDE && c != 0xD7)
+    return c + 32; // À..Þ, Ç, Ö, Ü
+  // Latin Extended-A pairs capitals with the next code point (Ğ, Ş, ...),
+  // except for the odd-aligned runs around ĸ and ŉ
+  if ((c >= 0x100 && c <= 0x137) || (c >= 0x14A && c <= 0x177))
+    return c & 1 ? c : c + 1;
+  if ((c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17E))
+    return c & 1 ? c + 1 : c;
+  if (c == 0x178)
+    return 0xFF; // Ÿ
+  return c;
+}
+
+int fold_search_key(const char *text, char *out, int size) {
+  const unsigned char *p = (const unsigned char *)text;
+  int len = 0;
+  while (*p != '\0') {
+    unsigned c;
+    int n = decode_utf8(p, &c);
+    if (n == 0) {
+      if (len + 1 >= size)
+        break;
+      out[len++] = (char)*p++;
+      continue;
+    }
+    p += n;
+
+    unsigned folded = fold_code_point(c);
+    // "I" plus U+0307 is the decomposed spelling of İ
+    if (c == 'I' && p[0] == 0xCC && p[1] == 0x87)
+      p += 2;
+
+    char bytes[4];
+    int width = encode_utf8(folded, bytes);
+    if (len + width >= size)
+      break;
+    for (int i = 0; i < width; i++)
+      out[len++] = bytes[i];
+  }
+  out[len] = '\0';
+  return len;
+}
+
+static void search_key_function(sqlite3_context *context, int argc,
+                                sqlite3_value **argv) {
+  (void)argc;
+  const unsigned char *text = sqlite3_value_text(argv[0]);
+  if (text == NULL) {
+    sqlite3_result_null(context);
+    return;
+  }
+  // Folding never makes a string longer
+  int size = sqlite3_value_bytes(argv[0]) + 1;
+  char *key = sqlite3_malloc(size);
+  if (key == NULL) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  int len = fold_search_key((const char *)text, key, size);
+  sqlite3_result_text(context, key, len, sqlite3_free);
+}
+
+int bind_search_key(sqlite3_stmt *stmt, int param, const char *text) {
+  int size = (int)strlen(text) + 1;
+  char *key = sqlite3_malloc(size);
+  if (key == NULL)
+    return SQLITE_NOMEM;
+  int len = fold_search_key(text, key, size);
+  return sqlite3_bind_text(stmt, param, key, len, sqlite3_free);
+}
+
+int register_search_key_function(sqlite3 *db) {
+  return sqlite3_create_function_v2(
+      db, "search_key", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+      search_key_function, NULL, NULL, NULL);
+}
+
+// Rows whose keys are already right are left alone, so a rebuild after a
+// clean migration writes nothing
+static int rebuild_schema_keys(sqlite3 *db, const char *schema, int *rows) {
+  char *sql = sqlite3_mprintf("UPDATE \"%w\".BOOKS "
+                              "SET TITLE_KEY = search_key(TITLE), "
+                              "AUTHOR_KEY = search_key(AUTHOR) "
+                              "WHERE TITLE_KEY IS NOT search_key(TITLE) "
+                              "OR AUTHOR_KEY IS NOT search_key(AUTHOR);",
+                              schema);
+  if (sql == NULL)
+    return SQLITE_NOMEM;
+  char *zErrMsg = 0;
+  int rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
+  sqlite3_free(sql);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "SQL error: %s\n", zErrMsg);
+    sqlite3_free(zErrMsg);
+    return rc;
+  }
+  *rows += sqlite3_changes(db);
+  return SQLITE_OK;
+}
+
+int rebuild_search_keys(sqlite3 *db, int *rows) {
+  *rows = 0;
+  int rc = register_search_key_function(db);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  // main and every attached branch file; temp holds no books
+  sqlite3_stmt *stmt;
+  rc = sqlite3_prepare_v2(db,
+                          "SELECT name FROM pragma_database_list "
+                          "WHERE name <> 'temp';",
+                          -1, &stmt, 0);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    const char *schema = (const char *)sqlite3_column_text(stmt, 0);
+    rc = rebuild_schema_keys(db, schema, rows);
+    if (rc != SQLITE_OK)
+      break;
+  }
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
@@ -0,0 +1,185 @@
+#include "../include/sha256.h"
+#include <string.h>
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(Sha256 *ctx, const uint8_t *block) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++) {
+    w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+           (uint32_t)block[i * 4 + 2] << 8 | (uint32_t)block[i * 4 + 3];
+  }
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2],
+           d = ctx->state[3], e = ctx->state[4], f = ctx->state[5],
+           g = ctx->state[6], h = ctx->state[7];
+
+  for (int i = 0; i < 64; i++) {
+    uint32_t s1 = ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25);
+    uint32_t ch = (e & f) ^ (~e & g);
+    uint32_t t1 = h + s1 + ch + K[i] + w[i];
+    uint32_t s0 = ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22);
+    uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+    uint32_t t2 = s0 + maj;
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+
+  ctx->state[0] += a;
+  ctx->state[1] += b;
+  ctx->state[2] += c;
+  ctx->state[3] += d;
+  ctx->state[4] += e;
+  ctx->state[5] += f;
+  ctx->state[6] += g;
+  ctx->state[7] += h;
+}
+
+void sha256_init(Sha256 *ctx) {
+  static const uint32_t init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                   0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                   0x1f83d9ab, 0x5be0cd19};
+  memcpy(ctx->state, init, sizeof(init));
+  ctx->length = 0;
+  ctx->used = 0;
+}
+
+void sha256_update(Sha256 *ctx, const void *data, size_t len) {
+  const uint8_t *p = data;
+  ctx->length += len;
+
+  while (len > 0) {
+    size_t n = 64 - ctx->used;
+    if (n > len)
+      n = len;
+    memcpy(ctx->buffer + ctx->used, p, n);
+    ctx->used += n;
+    p += n;
+    len -= n;
+
+    if (ctx->used == 64) {
+      sha256_block(ctx, ctx->buffer);
+      ctx->used = 0;
+    }
+  }
+}
+
+void sha256_final(Sha256 *ctx, uint8_t digest[SHA256_DIGEST_SIZE]) {
+  uint64_t bits = ctx->length * 8;
+  uint8_t pad = 0x80;
+  sha256_update(ctx, &pad, 1);
+
+  pad = 0;
+  while (ctx->used != 56)
+    sha256_update(ctx, &pad, 1);
+
+  uint8_t len[8];
+  for (int i = 0; i < 8; i++)
+    len[i] = (uint8_t)(bits >> (56 - 8 * i));
+  sha256_update(ctx, len, 8);
+
+  for (int i = 0; i < 8; i++) {
+    digest[i * 4] = (uint8_t)(ctx->state[i] >> 24);
+    digest[i * 4 + 1] = (uint8_t)(ctx->state[i] >> 16);
+    digest[i * 4 + 2] = (uint8_t)(ctx->state[i] >> 8);
+    digest[i * 4 + 3] = (uint8_t)ctx->state[i];
+  }
+}
+
+// Prepares the inner and outer HMAC states so they can be reused for every
+// message signed with the same key.
+static void hmac_prepare(const uint8_t *key, size_t key_len, Sha256 *inner,
+                         Sha256 *outer) {
+  uint8_t block[64] = {0};
+  if (key_len > 64) {
+    Sha256 ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, key, key_len);
+    sha256_final(&ctx, block);
+  } else {
+    memcpy(block, key, key_len);
+  }
+
+  uint8_t ipad[64], opad[64];
+  for (int i = 0; i < 64; i++) {
+    ipad[i] = block[i] ^ 0x36;
+    opad[i] = block[i] ^ 0x5c;
+  }
+
+  sha256_init(inner);
+  sha256_update(inner, ipad, 64);
+  sha256_init(outer);
+  sha256_update(outer, opad, 64);
+}
+
+static void hmac_finish(const Sha256 *inner, const Sha256 *outer,
+                        const uint8_t *msg, size_t msg_len,
+                        uint8_t digest[SHA256_DIGEST_SIZE]) {
+  Sha256 ctx = *inner;
+  uint8_t inner_digest[SHA256_DIGEST_SIZE];
+  sha256_update(&ctx, msg, msg_len);
+  sha256_final(&ctx, inner_digest);
+
+  ctx = *outer;
+  sha256_update(&ctx, inner_digest, sizeof(inner_digest));
+  sha256_final(&ctx, digest);
+}
+
+void hmac_sha256(const uint8_t *key, size_t key_len, const uint8_t *msg,
+                 size_t msg_len, uint8_t digest[SHA256_DIGEST_SIZE]) {
+  Sha256 inner, outer;
+  hmac_prepare(key, key_len, &inner, &outer);
+  hmac_finish(&inner, &outer, msg, msg_len, digest);
+}
+
+// PBKDF2 with a single output block, which is all a 32 byte hash needs.
+void pbkdf2_sha256(const uint8_t *password, size_t password_len,
+                   const uint8_t *salt, size_t salt_len, uint32_t iterations,
+                   uint8_t out[SHA256_DIGEST_SIZE]) {
+  Sha256 inner, outer;
+  hmac_prepare(password, password_len, &inner, &outer);
+
+  // U1 = HMAC(password, salt || INT(1))
+  Sha256 ctx = inner;
+  static const uint8_t block_index[4] = {0, 0, 0, 1};
+  uint8_t inner_digest[SHA256_DIGEST_SIZE];
+  sha256_update(&ctx, salt, salt_len);
+  sha256_update(&ctx, block_index, sizeof(block_index));
+  sha256_final(&ctx, inner_digest);
+  ctx = outer;
+  sha256_update(&ctx, inner_digest, sizeof(inner_digest));
+
+  uint8_t u[SHA256_DIGEST_SIZE];
+  sha256_final(&ctx, u);
+  memcpy(out, u, sizeof(u));
+
+  for (uint32_t i = 1; i < iterations; i++) {
+    hmac_finish(&inner, &outer, u, sizeof(u), u);
+    for (int j = 0; j < SHA256_DIGEST_SIZE; j++)
+      out[j] ^= u[j];
+  }
+}
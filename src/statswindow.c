@@ -0,0 +1,190 @@
+#include "../include/statswindow.h"
+#include "../include/auth.h"
+#include "../include/cache.h"
+#include "../include/config.h"
+#include "../include/db.h"
+#include "../include/userwindow.h"
+#include "../include/window.h"
+#include <ncurses.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <time.h>
+
+typedef struct {
+  char label[100];
+  int count;
+} StatRow;
+
+// Everything the dashboard shows. It is read only from the aggregate
+// tables, so loading it costs a few index reads however long LOANS is.
+typedef struct {
+  StatRow top_books[STATS_TOP_ROWS];
+  int top_book_count;
+  StatRow days[STATS_DAYS];
+  int day_count;
+  StatRow borrowers[STATS_TOP_ROWS];
+  int borrower_count;
+  int active_loans;
+  int month_loans; // borrowed since the 1st, returned or not
+  int overdue_loans;
+} Stats;
+
+static int read_rows(sqlite3 *db, const char *sql, StatRow *rows, int max,
+                     int *count) {
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  if (sqlite3_bind_parameter_count(stmt) > 0)
+    sqlite3_bind_int(stmt, 1, max);
+  *count = 0;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW && *count < max) {
+    const unsigned char *label = sqlite3_column_text(stmt, 0);
+    snprintf(rows[*count].label, sizeof(rows[0].label), "%s",
+             label != NULL ? (const char *)label : "");
+    rows[*count].count = sqlite3_column_int(stmt, 1);
+    (*count)++;
+  }
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_DONE || rc == SQLITE_ROW ? SQLITE_OK : rc;
+}
+
+static int stats_job(sqlite3 *db, void *arg) {
+  Stats *stats = arg;
+  // One snapshot, so the three panels agree with each other
+  int rc = sqlite3_exec(db, "BEGIN;", 0, 0, 0);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  rc = read_rows(db,
+                 "SELECT COALESCE(BOOKS.TITLE, '(deleted book)'), C.LOANS "
+                 "FROM BOOK_LOAN_COUNTS AS C "
+                 "LEFT JOIN BOOKS ON BOOKS.ID = C.BOOK_ID "
+                 "ORDER BY C.LOANS DESC LIMIT ?;",
+                 stats->top_books, STATS_TOP_ROWS, &stats->top_book_count);
+  if (rc == SQLITE_OK)
+    rc = read_rows(db,
+                   "SELECT DAY, LOANS FROM LOANS_PER_DAY "
+                   "ORDER BY DAY DESC LIMIT ?;",
+                   stats->days, STATS_DAYS, &stats->day_count);
+  if (rc == SQLITE_OK)
+    rc = read_rows(db,
+                   "SELECT BORROWER_NAME, ACTIVE FROM ACTIVE_LOANS "
+                   "ORDER BY ACTIVE DESC LIMIT ?;",
+                   stats->borrowers, STATS_TOP_ROWS, &stats->borrower_count);
+  if (rc == SQLITE_OK) {
+    StatRow total;
+    int found;
+    rc = read_rows(db, "SELECT '', TOTAL(ACTIVE) FROM ACTIVE_LOANS;",
+                   &total, 1, &found);
+    stats->active_loans = found ? total.count : 0;
+  }
+
+  // Returned loans leave LOANS, so the month is summed from the per-day
+  // counts, which keep every loan. Their days are UTC dates; the month
+  // edge moves by the local offset.
+  time_t now = time(NULL);
+  char first_day[16];
+  strftime(first_day, sizeof(first_day), "%Y-%m-01", localtime(&now));
+  if (rc == SQLITE_OK) {
+    sqlite3_stmt *stmt;
+    rc = sqlite3_prepare_v2(db,
+                            "SELECT TOTAL(LOANS) FROM LOANS_PER_DAY "
+                            "WHERE DAY >= ?;",
+                            -1, &stmt, 0);
+    if (rc == SQLITE_OK) {
+      sqlite3_bind_text(stmt, 1, first_day, -1, SQLITE_STATIC);
+      rc = sqlite3_step(stmt);
+      stats->month_loans =
+          rc == SQLITE_ROW ? (int)sqlite3_column_int64(stmt, 0) : 0;
+      rc = rc == SQLITE_ROW ? SQLITE_OK : rc;
+      sqlite3_finalize(stmt);
+    }
+  }
+  if (rc == SQLITE_OK) {
+    LoanRow oldest;
+    if (list_overdue_loans(db, now - config.loan_days * 86400LL, &oldest, 1,
+                           &stats->overdue_loans) < 0)
+      rc = SQLITE_ERROR;
+  }
+
+  sqlite3_exec(db, "COMMIT;", 0, 0, 0);
+  return rc;
+}
+
+static void show_stats(void) {
+  Stats stats;
+  int rc = run_db_job(stats_job, &stats);
+
+  printw("###############################################\n");
+  printw("#            Circulation Statistics           #\n");
+  printw("###############################################\n");
+
+  if (rc != SQLITE_OK) {
+    printw("\nError: %s\n", sqlite3_errstr(rc));
+    printw("\nPress any key to return to the menu...\n");
+    refresh();
+    getch();
+    return;
+  }
+
+  printw("\nMost borrowed titles\n");
+  for (int i = 0; i < stats.top_book_count; i++)
+    printw("  %2d. %-40.40s %6d\n", i + 1, stats.top_books[i].label,
+           stats.top_books[i].count);
+  if (stats.top_book_count == 0)
+    printw("  No loans yet.\n");
+
+  // Bars are scaled to the busiest day shown
+  int busiest = 1;
+  for (int i = 0; i < stats.day_count; i++) {
+    if (stats.days[i].count > busiest)
+      busiest = stats.days[i].count;
+  }
+  printw("\nLoans per day (last %d days with loans)\n", STATS_DAYS);
+  for (int i = 0; i < stats.day_count; i++) {
+    int width = stats.days[i].count * 40 / busiest;
+    printw("  %-10.10s %6d ", stats.days[i].label, stats.days[i].count);
+    for (int j = 0; j < width; j++)
+      addch('#');
+    printw("\n");
+  }
+
+  printw("\nActive loans per borrower (%d active in total, %d borrowed this "
+         "month, %d overdue after %d days)\n",
+         stats.active_loans, stats.month_loans, stats.overdue_loans,
+         config.loan_days);
+  for (int i = 0; i < stats.borrower_count; i++)
+    printw("  %-40.40s %6d\n", stats.borrowers[i].label,
+           stats.borrowers[i].count);
+
+  // For sizing result_cache_entries: a low hit rate with a full cache means
+  // popular queries are being evicted
+  ResultCacheStats cache;
+  result_cache_stats(&cache);
+  unsigned long long lookups = cache.hits + cache.misses;
+  printw("\nResult cache: %d/%d entries, %llu hits, %llu misses (%.0f%%)\n",
+         cache.entries, cache.capacity, cache.hits, cache.misses,
+         lookups ? 100.0 * cache.hits / lookups : 0.0);
+
+  printw("\nPress any key to return to the menu...\n");
+  refresh();
+  getch();
+}
+
+// Borrower names are on the screen, so it is for the checkout desk only
+void stats_menu() {
+  const User *user = login_menu();
+  if (user == NULL)
+    return;
+  if (has_permission(user, ACTION_CHECKOUT_DESK)) {
+    show_stats();
+  } else {
+    printw("You are not allowed to do that.\n");
+    refresh();
+    getch();
+  }
+  // Like the user menu, leaving ends the session
+  logout_user();
+}
@@ -1,50 +1,95 @@
 #include "../include/userwindow.h"
+#include "../include/auth.h"
+#include "../include/bookwindow.h"
+#include "../include/branch.h"
 #include "../include/db.h"
+#include "../include/scan.h"
 #include "../include/window.h"
 #include <ncurses.h>
 #include <sqlite3.h>
-#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+typedef struct {
+  const char *username;
+  const char *password;
+  const User *user;
+} LoginJob;
+
+// Hashing the password and reading USERS both belong on the worker
+static int login_job(sqlite3 *db, void *arg) {
+  LoginJob *job = arg;
+  job->user = authenticate_user(db, job->username, job->password);
+  return SQLITE_OK;
+}
 
-char *username;
+const User *login_menu() {
+  const User *user = current_user();
+  if (user != NULL)
+    return user;
 
-void user_menu() {
   printw("###############################################\n");
-  printw("#                 User Menu                  #\n");
+  printw("#                   Login                     #\n");
   printw("###############################################\n");
 
-  printw("Enter your username: ");
+  char username[100];
+  char password[100];
 
   echo();
-  refresh();
-
-  username = (char *)malloc(100);
-  if (!username) {
-    log_error(MEMORY_ALLOCATION_ERROR, "Failed to allocate memory for username");
-    return;
-  }
-
   while (1) {
-    getstr(username);
+    printw("Enter your username: ");
+    refresh();
+    getnstr(username, sizeof(username) - 1);
     if (strlen(username) == 0) {
-      printw("Username cannot be empty. Please enter your username: ");
-      refresh();
+      printw("Username cannot be empty.\n");
     } else {
       break;
     }
   }
 
+  // Keep the password off the screen
+  noecho();
+  printw("Enter your password: ");
+  refresh();
+  getnstr(password, sizeof(password) - 1);
+
+  LoginJob job = {username, password, NULL};
+  run_db_job(login_job, &job);
+  user = job.user;
+  memset(password, 0, sizeof(password));
+
+  if (user == NULL) {
+    printw("\n\nInvalid username or password!\n");
+    printw("Press any key to return to the menu...\n");
+    refresh();
+    getch();
+  }
+
   clear_screen();
+  return user;
+}
+
+// The desk is shared, so the session ends whenever the menu is left; the
+// next person has to log in again.
+void user_menu() {
+  const User *user = login_menu();
+  if (user == NULL)
+    return;
 
   typedef struct {
     char *name;
     void (*func)();
+    Action action;
   } UserMenu;
 
-  UserMenu user_options[] = {{"Borrow Book", borrow_book_menu},
-                             {"Return Book", return_book_menu},
-                             {"List Borrowed Books", NULL},
-                             {"Search Book by Title", NULL}};
+  UserMenu user_options[] = {
+      {"Borrow Book", borrow_book_menu, ACTION_BORROW_BOOK},
+      {"Return Book", return_book_menu, ACTION_RETURN_BOOK},
+      {"Borrow Several Books", borrow_basket_menu, ACTION_BORROW_BOOK},
+      {"Return Several Books", return_basket_menu, ACTION_RETURN_BOOK},
+      {"Scan Desk", scan_desk, ACTION_CHECKOUT_DESK},
+      {"List Borrowed Books", list_borrowed_books, ACTION_VIEW_BOOKS},
+      {"Search Book by Title", search_book, ACTION_VIEW_BOOKS}};
 
   int highlight = 0;
   int size = sizeof(user_options) / sizeof(user_options[0]);
@@ -52,7 +97,7 @@ void user_menu() {
   while (1) {
     clear_screen();
 
-    printw("Welcome, %s\n", username);
+    printw("Welcome, %s\n", user->username);
 
     printw("###############################################\n");
     printw("#                 User Menu                  #\n");
@@ -66,7 +111,7 @@ void user_menu() {
         attroff(A_REVERSE); // Remove highlighting
     }
 
-    printw("\nUse Arrow Keys to navigate, Enter to select, q to quit: ");
+    printw("\nUse Arrow Keys to navigate, Enter to select, q to log out: ");
     refresh();
 
     int ch = getch();
@@ -78,16 +123,82 @@ void user_menu() {
       highlight = (highlight == size - 1) ? 0 : highlight + 1;
       break;
     case '\n': // Enter key
+      if (!has_permission(current_user(), user_options[highlight].action)) {
+        printw("\n\nYou are not allowed to do that.\n");
+        refresh();
+        getch();
+        break;
+      }
       call_menu(user_options[highlight].func);
+      logout_user();
       return;
+    case 'l': // Logout key
     case 'q': // Quit key
+      logout_user();
       return;
     default:
       break;
     }
   }
+}
 
-  free(username);
+// A borrow or return request handed to the database worker
+typedef struct {
+  int book_id;
+  const char *borrower;
+  int found;
+  int result;
+  int branch_id; // 0 is the main database
+} LoanJob;
+
+static int borrow_job(sqlite3 *db, void *arg) {
+  LoanJob *job = arg;
+  // Check if the book exists
+  int rc = branch_book_exists(db, job->branch_id, job->book_id, &job->found);
+  if (rc == SQLITE_OK && job->found)
+    job->result =
+        branch_borrow_book(db, job->branch_id, job->book_id, job->borrower);
+  return rc;
+}
+
+static int return_job(sqlite3 *db, void *arg) {
+  LoanJob *job = arg;
+  // Check if the book exists
+  int rc = branch_book_exists(db, job->branch_id, job->book_id, &job->found);
+  if (rc == SQLITE_OK && job->found)
+    job->result = branch_return_book(db, job->branch_id, job->book_id,
+                                     job->borrower);
+  return rc;
+}
+
+// Book IDs are per branch, so multi-branch setups also ask for the branch
+static void read_branch(LoanJob *job) {
+  if (branch_count() == 0)
+    return;
+  printw("Enter branch ID (0 for %s): ", branch_name(0));
+  refresh();
+  scanw("%d", &job->branch_id);
+}
+
+// Copies the logged-in user's name for jobs that run on the worker thread.
+// Returns 1, after telling the user, when the session has expired.
+static int capture_username(char *out, size_t size) {
+  if (!current_username(out, size))
+    return 0;
+  printw("\nSession expired; log in again.\n");
+  printw("Press any key to return to the menu...\n");
+  refresh();
+  getch();
+  return 1;
+}
+
+// The borrower whose loans the session may return: NULL at the checkout
+// desk, which takes back any loan, otherwise the user's own name.
+static int capture_returner(char *out, size_t size, const char **returner) {
+  if (capture_username(out, size))
+    return 1;
+  *returner = has_permission(current_user(), ACTION_CHECKOUT_DESK) ? NULL : out;
+  return 0;
 }
 
 void borrow_book_menu() {
@@ -95,49 +206,35 @@ void borrow_book_menu() {
   printw("#               Borrow Book                   #\n");
   printw("###############################################\n");
 
+  char username[100];
+  if (capture_username(username, sizeof(username)))
+    return;
+
   echo();
 
   printw("Enter book ID to borrow: ");
   refresh();
-  int book_id;
-  scanw("%d", &book_id);
-
-  // Open the database
-  sqlite3 *db;
-  sqlite3_open(DB_FILE, &db);
-
-  // Check if the book exists
-  sqlite3_stmt *stmt;
-  char check_sql[200];
-  sprintf(check_sql, "SELECT * FROM BOOKS WHERE ID = %d", book_id);
-  sqlite3_prepare_v2(db, check_sql, -1, &stmt, 0);
-
-  if (sqlite3_step(stmt) != SQLITE_ROW) {
+  LoanJob job = {0, username, 0, 0, 0};
+  scanw("%d", &job.book_id);
+  read_branch(&job);
+  noecho();
+
+  int rc = run_db_job(borrow_job, &job);
+
+  if (rc == SQLITE_INTERRUPT) {
+    printw("\nCancelled.\n");
+  } else if (rc != SQLITE_OK) {
+    printw("\nError: %s\n", sqlite3_errstr(rc));
+  } else if (!job.found) {
     // If book is not found
     printw("\nBook not found!\n");
-    sqlite3_finalize(stmt);
-    sqlite3_close(db);
-    refresh();
-    getch();
-    return;
-  }
-
-  // Close the statement for reuse
-  sqlite3_finalize(stmt);
-
-  // Borrow the book
-  int err = borrow_book(db, book_id, username);
-
-  if (err) {
+  } else if (job.result) {
     // If book is already borrowed
     printw("\nBook is already borrowed\n");
-    return;
   } else {
     printw("\nBook borrowed successfully!\n");
   }
 
-  // Close the database connection
-  sqlite3_close(db);
   // Prompt to continue
   printw("Press any key to return to the menu...\n");
   refresh();
@@ -149,45 +246,336 @@ void return_book_menu() {
   printw("#               Return Book                   #\n");
   printw("###############################################\n");
 
+  char username[100];
+  LoanJob job = {0, NULL, 0, 0, 0};
+  if (capture_returner(username, sizeof(username), &job.borrower))
+    return;
+
   echo();
 
   printw("Enter book ID to return: ");
   refresh();
-  int book_id;
-  scanw("%d", &book_id);
-
-  // Open the database
-  sqlite3 *db;
-  sqlite3_open(DB_FILE, &db);
+  scanw("%d", &job.book_id);
+  read_branch(&job);
+  noecho();
 
-  // Check if the book exists
-  sqlite3_stmt *stmt;
-  char check_sql[200];
-  sprintf(check_sql, "SELECT * FROM BOOKS WHERE ID = %d", book_id);
-  sqlite3_prepare_v2(db, check_sql, -1, &stmt, 0);
+  int rc = run_db_job(return_job, &job);
 
-  if (sqlite3_step(stmt) != SQLITE_ROW) {
+  if (rc == SQLITE_INTERRUPT) {
+    printw("\nCancelled.\n");
+  } else if (rc != SQLITE_OK) {
+    printw("\nError: %s\n", sqlite3_errstr(rc));
+  } else if (!job.found) {
     // If book is not found
     printw("\nBook not found!\n");
-    sqlite3_finalize(stmt);
-    sqlite3_close(db);
+  } else if (job.result == 1) {
+    printw(job.borrower != NULL ? "\nYou have not borrowed this book\n"
+                                : "\nBook is not borrowed\n");
+  } else if (job.result) {
+    printw("\nError: %s\n", sqlite3_errstr(job.result));
+  } else {
+    printw("\nBook returned successfully!\n");
+  }
+
+  // Prompt to continue
+  printw("Press any key to return to the menu...\n");
+  refresh();
+  getch();
+}
+
+#define BASKET_MAX_ITEMS 32
+
+// A whole basket of loans, committed in one transaction on the worker
+typedef struct {
+  int book_ids[BASKET_MAX_ITEMS];
+  int count;
+  int borrowing;
+  const char *borrower; // when returning, NULL takes back any loan
+  LoanStatus statuses[BASKET_MAX_ITEMS];
+} BasketJob;
+
+static int basket_job(sqlite3 *db, void *arg) {
+  BasketJob *job = arg;
+  if (job->borrowing)
+    return borrow_books(db, job->book_ids, job->count, job->borrower,
+                        job->statuses);
+  return return_books(db, job->book_ids, job->count, job->borrower,
+                      job->statuses);
+}
+
+static const char *loan_status_text(LoanStatus status) {
+  switch (status) {
+  case LOAN_OK:
+    return "ok";
+  case LOAN_NOT_FOUND:
+    return "book not found";
+  case LOAN_ALREADY_BORROWED:
+    return "already borrowed";
+  case LOAN_NOT_BORROWED:
+    return "not borrowed";
+  case LOAN_BORROWED_BY_OTHER:
+    return "borrowed by someone else";
+  }
+  return "";
+}
+
+static void basket_menu(const char *verb, int borrowing,
+                        const char *borrower) {
+  printw("###############################################\n");
+  printw("#            %-6s Several Books              #\n", verb);
+  printw("###############################################\n");
+
+  BasketJob job;
+  memset(&job, 0, sizeof(job));
+  job.borrowing = borrowing;
+  job.borrower = borrower;
+
+  // Collect the basket first; nothing touches the database yet
+  echo();
+  while (job.count < BASKET_MAX_ITEMS) {
+    printw("Book ID %d (empty line to finish): ", job.count + 1);
     refresh();
-    getch();
-    return;
+    char line[32];
+    getnstr(line, sizeof(line) - 1);
+    if (line[0] == '\0')
+      break;
+
+    int id;
+    if (sscanf(line, "%d", &id) != 1) {
+      printw("  Not a number, try again.\n");
+      continue;
+    }
+    int duplicate = 0;
+    for (int i = 0; i < job.count; i++)
+      duplicate |= job.book_ids[i] == id;
+    if (duplicate)
+      printw("  Already in the basket.\n");
+    else
+      job.book_ids[job.count++] = id;
   }
+  noecho();
+
+  while (job.count > 0) {
+    int rc = run_db_job(basket_job, &job);
+
+    if (rc == SQLITE_INTERRUPT) {
+      printw("\nCancelled, nothing was saved.\n");
+      break;
+    } else if (rc != SQLITE_OK && rc != SQLITE_CONSTRAINT) {
+      printw("\nError: %s. Nothing was saved.\n", sqlite3_errstr(rc));
+      break;
+    }
 
-  // Close the statement for reuse
-  sqlite3_finalize(stmt);
+    printw("\n%-8s %s\n", "Book ID", "Result");
+    int ok = 0;
+    for (int i = 0; i < job.count; i++) {
+      ok += job.statuses[i] == LOAN_OK;
+      printw("%-8d %s\n", job.book_ids[i],
+             rc == SQLITE_OK || job.statuses[i] != LOAN_OK
+                 ? loan_status_text(job.statuses[i])
+                 : "ok, but not saved");
+    }
 
-  // Return the book
-  return_book(db, book_id);
+    if (rc == SQLITE_OK) {
+      printw("\n%d book(s) done.\n", job.count);
+      break;
+    }
 
-  // Close the database connection
-  sqlite3_close(db);
+    // Conflict: the transaction was rolled back as a whole
+    printw("\nNothing was saved. ");
+    if (ok == 0)
+      break;
+    printw("Press r to retry without the failed books, any other key to "
+           "cancel: ");
+    refresh();
+    if (getch() != 'r')
+      break;
+
+    int kept = 0;
+    for (int i = 0; i < job.count; i++) {
+      if (job.statuses[i] == LOAN_OK)
+        job.book_ids[kept++] = job.book_ids[i];
+    }
+    job.count = kept;
+    printw("\n");
+  }
 
   // Prompt to continue
-  printw("\nBook returned successfully!\n");
-  printw("Press any key to return to the menu...\n");
+  printw("\nPress any key to return to the menu...\n");
   refresh();
   getch();
 }
+
+void borrow_basket_menu() {
+  char username[100];
+  if (!capture_username(username, sizeof(username)))
+    basket_menu("Borrow", 1, username);
+}
+
+void return_basket_menu() {
+  char username[100];
+  const char *returner;
+  if (!capture_returner(username, sizeof(username), &returner))
+    basket_menu("Return", 0, returner);
+}
+
+#define SCAN_LOG_LINES 64
+
+typedef struct {
+  Scanner scanner;
+  ScanMode mode;
+  const char *code;
+  const char *borrower;
+  ScanOutcome outcome;
+  Book book;
+} ScanJob;
+
+static int scan_open_job(sqlite3 *db, void *arg) {
+  ScanJob *job = arg;
+  return scanner_open(db, &job->scanner);
+}
+
+static int scan_close_job(sqlite3 *db, void *arg) {
+  (void)db;
+  ScanJob *job = arg;
+  scanner_close(&job->scanner);
+  return SQLITE_OK;
+}
+
+static int scan_item_job(sqlite3 *db, void *arg) {
+  (void)db;
+  ScanJob *job = arg;
+  return scan_item(&job->scanner, job->mode, job->code, job->borrower,
+                   &job->outcome, &job->book);
+}
+
+static void read_borrower(char *borrower, int size, const char *self) {
+  mvprintw(4, 0, "Borrower (empty for %s): ", self);
+  clrtoeol();
+  echo();
+  curs_set(1);
+  refresh();
+  getnstr(borrower, size - 1);
+  curs_set(0);
+  noecho();
+  if (borrower[0] == '\0')
+    snprintf(borrower, size, "%s", self);
+}
+
+// Checkout desk for barcode scanners: every line of input is one code, looked
+// up by ISBN and borrowed or returned immediately. Keyboard input is never
+// read while an item is being processed, so a scanner can keep typing.
+void scan_desk() {
+  printw("###############################################\n");
+  printw("#                 Scan Desk                   #\n");
+  printw("###############################################\n");
+
+  ScanJob job;
+  char self[100];
+  if (capture_username(self, sizeof(self)))
+    return;
+
+  memset(&job, 0, sizeof(job));
+  int rc = run_db_job(scan_open_job, &job);
+  if (rc != SQLITE_OK) {
+    printw("\nError: %s\n", sqlite3_errstr(rc));
+    printw("Press any key to return to the menu...\n");
+    refresh();
+    getch();
+    return;
+  }
+
+  char borrower[100];
+  read_borrower(borrower, sizeof(borrower), self);
+  job.borrower = borrower;
+  job.mode = SCAN_BORROW;
+
+  static char log[SCAN_LOG_LINES][160];
+  int logged = 0;
+  char code[64] = "";
+  int len = 0;
+  int items = 0;
+  double last_ms = 0, total_ms = 0;
+  int dirty = 1;
+
+  while (1) {
+    // Typing only touches the prompt line; the log is redrawn after a scan
+    if (dirty) {
+      erase();
+      printw("###############################################\n");
+      printw("#                 Scan Desk                   #\n");
+      printw("###############################################\n");
+      printw("Mode: %s   Borrower: %s\n",
+             job.mode == SCAN_BORROW ? "BORROW" : "RETURN", borrower);
+      printw("Items: %d   Last: %.3f ms   Average: %.3f ms\n", items, last_ms,
+             items ? total_ms / items : 0.0);
+      printw("TAB switches borrow/return, F2 changes borrower, F10 or ESC "
+             "leaves.\n\n");
+
+      int rows = LINES - 9;
+      for (int i = 0; i < rows && i < logged && i < SCAN_LOG_LINES; i++)
+        printw("%s\n", log[(logged - 1 - i) % SCAN_LOG_LINES]);
+      dirty = 0;
+    }
+    mvprintw(LINES - 1, 0, "Scan> %s", code);
+    clrtoeol();
+    refresh();
+
+    int ch = getch();
+    if (ch == 27 || ch == KEY_F(10)) {
+      break;
+    } else if (ch == '\t') {
+      job.mode = job.mode == SCAN_BORROW ? SCAN_RETURN : SCAN_BORROW;
+      dirty = 1;
+    } else if (ch == KEY_F(2)) {
+      read_borrower(borrower, sizeof(borrower), self);
+      dirty = 1;
+    } else if (ch == KEY_BACKSPACE || ch == 127 || ch == 8) {
+      if (len > 0)
+        code[--len] = '\0';
+    } else if (ch == '\n' || ch == '\r' || ch == KEY_ENTER) {
+      if (len == 0)
+        continue;
+
+      struct timespec started, finished;
+      clock_gettime(CLOCK_MONOTONIC, &started);
+      job.code = code;
+      unsigned ticket = submit_db_job(scan_item_job, &job);
+      rc = ticket ? wait_db_job(ticket) : SQLITE_BUSY;
+      clock_gettime(CLOCK_MONOTONIC, &finished);
+      last_ms = (finished.tv_sec - started.tv_sec) * 1e3 +
+                (finished.tv_nsec - started.tv_nsec) / 1e6;
+
+      char *line = log[logged++ % SCAN_LOG_LINES];
+      if (rc != SQLITE_OK) {
+        snprintf(line, sizeof(log[0]), "%-16s ERROR %s", code,
+                 sqlite3_errstr(rc));
+      } else if (job.outcome == SCAN_UNKNOWN_CODE) {
+        beep();
+        snprintf(line, sizeof(log[0]), "%-16s UNKNOWN CODE", code);
+      } else if (job.outcome == SCAN_ALREADY_BORROWED) {
+        beep();
+        snprintf(line, sizeof(log[0]), "%-16s ALREADY BORROWED by %.40s  %.60s",
+                 code, job.book.borrower, job.book.title);
+      } else if (job.outcome == SCAN_NOT_BORROWED) {
+        beep();
+        snprintf(line, sizeof(log[0]), "%-16s NOT BORROWED  %.60s", code,
+                 job.book.title);
+      } else {
+        items++;
+        total_ms += last_ms;
+        snprintf(line, sizeof(log[0]), "%-16s %s  %.60s", code,
+                 job.mode == SCAN_BORROW ? "BORROWED" : "RETURNED",
+                 job.book.title);
+      }
+      len = 0;
+      code[0] = '\0';
+      dirty = 1;
+    } else if (ch >= 32 && ch < 127 && len < (int)sizeof(code) - 1) {
+      code[len++] = (char)ch;
+      code[len] = '\0';
+    }
+  }
+
+  run_db_job(scan_close_job, &job);
+}
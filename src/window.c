@@ -1,7 +1,27 @@
 #include "../include/window.h"
 #include "../include/db.h"
 #include "../include/mainwindow.h"
+#include "../include/worker.h"
 #include <ncurses.h>
+#include <time.h>
+
+static struct timespec startup_begin;
+static double startup_ms = -1;
+
+void start_startup_timer() { clock_gettime(CLOCK_MONOTONIC, &startup_begin); }
+
+int stop_startup_timer() {
+  if (startup_ms >= 0)
+    return 0;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  startup_ms = (now.tv_sec - startup_begin.tv_sec) * 1e3 +
+               (now.tv_nsec - startup_begin.tv_nsec) / 1e6;
+  return 1;
+}
+
+double startup_time_ms() { return startup_ms; }
 
 void clear_screen() {
   clear();
@@ -15,13 +35,155 @@ void call_menu(void *menu) {
   clear_screen();
 }
 
+static double elapsed_ms(const struct timespec *since) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - since->tv_sec) * 1e3 +
+         (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+int run_db_job(DbJob job, void *arg) {
+  unsigned ticket = submit_db_job(job, arg);
+  if (ticket == 0)
+    return SQLITE_BUSY;
+
+  static const char frames[] = "|/-\\";
+  struct timespec started;
+  clock_gettime(CLOCK_MONOTONIC, &started);
+
+  int rc;
+  int frame = 0;
+  int shown = 0;
+  int y, x;
+  getyx(stdscr, y, x);
+  noecho();
+  timeout(SPINNER_INTERVAL_MS);
+
+  while (!poll_db_job(ticket, &rc)) {
+    // Fast jobs finish before the spinner would only flicker
+    if (elapsed_ms(&started) >= SPINNER_DELAY_MS) {
+      mvprintw(LINES - 1, 0, "%c Working... press q to cancel",
+               frames[frame++ % 4]);
+      clrtoeol();
+      move(y, x);
+      refresh();
+      shown = 1;
+    }
+
+    int ch = getch();
+    if (ch == 'q' || ch == 'Q') {
+      cancel_db_jobs();
+    } else if (ch == KEY_RESIZE) {
+      // Keep the cursor inside the new bounds; the spinner moves with LINES
+      if (y >= LINES)
+        y = LINES - 1;
+      if (x >= COLS)
+        x = COLS - 1;
+    }
+  }
+
+  timeout(-1);
+  if (shown) {
+    move(LINES - 1, 0);
+    clrtoeol();
+    move(y, x);
+    refresh();
+  }
+  return rc;
+}
+
+#define LIST_VIEW_MAX_LINE 512 // bytes of a formatted row
+
+int list_view_rows(const ListView *view) {
+  int rows = LINES - 1 - view->top;
+  return rows > 1 ? rows : 1;
+}
+
+static void clamp_view(ListView *view) {
+  int rows = list_view_rows(view);
+  if (view->cursor >= view->count)
+    view->cursor = view->count - 1;
+  if (view->cursor < 0)
+    view->cursor = 0;
+  if (view->first > view->cursor)
+    view->first = view->cursor;
+  if (view->first < view->cursor - rows + 1)
+    view->first = view->cursor - rows + 1;
+  // No blank lines at the bottom while rows above are hidden, e.g. after
+  // the terminal grew
+  if (view->first > view->count - rows)
+    view->first = view->count - rows;
+  if (view->first < 0)
+    view->first = 0;
+}
+
+void list_view_draw(ListView *view, ListRowFormat format, const void *rows) {
+  clamp_view(view);
+  int shown = view->count - view->first;
+  if (shown > list_view_rows(view))
+    shown = list_view_rows(view);
+
+  char line[LIST_VIEW_MAX_LINE];
+  for (int i = 0; i < shown; i++) {
+    int row = view->first + i;
+    format(rows, row, line, sizeof(line));
+    move(view->top + i, 0);
+    clrtoeol();
+    if (row == view->cursor)
+      attron(A_REVERSE);
+    addnstr(line, COLS);
+    if (row == view->cursor)
+      attroff(A_REVERSE);
+  }
+  move(view->top + shown, 0);
+  clrtobot();
+}
+
+int list_view_key(ListView *view, int ch) {
+  int rows = list_view_rows(view);
+  switch (ch) {
+  case KEY_UP:
+    view->cursor--;
+    break;
+  case KEY_DOWN:
+    view->cursor++;
+    break;
+  case KEY_PPAGE:
+    view->cursor -= rows;
+    view->first -= rows;
+    break;
+  case KEY_NPAGE:
+    view->cursor += rows;
+    view->first += rows;
+    break;
+  case KEY_HOME:
+    view->cursor = 0;
+    break;
+  case KEY_END:
+    view->cursor = view->count - 1;
+    break;
+  case KEY_RESIZE:
+    // ncurses has already updated LINES and COLS
+    break;
+  default:
+    return 0;
+  }
+  clamp_view(view);
+  return 1;
+}
+
 void start_window() {
   initscr();            // Initialize ncurses
   keypad(stdscr, TRUE); // Enable special keys like arrow keys
   noecho();             // Disable echoing of typed characters
   curs_set(0);          // Hide the cursor
 
+  // Database work runs off the UI thread from here on
+  start_db_worker(get_database());
+
   main_menu();
 
+  stop_db_worker();
+
   endwin(); // End ncurses
 }
@@ -0,0 +1,160 @@
+#include "../include/worker.h"
+#include "../include/db.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <unistd.h>
+
+typedef struct {
+  unsigned ticket;
+  DbJob job;
+  void *arg;
+  int rc;
+} Job;
+
+// Single producer, single consumer ring. Only the producer moves tail and
+// only the consumer moves head, so neither side needs a lock.
+typedef struct {
+  _Atomic size_t head;
+  _Atomic size_t tail;
+  Job slots[WORKER_QUEUE_SIZE];
+} Ring;
+
+static Ring requests;  // UI -> worker
+static Ring responses; // worker -> UI
+
+static sqlite3 *worker_db = NULL;
+static pthread_t worker_thread;
+static int wake_pipe[2] = {-1, -1};
+static atomic_int worker_running = 0;
+static unsigned next_ticket = 1;
+
+static int ring_push(Ring *ring, const Job *job) {
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  if (tail - head == WORKER_QUEUE_SIZE)
+    return 0;
+
+  ring->slots[tail & (WORKER_QUEUE_SIZE - 1)] = *job;
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+  return 1;
+}
+
+static int ring_pop(Ring *ring, Job *job) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (head == tail)
+    return 0;
+
+  *job = ring->slots[head & (WORKER_QUEUE_SIZE - 1)];
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  return 1;
+}
+
+static void *worker_main(void *unused) {
+  (void)unused;
+  char byte;
+
+  // The pipe only wakes the thread up; the jobs travel through the ring.
+  while (read(wake_pipe[0], &byte, 1) == 1) {
+    Job job;
+    while (ring_pop(&requests, &job)) {
+      job.rc = job.job(worker_db, job.arg);
+      // The UI thread drains responses while it waits, so this only spins
+      // if it stopped waiting with a full queue of finished jobs.
+      while (!ring_push(&responses, &job))
+        usleep(1000);
+    }
+    if (!atomic_load(&worker_running))
+      break;
+  }
+  return NULL;
+}
+
+int start_db_worker(sqlite3 *db) {
+  if (atomic_load(&worker_running))
+    return 0;
+  if (pipe(wake_pipe) != 0)
+    return 1;
+
+  worker_db = db;
+  atomic_store(&worker_running, 1);
+  if (pthread_create(&worker_thread, NULL, worker_main, NULL) != 0) {
+    atomic_store(&worker_running, 0);
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+    return 1;
+  }
+  return 0;
+}
+
+void stop_db_worker(void) {
+  if (!atomic_load(&worker_running))
+    return;
+
+  atomic_store(&worker_running, 0);
+  char byte = 0;
+  if (write(wake_pipe[1], &byte, 1) != 1)
+    sqlite3_interrupt(worker_db);
+  close(wake_pipe[1]);
+  pthread_join(worker_thread, NULL);
+  close(wake_pipe[0]);
+  wake_pipe[0] = wake_pipe[1] = -1;
+}
+
+// Finished jobs that were not polled yet, so out-of-order polls still work.
+static Job finished[WORKER_QUEUE_SIZE];
+static int finished_count = 0;
+
+unsigned submit_db_job(DbJob job, void *arg) {
+  Job request = {next_ticket, job, arg, 0};
+
+  // Without a worker (command line tools) the job simply runs inline
+  if (!atomic_load(&worker_running)) {
+    if (finished_count == WORKER_QUEUE_SIZE)
+      return 0;
+    request.rc = job(get_database(), arg);
+    finished[finished_count++] = request;
+    return next_ticket++;
+  }
+
+  if (!ring_push(&requests, &request))
+    return 0;
+
+  // The job is queued and will run, so its ticket is handed out whatever
+  // happens to the wake-up; a lost one only delays it until the next job
+  char byte = 0;
+  while (write(wake_pipe[1], &byte, 1) < 0 && errno == EINTR)
+    ;
+  return next_ticket++;
+}
+
+int poll_db_job(unsigned ticket, int *rc) {
+  Job job;
+  while (finished_count < WORKER_QUEUE_SIZE && ring_pop(&responses, &job))
+    finished[finished_count++] = job;
+
+  for (int i = 0; i < finished_count; i++) {
+    if (finished[i].ticket == ticket) {
+      *rc = finished[i].rc;
+      finished[i] = finished[--finished_count];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int wait_db_job(unsigned ticket) {
+  int rc;
+  // Meant for jobs that take well under a millisecond, so a short nap
+  // between polls is cheaper than another wake-up channel.
+  while (!poll_db_job(ticket, &rc))
+    usleep(20);
+  return rc;
+}
+
+void cancel_db_jobs(void) {
+  if (worker_db != NULL)
+    sqlite3_interrupt(worker_db);
+}
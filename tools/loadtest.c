@@ -0,0 +1,379 @@
+// Concurrent circulation load tester. Runs randomized borrow, return, search
+// and add operations from several threads (or processes) against one
+// database through the src/db.c functions, then checks the loan invariants.
+//
+//   ./build/loadtest [-t workers] [-d seconds] [-p] [-m b,r,s,a] [-v] [db]
+
+#include "../include/config.h"
+#include "../include/db.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOAD_MAX_WORKERS 64
+#define LOAD_MAX_SAMPLES 200000 // latencies kept per worker
+#define LOAD_BORROWERS 50       // distinct borrower names per worker
+
+typedef enum { OP_BORROW, OP_RETURN, OP_SEARCH, OP_ADD, OP_COUNT } Op;
+
+static const char *op_names[OP_COUNT] = {"borrow", "return", "search", "add"};
+
+// One per worker, in shared memory so process workers can fill it too
+typedef struct {
+  long long count[OP_COUNT];
+  long long ok[OP_COUNT];
+  long long conflicts[OP_COUNT]; // borrow of a book that is out, or return
+                                 // of one that is not
+  long long busy[OP_COUNT];      // SQLITE_BUSY or SQLITE_LOCKED
+  long long errors[OP_COUNT];
+  int samples;
+  float latency_us[LOAD_MAX_SAMPLES];
+  unsigned char sample_op[LOAD_MAX_SAMPLES];
+} WorkerStats;
+
+typedef struct {
+  const char *db_path;
+  int worker;
+  int max_book_id;
+  int weights[OP_COUNT];
+  double deadline;
+  WorkerStats *stats;
+} Worker;
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int is_busy(int rc) {
+  return (rc & 0xff) == SQLITE_BUSY || (rc & 0xff) == SQLITE_LOCKED;
+}
+
+static Op pick_op(const int weights[OP_COUNT], unsigned *seed) {
+  int total = 0;
+  for (int i = 0; i < OP_COUNT; i++)
+    total += weights[i];
+  int roll = rand_r(seed) % total;
+  int op = 0;
+  while (roll >= weights[op])
+    roll -= weights[op++];
+  return (Op)op;
+}
+
+static int run_op(sqlite3 *db, Op op, const Worker *worker, unsigned *seed) {
+  int book_id = 1 + rand_r(seed) % worker->max_book_id;
+  switch (op) {
+  case OP_BORROW: {
+    char borrower[32];
+    snprintf(borrower, sizeof(borrower), "load%d-%d", worker->worker,
+             rand_r(seed) % LOAD_BORROWERS);
+    return borrow_book(db, book_id, borrower);
+  }
+  case OP_RETURN:
+    // Like borrow_book, 1 means the book was not out
+    return return_book(db, book_id, NULL);
+  case OP_SEARCH: {
+    // A title-ordered page starting at a random title, like paging the list
+    ListQuery query = {SORT_BY_TITLE, 0, 0, 0, 0, 20};
+    Book after = {0};
+    snprintf(after.title, sizeof(after.title), "t%d", rand_r(seed) % 100000);
+    BookList list = {0};
+    int rc = list_books_page(db, &query, &after, &list);
+    free_book_list(&list);
+    return rc;
+  }
+  case OP_ADD: {
+    Book book = {0};
+    snprintf(book.title, sizeof(book.title), "load %d-%d", worker->worker,
+             rand_r(seed));
+    snprintf(book.author, sizeof(book.author), "load author %d",
+             rand_r(seed) % 1000);
+    snprintf(book.publisher, sizeof(book.publisher), "load press");
+    book.year = 1900 + rand_r(seed) % 125;
+    return insert_book(db, &book);
+  }
+  default:
+    return SQLITE_MISUSE;
+  }
+}
+
+static void *worker_main(void *arg) {
+  Worker *worker = arg;
+  WorkerStats *stats = worker->stats;
+  unsigned seed = (unsigned)time(NULL) ^ (unsigned)(worker->worker * 7919);
+
+  sqlite3 *db;
+  if (open_connection(worker->db_path, &db) != 0)
+    return NULL;
+
+  while (now_seconds() < worker->deadline) {
+    Op op = pick_op(worker->weights, &seed);
+    double started = now_seconds();
+    int rc = run_op(db, op, worker, &seed);
+    double elapsed = now_seconds() - started;
+
+    stats->count[op]++;
+    if (rc == 0)
+      stats->ok[op]++;
+    else if ((op == OP_BORROW || op == OP_RETURN) && rc == 1)
+      stats->conflicts[op]++;
+    else if (is_busy(rc))
+      stats->busy[op]++;
+    else
+      stats->errors[op]++;
+    if (stats->samples < LOAD_MAX_SAMPLES) {
+      stats->latency_us[stats->samples] = (float)(elapsed * 1e6);
+      stats->sample_op[stats->samples++] = (unsigned char)op;
+    }
+  }
+
+  sqlite3_close(db);
+  return NULL;
+}
+
+static int compare_floats(const void *a, const void *b) {
+  float x = *(const float *)a, y = *(const float *)b;
+  return (x > y) - (x < y);
+}
+
+static float percentile(const float *sorted, int count, double p) {
+  return count > 0 ? sorted[(int)(p * (count - 1))] : 0;
+}
+
+static void print_report(const WorkerStats *stats, int workers,
+                         double seconds) {
+  long long total = 0, busy = 0;
+  printf("%-8s %9s %9s %9s %7s %7s %9s %9s %9s %9s\n", "op", "count", "ok",
+         "conflict", "busy", "error", "p50 ms", "p95 ms", "p99 ms", "max ms");
+
+  int capacity = workers * LOAD_MAX_SAMPLES;
+  float *latencies = malloc(capacity * sizeof(float));
+  for (int op = 0; op < OP_COUNT; op++) {
+    long long sums[5] = {0};
+    int n = 0;
+    for (int w = 0; w < workers; w++) {
+      sums[0] += stats[w].count[op];
+      sums[1] += stats[w].ok[op];
+      sums[2] += stats[w].conflicts[op];
+      sums[3] += stats[w].busy[op];
+      sums[4] += stats[w].errors[op];
+      for (int i = 0; latencies != NULL && i < stats[w].samples; i++) {
+        if (stats[w].sample_op[i] == op)
+          latencies[n++] = stats[w].latency_us[i];
+      }
+    }
+    qsort(latencies, n, sizeof(float), compare_floats);
+    printf("%-8s %9lld %9lld %9lld %7lld %7lld %9.3f %9.3f %9.3f %9.3f\n",
+           op_names[op], sums[0], sums[1], sums[2], sums[3], sums[4],
+           percentile(latencies, n, 0.50) / 1000,
+           percentile(latencies, n, 0.95) / 1000,
+           percentile(latencies, n, 0.99) / 1000,
+           percentile(latencies, n, 1.0) / 1000);
+    total += sums[0];
+    busy += sums[3];
+  }
+  free(latencies);
+
+  printf("\n%lld operations in %.2f s on %d workers: %.0f ops/s, busy rate "
+         "%.2f%%\n",
+         total, seconds, workers, seconds > 0 ? total / seconds : 0,
+         total > 0 ? 100.0 * busy / total : 0);
+}
+
+// Returns the number of rows returned by sql, each one a violation.
+static int count_violations(sqlite3 *db, const char *what, const char *sql) {
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK) {
+    fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+    return 1;
+  }
+  int count = 0;
+  while (sqlite3_step(stmt) == SQLITE_ROW)
+    count++;
+  sqlite3_finalize(stmt);
+  if (count > 0)
+    printf("  %s: %d\n", what, count);
+  return count;
+}
+
+static int check_invariants(sqlite3 *db) {
+  int violations = 0;
+  violations += count_violations(
+      db, "books with more than one active loan",
+      "SELECT BOOK_ID FROM LOANS WHERE RETURN_DATE IS NULL "
+      "GROUP BY BOOK_ID HAVING COUNT(*) > 1;");
+  violations += count_violations(
+      db, "loans of books that do not exist",
+      "SELECT BOOK_ID FROM LOANS WHERE BOOK_ID NOT IN (SELECT ID FROM BOOKS);");
+  // The trigger-kept columns must agree with LOANS as well
+  violations += count_violations(
+      db, "books whose ON_LOAN flag is wrong",
+      "SELECT ID FROM BOOKS WHERE ON_LOAN != EXISTS(SELECT 1 FROM LOANS "
+      "  WHERE BOOK_ID = BOOKS.ID AND RETURN_DATE IS NULL);");
+  violations += count_violations(
+      db, "borrowers whose ACTIVE_LOANS count is wrong",
+      "SELECT 0 FROM (SELECT BORROWER_NAME, COUNT(*) AS ACTIVE FROM LOANS "
+      "  WHERE RETURN_DATE IS NULL GROUP BY 1) AS real "
+      "FULL JOIN ACTIVE_LOANS USING (BORROWER_NAME) "
+      "WHERE real.ACTIVE IS NOT ACTIVE_LOANS.ACTIVE;");
+  if (violations == 0)
+    printf("  all invariants hold\n");
+  return violations;
+}
+
+static int parse_weights(const char *text, int weights[OP_COUNT]) {
+  char extra;
+  if (sscanf(text, "%d,%d,%d,%d%c", &weights[0], &weights[1], &weights[2],
+             &weights[3], &extra) != 4)
+    return 1;
+  int total = 0;
+  for (int i = 0; i < OP_COUNT; i++) {
+    if (weights[i] < 0)
+      return 1;
+    total += weights[i];
+  }
+  return total == 0;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: loadtest [-t workers] [-d seconds] [-p] [-m b,r,s,a] [-v] "
+          "[database]\n"
+          "  -t  concurrent workers (default 4, at most %d)\n"
+          "  -d  run time in seconds (default 10)\n"
+          "  -p  run workers as processes instead of threads\n"
+          "  -m  borrow,return,search,add weights (default 40,30,20,10)\n"
+          "  -v  keep the error messages printed by db.c\n",
+          LOAD_MAX_WORKERS);
+}
+
+int main(int argc, char *argv[]) {
+  int workers = 4;
+  double seconds = 10;
+  int processes = 0;
+  int verbose = 0;
+  int weights[OP_COUNT] = {40, 30, 20, 10};
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:d:m:pv")) != -1) {
+    switch (opt) {
+    case 't':
+      workers = atoi(optarg);
+      break;
+    case 'd':
+      seconds = atof(optarg);
+      break;
+    case 'm':
+      if (parse_weights(optarg, weights) != 0) {
+        usage();
+        return 1;
+      }
+      break;
+    case 'p':
+      processes = 1;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  if (workers < 1 || workers > LOAD_MAX_WORKERS || seconds <= 0 ||
+      argc - optind > 1) {
+    usage();
+    return 1;
+  }
+
+  // Same tuning as the desk, so the numbers size the real setup
+  const char *config_path = getenv("LIBRARY_CONFIG");
+  if (load_config(config_path ? config_path : CONFIG_FILE, &config) != 0)
+    return 1;
+  const char *db_path = optind < argc ? argv[optind] : config.db_path;
+  if (connect_to_database(db_path) != 0)
+    return 1;
+
+  int max_book_id = 0;
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(get_database(), "SELECT MAX(ID) FROM BOOKS;", -1,
+                         &stmt, 0) == SQLITE_OK) {
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+      max_book_id = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+  }
+  // SQLite connections must not cross a fork; workers open their own
+  close_database();
+  if (max_book_id == 0) {
+    fprintf(stderr, "%s has no books to circulate\n", db_path);
+    return 1;
+  }
+
+  WorkerStats *stats =
+      mmap(NULL, workers * sizeof(WorkerStats), PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (stats == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+
+  printf("%d %s on %s for %.0f s, mix borrow/return/search/add %d/%d/%d/%d\n",
+         workers, processes ? "processes" : "threads", db_path, seconds,
+         weights[0], weights[1], weights[2], weights[3]);
+  fflush(stdout);
+
+  // db.c reports every conflict on stderr; that would drown the report
+  int saved_stderr = dup(STDERR_FILENO);
+  if (!verbose) {
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDERR_FILENO);
+    close(devnull);
+  }
+
+  Worker pool[LOAD_MAX_WORKERS];
+  pthread_t threads[LOAD_MAX_WORKERS];
+  pid_t pids[LOAD_MAX_WORKERS];
+  double started = now_seconds();
+  for (int i = 0; i < workers; i++) {
+    Worker *worker = &pool[i];
+    *worker = (Worker){db_path, i, max_book_id, {0}, started + seconds,
+                       &stats[i]};
+    memcpy(worker->weights, weights, sizeof(weights));
+    if (processes) {
+      pids[i] = fork();
+      if (pids[i] == 0) {
+        worker_main(worker);
+        _exit(0);
+      }
+    } else if (pthread_create(&threads[i], NULL, worker_main, worker) != 0) {
+      threads[i] = 0;
+    }
+  }
+  for (int i = 0; i < workers; i++) {
+    if (processes && pids[i] > 0)
+      waitpid(pids[i], NULL, 0);
+    else if (!processes && threads[i] != 0)
+      pthread_join(threads[i], NULL);
+  }
+  double elapsed = now_seconds() - started;
+
+  dup2(saved_stderr, STDERR_FILENO);
+  close(saved_stderr);
+
+  print_report(stats, workers, elapsed);
+  printf("\nInvariants:\n");
+  if (connect_to_database(db_path) != 0)
+    return 1;
+  int violations = check_invariants(get_database());
+
+  munmap(stats, workers * sizeof(WorkerStats));
+  close_database();
+  return violations > 0 ? 1 : 0;
+}